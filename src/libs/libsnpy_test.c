@@ -1,16 +1,766 @@
 #include "snpy_util.h"
 #include "snpy_log.h"
+#include "snpy_blk_map.h"
+#include "snpy_crc32c.h"
+#include "snpy_ioeng.h"
+#include "snpy_crypt.h"
+#include "snpy_chunk.h"
+#include "snpy_cdc.h"
+#include "snpy_tb.h"
+#include "snpy_ckpt.h"
+#include "snpy_manifest.h"
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#undef NDEBUG                       /* the checks are in the asserts */
 #include <assert.h>
 
 
+static void test_crc32c(void) {
+    const char *check = "123456789";
+    size_t size = 1 << 16;
+    u8 *buf = malloc(size + 8);
+    u64 x = 0x9e3779b97f4a7c15ULL;
+    size_t i, off, len;
+    assert(buf);
+    for (i = 0; i < size + 8; i ++) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        buf[i] = x;
+    }
+
+    /* the check value of crc32c, on both paths */
+    assert(snpy_crc32c(0, check, 9) == 0xe3069283);
+    assert(snpy_crc32c_sw(0, check, 9) == 0xe3069283);
+    assert(snpy_crc32c(0, NULL, 0) == 0);
+
+    /*
+     * snpy_crc32c() takes SSE4.2 where the cpu has it, it must agree with
+     * the table at every alignment and across the 8 and 32 byte steps
+     */
+#if defined(__x86_64__)
+    printf("crc32c: %s path against the table\n",
+           __builtin_cpu_supports("sse4.2") ? "sse4.2" : "table");
+#endif
+    for (off = 0; off < 8; off ++)
+        for (len = 0; len < 300; len ++)
+            assert(snpy_crc32c(0, buf + off, len) ==
+                   snpy_crc32c_sw(0, buf + off, len));
+    assert(snpy_crc32c(0, buf + 3, size) == snpy_crc32c_sw(0, buf + 3, size));
+
+    /* continuing a crc, and combining two, equal the crc of both at once */
+    u32 whole = snpy_crc32c(0, buf, size);
+    size_t cut[] = { 0, 1, 7, 8, 4096, size - 1, size };
+    for (i = 0; i < ARRAY_SIZE(cut); i ++) {
+        u32 a = snpy_crc32c(0, buf, cut[i]);
+        u32 b = snpy_crc32c(0, buf + cut[i], size - cut[i]);
+        assert(snpy_crc32c(a, buf + cut[i], size - cut[i]) == whole);
+        assert(snpy_crc32c_sw(snpy_crc32c_sw(0, buf, cut[i]),
+                              buf + cut[i], size - cut[i]) == whole);
+        assert(snpy_crc32c_combine(a, b, size - cut[i]) == whole);
+    }
+    u32 c = snpy_crc32c(0, check, 4);
+    u32 d = snpy_crc32c(0, check + 4, 5);
+    assert(snpy_crc32c_combine(c, d, 5) == 0xe3069283);
+    free(buf);
+    printf("crc32c: ok\n");
+}
+
+/* map_eq() - whether @bm holds the @n segments of @v */
+static int map_eq(const struct blk_map *bm, const struct seg *v, u64 n) {
+    return bm->nuse == n && !memcmp(bm->segv, v, n * sizeof v[0]);
+}
+
+/* map_round_trip() - @bm written and read back by blk_map_write()/read() */
+static struct blk_map *map_round_trip(struct blk_map *bm) {
+    struct blk_map *out = NULL;
+    FILE *fp = tmpfile();
+    assert(fp);
+    assert(blk_map_write(fileno(fp), bm) == 0);
+    assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    assert(blk_map_read(fileno(fp), &out) == 0);
+    fclose(fp);
+    return out;
+}
+
+static void test_blk_map(void) {
+    u64 i;
+    struct blk_map *bm, *out;
+
+    /* 
+     * gap 0: a first segment at 0 and segments back to back, which come
+     * back as one; runs of equal gap and length make one group each, the
+     * rest one group apiece
+     */
+    struct seg v[] = {
+        { 0, 4096 }, { 4096, 4096 }, { 8192, 4096 },
+        { 1 << 20, 512 }, { (1 << 20) + 1024, 512 }, 
+        { (1 << 20) + 2048, 512 }, { (1 << 20) + 3072, 512 },
+        { 5ULL << 30, 1 }, { (5ULL << 30) + 3, 7 },
+        { 1ULL << 50, 4ULL << 20 }
+    };
+    u64 n = ARRAY_SIZE(v);
+    bm = blk_map_alloc(n);
+    memcpy(bm->segv, v, sizeof v);
+    bm->nuse = n;
+    out = map_round_trip(bm);
+    assert(out && out->nuse == n - 2);
+    assert(out->segv[0].off == 0 && out->segv[0].len == 12288);
+    assert(!memcmp(out->segv + 1, v + 3, (n - 3) * sizeof v[0]));
+    blk_map_free(out);
+
+    /* an empty map */
+    bm->nuse = 0;
+    out = map_round_trip(bm);
+    assert(out && out->nuse == 0);
+    blk_map_free(out);
+    blk_map_free(bm);
+
+    /* 
+     * sort: segments out of order, overlapping and adjacent, through runs
+     * of 8 spilled to a file, come out sorted and coalesced
+     */
+    struct seg want[] = {
+        { 0, 12288 }, { 65536, 4096 }, { 131072, 4096 }, { 196608, 4096 },
+        { 1 << 20, 3 << 20 }, { 100 << 20, 1 }
+    };
+    struct blk_map_sort *s = blk_map_sort_create("/tmp", 8);
+    assert(s);
+    assert(blk_map_sort_add(s, 100 << 20, 1) == 0);
+    for (i = 3; i-- > 1; )
+        assert(blk_map_sort_add(s, i * 65536 + 65536, 4096) == 0);
+    assert(blk_map_sort_add(s, 65536, 4096) == 0);
+    for (i = 0; i < 64; i ++)       /* 1 MB on, backwards, 48 KB apiece */
+        assert(blk_map_sort_add(s, (4 << 20) - (i + 1) * 49152, 49152) == 0);
+    assert(blk_map_sort_add(s, 8192, 4096) == 0);
+    assert(blk_map_sort_add(s, 0, 4096) == 0);
+    assert(blk_map_sort_add(s, 2048, 8192) == 0);   /* overlaps both */
+    assert(blk_map_sort_add(s, 65536 + 1024, 1024) == 0);    /* inside */
+    assert(s->nrun > 0);
+    assert(blk_map_sort_map(s, &bm) == 0);
+    assert(map_eq(bm, want, ARRAY_SIZE(want)));
+    out = map_round_trip(bm);
+    assert(out && map_eq(out, want, ARRAY_SIZE(want)));
+    blk_map_free(out);
+    blk_map_free(bm);
+
+    /* blk_map_sort_write() encodes as blk_map_write() does */
+    FILE *fp = tmpfile();
+    assert(fp);
+    assert(blk_map_sort_write(s, fileno(fp)) == 0);
+    assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    assert(blk_map_read(fileno(fp), &out) == 0);
+    assert(map_eq(out, want, ARRAY_SIZE(want)));
+    blk_map_free(out);
+    fclose(fp);
+    blk_map_sort_free(s);
+
+    /* v1: the u64 segment count and the raw segments */
+    fp = tmpfile();
+    assert(fp);
+    n = ARRAY_SIZE(v);
+    assert(fwrite(&n, sizeof n, 1, fp) == 1);
+    assert(fwrite(v, sizeof v, 1, fp) == 1);
+    assert(fflush(fp) == 0);
+    assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    assert(blk_map_read(fileno(fp), &out) == 0);
+    assert(map_eq(out, v, n));
+    blk_map_free(out);
+    fclose(fp);
+
+    /* 
+     * a flipped bit in the groups that still decode, here in the length of
+     * the first, 3 segments of 4096, or in the crc, fails the crc check
+     */
+    bm = blk_map_alloc(n);
+    memcpy(bm->segv, v, sizeof v);
+    bm->nuse = n;
+    off_t flip[] = { 
+        sizeof(struct blk_map_hdr) + 3, offsetof(struct blk_map_hdr, crc)
+    };
+    for (i = 0; i < ARRAY_SIZE(flip); i ++) {
+        u8 b;
+        fp = tmpfile();
+        assert(fp);
+        assert(blk_map_write(fileno(fp), bm) == 0);
+        assert(pread(fileno(fp), &b, 1, flip[i]) == 1);
+        b ^= 0x10;
+        assert(pwrite(fileno(fp), &b, 1, flip[i]) == 1);
+        assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+        out = NULL;
+        assert(blk_map_read(fileno(fp), &out) == -EBADMSG && !out);
+        fclose(fp);
+    }
+    blk_map_free(bm);
+    printf("blk_map: ok\n");
+}
+
+/* fill_random() - @len bytes of xorshift noise from @seed */
+static void fill_random(void *buf, size_t len, u64 seed) {
+    u8 *p = buf;
+    u64 x = seed | 1;
+    size_t i;
+    for (i = 0; i < len; i ++) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        p[i] = x;
+    }
+}
+
+/*
+ * io_one() - a file written and read back through an engine of @flags
+ *
+ * Pieces of every size around the 4 KB buffers, from an offset inside the
+ * first buffer; the last read asks past the end of the file.
+ */
+static void io_one(int flags) {
+    u32 piece[] = { 1, 7, 4095, 4096, 4097, 8195, 12288, 3, 20000 };
+    size_t size = 0, off, i;
+    u64 pos = 100;
+    for (i = 0; i < ARRAY_SIZE(piece); i ++)
+        size += 3 * piece[i];
+    char *data = malloc(size), *back = malloc(size + 4096);
+    assert(data && back);
+    fill_random(data, size, 0x1234567);
+    FILE *fp = tmpfile();
+    assert(fp);
+    int fd = fileno(fp);
+
+    struct snpy_ioeng *e = snpy_ioeng_open(fd, pos, flags, 0, 4096);
+    assert(e);
+    printf("ioeng: %s path\n", e->ring ? "io_uring" : "sync");
+    for (off = 0, i = 0; off < size; i ++) {
+        u32 n = piece[i % ARRAY_SIZE(piece)];
+        assert(snpy_ioeng_write(e, data + off, n) == 0);
+        off += n;
+    }
+    assert(snpy_ioeng_flush(e) == 0);
+    assert(lseek(fd, 0, SEEK_CUR) == pos + size);
+    snpy_ioeng_close(e);
+    assert(pread(fd, back, size + 1, pos) == size);
+    assert(!memcmp(back, data, size));
+
+    /* pieces in the other order, then what is left and more */
+    e = snpy_ioeng_open(fd, pos, flags|SNPY_IOENG_READ, 0, 4096);
+    assert(e);
+    memset(back, 0, size);
+    for (off = 0, i = ARRAY_SIZE(piece); off + 20000 < size; ) {
+        u32 n = piece[-- i % ARRAY_SIZE(piece)];
+        i = i ? i : ARRAY_SIZE(piece);
+        assert(snpy_ioeng_read(e, back + off, n) == n);
+        off += n;
+    }
+    assert(snpy_ioeng_read(e, back + off, 4096 + size - off) == size - off);
+    assert(snpy_ioeng_read(e, back, 1) == 0);
+    assert(!memcmp(back, data, size));
+    snpy_ioeng_close(e);
+
+    /* a reader from a buffer boundary, and one at the end of the file */
+    e = snpy_ioeng_open(fd, pos + 8192, flags|SNPY_IOENG_READ, 0, 4096);
+    assert(e);
+    assert(snpy_ioeng_read(e, back, size) == size - 8192);
+    assert(!memcmp(back, data + 8192, size - 8192));
+    snpy_ioeng_close(e);
+    e = snpy_ioeng_open(fd, pos + size, flags|SNPY_IOENG_READ, 0, 4096);
+    assert(e);
+    assert(snpy_ioeng_read(e, back, 10) == 0);
+    snpy_ioeng_close(e);
+
+    fclose(fp);
+    free(data);
+    free(back);
+}
+
+static void test_ioeng(void) {
+    io_one(0);
+    io_one(SNPY_IOENG_SYNC);
+    printf("ioeng: ok\n");
+}
+
+/* 
+ * test_crypt() - sealed bytes open with their key and associated data
+ * only, any bit of either or of the sealed bytes changed fails them
+ */
+static void test_crypt(const char *dir) {
+    char key_fn[PATH_MAX];
+    u8 src[1000], e[1000 + SNPY_CRYPT_OVERHEAD], out[1000];
+    u8 aad[32];
+    int alg[] = { SNPY_CRYPT_AES_GCM, SNPY_CRYPT_CHACHA20 };
+    int i;
+    fill_random(src, sizeof src, 77);
+    fill_random(aad, sizeof aad, 78);
+    snprintf(key_fn, sizeof key_fn, "%s/key", dir);
+    FILE *fp = fopen(key_fn, "w");
+    assert(fp);
+    fprintf(fp, "%s\n", "000102030405060708090a0b0c0d0e0f"
+            "101112131415161718191A1B1C1D1E1F");
+    fclose(fp);
+    assert(snpy_crypt_parse("auto") > SNPY_CRYPT_NONE);
+    assert(snpy_crypt_parse("rot13") == -EINVAL);
+
+    for (i = 0; i < ARRAY_SIZE(alg); i ++) {
+        struct snpy_crypt c, other;
+        assert(snpy_crypt_init(&c, alg[i], key_fn) == 0);
+        assert(c.key[0] == 0 && c.key[26] == 0x1a);
+        ssize_t n = snpy_crypt_seal(&c, aad, sizeof aad, src, sizeof src, e);
+        assert(n == sizeof e);
+        assert(snpy_crypt_open(&c, aad, sizeof aad, e, n, out) == 
+               sizeof out);
+        assert(!memcmp(out, src, sizeof src));
+
+        /* nonces are random, the same bytes seal differently */
+        u8 e2[sizeof e];
+        assert(snpy_crypt_seal(&c, aad, sizeof aad, src, sizeof src, e2) == n);
+        assert(memcmp(e, e2, n));
+
+        /* the associated data: a bit flipped, cut short, left out */
+        aad[5] ^= 1;
+        assert(snpy_crypt_open(&c, aad, sizeof aad, e, n, out) < 0);
+        aad[5] ^= 1;
+        assert(snpy_crypt_open(&c, aad, sizeof aad - 8, e, n, out) < 0);
+        assert(snpy_crypt_open(&c, NULL, 0, e, n, out) < 0);
+
+        /* the nonce, the ciphertext and the tag */
+        size_t flip[] = { 0, SNPY_CRYPT_NONCE_SIZE + 500, n - 1 };
+        int j;
+        for (j = 0; j < ARRAY_SIZE(flip); j ++) {
+            e[flip[j]] ^= 0x80;
+            assert(snpy_crypt_open(&c, aad, sizeof aad, e, n, out) < 0);
+            e[flip[j]] ^= 0x80;
+        }
+        assert(snpy_crypt_open(&c, aad, sizeof aad, e, n - 1, out) < 0);
+
+        /* another key */
+        other = c;
+        other.key[31] ^= 1;
+        assert(snpy_crypt_open(&other, aad, sizeof aad, e, n, out) < 0);
+
+        /* nothing sealed still carries a tag */
+        assert(snpy_crypt_seal(&c, aad, sizeof aad, src, 0, e) == 
+               SNPY_CRYPT_OVERHEAD);
+        assert(snpy_crypt_open(&c, aad, sizeof aad, e, SNPY_CRYPT_OVERHEAD,
+                               out) == 0);
+        snpy_crypt_clear(&c);
+    }
+    unlink(key_fn);
+    printf("crypt: ok\n");
+}
+
+/* chunk_fp() - fingerprint of test chunk @i */
+static void chunk_fp(u32 i, u8 *fp) {
+    snpy_sha256(&i, sizeof i, fp);
+}
+
+/* chunk_get() - whether test chunk @i is in @s, with its bytes */
+static int chunk_get(struct snpy_chunk_store *s, u32 i) {
+    u8 fp[SNPY_CHUNK_FP_SIZE];
+    char buf[32], want[32];
+    u32 len, codec;
+    chunk_fp(i, fp);
+    ssize_t n = snpy_chunk_store_get(s, fp, buf, sizeof buf, &len, &codec);
+    if (n == -ENOENT)
+        return 0;
+    snprintf(want, sizeof want, "chunk %u", i);
+    assert(n == strlen(want) + 1 && !strcmp(buf, want));
+    assert(len == 4096 + i && codec == i % 3);
+    return 1;
+}
+
+/* data_file_refs() - a deduplicated data file, a record of @n refs @fpv */
+static void data_file_refs(int fd, const u8 (*fpv)[SNPY_CHUNK_FP_SIZE], 
+                           int n) {
+    struct snpy_data_hdr hdr;
+    struct snpy_chunk_ref refv[8];
+    struct snpy_seg_rec rec = { 
+        .off = 0, .len = 4096, .zlen = n * sizeof refv[0], 
+        .codec = SNPY_CHUNK_CODEC_REF 
+    };
+    int i;
+    assert(n <= ARRAY_SIZE(refv));
+    memset(refv, 0, sizeof refv);
+    for (i = 0; i < n; i ++)
+        memcpy(refv[i].fp, fpv[i], sizeof refv[i].fp);
+    snpy_data_hdr_init(&hdr, 1 << 20, 1);
+    hdr.flags |= SNPY_DATA_F_DEDUP;
+    hdr.nrec = 1;
+    u64 file_off = sizeof hdr + sizeof rec;
+    hdr.idx_offset = file_off + rec.zlen;
+    struct snpy_data_idx *idx = snpy_data_idx_alloc(1);
+    assert(idx && snpy_data_idx_add(&idx, &rec, file_off) == 0);
+    assert(pwrite(fd, &rec, sizeof rec, sizeof hdr) == sizeof rec);
+    assert(pwrite(fd, refv, rec.zlen, file_off) == rec.zlen);
+    assert(lseek(fd, hdr.idx_offset, SEEK_SET) == hdr.idx_offset);
+    assert(snpy_data_idx_write(fd, idx) == 0);
+    hdr.blk_map_offset = lseek(fd, 0, SEEK_CUR);
+    assert(pwrite(fd, &hdr, sizeof hdr, 0) == sizeof hdr);
+    snpy_data_idx_free(idx);
+}
+
+/*
+ * test_chunk() - chunks put, synced through a grow of the table, got back
+ * and reclaimed
+ */
+static void test_chunk(const char *dir) {
+    char fn[PATH_MAX];
+    u8 fp[SNPY_CHUNK_FP_SIZE];
+    u32 i, n = SNPY_CHUNK_NSLOT;    /* past 70% of the first table */
+    snprintf(fn, sizeof fn, "%s/chunks", dir);
+    struct snpy_chunk_store *w = snpy_chunk_store_open(fn, 1);
+    struct snpy_chunk_store *r = snpy_chunk_store_open(fn, 0);
+    assert(w && r);
+    for (i = 0; i < n; i ++) {
+        char buf[32];
+        int len = snprintf(buf, sizeof buf, "chunk %u", i) + 1;
+        chunk_fp(i, fp);
+        assert(snpy_chunk_store_put(w, fp, 4096 + i, i % 3, buf, len) == 0);
+        if (i == 10)        /* pending: the writer's own, no one else's */
+            assert(snpy_chunk_store_has(w, fp) && 
+                   !snpy_chunk_store_has(r, fp));
+    }
+    assert(chunk_get(w, n - 1));
+    assert(snpy_chunk_store_sync(w) == 0);
+    assert(w->hdr->nslot > SNPY_CHUNK_NSLOT && w->hdr->nuse == n);
+    snpy_chunk_store_close(r);
+    r = snpy_chunk_store_open(fn, 0);
+    assert(r);
+    for (i = 0; i < n; i ++)
+        assert(chunk_get(r, i));
+    assert(!chunk_get(r, n));
+
+    /* putting a chunk again keeps the first */
+    chunk_fp(5, fp);
+    assert(snpy_chunk_store_put(w, fp, 1, 1, "x", 2) == 0);
+    assert(snpy_chunk_store_sync(w) == 0 && w->hdr->nuse == n);
+    assert(chunk_get(w, 5));
+
+    /* no reclaim while the store is in use */
+    assert(!snpy_chunk_store_open(fn, SNPY_CHUNK_RECLAIM) && errno == EBUSY);
+    snpy_chunk_store_close(w);
+    snpy_chunk_store_close(r);
+
+    /* 
+     * every third chunk marked, two more and a missing one through a data
+     * file; the rest is swept
+     */
+    struct snpy_chunk_store *g = snpy_chunk_store_open(fn, SNPY_CHUNK_RECLAIM);
+    assert(g);
+    u32 nkeep = 0;
+    for (i = 0; i < n; i += 3, nkeep ++) {
+        chunk_fp(i, fp);
+        assert(snpy_chunk_store_mark(g, fp) == 0);
+    }
+    chunk_fp(n, fp);
+    assert(snpy_chunk_store_mark(g, fp) == -ENOENT);
+    u8 fpv[3][SNPY_CHUNK_FP_SIZE];
+    chunk_fp(1, fpv[0]);
+    chunk_fp(n + 1, fpv[1]);
+    chunk_fp(2, fpv[2]);
+    nkeep += 2;
+    FILE *df = tmpfile();
+    assert(df);
+    data_file_refs(fileno(df), fpv, 3);
+    assert(snpy_chunk_store_mark_file(g, fileno(df)) == 1);
+    fclose(df);
+    df = tmpfile();                 /* not a data file, no refs */
+    assert(df && fputs("not a data file", df) >= 0 && !fflush(df));
+    assert(snpy_chunk_store_mark_file(g, fileno(df)) == 0);
+    fclose(df);
+    u64 nbyte;
+    assert(snpy_chunk_store_sweep(g, &nbyte) == n - nkeep && nbyte > 0);
+    assert(g->hdr->nuse == nkeep);
+    snpy_chunk_store_close(g);
+
+    r = snpy_chunk_store_open(fn, 0);
+    assert(r);
+    for (i = 0; i < n; i ++)
+        assert(chunk_get(r, i) == (i % 3 == 0 || i < 3));
+    snpy_chunk_store_close(r);
+    snprintf(fn, sizeof fn, "%s/chunks/pack.0", dir);
+    assert(access(fn, F_OK) && errno == ENOENT);
+    printf("chunk: ok\n");
+}
+
+/* cdc_cuts() - chunk ends of @buf, @v takes up to @max of them */
+static u32 cdc_cuts(const u8 *buf, u32 len, u32 *v, u32 max) {
+    u32 n = 0, pos = 0;
+    while (pos < len) {
+        u32 c = snpy_cdc_cut(buf + pos, len - pos);
+        assert(c > 0 && c <= SNPY_CDC_MAX);
+        assert(c >= SNPY_CDC_MIN || pos + c == len);
+        pos += c;
+        assert(n < max);
+        v[n ++] = pos;
+    }
+    return n;
+}
+
+/*
+ * test_cdc() - chunk boundaries follow content: bytes inserted move the
+ * boundaries around them only, the others shift along
+ */
+static void test_cdc(void) {
+    u32 len = 8 << 20, ins = 100, at = 3 << 20;
+    u32 max = len / SNPY_CDC_MIN + 2;
+    u8 *buf = malloc(len), *mod = malloc(len + ins);
+    u32 *a = malloc(max * sizeof a[0]), *b = malloc(max * sizeof b[0]);
+    u32 i, j;
+    assert(buf && mod && a && b);
+    fill_random(buf, len, 0xcdc);
+    memcpy(mod, buf, at);
+    fill_random(mod + at, ins, 0xadd);
+    memcpy(mod + at + ins, buf + at, len - at);
+
+    assert(snpy_cdc_cut(buf, SNPY_CDC_MIN) == SNPY_CDC_MIN);
+    assert(snpy_cdc_cut(buf, 10) == 10);
+    u32 na = cdc_cuts(buf, len, a, max);
+    assert(cdc_cuts(buf, len, b, max) == na && !memcmp(a, b, na * sizeof a[0]));
+    /* normalized chunking keeps the average near SNPY_CDC_AVG */
+    assert(len / na > SNPY_CDC_AVG / 2 && len / na < SNPY_CDC_AVG * 2);
+
+    u32 nb = cdc_cuts(mod, len + ins, b, max);
+    for (i = 0; a[i] <= at; i ++)   /* before the insert: the same */
+        assert(b[i] == a[i]);
+    for (j = i; j < nb && b[j] < a[i] + ins; j ++)
+        ;
+    /* resynchronized within a few chunks, and in step from there on */
+    for (; i < na && a[i] + ins != b[j]; i ++)
+        while (j < nb && b[j] < a[i] + ins)
+            j ++;
+    assert(i < na && a[i] < at + 4 * SNPY_CDC_MAX);
+    assert(na - i == nb - j);
+    for (; i < na; i ++, j ++)
+        assert(b[j] == a[i] + ins);
+    free(buf);
+    free(mod);
+    free(a);
+    free(b);
+    printf("cdc: ok\n");
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* test_tb() - limits of the plugin and of meta/throttle, and the pace */
+static void test_tb(void) {
+    struct snpy_tb *tb;
+    FILE *fp;
+    unlink(SNPY_TB_KEY);
+    assert((tb = snpy_tb_create(0, 0)));
+    assert(tb->bw == 0 && tb->iops == 0);
+    snpy_tb_destroy(tb);
+    snpy_tb_take(NULL, 1ULL << 40, 1ULL << 30);     /* never waits */
+
+    /* the lower of the two, 0 not being a limit */
+    assert((fp = fopen(SNPY_TB_KEY, "w")));
+    fprintf(fp, "%u %u\n", 8 << 20, 0);
+    fclose(fp);
+    assert((tb = snpy_tb_create(4 << 20, 100)));
+    assert(tb->bw == 4 << 20 && tb->iops == 100);
+    snpy_tb_destroy(tb);
+    assert((tb = snpy_tb_create(0, 0)));
+    assert(tb->bw == 8 << 20 && tb->iops == 0);
+
+    /* 2 MB at 8 MB/s: a burst of 100 ms saved up at most, then the rate */
+    usleep(200000);
+    double t = now_s();
+    int i;
+    for (i = 0; i < 32; i ++)
+        snpy_tb_take(tb, 64 << 10, 1);
+    t = now_s() - t;
+    assert(t > 0.1 && t < 1.0);
+    snpy_tb_destroy(tb);
+
+    /* a garbled file is no limit */
+    assert((fp = fopen(SNPY_TB_KEY, "w")));
+    fputs("fast\n", fp);
+    fclose(fp);
+    assert((tb = snpy_tb_create(0, 7)));
+    assert(tb->bw == 0 && tb->iops == 7);
+    snpy_tb_destroy(tb);
+    unlink(SNPY_TB_KEY);
+    printf("tb: ok\n");
+}
+
+/* test_ckpt() - checkpoints of the job in the cwd, written and read back */
+static void test_ckpt(void) {
+    struct snpy_ckpt ckpt = {
+        .magic = SNPY_CKPT_MAGIC, .id = 17, .size = 1ULL << 40,
+        .pos = 123456789, .nbyte = 1ULL << 33, .aux = 42, .crc = 0xabcd
+    }, back;
+    struct seg v[] = { { 0, 4096 }, { 1 << 20, 8192 } };
+    struct blk_map *bm = blk_map_alloc(ARRAY_SIZE(v)), *bm_back = NULL;
+    struct snpy_data_idx *idx = snpy_data_idx_alloc(4), *idx_back = NULL;
+    int i;
+    assert(bm && idx);
+    memcpy(bm->segv, v, sizeof v);
+    bm->nuse = ARRAY_SIZE(v);
+
+    assert(snpy_ckpt_clear() == 0);
+    assert(!snpy_ckpt_exists("."));
+    assert(snpy_ckpt_read(&back, NULL, &bm_back) == -ENOENT);
+
+    /* no records */
+    assert(snpy_ckpt_write(&ckpt, NULL, bm) == 0);
+    assert(snpy_ckpt_exists("."));
+    assert(snpy_ckpt_read(&back, &idx_back, &bm_back) == 0);
+    assert(!memcmp(&back, &ckpt, sizeof ckpt));
+    assert(idx_back && idx_back->nuse == 0);
+    assert(map_eq(bm_back, v, ARRAY_SIZE(v)));
+    snpy_data_idx_free(idx_back);
+    blk_map_free(bm_back);
+
+    /* records, replacing the checkpoint before */
+    for (i = 0; i < 3; i ++) {
+        struct snpy_seg_rec rec = { 
+            .off = i << 20, .len = 4096, .zlen = 100 + i, .codec = 2, 
+            .crc = i 
+        };
+        assert(snpy_data_idx_add(&idx, &rec, 1000 * i) == 0);
+    }
+    ckpt.pos ++;
+    assert(snpy_ckpt_write(&ckpt, idx, bm) == 0);
+    assert(snpy_ckpt_read(&back, &idx_back, &bm_back) == 0);
+    assert(back.pos == ckpt.pos && idx_back->nuse == 3);
+    assert(!memcmp(idx_back->entv, idx->entv, 3 * sizeof idx->entv[0]));
+    snpy_data_idx_free(idx_back);
+    blk_map_free(bm_back);
+
+    /* not a checkpoint */
+    int fd = open(SNPY_CKPT_KEY, O_WRONLY);
+    assert(fd != -1);
+    u64 magic = 0;
+    assert(pwrite(fd, &magic, sizeof magic, 0) == sizeof magic);
+    close(fd);
+    bm_back = NULL;
+    assert(snpy_ckpt_read(&back, NULL, &bm_back) == -EINVAL && !bm_back);
+
+    assert(snpy_ckpt_clear() == 0 && snpy_ckpt_clear() == 0);
+    assert(!snpy_ckpt_exists("."));
+    snpy_data_idx_free(idx);
+    blk_map_free(bm);
+    printf("ckpt: ok\n");
+}
+
+/* manifest_blk() - count the blocks a builder passes on */
+static int manifest_blk(u64 blk, const char *data, u32 len, void *arg) {
+    (*(u64 *)arg) ++;
+    return 0;
+}
+
+/* manifest_diff() - note the blocks found changed */
+static int manifest_diff(u64 blk, void *arg) {
+    u64 *v = arg;
+    v[v[0] ++ + 1] = blk;
+    return 0;
+}
+
+/*
+ * test_manifest() - a manifest built from bytes fed piecemeal is the one
+ * of the whole image, diffs find the blocks changed, and the file form
+ * reads back and checks its crc
+ */
+static void test_manifest(void) {
+    u32 bs = 4096;
+    u64 size = 37 * bs + 100, i, nblk = 0;
+    u8 *img = calloc(1, size);
+    assert(img);
+    fill_random(img, 20 * bs, 0x5eed);      /* blocks 20 on are zeros */
+    fill_random(img + 30 * bs + 7, 600, 0x5eee);
+
+    struct snpy_manifest *m, *ref = snpy_manifest_alloc(size, bs);
+    assert(ref && ref->hdr.nleaf == 38);
+    for (i = 0; i < ref->hdr.nleaf; i ++)
+        snpy_manifest_leaf(img + i * bs, MIN(bs, size - i * bs), 
+                           ref->nodev[i]);
+    snpy_manifest_seal(ref);
+    assert(snpy_is_zero(ref->nodev[25], sizeof ref->nodev[25]));
+
+    /* pieces across block ends, the zeros never fed */
+    struct snpy_manifest_builder *b = 
+        snpy_manifest_builder_create(size, bs, manifest_blk, &nblk);
+    assert(b);
+    u64 off = 0, piece[] = { 1, bs - 1, bs + 3, 3 * bs, 777 };
+    for (i = 0; off < 20 * bs; i ++) {
+        u64 n = MIN(piece[i % ARRAY_SIZE(piece)], 20 * bs - off);
+        assert(snpy_manifest_builder_feed(b, off, img + off, n) == 0);
+        off += n;
+    }
+    assert(snpy_manifest_builder_feed(b, 30 * bs, img + 30 * bs, bs) == 0);
+    assert(snpy_manifest_builder_feed(b, 0, img, 1) == -EINVAL);
+    assert(snpy_manifest_builder_feed(b, size - 100, img, 101) == -EINVAL);
+    assert(snpy_manifest_builder_finish(b, &m) == 0);
+    snpy_manifest_builder_free(b);
+    assert(nblk == 38);
+    assert(!memcmp(&m->hdr, &ref->hdr, sizeof m->hdr));
+    assert(!memcmp(m->nodev, ref->nodev, m->hdr.nnode * sizeof m->nodev[0]));
+
+    /* two blocks changed, the diff finds them and nothing else */
+    u64 found[8] = { 0 };
+    assert(snpy_manifest_diff(ref, m, manifest_diff, found) == 0);
+    img[3 * bs + 5] ^= 1;
+    img[size - 1] = 1;
+    snpy_manifest_leaf(img + 3 * bs, bs, m->nodev[3]);
+    snpy_manifest_leaf(img + 37 * bs, 100, m->nodev[37]);
+    snpy_manifest_seal(m);
+    assert(memcmp(m->hdr.root, ref->hdr.root, sizeof m->hdr.root));
+    assert(snpy_manifest_diff(ref, m, manifest_diff, found) == 2);
+    assert(found[0] == 2 && found[1] == 3 && found[2] == 37);
+
+    /* written and read back; a flipped bit of a node fails the crc */
+    struct snpy_manifest *back = NULL;
+    FILE *fp = tmpfile();
+    assert(fp);
+    assert(snpy_manifest_write(fileno(fp), m) == 0);
+    assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    assert(snpy_manifest_read(fileno(fp), &back) == 0);
+    assert(back->hdr.crc == snpy_crc32c(0, m->nodev, 
+                                        m->hdr.nnode * sizeof m->nodev[0]));
+    m->hdr.crc = back->hdr.crc;
+    assert(!memcmp(&back->hdr, &m->hdr, sizeof m->hdr));
+    assert(!memcmp(back->nodev, m->nodev, m->hdr.nnode * sizeof m->nodev[0]));
+    free(back);
+    u8 x;
+    off_t at = sizeof m->hdr + 5 * sizeof m->nodev[0];
+    assert(pread(fileno(fp), &x, 1, at) == 1);
+    x ^= 4;
+    assert(pwrite(fileno(fp), &x, 1, at) == 1);
+    assert(lseek(fileno(fp), 0, SEEK_SET) == 0);
+    back = NULL;
+    assert(snpy_manifest_read(fileno(fp), &back) == -EBADMSG && !back);
+    fclose(fp);
+    free(m);
+    free(ref);
+    free(img);
+    printf("manifest: ok\n");
+}
+
 int main(int argc, char *argv[]) {
     
     const char *path = "/var/lib/snappy";
 
+    test_crc32c();
+    test_blk_map();
+    test_ioeng();
+    test_cdc();
+    test_manifest();
+
+    /* the store, key, checkpoint and throttle of a job in the cwd */
+    char cwd[PATH_MAX], dir[] = "/tmp/libsnpy_test.XXXXXX";
+    assert(getcwd(cwd, sizeof cwd) && mkdtemp(dir));
+    assert(chdir(dir) == 0 && mkdir("meta", 0700) == 0);
+    test_crypt(dir);
+    test_chunk(dir);
+    test_ckpt();
+    test_tb();
+    assert(chdir(cwd) == 0 && rmdir_recurs(dir) == 0);
+
     if (argc == 2) 
         path = argv[1];
     ssize_t free_space = snpy_get_free_spc(path);
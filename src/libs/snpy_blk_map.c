@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
 
 #include "snpy_blk_map.h"
+#include "snpy_crc32c.h"
 
 
 struct blk_map *blk_map_alloc(size_t n) {
@@ -54,7 +60,163 @@ int blk_map_add(struct blk_map **bm, u64 off, u64 len) {
 }
 
 
+/* blk_map_union() - merge @src into @dst
+ *
+ * Both maps must be sorted by offset. Overlapping and adjacent segments are
+ * coalesced, so the result is again a sorted map of disjoint segments.
+ */
+
+int blk_map_union(struct blk_map **dst, const struct blk_map *src) {
+    if (!dst || !*dst || !src)
+        return -EINVAL;
+
+    struct blk_map *a = *dst;
+    struct blk_map *p = blk_map_alloc(a->nuse + src->nuse);
+    if (!p)
+        return -ENOMEM;
+
+    u64 i = 0, j = 0;
+    while (i < a->nuse || j < src->nuse) {
+        const struct seg *s;
+        if (j == src->nuse || (i < a->nuse && a->segv[i].off <= src->segv[j].off))
+            s = &a->segv[i++];
+        else
+            s = &src->segv[j++];
+
+        struct seg *last = p->nuse ? &p->segv[p->nuse - 1] : NULL;
+        if (last && s->off <= last->off + last->len) {
+            if (s->off + s->len > last->off + last->len)
+                last->len = s->off + s->len - last->off;
+        } else {
+            p->segv[p->nuse].off = s->off;
+            p->segv[p->nuse].len = s->len;
+            p->nuse ++;
+        }
+    }
+
+    blk_map_free(a);
+    *dst = p;
+    return 0;
+}
+
+
+/* blk_map_find() - first segment ending after @off
+ *
+ * @bm must be sorted. Returns bm->nuse if no segment ends after @off.
+ */
+
+u64 blk_map_find(const struct blk_map *bm, u64 off) {
+    u64 lo = 0, hi = bm->nuse;
+    while (lo < hi) {
+        u64 mid = lo + (hi - lo) / 2;
+        if (bm->segv[mid].off + bm->segv[mid].len <= off)
+            lo = mid + 1;
+        else 
+            hi = mid;
+    }
+    return lo;
+}
+
+
+/* encoder of the v2 layout, a dry run with fd -1 only sizes it */
+struct blk_map_enc {
+    int fd;
+    u64 nseg;
+    u64 size;
+    u32 crc;
+    u64 end;                /* end of the last segment */
+    u64 count;              /* segments in the pending group */
+    u64 gap;
+    u64 len;
+    u32 n;
+    u8 buf[BLK_MAP_BUF_SIZE];
+};
+
+static void enc_init(struct blk_map_enc *e, int fd) {
+    memset(e, 0, offsetof(struct blk_map_enc, buf));
+    e->fd = fd;
+}
+
+static int enc_flush(struct blk_map_enc *e) {
+    e->crc = snpy_crc32c(e->crc, e->buf, e->n);
+    e->size += e->n;
+    if (e->fd >= 0) {
+        ssize_t nwrite = snpy_write_full(e->fd, e->buf, e->n);
+        if (nwrite != e->n)
+            return nwrite < 0 ? nwrite : -EIO;
+    }
+    e->n = 0;
+    return 0;
+}
+
+static void enc_varint(struct blk_map_enc *e, u64 v) {
+    while (v >= 0x80) {
+        e->buf[e->n ++] = v | 0x80;
+        v >>= 7;
+    }
+    e->buf[e->n ++] = v;
+}
+
+/* enc_group() - encode the pending group of equal segments */
+static int enc_group(struct blk_map_enc *e) {
+    if (!e->count)
+        return 0;
+    if (e->n > sizeof e->buf - 3 * 10) {
+        int rc = enc_flush(e);
+        if (rc)
+            return rc;
+    }
+    enc_varint(e, e->count);
+    enc_varint(e, e->gap);
+    enc_varint(e, e->len);
+    e->count = 0;
+    return 0;
+}
+
+/* enc_seg() - add a segment, they must come sorted */
+static int enc_seg(struct blk_map_enc *e, const struct seg *seg) {
+    int rc;
+    if (!seg->len)
+        return 0;
+    if (seg->off < e->end)
+        return -EINVAL;
+    u64 gap = seg->off - e->end;
+    if (e->count && gap == e->gap && seg->len == e->len) {
+        e->count ++;
+    } else {
+        if ((rc = enc_group(e)))
+            return rc;
+        e->count = 1;
+        e->gap = gap;
+        e->len = seg->len;
+    }
+    e->end = seg->off + seg->len;
+    e->nseg ++;
+    return 0;
+}
+
+static int enc_end(struct blk_map_enc *e) {
+    int rc = enc_group(e);
+    return rc ? rc : enc_flush(e);
+}
+
+static int write_hdr(int fd, const struct blk_map_enc *e) {
+    struct blk_map_hdr hdr = {
+        .magic = BLK_MAP_MAGIC,
+        .nseg = e->nseg,
+        .size = e->size,
+        .crc = e->crc
+    };
+    ssize_t nwrite = snpy_write_full(fd, &hdr, sizeof hdr);
+    if (nwrite != sizeof hdr)
+        return nwrite < 0 ? nwrite : -EIO;
+    return 0;
+}
+
 /* blk_map_write() - write block map to a give fd
+ *
+ * @bm must be sorted. The map is encoded twice, once to size and checksum
+ * it for the header, once to write it.
  *
  * Note: it will change the offset of the @fd
  */
@@ -63,16 +225,115 @@ int blk_map_write(int fd, struct blk_map *bm) {
     if (!bm || fd < 0)
         return -EINVAL;
 
-    size_t size = (sizeof bm->nuse) + bm->nuse * (sizeof bm->segv[0]);
-    ssize_t nwrite = write(fd, &(bm->nuse), size);
-    if (nwrite != size) 
-        return -errno;
+    int rc;
+    int pass;
+    struct blk_map_enc *e = malloc(sizeof *e);
+    if (!e)
+        return -ENOMEM;
+    for (pass = 0; pass < 2; pass ++) {
+        u64 i;
+        enc_init(e, pass ? fd : -1);
+        for (i = 0, rc = 0; !rc && i < bm->nuse; i ++)
+            rc = enc_seg(e, &bm->segv[i]);
+        if (rc || (rc = enc_end(e)))
+            break;
+        if (!pass && (rc = write_hdr(fd, e)))
+            break;
+    }
+    free(e);
+    return rc;
+}
+
+/* decoder of the v2 layout, consumes exactly its bytes of the fd */
+struct blk_map_dec {
+    int fd;
+    u64 left;
+    u32 crc;
+    u32 i;
+    u32 n;
+    u8 buf[BLK_MAP_BUF_SIZE];
+};
 
+static int dec_varint(struct blk_map_dec *d, u64 *v) {
+    int shift;
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (d->i == d->n) {
+            if (!d->left)
+                return -EINVAL;
+            u32 n = MIN(d->left, sizeof d->buf);
+            if (snpy_read_full(d->fd, d->buf, n) != n)
+                return -EIO;
+            d->crc = snpy_crc32c(d->crc, d->buf, n);
+            d->left -= n;
+            d->i = 0;
+            d->n = n;
+        }
+        u8 b = d->buf[d->i ++];
+        *v |= (u64)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -EINVAL;
+}
+
+/* read_v2() - decode a v2 map, growing it as segments come in */
+static int read_v2(int fd, struct blk_map **bm) {
+    int rc;
+    struct blk_map_hdr hdr;
+    hdr.magic = BLK_MAP_MAGIC;
+    size_t rest = sizeof hdr - sizeof hdr.magic;
+    if (snpy_read_full(fd, (char *)&hdr + sizeof hdr.magic, rest) != rest)
+        return -EIO;
+    struct blk_map_dec *d = malloc(sizeof *d);
+    /* nseg is not to be trusted before the crc is checked */
+    struct blk_map *p = blk_map_alloc(MIN(hdr.nseg, 4096));
+    if (!d || !p) {
+        rc = -ENOMEM;
+        goto free_map;
+    }
+    d->fd = fd;
+    d->left = hdr.size;
+    d->crc = 0;
+    d->i = d->n = 0;
+
+    u64 nseg = 0, end = 0;
+    while (nseg < hdr.nseg) {
+        u64 count, gap, len;
+        if ((rc = dec_varint(d, &count)) || (rc = dec_varint(d, &gap)) ||
+            (rc = dec_varint(d, &len)))
+            goto free_map;
+        if (!count || !len || count > hdr.nseg - nseg) {
+            rc = -EINVAL;
+            goto free_map;
+        }
+        for (; count; count --, nseg ++) {
+            if (end + gap < end || end + gap + len < end + gap) {
+                rc = -EINVAL;       /* wraps around */
+                goto free_map;
+            }
+            if ((rc = blk_map_add(&p, end + gap, len)))
+                goto free_map;
+            end += gap + len;
+        }
+    }
+    if (d->i != d->n || d->left || d->crc != hdr.crc) {
+        rc = -EBADMSG;
+        goto free_map;
+    }
+    free(d);
+    *bm = p;
     return 0;
+
+free_map:
+    blk_map_free(p);
+    free(d);
+    return rc;
 }
 
 /* blk_map_read() - read a blk_map from an open fd
  *
+ * Reads both layouts, a v1 map starts with its segment count.
  */
 
 int blk_map_read(int fd, struct blk_map **bm) {
@@ -80,17 +341,22 @@ int blk_map_read(int fd, struct blk_map **bm) {
         return -EINVAL;
 
     u64 nseg = 0;
-    if (read(fd, &nseg, sizeof nseg) != sizeof nseg) 
-        return -errno;
+    ssize_t nread = snpy_read_full(fd, &nseg, sizeof nseg);
+    if (nread != sizeof nseg) 
+        return nread < 0 ? nread : -EIO;
+    if (nseg == BLK_MAP_MAGIC)
+        return read_v2(fd, bm);
+    if (nseg > (SIZE_MAX - sizeof(struct blk_map)) / sizeof(struct seg))
+        return -EINVAL;             /* not a blk_map */
     struct blk_map *p = blk_map_alloc(nseg);
     if (!p) 
         return -ENOMEM;
     p->nuse = nseg;
     size_t size = nseg * (sizeof p->segv[0]);
-    ssize_t nread = read(fd, p->segv, size);
+    nread = snpy_read_full(fd, p->segv, size);
     if (nread != size) {
         blk_map_free(p);
-        return -errno;
+        return nread < 0 ? nread : -EIO;
     }
     *bm = p;
     return 0;
@@ -104,3 +370,279 @@ void blk_map_free(struct blk_map *bm) {
 }
 
 
+
+
+#define BLK_MAP_CURSOR_NSEG 1024
+
+static int seg_cmp(const void *a, const void *b) {
+    const struct seg *x = a, *y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/* coalesce() - sort @n segments of @v and merge the overlapping and adjacent */
+static u64 coalesce(struct seg *v, u64 n) {
+    qsort(v, n, sizeof *v, seg_cmp);
+    u64 i, m = 0;
+    for (i = 0; i < n; i ++) {
+        if (m && v[i].off <= v[m - 1].off + v[m - 1].len) {
+            if (v[i].off + v[i].len > v[m - 1].off + v[m - 1].len)
+                v[m - 1].len = v[i].off + v[i].len - v[m - 1].off;
+        } else {
+            v[m ++] = v[i];
+        }
+    }
+    return m;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char *)buf + done, len - done, 
+                           off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -errno : -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+/* blk_map_sort_create() - sorter spilling runs of @n segments into @dir 
+ *
+ * @n of 0 takes BLK_MAP_RUN_NSEG.
+ */
+
+struct blk_map_sort *blk_map_sort_create(const char *dir, size_t n) {
+    if (!n)
+        n = BLK_MAP_RUN_NSEG;
+    struct blk_map_sort *s = calloc(sizeof *s + n * sizeof s->segv[0], 1);
+    if (!s)
+        return NULL;
+    s->fd = -1;
+    s->nalloc = n;
+    strlcpy(s->dir, dir ? dir : ".", sizeof s->dir);
+    return s;
+}
+
+/* spill() - sort the run in memory and append it to the spill file */
+static int spill(struct blk_map_sort *s) {
+    int rc;
+    if (!s->nuse)
+        return 0;
+    s->nuse = coalesce(s->segv, s->nuse);
+    if (s->fd == -1) {
+#ifdef O_TMPFILE
+        s->fd = open(s->dir, O_TMPFILE|O_RDWR, 0600);
+#endif
+        if (s->fd == -1) {
+            char fn[PATH_MAX];
+            snprintf(fn, sizeof fn, "%s/blk_map.XXXXXX", s->dir);
+            if ((s->fd = mkstemp(fn)) == -1)
+                return -errno;
+            unlink(fn);
+        }
+    }
+    u64 *runv = realloc(s->runv, (s->nrun + 1) * sizeof s->runv[0]);
+    if (!runv)
+        return -ENOMEM;
+    s->runv = runv;
+    u64 start = s->nrun ? s->runv[s->nrun - 1] : 0;
+    if ((rc = pwrite_full(s->fd, s->segv, s->nuse * sizeof s->segv[0],
+                          start * sizeof s->segv[0])))
+        return rc;
+    s->runv[s->nrun ++] = start + s->nuse;
+    s->nuse = 0;
+    return 0;
+}
+
+/* blk_map_sort_add() - add a segment, in any order */
+int blk_map_sort_add(struct blk_map_sort *s, u64 off, u64 len) {
+    int rc;
+    if (!s)
+        return -EINVAL;
+    if (!len)
+        return 0;
+    /* segments mostly come in order, merge into the last one if we can */
+    struct seg *last = s->nuse ? &s->segv[s->nuse - 1] : NULL;
+    if (last && off >= last->off && off <= last->off + last->len) {
+        if (off + len > last->off + last->len)
+            last->len = off + len - last->off;
+        return 0;
+    }
+    if (s->nuse == s->nalloc) {
+        /* spill only if coalescing does not free half of the run */
+        s->nuse = coalesce(s->segv, s->nuse);
+        if (s->nuse > s->nalloc / 2 && (rc = spill(s)))
+            return rc;
+    }
+    s->segv[s->nuse].off = off;
+    s->segv[s->nuse].len = len;
+    s->nuse ++;
+    return 0;
+}
+
+/* cursor over a spilled run */
+struct cursor {
+    u64 pos;
+    u64 end;
+    u64 i;
+    u64 n;
+    struct seg segv[BLK_MAP_CURSOR_NSEG];
+};
+
+static int cursor_fill(int fd, struct cursor *c) {
+    c->i = 0;
+    c->n = MIN(c->end - c->pos, BLK_MAP_CURSOR_NSEG);
+    size_t size = c->n * sizeof c->segv[0];
+    if (c->n && pread(fd, c->segv, size, c->pos * sizeof c->segv[0]) != size)
+        return errno ? -errno : -EIO;
+    c->pos += c->n;
+    return 0;
+}
+
+/* heap_down() - restore the heap of cursors @hv below @i, least off on top */
+static void heap_down(struct cursor **hv, u64 n, u64 i) {
+    for (;;) {
+        u64 m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && hv[l]->segv[hv[l]->i].off < hv[m]->segv[hv[m]->i].off)
+            m = l;
+        if (r < n && hv[r]->segv[hv[r]->i].off < hv[m]->segv[hv[m]->i].off)
+            m = r;
+        if (m == i)
+            return;
+        struct cursor *t = hv[i];
+        hv[i] = hv[m];
+        hv[m] = t;
+        i = m;
+    }
+}
+
+typedef int (*blk_map_emit_t)(void *ctx, const struct seg *seg);
+
+/* merge() - hand the coalesced segments of all runs to @emit, in order */
+static int merge(struct blk_map_sort *s, blk_map_emit_t emit, void *ctx) {
+    int rc;
+    u64 i, n = 0;
+    struct seg cur = { 0, 0 };
+
+    if (!s->nrun) {
+        s->nuse = coalesce(s->segv, s->nuse);
+        for (i = 0; i < s->nuse; i ++)
+            if ((rc = emit(ctx, &s->segv[i])))
+                return rc;
+        return 0;
+    }
+    if ((rc = spill(s)))
+        return rc;
+    struct cursor *curv = malloc(s->nrun * sizeof curv[0]);
+    struct cursor **hv = malloc(s->nrun * sizeof hv[0]);
+    if (!curv || !hv) {
+        rc = -ENOMEM;
+        goto free_cursor;
+    }
+    for (i = 0; i < s->nrun; i ++) {
+        struct cursor *c = &curv[i];
+        c->pos = i ? s->runv[i - 1] : 0;
+        c->end = s->runv[i];
+        if ((rc = cursor_fill(s->fd, c)))
+            goto free_cursor;
+        if (c->n)
+            hv[n ++] = c;
+    }
+    for (i = n / 2; i --; )
+        heap_down(hv, n, i);
+
+    while (n) {
+        struct cursor *c = hv[0];
+        struct seg seg = c->segv[c->i ++];
+        if (c->i == c->n && (rc = cursor_fill(s->fd, c)))
+            goto free_cursor;
+        if (!c->n)
+            hv[0] = hv[-- n];
+        heap_down(hv, n, 0);
+
+        if (cur.len && seg.off <= cur.off + cur.len) {
+            if (seg.off + seg.len > cur.off + cur.len)
+                cur.len = seg.off + seg.len - cur.off;
+            continue;
+        }
+        if (cur.len && (rc = emit(ctx, &cur)))
+            goto free_cursor;
+        cur = seg;
+    }
+    rc = cur.len ? emit(ctx, &cur) : 0;
+
+free_cursor:
+    free(hv);
+    free(curv);
+    return rc;
+}
+
+static int emit_count(void *ctx, const struct seg *seg) {
+    (*(u64 *)ctx) ++;
+    return 0;
+}
+
+static int emit_map(void *ctx, const struct seg *seg) {
+    struct blk_map *bm = ctx;
+    bm->segv[bm->nuse ++] = *seg;
+    return 0;
+}
+
+/* blk_map_sort_map() - the merged segments as a blk_map in @bm */
+int blk_map_sort_map(struct blk_map_sort *s, struct blk_map **bm) {
+    int rc;
+    u64 n = 0;
+    if (!s || !bm)
+        return -EINVAL;
+    if ((rc = merge(s, emit_count, &n)))
+        return rc;
+    struct blk_map *p = blk_map_alloc(n);
+    if (!p)
+        return -ENOMEM;
+    if ((rc = merge(s, emit_map, p))) {
+        blk_map_free(p);
+        return rc;
+    }
+    *bm = p;
+    return 0;
+}
+
+static int emit_enc(void *ctx, const struct seg *seg) {
+    return enc_seg(ctx, seg);
+}
+
+/* blk_map_sort_write() - write the merged segments to @fd as blk_map_write()
+ *
+ * The map is never whole in memory, it is merged twice instead, once to
+ * size it and once to write it.
+ */
+
+int blk_map_sort_write(struct blk_map_sort *s, int fd) {
+    int rc;
+    int pass;
+    if (!s || fd < 0)
+        return -EINVAL;
+    struct blk_map_enc *e = malloc(sizeof *e);
+    if (!e)
+        return -ENOMEM;
+    for (pass = 0; pass < 2; pass ++) {
+        enc_init(e, pass ? fd : -1);
+        if ((rc = merge(s, emit_enc, e)) || (rc = enc_end(e)))
+            break;
+        if (!pass && (rc = write_hdr(fd, e)))
+            break;
+    }
+    free(e);
+    return rc;
+}
+
+void blk_map_sort_free(struct blk_map_sort *s) {
+    if (!s)
+        return;
+    if (s->fd != -1)
+        close(s->fd);
+    free(s->runv);
+    free(s);
+}
@@ -15,11 +15,63 @@ struct blk_map {
     struct seg segv[0];
 };
 
+/*
+ * On disk a sorted map is a struct blk_map_hdr and size bytes of groups of
+ * equal segments, each three LEB128 varints: the number of segments, the
+ * gap before each from the end of the one before, and their length. crc
+ * is the crc32c of the groups. Object aligned extents of one size make
+ * one group per run however long.
+ *
+ * The v1 layout, still read, was the u64 segment count and the raw
+ * segments.
+ */
+
+#define BLK_MAP_MAGIC 0x3250414d4b4c42ULL     /* "BLKMAP2" */
+#define BLK_MAP_BUF_SIZE (64 << 10)
+
+struct blk_map_hdr {
+    u64 magic;
+    u64 nseg;
+    u64 size;
+    u32 crc;
+    u32 reserved;
+};
+
+
+/*
+ * blk_map_sort - builds a blk_map from segments added in any order
+ *
+ * Segments are collected in a run of at most nalloc segments; a full run is
+ * sorted, coalesced and spilled to an unlinked file, so memory stays bounded
+ * however many segments come in. At the end the runs are merged, with
+ * overlapping and adjacent segments coalesced, into a blk_map or straight
+ * into a file.
+ */
+
+#define BLK_MAP_RUN_NSEG (1 << 20)
+
+struct blk_map_sort {
+    int fd;                 /* spilled runs, -1 until the first spill */
+    char dir[256];
+    u64 nrun;
+    u64 *runv;              /* end of each spilled run, in segments */
+    u64 nalloc;
+    u64 nuse;
+    struct seg segv[0];
+};
 
 struct blk_map *blk_map_alloc(size_t n);
 int blk_map_add(struct blk_map **bm, u64 off, u64 len);
 void blk_map_free(struct blk_map *bm);
+int blk_map_union(struct blk_map **dst, const struct blk_map *src);
+u64 blk_map_find(const struct blk_map *bm, u64 off);
 
 int blk_map_write(int fd, struct blk_map *bm);
 int blk_map_read(int fd, struct blk_map **bm);
+
+struct blk_map_sort *blk_map_sort_create(const char *dir, size_t n);
+int blk_map_sort_add(struct blk_map_sort *s, u64 off, u64 len);
+int blk_map_sort_map(struct blk_map_sort *s, struct blk_map **bm);
+int blk_map_sort_write(struct blk_map_sort *s, int fd);
+void blk_map_sort_free(struct blk_map_sort *s);
 #endif
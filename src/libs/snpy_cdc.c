@@ -0,0 +1,45 @@
+#include <pthread.h>
+
+#include "snpy_cdc.h"
+
+#define CDC_MASK_S 0xffffc00000000000ULL    /* 18 bits, before SNPY_CDC_AVG */
+#define CDC_MASK_L 0xfffc000000000000ULL    /* 14 bits, after it */
+
+static u64 gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* gear_init() - the gear table, splitmix64 from a fixed seed */
+static void gear_init(void) {
+    u64 x = 0x534e5059434443ULL;            /* "SNPYCDC" */
+    int i;
+    for (i = 0; i < 256; i ++) {
+        u64 z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* snpy_cdc_cut() - length of the first chunk of the @len bytes at @buf */
+u32 snpy_cdc_cut(const void *buf, u32 len) {
+    const u8 *p = buf;
+    if (len <= SNPY_CDC_MIN)
+        return len;
+    pthread_once(&gear_once, gear_init);
+
+    u32 avg = MIN(len, SNPY_CDC_AVG);
+    u32 max = MIN(len, SNPY_CDC_MAX);
+    u32 i = SNPY_CDC_MIN;
+    u64 h = 0;
+    for (; i < avg; i ++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CDC_MASK_S))
+            return i + 1;
+    }
+    for (; i < max; i ++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CDC_MASK_L))
+            return i + 1;
+    }
+    return max;
+}
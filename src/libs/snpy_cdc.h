@@ -0,0 +1,26 @@
+#ifndef SNPY_CDC_H
+#define SNPY_CDC_H
+
+#include "snpy_util.h"
+
+/*
+ * content defined chunking
+ *
+ * A gear hash rolls over the data and a chunk ends where its top bits are
+ * zero, so chunk boundaries follow content rather than offsets. Chunks are
+ * kept between SNPY_CDC_MIN and SNPY_CDC_MAX bytes; the first SNPY_CDC_MIN
+ * bytes are skipped without hashing and the mask is stricter before
+ * SNPY_CDC_AVG than after it, which keeps chunks close to the average size
+ * (normalized chunking, as in FastCDC).
+ *
+ * The gear table is fixed, chunk boundaries must not change from one
+ * backup to the next.
+ */
+
+#define SNPY_CDC_MIN (16 << 10)
+#define SNPY_CDC_AVG (64 << 10)
+#define SNPY_CDC_MAX (256 << 10)
+
+u32 snpy_cdc_cut(const void *buf, u32 len);
+
+#endif
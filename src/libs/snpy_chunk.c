@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snpy_chunk.h"
+#include "snpy_data.h"
+
+#define PACK_SHIFT 40
+
+static u64 fp_word(const u8 *fp, int i) {
+    u64 w;
+    memcpy(&w, fp + 8 * i, sizeof w);
+    return w;
+}
+
+static size_t bloom_size(u64 nbloom) {
+    return (nbloom / 8 + 4095) & ~4095ULL;
+}
+
+static size_t index_size(u64 nslot, u64 nbloom) {
+    return sizeof(struct snpy_chunk_hdr) + bloom_size(nbloom) +
+        nslot * sizeof(struct snpy_chunk_ent);
+}
+
+static int bloom_test(const u8 *bloom, u64 nbloom, const u8 *fp) {
+    u64 h1 = fp_word(fp, 1), h2 = fp_word(fp, 2) | 1;
+    int i;
+    for (i = 0; i < SNPY_CHUNK_BLOOM_K; i ++) {
+        u64 bit = (h1 + i * h2) & (nbloom - 1);
+        if (!(bloom[bit / 8] & (1 << bit % 8)))
+            return 0;
+    }
+    return 1;
+}
+
+static void bloom_set(u8 *bloom, u64 nbloom, const u8 *fp) {
+    u64 h1 = fp_word(fp, 1), h2 = fp_word(fp, 2) | 1;
+    int i;
+    for (i = 0; i < SNPY_CHUNK_BLOOM_K; i ++) {
+        u64 bit = (h1 + i * h2) & (nbloom - 1);
+        bloom[bit / 8] |= 1 << bit % 8;
+    }
+}
+
+/* table_find() - slot of @fp, or the free slot it would go in */
+static struct snpy_chunk_ent *table_find(struct snpy_chunk_ent *slotv,
+                                         u64 nslot, const u8 *fp) {
+    u64 i = fp_word(fp, 0) & (nslot - 1);
+    for (;;) {
+        struct snpy_chunk_ent *e = &slotv[i];
+        if (!__atomic_load_n(&e->zlen, __ATOMIC_ACQUIRE) ||
+            !memcmp(e->fp, fp, sizeof e->fp))
+            return e;
+        i = (i + 1) & (nslot - 1);
+    }
+}
+
+/* table_set() - fill free slot @e, zlen last for lock free readers */
+static void table_set(struct snpy_chunk_ent *e, const struct snpy_chunk_ent *v) {
+    memcpy(e->fp, v->fp, sizeof e->fp);
+    e->off = v->off;
+    e->len = v->len;
+    e->codec = v->codec;
+    __atomic_store_n(&e->zlen, v->zlen, __ATOMIC_RELEASE);
+}
+
+static void unmap_index(struct snpy_chunk_store *s) {
+    if (s->hdr)
+        munmap(s->hdr, s->map_size);
+    s->hdr = NULL;
+}
+
+/* map_file() - map the index at @fn in place of the one mapped */
+static int map_file(struct snpy_chunk_store *s, const char *fn) {
+    int rc;
+    int fd = open(fn, s->wr ? O_RDWR : O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    struct stat st;
+    struct snpy_chunk_hdr hdr;
+    if (fstat(fd, &st) || pread(fd, &hdr, sizeof hdr, 0) != sizeof hdr) {
+        rc = errno ? -errno : -EIO;
+        goto close_fd;
+    }
+    if (hdr.magic != SNPY_CHUNK_MAGIC || !hdr.nslot || !hdr.nbloom ||
+        (hdr.nslot & (hdr.nslot - 1)) || (hdr.nbloom & (hdr.nbloom - 1)) ||
+        st.st_size != index_size(hdr.nslot, hdr.nbloom)) {
+        rc = -EINVAL;
+        goto close_fd;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ|(s->wr ? PROT_WRITE : 0),
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        rc = -errno;
+        goto close_fd;
+    }
+    unmap_index(s);
+    s->hdr = p;
+    s->map_size = st.st_size;
+    s->ino = st.st_ino;
+    s->bloom = (u8 *)p + sizeof hdr;
+    s->slotv = (struct snpy_chunk_ent *)(s->bloom + bloom_size(hdr.nbloom));
+    rc = 0;
+close_fd:
+    close(fd);
+    return rc;
+}
+
+static int map_index(struct snpy_chunk_store *s) {
+    char fn[PATH_MAX];
+    snprintf(fn, sizeof fn, "%s/index", s->dir);
+    return map_file(s, fn);
+}
+
+/* create_index() - an empty index of @nslot slots at @fn */
+static int create_index(const char *fn, u64 nslot, u64 pack) {
+    struct snpy_chunk_hdr hdr = {
+        .magic = SNPY_CHUNK_MAGIC,
+        .nslot = nslot,
+        .nbloom = nslot * SNPY_CHUNK_BLOOM_BITS,
+        .pack = pack
+    };
+    int fd = open(fn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+    int rc = 0;
+    if (ftruncate(fd, index_size(hdr.nslot, hdr.nbloom)) ||
+        pwrite(fd, &hdr, sizeof hdr, 0) != sizeof hdr)
+        rc = errno ? -errno : -EIO;
+    close(fd);
+    return rc;
+}
+
+/* remap() - map the index again if a writer replaced it */
+static int remap(struct snpy_chunk_store *s) {
+    char fn[PATH_MAX];
+    struct stat st;
+    snprintf(fn, sizeof fn, "%s/index", s->dir);
+    if (stat(fn, &st))
+        return -errno;
+    return st.st_ino == s->ino ? 0 : map_index(s);
+}
+
+/*
+ * grow() - rehash the index into one of twice the slots
+ *
+ * The new index is complete and synced before it replaces the old one,
+ * a crash leaves one or the other.
+ */
+static int grow(struct snpy_chunk_store *s) {
+    int rc;
+    char fn[PATH_MAX];
+    char tmp[PATH_MAX];
+    snprintf(fn, sizeof fn, "%s/index", s->dir);
+    snprintf(tmp, sizeof tmp, "%s/index.tmp", s->dir);
+    if ((rc = create_index(tmp, s->hdr->nslot * 2, s->hdr->pack)))
+        return rc;
+    struct snpy_chunk_hdr *old = s->hdr;
+    struct snpy_chunk_ent *old_slotv = s->slotv;
+    u8 *old_bloom = s->bloom;
+    size_t old_size = s->map_size;
+    ino_t old_ino = s->ino;
+    s->hdr = NULL;
+    if ((rc = map_file(s, tmp)))
+        goto restore;
+    u64 i;
+    for (i = 0; i < old->nslot; i ++) {
+        struct snpy_chunk_ent *e = &old_slotv[i];
+        if (!e->zlen)
+            continue;
+        table_set(table_find(s->slotv, s->hdr->nslot, e->fp), e);
+        bloom_set(s->bloom, s->hdr->nbloom, e->fp);
+    }
+    s->hdr->nuse = old->nuse;
+    if (msync(s->hdr, s->map_size, MS_SYNC) || rename(tmp, fn)) {
+        rc = -errno;
+        unmap_index(s);
+        goto restore;
+    }
+    munmap(old, old_size);
+    return 0;
+
+restore:
+    unlink(tmp);
+    s->hdr = old;
+    s->map_size = old_size;
+    s->ino = old_ino;
+    s->bloom = old_bloom;
+    s->slotv = old_slotv;
+    return rc;
+}
+
+static int lock_store(struct snpy_chunk_store *s) {
+    int rc;
+    if (flock(s->lock_fd, LOCK_EX))
+        return -errno;
+    if ((rc = remap(s)))
+        flock(s->lock_fd, LOCK_UN);
+    return rc;
+}
+
+static void unlock_store(struct snpy_chunk_store *s) {
+    flock(s->lock_fd, LOCK_UN);
+}
+
+/* pwrite_full() - write all @len bytes of @data at @off of @fd */
+static int pwrite_full(int fd, const void *data, u32 len, u64 off) {
+    u32 done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const char *)data + done, len - done,
+                           off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -errno : -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+/* pack_fd() - fd of pack @n, opened on first use */
+static int pack_fd(struct snpy_chunk_store *s, u64 n) {
+    int fd = -1;
+    pthread_mutex_lock(&s->lock);
+    if (n >= s->npack) {
+        u64 npack = MAX(n + 1, 2 * s->npack);
+        int *packv = realloc(s->packv, npack * sizeof packv[0]);
+        u8 *dirtyv = packv ? realloc(s->dirtyv, npack) : NULL;
+        if (packv)
+            s->packv = packv;
+        if (!dirtyv) {
+            errno = ENOMEM;
+            goto unlock;
+        }
+        s->dirtyv = dirtyv;
+        for (; s->npack < npack; s->npack ++) {
+            s->packv[s->npack] = -1;
+            s->dirtyv[s->npack] = 0;
+        }
+    }
+    if (s->packv[n] == -1) {
+        char fn[PATH_MAX];
+        snprintf(fn, sizeof fn, "%s/pack.%llu", s->dir, (unsigned long long)n);
+        s->packv[n] = open(fn, s->wr ? O_RDWR|O_CREAT : O_RDONLY, 0600);
+    }
+    fd = s->packv[n];
+unlock:
+    pthread_mutex_unlock(&s->lock);
+    return fd;
+}
+
+static struct snpy_chunk_ent *pend_find(struct snpy_chunk_store *s,
+                                        const u8 *fp, u32 **slot) {
+    u32 mask = 2 * SNPY_CHUNK_PEND_MAX - 1;
+    u32 i = fp_word(fp, 0) & mask;
+    for (; s->pend_slotv[i]; i = (i + 1) & mask) {
+        struct snpy_chunk_ent *e = &s->pendv[s->pend_slotv[i] - 1];
+        if (!memcmp(e->fp, fp, sizeof e->fp))
+            return e;
+    }
+    if (slot)
+        *slot = &s->pend_slotv[i];
+    return NULL;
+}
+
+/* find() - entry of @fp synced or pending, NULL if not in the store */
+static const struct snpy_chunk_ent *find(struct snpy_chunk_store *s,
+                                         const u8 *fp) {
+    if (bloom_test(s->bloom, s->hdr->nbloom, fp)) {
+        struct snpy_chunk_ent *e = table_find(s->slotv, s->hdr->nslot, fp);
+        if (__atomic_load_n(&e->zlen, __ATOMIC_ACQUIRE))
+            return e;
+    }
+    return s->wr ? pend_find(s, fp, NULL) : NULL;
+}
+
+/*
+ * snpy_chunk_store_open() - open the store in @dir, created if @wr
+ *
+ * A reader may be shared by threads, a writer may not. With @wr
+ * SNPY_CHUNK_RECLAIM the store is opened to be swept, -EBUSY while anyone
+ * else has it open.
+ */
+struct snpy_chunk_store *snpy_chunk_store_open(const char *dir, int wr) {
+    int rc;
+    char fn[PATH_MAX];
+    struct snpy_chunk_store *s = calloc(1, sizeof *s);
+    if (!s)
+        return NULL;
+    if (strlcpy(s->dir, dir, sizeof s->dir) >= sizeof s->dir) {
+        rc = -ENAMETOOLONG;
+        goto free_store;
+    }
+    s->wr = wr;
+    s->lock_fd = -1;
+    s->use_fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    if (wr && (rc = mkdir_p(dir, 0700)) && rc != -EEXIST)
+        goto free_store;
+    snprintf(fn, sizeof fn, "%s/use", dir);
+    if ((s->use_fd = open(fn, O_RDONLY|O_CREAT, 0600)) == -1 ||
+        flock(s->use_fd, 
+              wr == SNPY_CHUNK_RECLAIM ? LOCK_EX|LOCK_NB : LOCK_SH)) {
+        rc = errno == EWOULDBLOCK ? -EBUSY : -errno;
+        goto free_store;
+    }
+    if (wr) {
+        snprintf(fn, sizeof fn, "%s/lock", dir);
+        if ((s->lock_fd = open(fn, O_RDWR|O_CREAT, 0600)) == -1 ||
+            flock(s->lock_fd, LOCK_EX)) {
+            rc = -errno;
+            goto free_store;
+        }
+        snprintf(fn, sizeof fn, "%s/index", dir);
+        rc = access(fn, F_OK) ? create_index(fn, SNPY_CHUNK_NSLOT, 0) : 0;
+        unlock_store(s);
+        s->pendv = malloc(SNPY_CHUNK_PEND_MAX * sizeof s->pendv[0]);
+        s->pend_slotv = calloc(2 * SNPY_CHUNK_PEND_MAX,
+                               sizeof s->pend_slotv[0]);
+        if (!rc && (!s->pendv || !s->pend_slotv))
+            rc = -ENOMEM;
+        if (rc)
+            goto free_store;
+    }
+    if ((rc = map_index(s)))
+        goto free_store;
+    if (wr == SNPY_CHUNK_RECLAIM && 
+        !(s->markv = calloc(s->hdr->nslot / 8 + 1, 1))) {
+        rc = -ENOMEM;
+        goto free_store;
+    }
+    return s;
+
+free_store:
+    snpy_chunk_store_close(s);
+    errno = -rc;
+    return NULL;
+}
+
+/* snpy_chunk_store_has() - whether chunk @fp is in the store */
+int snpy_chunk_store_has(struct snpy_chunk_store *s, const u8 *fp) {
+    return !!find(s, fp);
+}
+
+/*
+ * snpy_chunk_store_put() - append chunk @fp of @len bytes stored as @zlen
+ *                          bytes of @data in @codec
+ *
+ * The chunk is found by its writer at once and by everyone else once
+ * synced; a full set of pending chunks is synced right away.
+ */
+int snpy_chunk_store_put(struct snpy_chunk_store *s, const u8 *fp, u32 len,
+                         u32 codec, const void *data, u32 zlen) {
+    int rc;
+    u32 *slot;
+    if (!s->wr || !zlen)
+        return -EINVAL;
+    if (pend_find(s, fp, &slot))
+        return 0;
+    if ((rc = lock_store(s)))
+        return rc;
+
+    u64 pack = s->hdr->pack;
+    int fd = pack_fd(s, pack);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        rc = -errno;
+        goto unlock;
+    }
+    if (st.st_size >= SNPY_CHUNK_PACK_SIZE) {
+        pack = ++ s->hdr->pack;
+        st.st_size = 0;
+        if ((fd = pack_fd(s, pack)) == -1) {
+            rc = -errno;
+            goto unlock;
+        }
+    }
+    if ((rc = pwrite_full(fd, data, zlen, st.st_size)))
+        goto unlock;
+    s->dirtyv[pack] = 1;
+
+    struct snpy_chunk_ent *e = &s->pendv[s->npend];
+    memcpy(e->fp, fp, sizeof e->fp);
+    e->off = pack << PACK_SHIFT | st.st_size;
+    e->zlen = zlen;
+    e->len = len;
+    e->codec = codec;
+    *slot = ++ s->npend;
+    rc = 0;
+unlock:
+    unlock_store(s);
+    if (!rc && s->npend == SNPY_CHUNK_PEND_MAX)
+        rc = snpy_chunk_store_sync(s);
+    return rc;
+}
+
+/*
+ * snpy_chunk_store_get() - read the stored bytes of chunk @fp into @buf
+ *
+ * Returns their number, with the raw length in @len and their codec in
+ * @codec; -ENOENT if the chunk is not in the store.
+ */
+ssize_t snpy_chunk_store_get(struct snpy_chunk_store *s, const u8 *fp,
+                             void *buf, u32 size, u32 *len, u32 *codec) {
+    const struct snpy_chunk_ent *e = find(s, fp);
+    if (!e)
+        return -ENOENT;
+    u64 off = e->off;
+    u32 zlen = e->zlen;
+    *len = e->len;
+    *codec = e->codec;
+    if (zlen > size)
+        return -EINVAL;
+    int fd = pack_fd(s, off >> PACK_SHIFT);
+    if (fd == -1)
+        return -errno;
+    ssize_t n = pread(fd, buf, zlen, off & ((1ULL << PACK_SHIFT) - 1));
+    if (n != zlen)
+        return n < 0 ? -errno : -EIO;
+    return n;
+}
+
+/* snpy_chunk_store_sync() - make the pending chunks durable and public */
+int snpy_chunk_store_sync(struct snpy_chunk_store *s) {
+    int rc;
+    u64 i;
+    if (!s->wr || !s->npend)
+        return 0;
+    for (i = 0; i < s->npack; i ++) {
+        if (s->dirtyv[i] && fdatasync(s->packv[i]))
+            return -errno;
+        s->dirtyv[i] = 0;
+    }
+    if ((rc = lock_store(s)))
+        return rc;
+    for (i = 0; i < s->npend; i ++) {
+        struct snpy_chunk_ent *v = &s->pendv[i];
+        if ((s->hdr->nuse + 1) * 10 > s->hdr->nslot * 7 && (rc = grow(s)))
+            goto unlock;
+        struct snpy_chunk_ent *e = table_find(s->slotv, s->hdr->nslot, v->fp);
+        if (e->zlen)
+            continue;               /* put by another writer meanwhile */
+        table_set(e, v);
+        bloom_set(s->bloom, s->hdr->nbloom, v->fp);
+        s->hdr->nuse ++;
+    }
+    if (msync(s->hdr, s->map_size, MS_SYNC)) {
+        rc = -errno;
+        goto unlock;
+    }
+    s->npend = 0;
+    memset(s->pend_slotv, 0, 2 * SNPY_CHUNK_PEND_MAX * sizeof s->pend_slotv[0]);
+unlock:
+    unlock_store(s);
+    return rc;
+}
+
+/* snpy_chunk_store_close() - close the store, pending chunks are dropped */
+void snpy_chunk_store_close(struct snpy_chunk_store *s) {
+    if (!s)
+        return;
+    unmap_index(s);
+    u64 i;
+    for (i = 0; i < s->npack; i ++)
+        if (s->packv[i] != -1)
+            close(s->packv[i]);
+    free(s->packv);
+    free(s->dirtyv);
+    free(s->pendv);
+    free(s->pend_slotv);
+    free(s->markv);
+    if (s->lock_fd != -1)
+        close(s->lock_fd);
+    if (s->use_fd != -1)
+        close(s->use_fd);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/* snpy_chunk_store_mark() - keep chunk @fp on the next sweep */
+int snpy_chunk_store_mark(struct snpy_chunk_store *s, const u8 *fp) {
+    if (!s->markv)
+        return -EINVAL;
+    struct snpy_chunk_ent *e = table_find(s->slotv, s->hdr->nslot, fp);
+    if (!e->zlen)
+        return -ENOENT;
+    u64 i = e - s->slotv;
+    s->markv[i / 8] |= 1 << i % 8;
+    return 0;
+}
+
+/*
+ * snpy_chunk_store_mark_file() - mark the chunks data file @fd refers to
+ *
+ * Only the records of a v2 data file with SNPY_DATA_F_DEDUP refer to
+ * chunks, any other file is passed over. Returns the refs to chunks not in
+ * the store, which a restore of the file would miss.
+ */
+ssize_t snpy_chunk_store_mark_file(struct snpy_chunk_store *s, int fd) {
+    int rc;
+    struct snpy_data_hdr hdr;
+    struct snpy_data_idx *idx = NULL;
+    struct snpy_chunk_ref *refv = NULL;
+    if (snpy_data_hdr_read(fd, &hdr) || hdr.version < 2 ||
+        !(hdr.flags & SNPY_DATA_F_DEDUP))
+        return 0;
+    if (lseek(fd, hdr.idx_offset, SEEK_SET) == -1)
+        return -errno;
+    if ((rc = snpy_data_idx_read(fd, &idx)))
+        return rc;
+
+    ssize_t nmiss = 0;
+    u32 size = 0;
+    u64 i, j;
+    for (i = 0; i < idx->nuse; i ++) {
+        const struct snpy_data_ent *ent = &idx->entv[i];
+        if (ent->codec != SNPY_CHUNK_CODEC_REF)
+            continue;
+        if (ent->zlen % sizeof *refv) {
+            nmiss = -EIO;
+            break;
+        }
+        if (ent->zlen > size) {
+            void *p = realloc(refv, ent->zlen);
+            if (!p) {
+                nmiss = -ENOMEM;
+                break;
+            }
+            refv = p;
+            size = ent->zlen;
+        }
+        if (pread(fd, refv, ent->zlen, ent->file_off) != ent->zlen) {
+            nmiss = -EIO;
+            break;
+        }
+        for (j = 0; j < ent->zlen / sizeof *refv; j ++)
+            if (snpy_chunk_store_mark(s, refv[j].fp))
+                nmiss ++;
+    }
+    free(refv);
+    snpy_data_idx_free(idx);
+    return nmiss;
+}
+
+/* pack_fn() - file name of pack @n */
+static void pack_fn(const struct snpy_chunk_store *s, u64 n, char *fn) {
+    snprintf(fn, PATH_MAX, "%s/pack.%llu", s->dir, (unsigned long long)n);
+}
+
+/* new_pack() - fd of pack @n, emptied */
+static int new_pack(struct snpy_chunk_store *s, u64 n) {
+    int fd = pack_fd(s, n);
+    if (fd == -1 || ftruncate(fd, 0))
+        return -errno;
+    s->dirtyv[n] = 1;
+    return fd;
+}
+
+/*
+ * snpy_chunk_store_sweep() - drop the chunks not marked
+ *
+ * The marked chunks are copied to packs numbered on from the last one,
+ * under a new index sized for them. The old index is replaced once the
+ * new packs and index are durable, and only then are the old packs
+ * removed; a crash leaves the old store whole, or the new one with some
+ * old packs left over. Returns the chunks dropped, their stored bytes in
+ * @nbyte.
+ */
+ssize_t snpy_chunk_store_sweep(struct snpy_chunk_store *s, u64 *nbyte) {
+    int rc, fd;
+    char fn[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (!s->markv)
+        return -EINVAL;
+    snprintf(fn, sizeof fn, "%s/index", s->dir);
+    snprintf(tmp, sizeof tmp, "%s/index.tmp", s->dir);
+
+    u64 i, nmark = 0, nslot = SNPY_CHUNK_NSLOT;
+    for (i = 0; i < s->hdr->nslot; i ++)
+        nmark += s->markv[i / 8] >> i % 8 & 1;
+    while (nmark * 10 > nslot * 7)
+        nslot <<= 1;
+    u64 first = s->hdr->pack + 1, pack = first, pos = 0;
+    if ((rc = create_index(tmp, nslot, first)))
+        return rc;
+    struct snpy_chunk_hdr *old = s->hdr;
+    struct snpy_chunk_ent *old_slotv = s->slotv;
+    u8 *old_bloom = s->bloom;
+    size_t old_size = s->map_size;
+    ino_t old_ino = s->ino;
+    s->hdr = NULL;
+    char *buf = NULL;
+    u32 size = 0;
+    ssize_t nfree = 0;
+    *nbyte = 0;
+    if ((rc = map_file(s, tmp)))
+        goto restore;
+    if ((fd = new_pack(s, pack)) < 0) {
+        rc = fd;
+        goto restore;
+    }
+
+    for (i = 0; i < old->nslot; i ++) {
+        const struct snpy_chunk_ent *e = &old_slotv[i];
+        if (!e->zlen)
+            continue;
+        if (!(s->markv[i / 8] >> i % 8 & 1)) {
+            nfree ++;
+            *nbyte += e->zlen;
+            continue;
+        }
+        if (pos && pos + e->zlen > SNPY_CHUNK_PACK_SIZE) {
+            if ((fd = new_pack(s, ++ pack)) < 0) {
+                rc = fd;
+                goto restore;
+            }
+            pos = 0;
+        }
+        if (e->zlen > size) {
+            void *p = realloc(buf, e->zlen);
+            if (!p) {
+                rc = -ENOMEM;
+                goto restore;
+            }
+            buf = p;
+            size = e->zlen;
+        }
+        int in = pack_fd(s, e->off >> PACK_SHIFT);
+        if (in == -1 ||
+            pread(in, buf, e->zlen, e->off & ((1ULL << PACK_SHIFT) - 1)) 
+            != e->zlen) {
+            rc = in == -1 ? -errno : -EIO;
+            goto restore;
+        }
+        if ((rc = pwrite_full(fd, buf, e->zlen, pos)))
+            goto restore;
+        struct snpy_chunk_ent v = *e;
+        v.off = pack << PACK_SHIFT | pos;
+        table_set(table_find(s->slotv, s->hdr->nslot, v.fp), &v);
+        bloom_set(s->bloom, s->hdr->nbloom, v.fp);
+        s->hdr->nuse ++;
+        pos += e->zlen;
+    }
+    s->hdr->pack = pack;
+    for (i = first; i <= pack; i ++) {
+        if (fdatasync(s->packv[i])) {
+            rc = -errno;
+            goto restore;
+        }
+        s->dirtyv[i] = 0;
+    }
+    if (msync(s->hdr, s->map_size, MS_SYNC) || rename(tmp, fn)) {
+        rc = -errno;
+        goto restore;
+    }
+    munmap(old, old_size);
+    free(buf);
+    free(s->markv);
+    s->markv = calloc(s->hdr->nslot / 8 + 1, 1);
+
+    /* no index refers to the old packs now */
+    for (i = 0; i < first; i ++) {
+        if (i < s->npack && s->packv[i] != -1) {
+            close(s->packv[i]);
+            s->packv[i] = -1;
+        }
+        pack_fn(s, i, tmp);
+        unlink(tmp);
+    }
+    return nfree;
+
+restore:
+    free(buf);
+    unmap_index(s);
+    unlink(tmp);
+    for (i = first; i <= pack && i < s->npack; i ++) {
+        if (s->packv[i] != -1) {
+            close(s->packv[i]);
+            s->packv[i] = -1;
+        }
+        s->dirtyv[i] = 0;
+        pack_fn(s, i, tmp);
+        unlink(tmp);
+    }
+    s->hdr = old;
+    s->map_size = old_size;
+    s->ino = old_ino;
+    s->bloom = old_bloom;
+    s->slotv = old_slotv;
+    return rc;
+}
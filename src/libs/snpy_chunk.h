@@ -0,0 +1,106 @@
+#ifndef SNPY_CHUNK_H
+#define SNPY_CHUNK_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "snpy_util.h"
+#include "snpy_sha256.h"
+
+/*
+ * chunk store - deduplicated chunks of backup data, by sha256
+ *
+ *   <dir>/index    struct snpy_chunk_hdr, a Bloom filter of nbloom bits
+ *                  and a hash table of nslot struct snpy_chunk_ent
+ *   <dir>/pack.N   stored bytes of the chunks, back to back
+ *   <dir>/lock     flock()ed by writers
+ *   <dir>/use      flock()ed shared while the store is open, exclusively
+ *                  by a reclaim
+ *
+ * A writer appends new chunks to the current pack and keeps their entries
+ * pending; snpy_chunk_store_sync() makes the packs durable and only then
+ * enters the pending chunks in the index, so the index never points at
+ * bytes a crash may have lost. Lookups test the Bloom filter first: most
+ * chunks of a backup either are in the store or are new, and new chunks
+ * never touch the table.
+ *
+ * The table grows by rehashing into a new file renamed over the old one.
+ * Writers notice under the lock and map the new one; readers keep the
+ * table they opened, which holds every chunk synced before.
+ *
+ * Nothing in the store tells which chunks the backups still use. A store
+ * opened with SNPY_CHUNK_RECLAIM, only while no one else has it open, is
+ * given the chunks in use by snpy_chunk_store_mark() and then swept: the
+ * marked chunks are copied to new packs under a new index, the old packs
+ * removed.
+ */
+
+#define SNPY_CHUNK_MAGIC 0x584449534b4e4843ULL  /* "CHNKSIDX" */
+#define SNPY_CHUNK_FP_SIZE SNPY_SHA256_SIZE
+#define SNPY_CHUNK_NSLOT (1 << 16)              /* initial table */
+#define SNPY_CHUNK_BLOOM_BITS 16                /* a slot */
+#define SNPY_CHUNK_BLOOM_K 6
+#define SNPY_CHUNK_PACK_SIZE (1ULL << 30)
+#define SNPY_CHUNK_PEND_MAX (1 << 16)
+#define SNPY_CHUNK_RECLAIM 2                    /* open mode, 1 writes */
+#define SNPY_CHUNK_CODEC_REF 0x100      /* records of struct snpy_chunk_ref */
+
+/* a chunk in a recipe record of a data file */
+struct snpy_chunk_ref {
+    u8 fp[SNPY_CHUNK_FP_SIZE];
+    u32 len;
+    u32 reserved;
+};
+
+struct snpy_chunk_ent {
+    u8 fp[SNPY_CHUNK_FP_SIZE];
+    u64 off;                /* pack << 40 | offset in the pack */
+    u32 zlen;               /* stored bytes, 0 for a free slot */
+    u32 len;
+    u32 codec;              /* of the stored bytes, opaque to the store */
+    u32 reserved;
+};
+
+struct snpy_chunk_hdr {
+    u64 magic;
+    u64 nslot;              /* power of 2 */
+    u64 nuse;
+    u64 nbloom;             /* power of 2 */
+    u64 pack;               /* pack appended to */
+    u8 reserved[4096 - 5 * sizeof(u64)];
+};
+
+struct snpy_chunk_store {
+    char dir[PATH_MAX - 32];
+    int wr;
+    int lock_fd;
+    int use_fd;
+    ino_t ino;              /* of the index mapped */
+    struct snpy_chunk_hdr *hdr;
+    size_t map_size;
+    u8 *bloom;
+    struct snpy_chunk_ent *slotv;
+    pthread_mutex_t lock;   /* of packv */
+    u64 npack;
+    int *packv;             /* fds by pack number, -1 if not open */
+    u8 *dirtyv;             /* packs written since the last sync */
+    u32 npend;
+    struct snpy_chunk_ent *pendv;
+    u32 *pend_slotv;        /* hash of pendv, index + 1 */
+    u8 *markv;              /* reclaim: a bit a slot, set if in use */
+};
+
+struct snpy_chunk_store *snpy_chunk_store_open(const char *dir, int wr);
+int snpy_chunk_store_has(struct snpy_chunk_store *s, const u8 *fp);
+int snpy_chunk_store_put(struct snpy_chunk_store *s, const u8 *fp, u32 len,
+                         u32 codec, const void *data, u32 zlen);
+ssize_t snpy_chunk_store_get(struct snpy_chunk_store *s, const u8 *fp,
+                             void *buf, u32 size, u32 *len, u32 *codec);
+int snpy_chunk_store_sync(struct snpy_chunk_store *s);
+void snpy_chunk_store_close(struct snpy_chunk_store *s);
+int snpy_chunk_store_mark(struct snpy_chunk_store *s, const u8 *fp);
+ssize_t snpy_chunk_store_mark_file(struct snpy_chunk_store *s, int fd);
+ssize_t snpy_chunk_store_sweep(struct snpy_chunk_store *s, u64 *nbyte);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "snpy_ckpt.h"
+
+#define SNPY_CKPT_TMP_KEY SNPY_CKPT_KEY ".tmp"
+
+/* snpy_ckpt_write() - replace the checkpoint of the job in the cwd
+ *
+ * @idx may be NULL if the job writes no records.
+ */
+int snpy_ckpt_write(const struct snpy_ckpt *ckpt,
+                    struct snpy_data_idx *idx, struct blk_map *bm) {
+    int rc = 0;
+    if (!ckpt || !bm)
+        return -EINVAL;
+    int fd = open(SNPY_CKPT_TMP_KEY, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+
+    u64 nrec = 0;
+    if (write(fd, ckpt, sizeof *ckpt) != sizeof *ckpt ||
+        (!idx && write(fd, &nrec, sizeof nrec) != sizeof nrec)) {
+        rc = errno ? -errno : -EIO;
+        goto close_fd;
+    }
+    if ((idx && (rc = snpy_data_idx_write(fd, idx))) ||
+        (rc = blk_map_write(fd, bm)))
+        goto close_fd;
+    if (fsync(fd))
+        rc = -errno;
+close_fd:
+    close(fd);
+    if (!rc && rename(SNPY_CKPT_TMP_KEY, SNPY_CKPT_KEY))
+        rc = -errno;
+    if (rc)
+        unlink(SNPY_CKPT_TMP_KEY);
+    return rc;
+}
+
+/* snpy_ckpt_read() - load the checkpoint of the job in the cwd
+ *
+ * Returns -ENOENT if there is none. @idx may be NULL if the job writes no
+ * records.
+ */
+int snpy_ckpt_read(struct snpy_ckpt *ckpt,
+                   struct snpy_data_idx **idx, struct blk_map **bm) {
+    int rc;
+    if (!ckpt || !bm)
+        return -EINVAL;
+    int fd = open(SNPY_CKPT_KEY, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    struct snpy_data_idx *p = NULL;
+    if (snpy_read_full(fd, ckpt, sizeof *ckpt) != sizeof *ckpt ||
+        ckpt->magic != SNPY_CKPT_MAGIC) {
+        rc = -EINVAL;
+        goto close_fd;
+    }
+    if ((rc = snpy_data_idx_read(fd, &p)))
+        goto close_fd;
+    if ((rc = blk_map_read(fd, bm))) {
+        snpy_data_idx_free(p);
+        goto close_fd;
+    }
+    if (idx)
+        *idx = p;
+    else
+        snpy_data_idx_free(p);
+close_fd:
+    close(fd);
+    return rc;
+}
+
+/*
+ * snpy_ckpt_exists() - whether the job in working directory @wd has one
+ *
+ * An upload manifest counts as one.
+ */
+int snpy_ckpt_exists(const char *wd) {
+    char path[PATH_MAX], upload[PATH_MAX];
+    if (snprintf(path, sizeof path, "%s/%s", wd, SNPY_CKPT_KEY)
+        >= sizeof path ||
+        snprintf(upload, sizeof upload, "%s/%s", wd, SNPY_CKPT_UPLOAD_KEY)
+        >= sizeof upload)
+        return 0;
+    return !access(path, R_OK) || !access(upload, R_OK);
+}
+
+/* snpy_ckpt_clear() - drop the checkpoint once the job is done */
+int snpy_ckpt_clear(void) {
+    if (unlink(SNPY_CKPT_KEY) && errno != ENOENT)
+        return -errno;
+    return 0;
+}
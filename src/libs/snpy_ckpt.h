@@ -0,0 +1,51 @@
+#ifndef SNPY_CKPT_H
+#define SNPY_CKPT_H
+
+#include "snpy_util.h"
+#include "snpy_blk_map.h"
+#include "snpy_data.h"
+
+/*
+ * job checkpoint
+ *
+ * A plugin moving a lot of data saves its progress in meta/ckpt every
+ * SNPY_CKPT_INTERVAL bytes or so. When the plugin dies, xcore runs the job
+ * again in the same working directory and the plugin picks up from the
+ * checkpoint instead of starting over.
+ *
+ * The file holds struct snpy_ckpt, the footer index of the records written
+ * so far (nuse 0 if none) and the blk_map done so far. It is written to
+ * meta/ckpt.tmp, synced and renamed over meta/ckpt, so a crash leaves
+ * either the old or the new checkpoint. The plugin syncs its own output
+ * before saving one.
+ *
+ * A target plugin keeps the parts of its uploads stored so far in
+ * SNPY_CKPT_UPLOAD_KEY instead, in a format of its own. A put that failed
+ * with one there is run again and sends only what is missing.
+ */
+
+#define SNPY_CKPT_MAGIC 0x54504b43594e5053ULL   /* "SNPYCKPT" */
+#define SNPY_CKPT_KEY "meta/ckpt"
+#define SNPY_CKPT_INTERVAL (1ULL << 30)
+#define SNPY_CKPT_UPLOAD_KEY "meta/upload"
+#define SNPY_CKPT_RESUME_MAX 3  /* times xcore runs a job again, meta/nresume */
+
+struct snpy_ckpt {
+    u64 magic;
+    u64 id;             /* what the job works on, plugin defined */
+    u64 size;           /* image size */
+    u64 pos;            /* where to resume, plugin defined */
+    u64 nbyte;          /* data bytes done */
+    u64 aux;            /* plugin defined */
+    u32 crc;            /* crc32c of the data done */
+    u32 reserved;
+};
+
+int snpy_ckpt_write(const struct snpy_ckpt *ckpt,
+                    struct snpy_data_idx *idx, struct blk_map *bm);
+int snpy_ckpt_read(struct snpy_ckpt *ckpt,
+                   struct snpy_data_idx **idx, struct blk_map **bm);
+int snpy_ckpt_exists(const char *wd);
+int snpy_ckpt_clear(void);
+
+#endif
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "snpy_crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78      /* reflected Castagnoli polynomial */
+
+static u32 crc32c_tab[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_tab(void) {
+    u32 i, j;
+    for (i = 0; i < 256; i ++) {
+        u32 crc = i;
+        for (j = 0; j < 8; j ++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_tab[0][i] = crc;
+    }
+    for (i = 0; i < 256; i ++)
+        for (j = 1; j < 8; j ++)
+            crc32c_tab[j][i] = (crc32c_tab[j - 1][i] >> 8) ^
+                crc32c_tab[0][crc32c_tab[j - 1][i] & 0xff];
+}
+
+/* crc32c_sw() - slicing by 8, on the inverted crc */
+static u32 crc32c_sw(u32 crc, const u8 *p, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_tab);
+    for (; len && ((uintptr_t)p & 7); len --)
+        crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        u64 w;
+        memcpy(&w, p, sizeof w);
+        w ^= crc;
+        crc = crc32c_tab[7][w & 0xff] ^
+            crc32c_tab[6][(w >> 8) & 0xff] ^
+            crc32c_tab[5][(w >> 16) & 0xff] ^
+            crc32c_tab[4][(w >> 24) & 0xff] ^
+            crc32c_tab[3][(w >> 32) & 0xff] ^
+            crc32c_tab[2][(w >> 40) & 0xff] ^
+            crc32c_tab[1][(w >> 48) & 0xff] ^
+            crc32c_tab[0][w >> 56];
+    }
+    for (; len; len --)
+        crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* crc32c_sse42() - crc32 instruction, 8 bytes per step */
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *p, size_t len) {
+    for (; len && ((uintptr_t)p & 7); len --)
+        crc = _mm_crc32_u8(crc, *p++);
+    u64 c = crc;
+    for (; len >= 32; len -= 32, p += 32) {
+        c = _mm_crc32_u64(c, *(const u64 *)p);
+        c = _mm_crc32_u64(c, *(const u64 *)(p + 8));
+        c = _mm_crc32_u64(c, *(const u64 *)(p + 16));
+        c = _mm_crc32_u64(c, *(const u64 *)(p + 24));
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        c = _mm_crc32_u64(c, *(const u64 *)p);
+    crc = c;
+    for (; len; len --)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+u32 snpy_crc32c(u32 crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+    static u32 (*fn)(u32, const u8 *, size_t);
+    if (!fn) 
+        fn = __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_sw;
+    return ~fn(~crc, buf, len);
+#else
+    return ~crc32c_sw(~crc, buf, len);
+#endif
+}
+
+/* snpy_crc32c_sw() - snpy_crc32c() by the table, whatever the cpu has */
+u32 snpy_crc32c_sw(u32 crc, const void *buf, size_t len) {
+    return ~crc32c_sw(~crc, buf, len);
+}
+
+/* gf2_times() - multiply the 32x32 GF(2) matrix @mat by @vec */
+static u32 gf2_times(const u32 *mat, u32 vec) {
+    u32 sum = 0;
+    for (; vec; vec >>= 1, mat ++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(u32 *square, const u32 *mat) {
+    int n;
+    for (n = 0; n < 32; n ++)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+/* snpy_crc32c_combine() - crc of A then B from crc(A), crc(B) and len(B)
+ *
+ * Appends len2 zero bytes to crc1 by repeated squaring of the one-zero-bit
+ * operator, as zlib's crc32_combine() does.
+ */
+u32 snpy_crc32c_combine(u32 crc1, u32 crc2, u64 len2) {
+    u32 even[32], odd[32];
+    int n;
+    u32 row = 1;
+    if (!len2)
+        return crc1;
+
+    odd[0] = CRC32C_POLY;           /* operator for one zero bit */
+    for (n = 1; n < 32; n ++, row <<= 1)
+        odd[n] = row;
+    gf2_square(even, odd);          /* two zero bits */
+    gf2_square(odd, even);          /* four zero bits */
+
+    do {
+        gf2_square(even, odd);      /* first pass: one zero byte */
+        if (len2 & 1)
+            crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (!len2)
+            break;
+        gf2_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
@@ -0,0 +1,20 @@
+#ifndef SNPY_CRC32C_H
+#define SNPY_CRC32C_H
+
+#include "snpy_util.h"
+
+/*
+ * crc32c - Castagnoli CRC of backup data
+ *
+ * snpy_crc32c() continues @crc over @len bytes at @buf, start with 0.
+ * snpy_crc32c_combine() gives the crc of two blocks back to back from the
+ * crc of each and the length of the second. SSE4.2 is used when the cpu
+ * has it, a table driven version otherwise; snpy_crc32c_sw() always takes
+ * the table, so the two can be checked against each other.
+ */
+
+u32 snpy_crc32c(u32 crc, const void *buf, size_t len);
+u32 snpy_crc32c_sw(u32 crc, const void *buf, size_t len);
+u32 snpy_crc32c_combine(u32 crc1, u32 crc2, u64 len2);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "snpy_crypt.h"
+
+/* has_aes() - whether AES-GCM runs on instructions rather than tables */
+static int has_aes(void) {
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    return !!(getauxval(AT_HWCAP) & (1 << 3));     /* HWCAP_AES */
+#else
+    return 0;
+#endif
+}
+
+/* snpy_crypt_parse() - algorithm by name, the fastest one here if "auto" */
+int snpy_crypt_parse(const char *name) {
+    if (!name || !name[0] || !strcmp(name, "none"))
+        return SNPY_CRYPT_NONE;
+    if (!strcmp(name, "auto"))
+        return has_aes() ? SNPY_CRYPT_AES_GCM : SNPY_CRYPT_CHACHA20;
+    if (!strcmp(name, "aes-256-gcm"))
+        return SNPY_CRYPT_AES_GCM;
+    if (!strcmp(name, "chacha20-poly1305"))
+        return SNPY_CRYPT_CHACHA20;
+    return -EINVAL;
+}
+
+static int hex(int ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * snpy_crypt_init() - @alg with the key in file @key_fn
+ *
+ * The file holds the 32 key bytes, raw or in hex with an optional newline.
+ */
+int snpy_crypt_init(struct snpy_crypt *c, int alg, const char *key_fn) {
+    char buf[2 * SNPY_CRYPT_KEY_SIZE + 2];
+    int rc = 0;
+    memset(c, 0, sizeof *c);
+    if (alg != SNPY_CRYPT_AES_GCM && alg != SNPY_CRYPT_CHACHA20)
+        return -EINVAL;
+    int fd = open(key_fn, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    ssize_t n = snpy_read_full(fd, buf, sizeof buf);
+    close(fd);
+    if (n == SNPY_CRYPT_KEY_SIZE) {
+        memcpy(c->key, buf, SNPY_CRYPT_KEY_SIZE);
+    } else if (n == 2 * SNPY_CRYPT_KEY_SIZE ||
+               (n == 2 * SNPY_CRYPT_KEY_SIZE + 1 && buf[n - 1] == '\n')) {
+        int i;
+        for (i = 0; !rc && i < SNPY_CRYPT_KEY_SIZE; i ++) {
+            int hi = hex(buf[2 * i]), lo = hex(buf[2 * i + 1]);
+            if (hi < 0 || lo < 0)
+                rc = -EINVAL;
+            c->key[i] = hi << 4 | lo;
+        }
+    } else {
+        rc = n < 0 ? n : -EINVAL;
+    }
+    OPENSSL_cleanse(buf, sizeof buf);
+    if (rc) {
+        snpy_crypt_clear(c);
+        return rc;
+    }
+    c->alg = alg;
+    return 0;
+}
+
+void snpy_crypt_clear(struct snpy_crypt *c) {
+    OPENSSL_cleanse(c, sizeof *c);
+}
+
+static const EVP_CIPHER *cipher(int alg) {
+    return alg == SNPY_CRYPT_AES_GCM ? EVP_aes_256_gcm() :
+        EVP_chacha20_poly1305();
+}
+
+/*
+ * snpy_crypt_seal() - encrypt the @len bytes at @src into @dst
+ *
+ * @dst takes @len + SNPY_CRYPT_OVERHEAD bytes; returns their number.
+ */
+ssize_t snpy_crypt_seal(const struct snpy_crypt *c,
+                        const void *aad, size_t aad_len,
+                        const void *src, size_t len, void *dst) {
+    u8 *nonce = dst;
+    u8 *out = nonce + SNPY_CRYPT_NONCE_SIZE;
+    int n, m;
+    ssize_t rc = -EIO;
+    if (len > INT_MAX || RAND_bytes(nonce, SNPY_CRYPT_NONCE_SIZE) != 1)
+        return -EIO;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return -ENOMEM;
+    if (EVP_EncryptInit_ex(ctx, cipher(c->alg), NULL, c->key, nonce) == 1 &&
+        EVP_EncryptUpdate(ctx, NULL, &n, aad, aad_len) == 1 &&
+        EVP_EncryptUpdate(ctx, out, &n, src, len) == 1 &&
+        EVP_EncryptFinal_ex(ctx, out + n, &m) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SNPY_CRYPT_TAG_SIZE,
+                            out + len) == 1)
+        rc = len + SNPY_CRYPT_OVERHEAD;
+    EVP_CIPHER_CTX_free(ctx);
+    return rc;
+}
+
+/*
+ * snpy_crypt_open() - decrypt the @len sealed bytes at @src into @dst
+ *
+ * Returns the number of plain bytes, -EBADMSG if they are not those
+ * sealed with this key and @aad.
+ */
+ssize_t snpy_crypt_open(const struct snpy_crypt *c,
+                        const void *aad, size_t aad_len,
+                        const void *src, size_t len, void *dst) {
+    const u8 *nonce = src;
+    const u8 *in = nonce + SNPY_CRYPT_NONCE_SIZE;
+    int n, m;
+    ssize_t rc = -EBADMSG;
+    if (len < SNPY_CRYPT_OVERHEAD || len > INT_MAX)
+        return -EINVAL;
+    len -= SNPY_CRYPT_OVERHEAD;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return -ENOMEM;
+    if (EVP_DecryptInit_ex(ctx, cipher(c->alg), NULL, c->key, nonce) == 1 &&
+        EVP_DecryptUpdate(ctx, NULL, &n, aad, aad_len) == 1 &&
+        EVP_DecryptUpdate(ctx, dst, &n, in, len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SNPY_CRYPT_TAG_SIZE,
+                            (void *)(in + len)) == 1 &&
+        EVP_DecryptFinal_ex(ctx, (u8 *)dst + n, &m) == 1)
+        rc = len;
+    EVP_CIPHER_CTX_free(ctx);
+    return rc;
+}
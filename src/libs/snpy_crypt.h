@@ -0,0 +1,48 @@
+#ifndef SNPY_CRYPT_H
+#define SNPY_CRYPT_H
+
+#include <sys/types.h>
+
+#include "snpy_util.h"
+
+/*
+ * authenticated encryption of data file records
+ *
+ * A sealed record is a random nonce, the ciphertext and the tag. Random
+ * nonces keep records of different backups under one key apart without
+ * any state; 96 bits of them are good for 2^32 records, 16 PB of 4 MB
+ * records, per key. The record header, its number and the backup id go in
+ * as associated data, so a record can not be moved to another offset,
+ * codec, position or backup unnoticed.
+ *
+ * AES-256-GCM where the CPU has AES instructions, ChaCha20-Poly1305
+ * elsewhere; the data file names the one it was sealed with.
+ */
+
+#define SNPY_CRYPT_KEY_SIZE 32
+#define SNPY_CRYPT_NONCE_SIZE 12
+#define SNPY_CRYPT_TAG_SIZE 16
+#define SNPY_CRYPT_OVERHEAD (SNPY_CRYPT_NONCE_SIZE + SNPY_CRYPT_TAG_SIZE)
+
+enum snpy_crypt_alg {
+    SNPY_CRYPT_NONE,
+    SNPY_CRYPT_AES_GCM,
+    SNPY_CRYPT_CHACHA20
+};
+
+struct snpy_crypt {
+    int alg;
+    u8 key[SNPY_CRYPT_KEY_SIZE];
+};
+
+int snpy_crypt_parse(const char *name);
+int snpy_crypt_init(struct snpy_crypt *c, int alg, const char *key_fn);
+void snpy_crypt_clear(struct snpy_crypt *c);
+ssize_t snpy_crypt_seal(const struct snpy_crypt *c,
+                        const void *aad, size_t aad_len,
+                        const void *src, size_t len, void *dst);
+ssize_t snpy_crypt_open(const struct snpy_crypt *c,
+                        const void *aad, size_t aad_len,
+                        const void *src, size_t len, void *dst);
+
+#endif
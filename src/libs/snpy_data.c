@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "snpy_data.h"
+#include "snpy_data_tag.h"
+
+
+/* snpy_data_hdr_init() - header of a v2 data file of an @size bytes image */
+void snpy_data_hdr_init(struct snpy_data_hdr *hdr, u64 size, u64 codec) {
+    memset(hdr, 0, sizeof *hdr);
+    hdr->blk_dev_size = size;
+    hdr->blk_map_offset = SNPY_DATA_HDR_TRAILER;
+    hdr->compress_type = SNPY_DATA_F_V2 | SNPY_DATA_CODEC(codec);
+    hdr->magic = SNPY_DATA_MAGIC;
+    hdr->version = SNPY_DATA_VERSION;
+    hdr->chunk_size = SNPY_DATA_CHUNK_SIZE;
+    hdr->flags = SNPY_DATA_F_CRC32C;
+}
+
+/* snpy_data_hdr_size() - bytes the header takes in the data file */
+size_t snpy_data_hdr_size(const struct snpy_data_hdr *hdr) {
+    return hdr->compress_type & SNPY_DATA_F_V2 ? 
+        sizeof *hdr : SNPY_DATA_HDR_V1_SIZE;
+}
+
+/* read_full() - read @len bytes at @off of @fd, or sequentially if @seq */
+static int read_full(int fd, void *buf, size_t len, off_t off, int seq) {
+    ssize_t n = seq ? snpy_read_full(fd, buf, len) : pread(fd, buf, len, off);
+    if (n < 0)
+        return seq ? n : -errno;
+    return n == len ? 0 : -EIO;
+}
+
+/* snpy_data_hdr_read() - read the header of a data file
+ *
+ * A v1 header is returned with version 1 and the v2 fields zeroed. For a
+ * streamed data file the header is taken from in front of the tag. A fifo
+ * is read sequentially and left right after the header, the trailing
+ * header is not followed; other files are read with pread().
+ */
+int snpy_data_hdr_read(int fd, struct snpy_data_hdr *hdr) {
+    struct stat st;
+    int rc;
+    if (fstat(fd, &st))
+        return -errno;
+    int seq = S_ISFIFO(st.st_mode);
+
+    memset(hdr, 0, sizeof *hdr);
+    if ((rc = read_full(fd, hdr, SNPY_DATA_HDR_V1_SIZE, 0, seq)))
+        return rc;
+    size_t size = snpy_data_hdr_size(hdr);
+    if (size > SNPY_DATA_HDR_V1_SIZE &&
+        (rc = read_full(fd, (char *)hdr + SNPY_DATA_HDR_V1_SIZE, 
+                        size - SNPY_DATA_HDR_V1_SIZE, 
+                        SNPY_DATA_HDR_V1_SIZE, seq)))
+        return rc;
+
+    if (!seq && hdr->blk_map_offset == SNPY_DATA_HDR_TRAILER) {
+        if (st.st_size < 2 * size + SNPY_DATA_TAG_SIZE ||
+            (rc = read_full(fd, hdr, size, 
+                            st.st_size - SNPY_DATA_TAG_SIZE - size, 0)))
+            return -EIO;
+        if (hdr->blk_map_offset == SNPY_DATA_HDR_TRAILER ||
+            snpy_data_hdr_size(hdr) != size)
+            return -EIO;
+    }
+
+    if (size == SNPY_DATA_HDR_V1_SIZE) {
+        hdr->version = 1;
+        return 0;
+    }
+    if (hdr->magic != SNPY_DATA_MAGIC || hdr->version != SNPY_DATA_VERSION ||
+        !hdr->chunk_size || hdr->chunk_size > SNPY_DATA_CHUNK_SIZE)
+        return -EINVAL;
+    return 0;
+}
+
+
+struct snpy_data_idx *snpy_data_idx_alloc(size_t n) {
+    if (n <= 0) 
+        n = 1024;
+    struct snpy_data_idx *p = calloc(sizeof(*p) + (sizeof p->entv[0]) * n, 1);
+    if (!p) 
+        return p;
+
+    p->nalloc = n;
+    return p;
+}
+
+/* snpy_data_idx_add() - append the record @rec stored at @file_off
+ *
+ * Records must be added in image offset order.
+ */
+int snpy_data_idx_add(struct snpy_data_idx **idx,
+                      const struct snpy_seg_rec *rec, u64 file_off) {
+    if (!idx || !*idx || !rec)
+        return -EINVAL;
+    struct snpy_data_idx *p = *idx;
+    if (p->nuse && rec->off < p->entv[p->nuse - 1].off + p->entv[p->nuse - 1].len)
+        return -EINVAL;
+    if (p->nuse == p->nalloc) {
+        p = realloc(p, sizeof *p + (p->nalloc << 1) * sizeof p->entv[0]);
+        if (!p)
+            return -ENOMEM;
+        p->nalloc <<= 1;
+        *idx = p;
+    }
+    p->entv[p->nuse ++] = (struct snpy_data_ent) {
+        .off = rec->off,
+        .file_off = file_off,
+        .len = rec->len,
+        .zlen = rec->zlen,
+        .codec = rec->codec,
+        .crc = rec->crc
+    };
+    return 0;
+}
+
+/* snpy_data_idx_find() - first entry ending after @off
+ *
+ * Returns idx->nuse if no record ends after @off.
+ */
+u64 snpy_data_idx_find(const struct snpy_data_idx *idx, u64 off) {
+    u64 lo = 0, hi = idx->nuse;
+    while (lo < hi) {
+        u64 mid = lo + (hi - lo) / 2;
+        if (idx->entv[mid].off + idx->entv[mid].len <= off)
+            lo = mid + 1;
+        else 
+            hi = mid;
+    }
+    return lo;
+}
+
+/* snpy_data_idx_write() - write the index to a given fd
+ *
+ * Note: it will change the offset of the @fd
+ */
+int snpy_data_idx_write(int fd, struct snpy_data_idx *idx) {
+    if (!idx || fd < 0)
+        return -EINVAL;
+
+    size_t size = (sizeof idx->nuse) + idx->nuse * (sizeof idx->entv[0]);
+    ssize_t nwrite = write(fd, &(idx->nuse), size);
+    if (nwrite != size) 
+        return nwrite < 0 ? -errno : -EIO;
+    return 0;
+}
+
+/* snpy_data_idx_read() - read an index from an open fd */
+int snpy_data_idx_read(int fd, struct snpy_data_idx **idx) {
+    if (!idx || fd < 0) 
+        return -EINVAL;
+
+    u64 nent = 0;
+    if (read(fd, &nent, sizeof nent) != sizeof nent) 
+        return -EIO;
+    if (nent > (SIZE_MAX - sizeof **idx) / sizeof (*idx)->entv[0])
+        return -EINVAL;
+    struct snpy_data_idx *p = snpy_data_idx_alloc(nent);
+    if (!p) 
+        return -ENOMEM;
+    p->nuse = nent;
+    size_t size = nent * (sizeof p->entv[0]);
+    if (snpy_read_full(fd, p->entv, size) != size) {
+        snpy_data_idx_free(p);
+        return -EIO;
+    }
+    *idx = p;
+    return 0;
+}
+
+void snpy_data_idx_free(struct snpy_data_idx *idx) {
+    free(idx);
+}
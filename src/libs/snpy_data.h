@@ -0,0 +1,107 @@
+#ifndef SNPY_DATA_H
+#define SNPY_DATA_H
+
+#include "snpy_util.h"
+
+/*
+ * backup data file
+ *
+ * v1: struct snpy_data_hdr (first 3 fields only), the raw extents back to
+ *     back, the blk_map at blk_map_offset, the data tag.
+ *
+ * v2: the full header, extent records (struct snpy_seg_rec plus zlen stored
+ *     bytes) ending with a record of zero len, the footer index at
+ *     idx_offset, the manifest (snpy_manifest.h) at manifest_offset if
+ *     not 0, the blk_map at blk_map_offset, the data tag.
+ *
+ * With SNPY_DATA_F_CRC32C in flags each record carries the crc32c of its
+ * raw bytes, repeated in the index. With SNPY_DATA_F_DEDUP records name
+ * chunks of a chunk store (snpy_chunk.h) rather than carry the bytes; the
+ * file is of no use without that store. With SNPY_DATA_F_CRYPT_* the
+ * stored bytes of each record are sealed (snpy_crypt.h), with the record
+ * header, its number in the file and the id of the backup as associated
+ * data, and records carry no crc: the tag checks them. The end record of a
+ * sealed file carries, sealed as record number nrec, the sha256 of the
+ * header, index, blk_map and hole map, so a file cut short or a forged
+ * footer does not open. Chunks of a store are plain, a file is never both
+ * deduplicated and sealed.
+ * With SNPY_DATA_F_HOLES a second blk_map follows the first: the extents an
+ * incremental export found gone since its base snapshot, which a restore
+ * zeroes since no record covers them.
+ *
+ * v2 records never cross a chunk_size boundary in image offsets and the
+ * index lists them by image offset, so the records of any logical range
+ * are found with a binary search. A v2 file is marked by SNPY_DATA_F_V2 in
+ * compress_type, whose low bits name the codec records were compressed
+ * with; v1 readers see it as an unknown compression type.
+ *
+ * A data file streamed through a fifo can not be rewound to fill in the
+ * header; its leading header carries SNPY_DATA_HDR_TRAILER in
+ * blk_map_offset and the real header is repeated right before the tag.
+ */
+
+#define SNPY_DATA_VERSION 2
+#define SNPY_DATA_MAGIC 0x32564453594e5053ULL   /* "SPNYSDV2" */
+#define SNPY_DATA_F_V2 (1ULL << 32)
+#define SNPY_DATA_CODEC(t) ((t) & 0xffffffffULL)
+#define SNPY_DATA_HDR_TRAILER ((u64)-1)
+#define SNPY_DATA_HDR_V1_SIZE (3 * sizeof(u64))
+#define SNPY_DATA_CHUNK_SIZE (4 << 20)  /* default chunk, max raw record */
+
+#define SNPY_DATA_F_CRC32C (1ULL << 0)  /* hdr flags: records have crc */
+#define SNPY_DATA_F_DEDUP (1ULL << 1)   /* records by reference */
+#define SNPY_DATA_F_CRYPT_AES_GCM (1ULL << 2)   /* records sealed */
+#define SNPY_DATA_F_CRYPT_CHACHA20 (1ULL << 3)
+#define SNPY_DATA_F_CRYPT (SNPY_DATA_F_CRYPT_AES_GCM|SNPY_DATA_F_CRYPT_CHACHA20)
+#define SNPY_DATA_F_HOLES (1ULL << 4)   /* hole map after the blk_map */
+
+struct snpy_data_hdr {
+    u64 blk_dev_size;   /* total size */
+    u64 blk_map_offset; /* location of block map */
+    u64 compress_type;  /* type of compression */
+    /* v2 */
+    u64 magic;
+    u32 version;
+    u32 chunk_size;     /* records are cut at multiples of it */
+    u64 idx_offset;     /* location of footer index */
+    u64 nrec;           /* records in the index */
+    u64 flags;
+    u64 manifest_offset;    /* 0 if none */
+};
+
+struct snpy_seg_rec {
+    u64 off;            /* image offset */
+    u32 len;            /* raw length, 0 ends the records */
+    u32 zlen;           /* stored length */
+    u32 codec;          /* codec of the stored bytes, 1 for none */
+    u32 crc;            /* crc32c of the raw bytes */
+};
+
+struct snpy_data_ent {
+    u64 off;            /* image offset */
+    u64 file_off;       /* offset of the stored bytes */
+    u32 len;
+    u32 zlen;
+    u32 codec;
+    u32 crc;
+};
+
+struct snpy_data_idx {
+    u64 nalloc;
+    u64 nuse;
+    struct snpy_data_ent entv[0];
+};
+
+void snpy_data_hdr_init(struct snpy_data_hdr *hdr, u64 size, u64 codec);
+int snpy_data_hdr_read(int fd, struct snpy_data_hdr *hdr);
+size_t snpy_data_hdr_size(const struct snpy_data_hdr *hdr);
+
+struct snpy_data_idx *snpy_data_idx_alloc(size_t n);
+int snpy_data_idx_add(struct snpy_data_idx **idx,
+                      const struct snpy_seg_rec *rec, u64 file_off);
+u64 snpy_data_idx_find(const struct snpy_data_idx *idx, u64 off);
+int snpy_data_idx_write(int fd, struct snpy_data_idx *idx);
+int snpy_data_idx_read(int fd, struct snpy_data_idx **idx);
+void snpy_data_idx_free(struct snpy_data_idx *idx);
+
+#endif
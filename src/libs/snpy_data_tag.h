@@ -39,7 +39,7 @@ struct snpy_data_tag {
     u64 pkt_off;                /* packet off set */
     u64 pkt_len;                /* packet length */
     /* check sum field */
-    u8  chksum[16];             /* md5 checksum */
+    u8  chksum[16];             /* v2: crc32c of image data, 4 bytes */
     u8 pkt_chksum[16];          /* checksum for current packet */       
     u32 chk_nday;               /* days of last check since snapshot */
     u32 pkt_chk_nday;           /* time diff between last check and snapshot */
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+
+#include "snpy_http.h"
+
+#define HTTP_IO_SIZE (128 << 10)    /* body bytes sent at a time */
+
+static SSL_CTX *ssl_ctx;
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+
+static void ssl_init(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+        return;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(ctx);
+    ssl_ctx = ctx;
+}
+
+/* snpy_http_url_parse() - split http[s]://host[:port][/path] */
+int snpy_http_url_parse(const char *s, struct snpy_http_url *u) {
+    memset(u, 0, sizeof *u);
+    if (!strncmp(s, "https://", 8)) {
+        u->tls = 1;
+        s += 8;
+    } else if (!strncmp(s, "http://", 7)) {
+        s += 7;
+    } else {
+        return -EINVAL;
+    }
+    size_t n = strcspn(s, "/?");
+    const char *host = s, *port = NULL;
+    size_t hlen;
+    if (host[0] == '[') {                   /* [v6 address] */
+        const char *e = memchr(host, ']', n);
+        if (!e)
+            return -EINVAL;
+        host ++;
+        hlen = e - host;
+        if (e + 1 < s + n && e[1] == ':')
+            port = e + 2;
+    } else {
+        const char *colon = memchr(host, ':', n);
+        hlen = colon ? colon - host : n;
+        if (colon)
+            port = colon + 1;
+    }
+    size_t plen = port ? s + n - port : 0;
+    if (!hlen || hlen >= sizeof u->host || plen >= sizeof u->port ||
+        strlen(s + n) >= sizeof u->path)
+        return -EINVAL;
+    memcpy(u->host, host, hlen);
+    if (plen)
+        memcpy(u->port, port, plen);
+    else
+        strcpy(u->port, u->tls ? "443" : "80");
+    strcpy(u->path, s + n);
+    n = strlen(u->path);
+    while (n && u->path[n - 1] == '/')
+        u->path[-- n] = '\0';
+    return 0;
+}
+
+/*
+ * snpy_http_escape() - percent-encode @s for a path or query
+ *
+ * Returns the length of the whole encoding, which is cut short to fit
+ * @size like snprintf() does.
+ */
+size_t snpy_http_escape(const char *s, int keep_slash, char *dst,
+                        size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 0;
+    for (; *s; s ++) {
+        unsigned char ch = *s;
+        char enc[3] = { ch };
+        int len = 1;
+        if (!((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') ||
+              (ch >= '0' && ch <= '9') || strchr("-._~", ch) ||
+              (keep_slash && ch == '/'))) {
+            enc[0] = '%';
+            enc[1] = hex[ch >> 4];
+            enc[2] = hex[ch & 15];
+            len = 3;
+        }
+        if (n + len < size)
+            memcpy(dst + n, enc, len);
+        else if (n < size)
+            size = n + 1;           /* stop at a whole character */
+        n += len;
+    }
+    if (size)
+        dst[MIN(n, size - 1)] = '\0';
+    return n;
+}
+
+void snpy_http_conn_init(struct snpy_http_conn *c,
+                         const struct snpy_http_url *u) {
+    c->url = *u;
+    c->fd = -1;
+    c->ssl = NULL;
+    c->pos = c->len = 0;
+}
+
+void snpy_http_conn_close(struct snpy_http_conn *c) {
+    if (c->ssl)
+        SSL_free(c->ssl);
+    if (c->fd != -1)
+        close(c->fd);
+    c->ssl = NULL;
+    c->fd = -1;
+    c->pos = c->len = 0;
+}
+
+static int conn_open(struct snpy_http_conn *c) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM
+    };
+    struct addrinfo *res, *ai;
+    if (getaddrinfo(c->url.host, c->url.port, &hints, &res))
+        return -EHOSTUNREACH;
+    int fd = -1, err = ECONNREFUSED;
+    for (ai = res; ai && fd == -1; ai = ai->ai_next) {
+        struct timeval tv = { .tv_sec = SNPY_HTTP_TIMEOUT };
+        int one = 1;
+        if ((fd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC,
+                         ai->ai_protocol)) == -1) {
+            err = errno;
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+        return -err;
+    c->fd = fd;
+    c->pos = c->len = 0;
+    if (!c->url.tls)
+        return 0;
+
+    pthread_once(&ssl_once, ssl_init);
+    SSL *ssl = ssl_ctx ? SSL_new(ssl_ctx) : NULL;
+    if (!ssl) {
+        snpy_http_conn_close(c);
+        return -ENOMEM;
+    }
+    c->ssl = ssl;
+    if (!SSL_set_fd(ssl, fd) ||
+        !SSL_set_tlsext_host_name(ssl, c->url.host) ||
+        !SSL_set1_host(ssl, c->url.host) || SSL_connect(ssl) != 1) {
+        snpy_http_conn_close(c);
+        return -ECONNREFUSED;
+    }
+    return 0;
+}
+
+/* conn_stale() - whether an idle connection was closed, or is out of step */
+static int conn_stale(struct snpy_http_conn *c) {
+    struct pollfd p = { .fd = c->fd, .events = POLLIN };
+    if (c->pos < c->len || (c->ssl && SSL_pending(c->ssl)))
+        return 1;
+    return poll(&p, 1, 0) != 0;
+}
+
+static int conn_send(struct snpy_http_conn *c, const void *data, size_t n) {
+    const char *p = data;
+    while (n) {
+        ssize_t m;
+        if (c->ssl) {
+            errno = 0;
+            m = SSL_write(c->ssl, p, MIN(n, INT32_MAX));
+            if (m <= 0)
+                return errno ? -errno : -EIO;
+        } else if ((m = send(c->fd, p, n, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? -ETIMEDOUT : -errno;
+        }
+        p += m;
+        n -= m;
+    }
+    return 0;
+}
+
+/* conn_fill() - read more into buf; returns bytes read, 0 at eof */
+static ssize_t conn_fill(struct snpy_http_conn *c) {
+    if (c->pos == c->len)
+        c->pos = c->len = 0;
+    else if (c->len == sizeof c->buf) {
+        memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+    }
+    size_t room = sizeof c->buf - c->len;
+    if (!room)
+        return -E2BIG;
+    ssize_t n;
+    if (c->ssl) {
+        errno = 0;
+        n = SSL_read(c->ssl, c->buf + c->len, room);
+        if (n <= 0) {
+            int err = SSL_get_error(c->ssl, n);
+            if (err == SSL_ERROR_ZERO_RETURN ||
+                (err == SSL_ERROR_SYSCALL && !errno))
+                return 0;
+            return errno == EAGAIN ? -ETIMEDOUT : errno ? -errno : -EIO;
+        }
+    } else {
+        do
+            n = recv(c->fd, c->buf + c->len, room, 0);
+        while (n == -1 && errno == EINTR);
+        if (n == -1)
+            return errno == EAGAIN ? -ETIMEDOUT : -errno;
+    }
+    c->len += n;
+    return n;
+}
+
+/* read_line() - the next line, its \r\n (or \n) replaced by NUL */
+static int read_line(struct snpy_http_conn *c, char **line) {
+    for (;;) {
+        char *p = c->buf + c->pos;
+        char *nl = memchr(p, '\n', c->len - c->pos);
+        if (nl) {
+            *nl = '\0';
+            if (nl > p && nl[-1] == '\r')
+                nl[-1] = '\0';
+            *line = p;
+            c->pos = nl + 1 - c->buf;
+            return 0;
+        }
+        ssize_t n = conn_fill(c);
+        if (n <= 0)
+            return n ? n : -ECONNRESET;
+    }
+}
+
+/* wanted() - whether the body of @resp goes to its write callback */
+static int wanted(const struct snpy_http_resp *resp) {
+    return resp->want ? resp->status == resp->want : 
+        resp->status >= 200 && resp->status < 300;
+}
+
+static int deliver(struct snpy_http_resp *resp, const char *data, size_t n) {
+    int rc = 0;
+    if (resp->write && wanted(resp)) {
+        rc = resp->write(resp->arg, data, n);
+    } else if (resp->buf && resp->size) {
+        size_t kept = MIN(resp->len, resp->size - 1);
+        size_t m = MIN(n, resp->size - 1 - kept);
+        memcpy(resp->buf + kept, data, m);
+        resp->buf[kept + m] = '\0';
+    }
+    resp->len += n;
+    return rc;
+}
+
+/* read_body() - pass the next @n bytes on, or all up to eof if n is -1 */
+static int read_body(struct snpy_http_conn *c, struct snpy_http_resp *resp,
+                     u64 n) {
+    int rc;
+    while (n) {
+        if (c->pos == c->len) {
+            ssize_t m = conn_fill(c);
+            if (m < 0)
+                return m;
+            if (!m)
+                return n == (u64)-1 ? 0 : -ECONNRESET;
+        }
+        size_t m = MIN(n, c->len - c->pos);
+        if ((rc = deliver(resp, c->buf + c->pos, m)))
+            return rc;
+        c->pos += m;
+        if (n != (u64)-1)
+            n -= m;
+    }
+    return 0;
+}
+
+static int read_chunked(struct snpy_http_conn *c, struct snpy_http_resp *resp) {
+    int rc;
+    char *line, *end;
+    for (;;) {
+        if ((rc = read_line(c, &line)))
+            return rc;
+        u64 n = strtoull(line, &end, 16);
+        if (end == line)
+            return -EPROTO;
+        if (!n)
+            break;
+        if ((rc = read_body(c, resp, n)) || (rc = read_line(c, &line)))
+            return rc;
+        if (line[0])
+            return -EPROTO;
+    }
+    do                              /* trailer */
+        if ((rc = read_line(c, &line)))
+            return rc;
+    while (line[0]);
+    return 0;
+}
+
+/* read_head() - status line and header lines of the response */
+static int read_head(struct snpy_http_conn *c, struct snpy_http_resp *resp,
+                     int *keep_alive) {
+    int rc, minor;
+    char *line;
+    if ((rc = read_line(c, &line)))
+        return rc;
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &resp->status) != 2)
+        return -EPROTO;
+    *keep_alive = minor > 0;
+    size_t n = 0;
+    resp->hdr[0] = '\0';
+    for (;;) {
+        if ((rc = read_line(c, &line)))
+            return rc;
+        if (!line[0])
+            break;
+        size_t len = strlen(line);
+        if (n + len + 3 > sizeof resp->hdr)
+            continue;               /* past what is kept */
+        memcpy(resp->hdr + n, line, len);
+        memcpy(resp->hdr + n + len, "\r\n", 3);
+        n += len + 2;
+    }
+    char conn[64];
+    if (!snpy_http_header(resp, "Connection", conn, sizeof conn))
+        *keep_alive = !strcasecmp(conn, "keep-alive") ||
+            (*keep_alive && strcasecmp(conn, "close"));
+    return 0;
+}
+
+static int send_req(struct snpy_http_conn *c, const struct snpy_http_req *req) {
+    int rc;
+    const char *hdrs = req->hdrs ? req->hdrs : "";
+    size_t size = strlen(hdrs) + strlen(req->path) + 512;
+    char *head = malloc(size);
+    if (!head)
+        return -ENOMEM;
+    int def_port = !strcmp(c->url.port, c->url.tls ? "443" : "80");
+    int has_body = req->body_len || !strcmp(req->method, "PUT") ||
+        !strcmp(req->method, "POST");
+    char clen[64] = "";
+    if (has_body)
+        snprintf(clen, sizeof clen, "Content-Length: %llu\r\n",
+                 (unsigned long long)req->body_len);
+    int n = snprintf(head, size, "%s %s HTTP/1.1\r\nHost: %s%s%s\r\n"
+                     "User-Agent: snappy\r\n%s%s\r\n",
+                     req->method, req->path[0] ? req->path : "/",
+                     c->url.host, def_port ? "" : ":",
+                     def_port ? "" : c->url.port, clen, hdrs);
+    rc = conn_send(c, head, n);
+    free(head);
+    if (rc || !req->body_len)
+        return rc;
+    if (!req->read)
+        return conn_send(c, req->body, req->body_len);
+
+    char *buf = malloc(HTTP_IO_SIZE);
+    if (!buf)
+        return -ENOMEM;
+    u64 left = req->body_len;
+    while (!rc && left) {
+        ssize_t m = req->read(req->arg, buf, MIN(left, HTTP_IO_SIZE));
+        if (m <= 0)
+            rc = m ? m : -EIO;
+        else if (!(rc = conn_send(c, buf, m)))
+            left -= m;
+    }
+    free(buf);
+    return rc;
+}
+
+static int recv_resp(struct snpy_http_conn *c, const struct snpy_http_req *req,
+                     struct snpy_http_resp *resp, int *keep_alive) {
+    int rc;
+    do {
+        if ((rc = read_head(c, resp, keep_alive)))
+            return rc;
+    } while (resp->status >= 100 && resp->status < 200);
+    resp->len = 0;
+    if (resp->buf && resp->size)
+        resp->buf[0] = '\0';
+    if (!strcmp(req->method, "HEAD") || resp->status == 204 ||
+        resp->status == 304)
+        return 0;
+
+    char val[64];
+    size_t n;
+    if (!snpy_http_header(resp, "Transfer-Encoding", val, sizeof val) &&
+        (n = strlen(val)) >= 7 && !strcasecmp(val + n - 7, "chunked"))
+        return read_chunked(c, resp);
+    if (!snpy_http_header(resp, "Content-Length", val, sizeof val))
+        return read_body(c, resp, strtoull(val, NULL, 10));
+    *keep_alive = 0;                /* the body runs to eof */
+    return read_body(c, resp, (u64)-1);
+}
+
+/*
+ * snpy_http_do() - send @req on @c and take the response into @resp
+ *
+ * Returns 0 if a response came, whatever its status, -errno if the
+ * exchange failed; the connection is closed then.
+ */
+int snpy_http_do(struct snpy_http_conn *c, const struct snpy_http_req *req,
+                 struct snpy_http_resp *resp) {
+    int rc, keep_alive = 0;
+    if (c->fd != -1 && conn_stale(c))
+        snpy_http_conn_close(c);
+    if (c->fd == -1 && (rc = conn_open(c)))
+        return rc;
+    if ((rc = send_req(c, req)) ||
+        (rc = recv_resp(c, req, resp, &keep_alive)) || !keep_alive)
+        snpy_http_conn_close(c);
+    return rc;
+}
+
+/* snpy_http_header() - value of the header @name of @resp, trimmed */
+int snpy_http_header(const struct snpy_http_resp *resp, const char *name,
+                     char *dst, size_t size) {
+    size_t len = strlen(name);
+    const char *p = resp->hdr;
+    while (*p) {
+        const char *eol = strstr(p, "\r\n");
+        if (!eol)
+            break;
+        if (!strncasecmp(p, name, len) && p[len] == ':') {
+            const char *v = p + len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v ++;
+            const char *e = eol;
+            while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+                e --;
+            if ((size_t)(e - v) >= size)
+                return -ENAMETOOLONG;
+            memcpy(dst, v, e - v);
+            dst[e - v] = '\0';
+            return 0;
+        }
+        p = eol + 2;
+    }
+    return -ENOENT;
+}
@@ -0,0 +1,78 @@
+#ifndef SNPY_HTTP_H
+#define SNPY_HTTP_H
+
+#include <sys/types.h>
+
+#include "snpy_util.h"
+
+/*
+ * minimal HTTP/1.1 client of the object store target plugins
+ *
+ * A connection is kept alive across requests and reopened when the server
+ * has closed it; one that went idle and was closed by the server is found
+ * out before the next request is sent on it. Request bodies come from
+ * memory or a read callback, response bodies go to memory or a write
+ * callback, so they can stream from and to files; only a body of the status
+ * asked for reaches the callback, any other is kept in memory if there is
+ * room or else drained. https goes through
+ * OpenSSL, with the peer checked against the system CAs.
+ *
+ * A connection is used by one thread at a time.
+ */
+
+#define SNPY_HTTP_HDR_SIZE 8192
+#define SNPY_HTTP_TIMEOUT 120       /* seconds a socket may make no progress */
+
+struct snpy_http_url {
+    int tls;
+    char host[256];
+    char port[8];
+    char path[1024];                /* "" or starting with '/' */
+};
+
+struct snpy_http_conn {
+    struct snpy_http_url url;       /* of the server, path unused */
+    int fd;                         /* -1 if not connected */
+    void *ssl;
+    size_t pos;                     /* unconsumed bytes in buf */
+    size_t len;
+    char buf[16384];
+};
+
+/* body source, returns bytes put in @buf, at most @n, or -errno */
+typedef ssize_t (*snpy_http_read_t)(void *arg, char *buf, size_t n);
+/* body sink, returns 0 or -errno to drop the connection */
+typedef int (*snpy_http_write_t)(void *arg, const char *data, size_t n);
+
+struct snpy_http_req {
+    const char *method;
+    const char *path;               /* escaped, with the query if any */
+    const char *hdrs;               /* extra header lines, each with \r\n */
+    const void *body;               /* body_len bytes, unless read is set */
+    u64 body_len;
+    snpy_http_read_t read;
+    void *arg;
+};
+
+struct snpy_http_resp {
+    int status;
+    char hdr[SNPY_HTTP_HDR_SIZE];   /* header lines as received */
+    u64 len;                        /* body bytes received */
+    snpy_http_write_t write;        /* body sink, or: */
+    char *buf;                      /* first size - 1 body bytes, NUL ended */
+    size_t size;
+    void *arg;
+    int want;                       /* status of a body for write, 0: 2xx */
+};
+
+int snpy_http_url_parse(const char *s, struct snpy_http_url *u);
+size_t snpy_http_escape(const char *s, int keep_slash, char *dst, size_t size);
+void snpy_http_conn_init(struct snpy_http_conn *c,
+                         const struct snpy_http_url *u);
+void snpy_http_conn_close(struct snpy_http_conn *c);
+int snpy_http_do(struct snpy_http_conn *c, const struct snpy_http_req *req,
+                 struct snpy_http_resp *resp);
+int snpy_http_header(const struct snpy_http_resp *resp, const char *name,
+                     char *dst, size_t size);
+
+#endif
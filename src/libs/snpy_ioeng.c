@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "snpy_ioeng.h"
+
+/*
+ * io_uring through its system calls, only what the engine needs: one
+ * request per buffer, so the rings never fill up.
+ */
+struct snpy_uring {
+    int fd;
+    int fixed;              /* buffers registered */
+    unsigned npend;         /* queued, not yet submitted */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+static void uring_close(struct snpy_uring *r) {
+    if (!r)
+        return;
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+static struct snpy_uring *uring_open(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+        return NULL;
+    struct snpy_uring *r = calloc(1, sizeof *r);
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto close_ring;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto close_ring;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto close_ring;
+    }
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+
+close_ring:
+    uring_close(r);
+    return NULL;
+}
+
+/* uring_enter() - submit the queued requests, waiting for @min_complete */
+static int uring_enter(struct snpy_uring *r, unsigned min_complete) {
+    while (r->npend || min_complete) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->npend, min_complete,
+                        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        r->npend -= n;
+        min_complete = 0;
+    }
+    return 0;
+}
+
+/* uring_queue() - queue a read or write of buffer @i */
+static void uring_queue(struct snpy_ioeng *e, int i) {
+    struct snpy_uring *r = e->ring;
+    struct snpy_ioeng_buf *b = &e->bufv[i];
+    int rd = e->flags & SNPY_IOENG_READ;
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = e->fd;
+    sqe->off = b->off;
+    sqe->user_data = i;
+    if (r->fixed) {
+        sqe->opcode = rd ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->addr = (unsigned long)b->data;
+        sqe->len = b->len;
+        sqe->buf_index = i;
+    } else {
+        e->iov[i].iov_len = b->len;
+        sqe->opcode = rd ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)&e->iov[i];
+        sqe->len = 1;
+    }
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->npend ++;
+    b->busy = 1;
+}
+
+/* uring_reap() - mark the buffers of the completed requests done */
+static void uring_reap(struct snpy_ioeng *e) {
+    struct snpy_uring *r = e->ring;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct snpy_ioeng_buf *b = &e->bufv[cqe->user_data];
+        b->res = cqe->res;
+        b->busy = 0;
+        head ++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* wait_buf() - wait for buffer @b to be done, submitting what is queued */
+static int wait_buf(struct snpy_ioeng *e, struct snpy_ioeng_buf *b) {
+    int rc;
+    while (b->busy) {
+        uring_reap(e);
+        if (b->busy && (rc = uring_enter(e->ring, 1)))
+            return rc;
+    }
+    return 0;
+}
+
+static int fail(struct snpy_ioeng *e, int rc) {
+    if (!e->status)
+        e->status = -rc;
+    return -e->status;
+}
+
+/* write_buf() - write out buffer @b of a writer */
+static int write_buf(struct snpy_ioeng *e, struct snpy_ioeng_buf *b) {
+    if (e->ring) {
+        uring_queue(e, b - e->bufv);
+        e->head ++;
+        /* batch the submissions, half the buffers at a time */
+        if (e->ring->npend * 2 >= e->depth)
+            return uring_enter(e->ring, 0);
+        return 0;
+    }
+    u32 done = 0;
+    while (done < b->len) {
+        ssize_t n = e->stream ? write(e->fd, b->data + done, b->len - done) :
+            pwrite(e->fd, b->data + done, b->len - done, b->off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -errno : -EIO;
+        done += n;
+    }
+    b->len = 0;
+    return 0;
+}
+
+/* done_buf() - check the write of the oldest buffer and free it for reuse */
+static int done_buf(struct snpy_ioeng *e) {
+    int rc;
+    struct snpy_ioeng_buf *b = &e->bufv[e->tail % e->depth];
+    if ((rc = wait_buf(e, b)))
+        return rc;
+    e->tail ++;
+    if (b->res < 0)
+        return b->res;
+    if (b->res != b->len)
+        return -EIO;
+    b->len = 0;
+    return 0;
+}
+
+/* read_ahead() - keep the free buffers of a reader in flight */
+static int read_ahead(struct snpy_ioeng *e) {
+    while (e->head - e->tail < e->depth && e->ra < e->end) {
+        int i = e->head % e->depth;
+        struct snpy_ioeng_buf *b = &e->bufv[i];
+        b->off = e->ra;
+        b->len = MIN(e->buf_size, e->end - e->ra);
+        b->cur = 0;
+        uring_queue(e, i);
+        e->ra += b->len;
+        e->head ++;
+    }
+    return uring_enter(e->ring, 0);
+}
+
+/* get_buf() - buffer holding the next bytes of a reader, NULL at the end */
+static struct snpy_ioeng_buf *get_buf(struct snpy_ioeng *e) {
+    int rc;
+    struct snpy_ioeng_buf *b;
+    if (!e->ring) {
+        b = &e->bufv[0];
+        if (b->cur < b->len)
+            return b;
+        ssize_t n;
+        do {
+            n = e->stream ? read(e->fd, b->data, e->buf_size) :
+                pread(e->fd, b->data, e->buf_size, e->ra);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            if (n < 0)
+                fail(e, -errno);
+            return NULL;
+        }
+        b->off = e->ra;
+        b->len = n;
+        b->cur = 0;
+        e->ra += n;
+        return b;
+    }
+    while (e->tail != e->head) {
+        b = &e->bufv[e->tail % e->depth];
+        if ((rc = wait_buf(e, b)) || (rc = MIN(b->res, 0))) {
+            fail(e, rc);
+            return NULL;
+        }
+        b->len = b->res;        /* short only if the file shrank */
+        if (b->cur < b->len)
+            return b;
+        e->tail ++;
+        if ((rc = read_ahead(e))) {
+            fail(e, rc);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * snpy_ioeng_open() - engine streaming @fd from offset @pos
+ *
+ * @depth and @buf_size of 0 take the defaults.
+ */
+struct snpy_ioeng *snpy_ioeng_open(int fd, u64 pos, int flags, int depth,
+                                   u32 buf_size) {
+    struct stat st;
+    if (fstat(fd, &st))
+        return NULL;
+    if (depth <= 0)
+        depth = SNPY_IOENG_DEPTH;
+    if (!buf_size)
+        buf_size = SNPY_IOENG_BUF_SIZE;
+
+    struct snpy_uring *ring = NULL;
+    int stream = !S_ISREG(st.st_mode);
+    if (stream || (flags & SNPY_IOENG_SYNC) || !(ring = uring_open(depth)))
+        depth = 1;
+
+    struct snpy_ioeng *e = calloc(1, sizeof *e + depth * sizeof e->bufv[0]);
+    if (!e) {
+        uring_close(ring);
+        return NULL;
+    }
+    e->fd = fd;
+    e->flags = flags;
+    e->stream = stream;
+    e->pos = e->ra = pos;
+    e->end = st.st_size;
+    e->buf_size = buf_size;
+    e->depth = depth;
+    e->ring = ring;
+    if (!(e->iov = calloc(depth, sizeof e->iov[0])))
+        goto close_eng;
+    int i;
+    for (i = 0; i < depth; i ++) {
+        if (posix_memalign((void **)&e->bufv[i].data, 4096, buf_size))
+            goto close_eng;
+        e->iov[i].iov_base = e->bufv[i].data;
+        e->iov[i].iov_len = buf_size;
+    }
+    /* locked memory may be short, then the buffers are passed each time */
+    if (ring)
+        ring->fixed = !syscall(__NR_io_uring_register, ring->fd,
+                               IORING_REGISTER_BUFFERS, e->iov, depth);
+    if (ring && (flags & SNPY_IOENG_READ) && read_ahead(e))
+        goto close_eng;
+    return e;
+
+close_eng:
+    snpy_ioeng_close(e);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* snpy_ioeng_read() - read up to @len bytes, fewer only at the end of file */
+ssize_t snpy_ioeng_read(struct snpy_ioeng *e, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len && !e->status) {
+        struct snpy_ioeng_buf *b = get_buf(e);
+        if (!b)
+            break;
+        u32 n = MIN(len - done, b->len - b->cur);
+        memcpy((char *)buf + done, b->data + b->cur, n);
+        b->cur += n;
+        done += n;
+        e->pos += n;
+    }
+    if (e->status)
+        return -e->status;
+    return done;
+}
+
+/* snpy_ioeng_write() - append @len bytes */
+int snpy_ioeng_write(struct snpy_ioeng *e, const void *buf, size_t len) {
+    int rc;
+    while (len && !e->status) {
+        struct snpy_ioeng_buf *b = &e->bufv[e->head % e->depth];
+        if (e->head - e->tail == e->depth && (rc = done_buf(e)))
+            return fail(e, rc);
+        if (!b->len)
+            b->off = e->pos;
+        u32 n = MIN(len, e->buf_size - b->len);
+        memcpy(b->data + b->len, buf, n);
+        b->len += n;
+        e->pos += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (b->len == e->buf_size && (rc = write_buf(e, b)))
+            return fail(e, rc);
+    }
+    return -e->status;
+}
+
+/*
+ * snpy_ioeng_flush() - write all appended bytes and seek @fd past them
+ *
+ * Does nothing on a reader.
+ */
+int snpy_ioeng_flush(struct snpy_ioeng *e) {
+    int rc;
+    if ((e->flags & SNPY_IOENG_READ) || e->status)
+        return -e->status;
+    struct snpy_ioeng_buf *b = &e->bufv[e->head % e->depth];
+    if (e->head - e->tail < e->depth && b->len && (rc = write_buf(e, b)))
+        return fail(e, rc);
+    if (e->ring && (rc = uring_enter(e->ring, 0)))
+        return fail(e, rc);
+    while (e->tail != e->head) {
+        if ((rc = done_buf(e)))
+            return fail(e, rc);
+    }
+    if (!e->stream && lseek(e->fd, e->pos, SEEK_SET) == -1)
+        return fail(e, -errno);
+    return 0;
+}
+
+/* snpy_ioeng_close() - free the engine, @fd is left open */
+void snpy_ioeng_close(struct snpy_ioeng *e) {
+    if (!e)
+        return;
+    if (e->ring) {
+        /* the kernel may still be writing into the buffers */
+        while (e->tail != e->head &&
+               !wait_buf(e, &e->bufv[e->tail % e->depth]))
+            e->tail ++;
+        uring_close(e->ring);
+    }
+    int i;
+    for (i = 0; i < e->depth; i ++)
+        free(e->bufv[i].data);
+    free(e->iov);
+    free(e);
+}
@@ -0,0 +1,69 @@
+#ifndef SNPY_IOENG_H
+#define SNPY_IOENG_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "snpy_util.h"
+
+/*
+ * I/O engine - sequential streams of a data file
+ *
+ * A data file is written by appending and read front to back in records,
+ * often of a few bytes each. The engine stages them in @depth buffers of
+ * @buf_size bytes and moves whole buffers: a writer fills buffers and
+ * writes each once it is full, a reader keeps the buffers ahead of it read.
+ *
+ * With io_uring the buffers are registered and in flight while the caller
+ * goes on with rados I/O; buffers are handed to the kernel in batches. Where
+ * io_uring is missing or refused the engine falls back to one buffer and
+ * pread()/pwrite(), and on a fifo to read()/write().
+ *
+ * The first error is remembered and fails every later call. The file
+ * offset of @fd is only brought in step by snpy_ioeng_flush().
+ */
+
+#define SNPY_IOENG_DEPTH 4
+#define SNPY_IOENG_BUF_SIZE (1 << 20)
+
+enum snpy_ioeng_flags {
+    SNPY_IOENG_READ = 1 << 0,       /* a reader, else a writer */
+    SNPY_IOENG_SYNC = 1 << 1,       /* do not try io_uring */
+};
+
+struct snpy_ioeng_buf {
+    char *data;
+    u64 off;                /* file offset of data[0] */
+    u32 len;                /* bytes filled, or asked for while busy */
+    u32 cur;                /* reader: bytes consumed */
+    int busy;               /* in flight */
+    int res;
+};
+
+struct snpy_uring;
+
+struct snpy_ioeng {
+    int fd;
+    int flags;
+    int stream;             /* fd is not seekable */
+    int status;
+    u64 pos;                /* offset of the next byte read or written */
+    u64 ra;                 /* reader: offset of the next buffer to read */
+    u64 end;                /* reader: size of the file */
+    u32 buf_size;
+    int depth;
+    u64 head;               /* next buffer to hand out */
+    u64 tail;               /* oldest buffer not done with */
+    struct snpy_uring *ring;    /* NULL: pread()/pwrite() */
+    struct iovec *iov;
+    struct snpy_ioeng_buf bufv[0];
+};
+
+struct snpy_ioeng *snpy_ioeng_open(int fd, u64 pos, int flags, int depth,
+                                   u32 buf_size);
+ssize_t snpy_ioeng_read(struct snpy_ioeng *e, void *buf, size_t len);
+int snpy_ioeng_write(struct snpy_ioeng *e, const void *buf, size_t len);
+int snpy_ioeng_flush(struct snpy_ioeng *e);
+void snpy_ioeng_close(struct snpy_ioeng *e);
+
+#endif
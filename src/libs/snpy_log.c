@@ -42,6 +42,15 @@ void snpy_log_setfd(struct snpy_log *log, int fd) {
 
 
 int snpy_log(struct snpy_log *log, int priority, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = snpy_vlog(log, priority, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+int snpy_vlog(struct snpy_log *log, int priority, const char *fmt, va_list ap) {
 
     char buf[4096]="";
     if (priority < SNPY_LOG_NONE || priority > SNPY_LOG_PANIC)
@@ -53,14 +62,10 @@ int snpy_log(struct snpy_log *log, int priority, const char *fmt, ...) {
                        "[%lld.%lld] %s ", 
                        (long long)tv.tv_sec, (long long)tv.tv_usec, 
                        snpy_logger_pri_strlist[priority]);
-    va_list ap;
-
-    va_start(ap, fmt);
 
     int rc = vsnprintf(buf+len, sizeof buf - len - 1, fmt, ap);
     if (rc >= (sizeof buf) - len)
         return -EMSGSIZE;
-    va_end(ap);
 
     len += rc;
     buf[len] = '\n'; len++; buf[len] = 0;
@@ -86,3 +91,28 @@ void snpy_log_destroy(struct snpy_log *log) {
 }
 
 
+
+
+/* process wide logger, defaults to stderr until snpy_logger_open() */
+static struct snpy_log snpy_logger_log = {
+    .fd = STDERR_FILENO,
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+int snpy_logger_open(const char *fn, int flag) {
+    return snpy_log_open(&snpy_logger_log, fn, flag);
+}
+
+int snpy_logger(int priority, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int rc = snpy_vlog(&snpy_logger_log, priority, fmt, ap);
+    va_end(ap);
+    return rc;
+}
+
+void snpy_logger_close(int flag) {
+    if (snpy_logger_log.fd != STDERR_FILENO)
+        snpy_log_close(&snpy_logger_log);
+}
@@ -2,6 +2,7 @@
 #define SNPY_LOG_H
 
 #include <pthread.h>
+#include <stdarg.h>
 
 struct snpy_log {
     int fd;
@@ -13,9 +14,15 @@ int snpy_log_open(struct snpy_log *log, const char* fn, int flag);
 void snpy_log_setfd(struct snpy_log *log, int fd);
     
 int snpy_log(struct snpy_log *log, int priority, const char *fmt, ...);
+int snpy_vlog(struct snpy_log *log, int priority, const char *fmt, va_list ap);
 void snpy_log_close(struct snpy_log *log);
 void snpy_log_destroy(struct snpy_log *log);
 
+/* process wide logger used by plugins */
+int snpy_logger_open(const char *fn, int flag);
+int snpy_logger(int priority, const char *fmt, ...);
+void snpy_logger_close(int flag);
+
 static const char *snpy_logger_pri_strlist[] = 
 {
     "NONE",
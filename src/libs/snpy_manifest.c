@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "snpy_manifest.h"
+#include "snpy_crc32c.h"
+
+#define MANIFEST_DEPTH_MAX 64
+
+static u64 count_leaves(u64 size, u32 blk_size) {
+    return size / blk_size + !!(size % blk_size);
+}
+
+static u64 count_nodes(u64 nleaf) {
+    u64 n = nleaf, total = nleaf;
+    while (n > 1) {
+        n = (n + 1) / 2;
+        total += n;
+    }
+    return total;
+}
+
+static int is_zero_md(const u8 *md) {
+    return snpy_is_zero(md, SNPY_SHA256_SIZE);
+}
+
+/* snpy_manifest_alloc() - manifest of an @size bytes image, leaves zeroed */
+struct snpy_manifest *snpy_manifest_alloc(u64 size, u32 blk_size) {
+    if (!blk_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    u64 nleaf = count_leaves(size, blk_size);
+    u64 nnode = count_nodes(nleaf);
+    if (nnode > (SIZE_MAX - sizeof(struct snpy_manifest)) / sizeof(snpy_md_t)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct snpy_manifest *m =
+        calloc(1, sizeof *m + nnode * sizeof m->nodev[0]);
+    if (!m)
+        return NULL;
+    m->hdr.magic = SNPY_MANIFEST_MAGIC;
+    m->hdr.size = size;
+    m->hdr.blk_size = blk_size;
+    m->hdr.nleaf = nleaf;
+    m->hdr.nnode = nnode;
+    return m;
+}
+
+/* snpy_manifest_leaf() - leaf of the @len bytes of a block at @data */
+void snpy_manifest_leaf(const void *data, u32 len, u8 *md) {
+    if (snpy_is_zero(data, len)) {
+        memset(md, 0, SNPY_SHA256_SIZE);
+        return;
+    }
+    u8 tag = 0;
+    struct snpy_sha256 c;
+    snpy_sha256_init(&c);
+    snpy_sha256_update(&c, &tag, 1);
+    snpy_sha256_update(&c, data, len);
+    snpy_sha256_final(&c, md);
+}
+
+/* node() - parent of @l and @r; zeros over zeros, so holes cost nothing */
+static void node(const u8 *l, const u8 *r, u8 *md) {
+    if (is_zero_md(l) && is_zero_md(r)) {
+        memset(md, 0, SNPY_SHA256_SIZE);
+        return;
+    }
+    u8 tag = 1;
+    struct snpy_sha256 c;
+    snpy_sha256_init(&c);
+    snpy_sha256_update(&c, &tag, 1);
+    snpy_sha256_update(&c, l, SNPY_SHA256_SIZE);
+    snpy_sha256_update(&c, r, SNPY_SHA256_SIZE);
+    snpy_sha256_final(&c, md);
+}
+
+/* snpy_manifest_seal() - compute the nodes and the root from the leaves */
+void snpy_manifest_seal(struct snpy_manifest *m) {
+    u64 start = 0, n = m->hdr.nleaf;
+    while (n > 1) {
+        u64 up = start + n;
+        u64 i;
+        for (i = 0; i + 1 < n; i += 2)
+            node(m->nodev[start + i], m->nodev[start + i + 1],
+                 m->nodev[up + i / 2]);
+        if (n % 2)
+            memcpy(m->nodev[up + n / 2], m->nodev[start + n - 1],
+                   sizeof m->nodev[0]);
+        start = up;
+        n = (n + 1) / 2;
+    }
+    if (m->hdr.nnode)
+        memcpy(m->hdr.root, m->nodev[m->hdr.nnode - 1], sizeof m->hdr.root);
+    else
+        memset(m->hdr.root, 0, sizeof m->hdr.root);
+}
+
+struct diff_walk {
+    const struct snpy_manifest *a;
+    const struct snpy_manifest *b;
+    u64 startv[MANIFEST_DEPTH_MAX];     /* first node of each level */
+    u64 countv[MANIFEST_DEPTH_MAX];
+    int (*cb)(u64 blk, void *arg);
+    void *arg;
+    u64 ndiff;
+    int stop;
+};
+
+static void diff_node(struct diff_walk *w, int level, u64 i) {
+    u64 k = w->startv[level] + i;
+    if (w->stop || !memcmp(w->a->nodev[k], w->b->nodev[k], sizeof(snpy_md_t)))
+        return;
+    if (!level) {
+        w->ndiff ++;
+        if (w->cb && w->cb(i, w->arg))
+            w->stop = 1;
+        return;
+    }
+    diff_node(w, level - 1, 2 * i);
+    if (2 * i + 1 < w->countv[level - 1])
+        diff_node(w, level - 1, 2 * i + 1);
+}
+
+/*
+ * snpy_manifest_diff() - blocks of @b whose content is not that in @a
+ *
+ * @cb, if any, is called on each in order and stops the walk by returning
+ * non-zero. Manifests of another size or block size are compared leaf by
+ * leaf, the blocks of @b past the end of @a all differ. Returns the
+ * number of blocks found.
+ */
+u64 snpy_manifest_diff(const struct snpy_manifest *a,
+                       const struct snpy_manifest *b,
+                       int (*cb)(u64 blk, void *arg), void *arg) {
+    struct diff_walk w = { .a = a, .b = b, .cb = cb, .arg = arg };
+    u64 i;
+    if (a->hdr.blk_size != b->hdr.blk_size || a->hdr.nleaf != b->hdr.nleaf) {
+        int same_blk = a->hdr.blk_size == b->hdr.blk_size;
+        for (i = 0; i < b->hdr.nleaf; i ++) {
+            if (same_blk && i < a->hdr.nleaf &&
+                !memcmp(a->nodev[i], b->nodev[i], sizeof(snpy_md_t)))
+                continue;
+            w.ndiff ++;
+            if (cb && cb(i, arg))
+                break;
+        }
+        return w.ndiff;
+    }
+    if (!b->hdr.nleaf)
+        return 0;
+
+    int level = 0;
+    u64 n = b->hdr.nleaf;
+    w.countv[0] = n;
+    while (n > 1) {
+        w.startv[level + 1] = w.startv[level] + n;
+        n = (n + 1) / 2;
+        w.countv[++ level] = n;
+    }
+    diff_node(&w, level, 0);
+    return w.ndiff;
+}
+
+/* snpy_manifest_write() - write @m at the current offset of @fd */
+int snpy_manifest_write(int fd, const struct snpy_manifest *m) {
+    struct snpy_manifest_hdr hdr = m->hdr;
+    size_t size = hdr.nnode * sizeof m->nodev[0];
+    hdr.crc = snpy_crc32c(0, m->nodev, size);
+    if (snpy_write_full(fd, &hdr, sizeof hdr) != sizeof hdr ||
+        snpy_write_full(fd, m->nodev, size) != size)
+        return errno ? -errno : -EIO;
+    return 0;
+}
+
+/* snpy_manifest_read() - read a manifest at the current offset of @fd */
+int snpy_manifest_read(int fd, struct snpy_manifest **m) {
+    struct snpy_manifest_hdr hdr;
+    ssize_t n = snpy_read_full(fd, &hdr, sizeof hdr);
+    if (n != sizeof hdr)
+        return n < 0 ? n : -EIO;
+    if (hdr.magic != SNPY_MANIFEST_MAGIC || !hdr.blk_size ||
+        hdr.nleaf != count_leaves(hdr.size, hdr.blk_size) ||
+        hdr.nnode != count_nodes(hdr.nleaf))
+        return -EINVAL;
+    struct snpy_manifest *p = snpy_manifest_alloc(hdr.size, hdr.blk_size);
+    if (!p)
+        return -errno;
+    size_t size = hdr.nnode * sizeof p->nodev[0];
+    if ((n = snpy_read_full(fd, p->nodev, size)) != size) {
+        free(p);
+        return n < 0 ? n : -EIO;
+    }
+    if (snpy_crc32c(0, p->nodev, size) != hdr.crc ||
+        (hdr.nnode && memcmp(p->nodev[hdr.nnode - 1], hdr.root,
+                             sizeof hdr.root))) {
+        free(p);
+        return -EBADMSG;
+    }
+    p->hdr = hdr;
+    *m = p;
+    return 0;
+}
+
+/* snpy_manifest_save() - replace the manifest file @fn by @m */
+int snpy_manifest_save(const char *fn, const struct snpy_manifest *m) {
+    int rc;
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", fn) >= sizeof tmp)
+        return -ENAMETOOLONG;
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1)
+        return -errno;
+    if ((rc = snpy_manifest_write(fd, m)) || (fsync(fd) && (rc = -errno))) {
+        close(fd);
+        unlink(tmp);
+        return rc;
+    }
+    close(fd);
+    if (rename(tmp, fn)) {
+        rc = -errno;
+        unlink(tmp);
+        return rc;
+    }
+    return 0;
+}
+
+/* snpy_manifest_load() - read the manifest file @fn */
+int snpy_manifest_load(const char *fn, struct snpy_manifest **m) {
+    int fd = open(fn, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    int rc = snpy_manifest_read(fd, m);
+    close(fd);
+    return rc;
+}
+
+/* snpy_manifest_builder_create() - builder of the manifest of an image */
+struct snpy_manifest_builder *
+snpy_manifest_builder_create(u64 size, u32 blk_size,
+                             snpy_manifest_blk_t cb, void *arg) {
+    struct snpy_manifest_builder *b = calloc(1, sizeof *b + blk_size);
+    if (!b)
+        return NULL;
+    if (!(b->m = snpy_manifest_alloc(size, blk_size))) {
+        free(b);
+        return NULL;
+    }
+    b->cb = cb;
+    b->arg = arg;
+    return b;
+}
+
+/* complete() - set the leaf of the block in buf and pass it on */
+static int complete(struct snpy_manifest_builder *b) {
+    struct snpy_manifest *m = b->m;
+    u32 bs = m->hdr.blk_size;
+    u32 len = MIN(bs, m->hdr.size - b->blk * bs);
+    if (b->fed)
+        snpy_manifest_leaf(b->buf, len, m->nodev[b->blk]);
+    else
+        memset(m->nodev[b->blk], 0, sizeof m->nodev[0]);
+    int rc = b->cb ? b->cb(b->blk, b->buf, len, b->arg) : 0;
+    if (b->fed)
+        memset(b->buf, 0, len);
+    b->fed = 0;
+    b->blk ++;
+    return rc;
+}
+
+/* snpy_manifest_builder_feed() - the @len bytes at image offset @off */
+int snpy_manifest_builder_feed(struct snpy_manifest_builder *b, u64 off,
+                               const void *data, u64 len) {
+    int rc;
+    const char *p = data;
+    u32 bs = b->m->hdr.blk_size;
+    if (off < b->pos || off + len > b->m->hdr.size)
+        return -EINVAL;
+    while (len) {
+        while (b->blk < off / bs)
+            if ((rc = complete(b)))
+                return rc;
+        u32 boff = off % bs;
+        u32 n = MIN(len, bs - boff);
+        memcpy(b->buf + boff, p, n);
+        b->fed = 1;
+        off += n;
+        p += n;
+        len -= n;
+        b->pos = off;
+        if (!(off % bs) || off == b->m->hdr.size)
+            if ((rc = complete(b)))
+                return rc;
+    }
+    return 0;
+}
+
+/* snpy_manifest_builder_finish() - complete the blocks left and seal */
+int snpy_manifest_builder_finish(struct snpy_manifest_builder *b,
+                                 struct snpy_manifest **m) {
+    int rc;
+    while (b->blk < b->m->hdr.nleaf)
+        if ((rc = complete(b)))
+            return rc;
+    snpy_manifest_seal(b->m);
+    *m = b->m;
+    b->m = NULL;
+    return 0;
+}
+
+void snpy_manifest_builder_free(struct snpy_manifest_builder *b) {
+    if (!b)
+        return;
+    free(b->m);
+    free(b);
+}
@@ -0,0 +1,86 @@
+#ifndef SNPY_MANIFEST_H
+#define SNPY_MANIFEST_H
+
+#include "snpy_util.h"
+#include "snpy_sha256.h"
+
+/*
+ * manifest - Merkle tree of the content of an image, a leaf a block
+ *
+ * A leaf is the sha256 of 0x00 and the bytes of its block, or all zeros
+ * for a block of zeros, allocated or not; a node is the sha256 of 0x01 and
+ * its two children, the last node of an odd level is carried up as is.
+ * Nodes are kept level by level from the leaves up, the root last.
+ *
+ * Two manifests of the same size and block size have the same shape and
+ * are compared from the root down, skipping equal subtrees: the blocks
+ * changed between two backups, or damaged in a restore, are found in
+ * time proportional to their number.
+ *
+ * On disk a manifest is a struct snpy_manifest_hdr and the nnode nodes;
+ * crc is the crc32c of the nodes.
+ */
+
+#define SNPY_MANIFEST_MAGIC 0x5453464e4d59504eULL  /* "NPYMNFST" */
+#define SNPY_MANIFEST_BLK (1 << 20)
+#define SNPY_MANIFEST_DEFAULT_DIR "/var/lib/snappy/manifests"
+
+typedef u8 snpy_md_t[SNPY_SHA256_SIZE];
+
+struct snpy_manifest_hdr {
+    u64 magic;
+    u64 size;               /* image bytes */
+    u32 blk_size;
+    u32 crc;
+    u64 nleaf;
+    u64 nnode;
+    snpy_md_t root;
+    snpy_md_t base;         /* root of the manifest diffed against, or 0 */
+};
+
+struct snpy_manifest {
+    struct snpy_manifest_hdr hdr;
+    snpy_md_t nodev[0];
+};
+
+/*
+ * snpy_manifest_builder - leaves from image data fed in offset order
+ *
+ * Bytes not fed are zeros. Each block is passed to @cb, if any, as soon
+ * as it is complete, with its leaf already set.
+ */
+
+typedef int (*snpy_manifest_blk_t)(u64 blk, const char *data, u32 len,
+                                   void *arg);
+
+struct snpy_manifest_builder {
+    struct snpy_manifest *m;
+    u64 pos;                /* end of the bytes fed */
+    u64 blk;                /* block in buf */
+    int fed;                /* buf has bytes fed */
+    snpy_manifest_blk_t cb;
+    void *arg;
+    char buf[0];
+};
+
+struct snpy_manifest *snpy_manifest_alloc(u64 size, u32 blk_size);
+void snpy_manifest_leaf(const void *data, u32 len, u8 *md);
+void snpy_manifest_seal(struct snpy_manifest *m);
+u64 snpy_manifest_diff(const struct snpy_manifest *a,
+                       const struct snpy_manifest *b,
+                       int (*cb)(u64 blk, void *arg), void *arg);
+int snpy_manifest_write(int fd, const struct snpy_manifest *m);
+int snpy_manifest_read(int fd, struct snpy_manifest **m);
+int snpy_manifest_save(const char *fn, const struct snpy_manifest *m);
+int snpy_manifest_load(const char *fn, struct snpy_manifest **m);
+
+struct snpy_manifest_builder *
+snpy_manifest_builder_create(u64 size, u32 blk_size,
+                             snpy_manifest_blk_t cb, void *arg);
+int snpy_manifest_builder_feed(struct snpy_manifest_builder *b, u64 off,
+                               const void *data, u64 len);
+int snpy_manifest_builder_finish(struct snpy_manifest_builder *b,
+                                 struct snpy_manifest **m);
+void snpy_manifest_builder_free(struct snpy_manifest_builder *b);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "snpy_progress.h"
+
+static u64 now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* snpy_progress_open() - publish progress of @total work in the cwd */
+struct snpy_progress *snpy_progress_open(u64 total) {
+    struct snpy_progress *p = NULL;
+    int fd = open(SNPY_PROGRESS_KEY, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, sizeof *p))
+        goto close_fd;
+    p = mmap(NULL, sizeof *p, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        p = NULL;
+        goto close_fd;
+    }
+    p->start = p->update = time(NULL);
+    p->total = total;
+    p->mark_ms = now_ms();
+    p->magic = SNPY_PROGRESS_MAGIC;
+close_fd:
+    close(fd);
+    return p;
+}
+
+/* snpy_progress_update() - @done work, @nbyte bytes and @nseg extents so far */
+void snpy_progress_update(struct snpy_progress *p,
+                          u64 done, u64 nbyte, u64 nseg) {
+    if (!p)
+        return;
+    u64 ms = now_ms();
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    p->done = done;
+    p->nbyte = nbyte;
+    p->nseg = nseg;
+    p->update = time(NULL);
+    if (ms - p->mark_ms >= SNPY_PROGRESS_RATE_MS) {
+        u64 rate = (nbyte - p->mark_nbyte) * 1000 / (ms - p->mark_ms);
+        p->rate = p->rate ? (3 * p->rate + rate) / 4 : rate;
+        p->mark_ms = ms;
+        p->mark_nbyte = nbyte;
+    }
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* snpy_progress_close() - stop publishing, the last update stays readable */
+void snpy_progress_close(struct snpy_progress *p) {
+    if (p)
+        munmap(p, sizeof *p);
+}
+
+/* snpy_progress_read() - copy the progress of the job in working dir @wd
+ *
+ * Returns -ENOENT if the plugin publishes none, -EAGAIN if it kept
+ * changing under the reader.
+ */
+int snpy_progress_read(const char *wd, struct snpy_progress *p) {
+    int rc = -EAGAIN;
+    char path[PATH_MAX];
+    if (!wd || !p)
+        return -EINVAL;
+    if (snprintf(path, sizeof path, "%s/%s", wd, SNPY_PROGRESS_KEY)
+        >= sizeof path)
+        return -ENAMETOOLONG;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    const off_t seq_off = offsetof(struct snpy_progress, seq);
+    int i;
+    for (i = 0; i < 8; i ++) {
+        u64 seq, seq_end;
+        if (pread(fd, &seq, sizeof seq, seq_off) != sizeof seq ||
+            pread(fd, p, sizeof *p, 0) != sizeof *p ||
+            pread(fd, &seq_end, sizeof seq_end, seq_off) != sizeof seq_end) {
+            rc = -EIO;
+            break;
+        }
+        if (p->magic != SNPY_PROGRESS_MAGIC) {
+            rc = -EINVAL;
+            break;
+        }
+        if (!(seq & 1) && seq == seq_end) {
+            rc = 0;
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,44 @@
+#ifndef SNPY_PROGRESS_H
+#define SNPY_PROGRESS_H
+
+#include "snpy_util.h"
+
+/*
+ * plugin progress
+ *
+ * A plugin publishes how far it got in meta/progress, a struct
+ * snpy_progress it keeps mmap'd and updates in place; xcore reads the file
+ * while the plugin runs. seq is odd while an update is under way, a reader
+ * retries until it sees the same even seq before and after its copy.
+ *
+ * total and done are in whatever unit tells the plugin's position best
+ * (image bytes scanned, data file bytes consumed); nbyte and rate count
+ * the data actually moved. A NULL progress is accepted and ignored, so a
+ * plugin runs on if meta/progress can not be set up.
+ */
+
+#define SNPY_PROGRESS_KEY "meta/progress"
+#define SNPY_PROGRESS_MAGIC 0x47525050594e5053ULL   /* "SNPYPPRG" */
+#define SNPY_PROGRESS_RATE_MS 1000  /* rate is averaged over windows this long */
+
+struct snpy_progress {
+    u64 magic;
+    u64 seq;
+    u64 start;          /* unix time the plugin started */
+    u64 update;         /* unix time of the last update */
+    u64 total;          /* work to do, 0 if not known */
+    u64 done;           /* work done */
+    u64 nbyte;          /* data bytes moved */
+    u64 nseg;           /* extents moved */
+    u64 rate;           /* data bytes per second, recent */
+    u64 mark_ms;        /* writer: start of the current rate window */
+    u64 mark_nbyte;
+};
+
+struct snpy_progress *snpy_progress_open(u64 total);
+void snpy_progress_update(struct snpy_progress *p,
+                          u64 done, u64 nbyte, u64 nseg);
+void snpy_progress_close(struct snpy_progress *p);
+int snpy_progress_read(const char *wd, struct snpy_progress *p);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SNPY_SHA256_H
+#define SNPY_SHA256_H
+
+#include "snpy_util.h"
+
+/*
+ * sha256 - fingerprints of deduplicated chunks (see snpy_chunk.h)
+ */
+
+#define SNPY_SHA256_SIZE 32
+
+struct snpy_sha256 {
+    u32 h[8];
+    u64 nbyte;
+    u8 buf[64];
+};
+
+void snpy_sha256_init(struct snpy_sha256 *c);
+void snpy_sha256_update(struct snpy_sha256 *c, const void *data, size_t len);
+void snpy_sha256_final(struct snpy_sha256 *c, u8 *md);
+void snpy_sha256(const void *data, size_t len, u8 *md);
+
+#endif
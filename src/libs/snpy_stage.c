@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "snpy_stage.h"
+
+/* snpy_stage_init() - stream @fd from offset @pos, read if @rd */
+void snpy_stage_init(struct snpy_stage *s, int fd, u64 pos, int rd) {
+    struct stat st;
+    s->fd = !fstat(fd, &st) && S_ISREG(st.st_mode) ? fd : -1;
+    s->start = s->done = pos;
+    s->prealloc = 0;
+    if (s->fd >= 0 && rd) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, pos, 2 * SNPY_STAGE_WINDOW, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* snpy_stage_prealloc() - reserve @len bytes past the write position
+ *
+ * The file size is kept, space left unused is given back by
+ * snpy_stage_trim(). Returns -EOPNOTSUPP where the filesystem can not.
+ */
+int snpy_stage_prealloc(struct snpy_stage *s, u64 len) {
+    if (s->fd < 0 || !len)
+        return 0;
+    if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->start, len))
+        return -errno;
+    s->prealloc = s->start + len;
+    return 0;
+}
+
+/* snpy_stage_trim() - end the file at @end, freeing the space past it
+ *
+ * Blocks past the end of file can not be punched out on every filesystem,
+ * truncating frees them everywhere.
+ */
+int snpy_stage_trim(struct snpy_stage *s, u64 end) {
+    if (s->fd < 0 || s->prealloc <= end)
+        return 0;
+    if (ftruncate(s->fd, end))
+        return -errno;
+    s->prealloc = end;
+    return 0;
+}
+
+/* snpy_stage_write() - the writer is at @pos, write back behind it */
+void snpy_stage_write(struct snpy_stage *s, u64 pos) {
+    if (s->fd < 0 || pos - s->start < SNPY_STAGE_WINDOW)
+        return;
+    sync_file_range(s->fd, s->start, pos - s->start, SYNC_FILE_RANGE_WRITE);
+    if (s->start > s->done) {
+        sync_file_range(s->fd, s->done, s->start - s->done,
+                        SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(s->fd, s->done, s->start - s->done,
+                      POSIX_FADV_DONTNEED);
+        s->done = s->start;
+    }
+    s->start = pos;
+}
+
+/* snpy_stage_read() - the reader is at @pos, drop behind and read ahead */
+void snpy_stage_read(struct snpy_stage *s, u64 pos) {
+    if (s->fd < 0 || pos - s->start < SNPY_STAGE_WINDOW)
+        return;
+    if (s->start > s->done) {
+        posix_fadvise(s->fd, s->done, s->start - s->done,
+                      POSIX_FADV_DONTNEED);
+        s->done = s->start;
+    }
+    s->start = pos;
+    posix_fadvise(s->fd, pos, 2 * SNPY_STAGE_WINDOW, POSIX_FADV_WILLNEED);
+}
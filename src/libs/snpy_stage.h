@@ -0,0 +1,36 @@
+#ifndef SNPY_STAGE_H
+#define SNPY_STAGE_H
+
+#include "snpy_util.h"
+
+/*
+ * staging file I/O
+ *
+ * Data files are written once and read once, front to back, often by many
+ * jobs at a time on one backup host. Left to the page cache they push out
+ * everything else, the database and the working sets of other jobs, so a
+ * stream is kept to a couple of SNPY_STAGE_WINDOW windows: behind a writer
+ * a window is written back as soon as it is full, waited for and dropped
+ * once the next one is full; behind a reader a window is dropped once the
+ * reader is a window past it, and the next two are read ahead.
+ *
+ * O_DIRECT is not used, data file records are not block aligned. Nothing
+ * is done on a fifo.
+ */
+
+#define SNPY_STAGE_WINDOW (8 << 20)
+
+struct snpy_stage {
+    int fd;             /* -1 if not a regular file */
+    u64 start;          /* window being written or read */
+    u64 done;           /* below it pages are dropped */
+    u64 prealloc;       /* end of the space fallocate()d */
+};
+
+void snpy_stage_init(struct snpy_stage *s, int fd, u64 pos, int rd);
+int snpy_stage_prealloc(struct snpy_stage *s, u64 len);
+int snpy_stage_trim(struct snpy_stage *s, u64 end);
+void snpy_stage_write(struct snpy_stage *s, u64 pos);
+void snpy_stage_read(struct snpy_stage *s, u64 pos);
+
+#endif
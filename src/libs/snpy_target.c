@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "snpy_util.h"
+#include "snpy_target.h"
+
+/*
+ * snpy_target_export_status() - how the export streaming into data/ ended
+ *
+ * EOF of the fifo only means the export closed it; its status is there
+ * once it has exited.
+ */
+int snpy_target_export_status(void) {
+    int pid, status;
+    if (kv_get_ival("data/../meta/pid", &pid, NULL))
+        return -1;
+    while (pid > 0 && !kill(pid, 0))
+        sleep(1);
+    if (kv_get_ival("data/../meta/status", &status, NULL))
+        return -1;
+    return status;
+}
+
+/*
+ * snpy_target_arg_out() - meta/arg.out, @arg with the times of the
+ *                         transfer
+ */
+int snpy_target_arg_out(const char *arg, time_t start, time_t fin) {
+    int rc, error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if ((rc = json_loadstring(js, arg)) ||
+        (rc = json_setnumber(js, start, ".tp_param.put_start")) ||
+        (rc = json_setnumber(js, fin, ".tp_param.put_fin"))) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    FILE *fp = fopen("meta/arg.out", "w");
+    if (!fp) {
+        rc = -errno;
+        goto close_js;
+    }
+    if (json_printfile(js, fp, 0))
+        rc = -EIO;
+    if (fclose(fp) && !rc)
+        rc = -errno;
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/*
+ * snpy_target_dir() - directory the backups of job arg @arg go to
+ *
+ * .tp_param.root (default SNPY_TARGET_POSIX_ROOT), in the subdirectory
+ * .tp_param.container if given. Only a posix target keeps backups in a
+ * directory, -EREMOTE for any other.
+ */
+int snpy_target_dir(const char *arg, char *dir, size_t size) {
+    int rc = 0, error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    if (strcmp(json_string(js, ".tp_name"), "posix")) {
+        rc = -EREMOTE;
+        goto close_js;
+    }
+    const char *root = json_string(js, ".tp_param.root");
+    const char *container = json_string(js, ".tp_param.container");
+    if (snprintf(dir, size, "%s%s%s", root[0] ? root : SNPY_TARGET_POSIX_ROOT,
+                 container[0] ? "/" : "", container) >= size)
+        rc = -ENAMETOOLONG;
+close_js:
+    json_close(js);
+    return rc;
+}
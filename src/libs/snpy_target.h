@@ -0,0 +1,22 @@
+#ifndef SNPY_TARGET_H
+#define SNPY_TARGET_H
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * target plugin helpers
+ *
+ * Shared by the plugins that run put and get jobs, called in the working
+ * directory of the job. Source plugins keeping data beside the backups
+ * find the directory of a posix target with snpy_target_dir().
+ */
+
+#define SNPY_TARGET_POSIX_ROOT "/var/lib/snappy/backups"
+#define SNPY_TARGET_CHUNK_DIR "chunks"  /* chunk store in the target dir */
+
+int snpy_target_export_status(void);
+int snpy_target_arg_out(const char *arg, time_t start, time_t fin);
+int snpy_target_dir(const char *arg, char *dir, size_t size);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "snpy_tb.h"
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* min_limit() - the lower of two limits, 0 being no limit */
+static u64 min_limit(u64 a, u64 b) {
+    if (!a || !b)
+        return a | b;
+    return MIN(a, b);
+}
+
+/* reload() - apply the share xcore gives the job, if it gives one */
+static void reload(struct snpy_tb *tb) {
+    unsigned long long bw = 0, iops = 0;
+    FILE *fp = fopen(SNPY_TB_KEY, "r");
+    if (fp) {
+        if (fscanf(fp, "%llu %llu", &bw, &iops) != 2)
+            bw = iops = 0;
+        fclose(fp);
+    }
+    tb->bw = min_limit(tb->bw_cap, bw);
+    tb->iops = min_limit(tb->iops_cap, iops);
+}
+
+/* snpy_tb_create() - bucket of at most @bw bytes and @iops ios a second */
+struct snpy_tb *snpy_tb_create(u64 bw, u64 iops) {
+    struct snpy_tb *tb = calloc(1, sizeof *tb);
+    if (!tb)
+        return NULL;
+    pthread_mutex_init(&tb->lock, NULL);
+    tb->bw_cap = bw;
+    tb->iops_cap = iops;
+    reload(tb);
+    tb->last_ns = now_ns();
+    tb->reload_ns = tb->last_ns + SNPY_TB_RELOAD_MS * 1000000ULL;
+    return tb;
+}
+
+/* snpy_tb_take() - pay for @nbyte bytes in @nio ios, sleeping if in debt */
+void snpy_tb_take(struct snpy_tb *tb, u64 nbyte, u64 nio) {
+    if (!tb)
+        return;
+    pthread_mutex_lock(&tb->lock);
+    u64 ns = now_ns();
+    if (ns >= tb->reload_ns) {
+        reload(tb);
+        tb->reload_ns = ns + SNPY_TB_RELOAD_MS * 1000000ULL;
+    }
+    double dt = (ns - tb->last_ns) / 1e9;
+    tb->last_ns = ns;
+
+    double wait = 0;
+    if (tb->bw) {
+        tb->nbyte = MIN(tb->nbyte + dt * tb->bw,
+                        tb->bw * SNPY_TB_BURST_MS / 1000.0) - nbyte;
+        if (tb->nbyte < 0)
+            wait = -tb->nbyte / tb->bw;
+    }
+    if (tb->iops) {
+        tb->nio = MIN(tb->nio + dt * tb->iops,
+                      tb->iops * SNPY_TB_BURST_MS / 1000.0) - nio;
+        if (tb->nio < 0)
+            wait = MAX(wait, -tb->nio / tb->iops);
+    }
+    pthread_mutex_unlock(&tb->lock);
+
+    if (wait > 0) {
+        struct timespec ts = {
+            .tv_sec = wait,
+            .tv_nsec = (wait - (time_t)wait) * 1e9
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void snpy_tb_destroy(struct snpy_tb *tb) {
+    if (!tb)
+        return;
+    pthread_mutex_destroy(&tb->lock);
+    free(tb);
+}
@@ -0,0 +1,44 @@
+#ifndef SNPY_TB_H
+#define SNPY_TB_H
+
+#include <pthread.h>
+
+#include "snpy_util.h"
+
+/*
+ * token bucket throttle of a data mover
+ *
+ * One bucket of bytes and one of ios, refilled at the byte and io rates;
+ * snpy_tb_take() sleeps until the request is paid for. A request larger
+ * than a burst goes into debt, which later requests wait off, so requests
+ * of any size average out to the rates.
+ *
+ * The rates in effect are the lower of the plugin's own (from its arg) and
+ * the share of the shared limits xcore writes to meta/throttle as
+ * "<bytes per second> <ios per second>". The file is reread every
+ * SNPY_TB_RELOAD_MS so limits follow time of day profiles and the number
+ * of jobs running. 0 means no limit. A NULL bucket never throttles; one
+ * bucket may be shared by threads.
+ */
+
+#define SNPY_TB_KEY "meta/throttle"
+#define SNPY_TB_BURST_MS 100        /* tokens saved up while idle */
+#define SNPY_TB_RELOAD_MS 5000
+
+struct snpy_tb {
+    pthread_mutex_t lock;
+    u64 bw_cap;         /* plugin's own limits */
+    u64 iops_cap;
+    u64 bw;             /* limits in effect */
+    u64 iops;
+    double nbyte;       /* tokens, negative in debt */
+    double nio;
+    u64 last_ns;        /* last refill */
+    u64 reload_ns;      /* next reread of meta/throttle */
+};
+
+struct snpy_tb *snpy_tb_create(u64 bw, u64 iops);
+void snpy_tb_take(struct snpy_tb *tb, u64 nbyte, u64 nio);
+void snpy_tb_destroy(struct snpy_tb *tb);
+
+#endif
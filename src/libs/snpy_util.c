@@ -32,6 +32,9 @@
 #include <fts.h>
 #include <unistd.h>
 #include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "snpy_util.h"
 #include "json.h"
@@ -461,3 +464,104 @@ void * xmalloc (size_t n) {
     return p;
 }
 
+
+/* is_zero_word() - portable scan, 8 bytes at a time */
+static int is_zero_word(const u8 *p, size_t len) {
+    u64 acc = 0;
+    for (; len >= 8 * sizeof(u64); len -= 8 * sizeof(u64), p += 8 * sizeof(u64)) {
+        const u64 *q = (const u64 *)p;
+        acc |= q[0] | q[1] | q[2] | q[3] | q[4] | q[5] | q[6] | q[7];
+        if (acc)
+            return 0;
+    }
+    for (; len; len --, p ++)
+        acc |= *p;
+    return !acc;
+}
+
+#if defined(__x86_64__)
+/* is_zero_avx2() - scan 128 bytes per iteration, bail out on first hit */
+__attribute__((target("avx2")))
+static int is_zero_avx2(const u8 *p, size_t len) {
+    for (; len >= 128; len -= 128, p += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + 96));
+        __m256i v = _mm256_or_si256(_mm256_or_si256(a, b),
+                                    _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(v, v))
+            return 0;
+    }
+    return is_zero_word(p, len);
+}
+
+static int is_zero_sse2(const u8 *p, size_t len) {
+    for (; len >= 64; len -= 64, p += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+        __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) 
+            != 0xffff)
+            return 0;
+    }
+    return is_zero_word(p, len);
+}
+#endif
+
+/* snpy_is_zero() - test whether @len bytes at @buf are all zero
+ *
+ * Picks the widest vector unit the cpu supports on first use.
+ */
+int snpy_is_zero(const void *buf, size_t len) {
+#if defined(__x86_64__)
+    static int (*fn)(const u8 *, size_t);
+    if (!fn) 
+        fn = __builtin_cpu_supports("avx2") ? is_zero_avx2 : is_zero_sse2;
+    return fn(buf, len);
+#else
+    return is_zero_word(buf, len);
+#endif
+}
+
+
+/* snpy_read_full() - read @len bytes from @fd, retrying short reads
+ *
+ * Pipes and fifos return what is buffered; this keeps reading until @len
+ * bytes arrived or end of file. Returns bytes read, -errno on error.
+ */
+ssize_t snpy_read_full(int fd, void *buf, size_t len) {
+    size_t n = 0;
+    while (n < len) {
+        ssize_t rc = read(fd, (char *)buf + n, len - n);
+        if (rc == 0)
+            break;
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        n += rc;
+    }
+    return n;
+}
+
+/* snpy_write_full() - write @len bytes to @fd, retrying short writes
+ *
+ * Returns bytes written, -errno on error.
+ */
+ssize_t snpy_write_full(int fd, const void *buf, size_t len) {
+    size_t n = 0;
+    while (n < len) {
+        ssize_t rc = write(fd, (const char *)buf + n, len - n);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        n += rc;
+    }
+    return n;
+}
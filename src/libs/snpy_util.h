@@ -144,5 +144,9 @@ ssize_t snpy_get_free_mem(void);
 ssize_t snpy_get_loadavg(void);
 
 void *xmalloc (size_t n);
+
+int snpy_is_zero(const void *buf, size_t len);
+ssize_t snpy_read_full(int fd, void *buf, size_t len);
+ssize_t snpy_write_full(int fd, const void *buf, size_t len);
 #endif
 
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "snpy_wq.h"
+
+static void *snpy_wq_worker(void *arg) {
+    struct snpy_wq *wq = arg;
+    struct snpy_wq_item *item;
+
+    pthread_mutex_lock(&wq->mutex);
+    for (;;) {
+        while (!wq->head && !wq->shutdown)
+            pthread_cond_wait(&wq->work_cond, &wq->mutex);
+        if (!wq->head)              /* shutdown and drained */
+            break;
+        item = wq->head;
+        wq->head = item->next;
+        if (!wq->head)
+            wq->tail = NULL;
+        pthread_mutex_unlock(&wq->mutex);
+
+        item->fn(item->arg);
+
+        pthread_mutex_lock(&wq->mutex);
+        item->done = 1;
+        pthread_cond_broadcast(&wq->done_cond);
+    }
+    pthread_mutex_unlock(&wq->mutex);
+    return NULL;
+}
+
+struct snpy_wq *snpy_wq_create(int nthread) {
+    if (nthread <= 0)
+        nthread = 1;
+    struct snpy_wq *wq = calloc(1, sizeof *wq + nthread * sizeof wq->tid[0]);
+    if (!wq)
+        return NULL;
+    pthread_mutex_init(&wq->mutex, NULL);
+    pthread_cond_init(&wq->work_cond, NULL);
+    pthread_cond_init(&wq->done_cond, NULL);
+
+    for (wq->nthread = 0; wq->nthread < nthread; wq->nthread ++) {
+        if (pthread_create(&wq->tid[wq->nthread], NULL, snpy_wq_worker, wq))
+            break;
+    }
+    if (!wq->nthread) {
+        snpy_wq_destroy(wq);
+        return NULL;
+    }
+    return wq;
+}
+
+int snpy_wq_submit(struct snpy_wq *wq, struct snpy_wq_item *item,
+                   void (*fn)(void *arg), void *arg) {
+    if (!wq || !item || !fn)
+        return -EINVAL;
+    item->fn = fn;
+    item->arg = arg;
+    item->done = 0;
+    item->next = NULL;
+
+    pthread_mutex_lock(&wq->mutex);
+    if (wq->tail)
+        wq->tail->next = item;
+    else 
+        wq->head = item;
+    wq->tail = item;
+    pthread_cond_signal(&wq->work_cond);
+    pthread_mutex_unlock(&wq->mutex);
+    return 0;
+}
+
+/* snpy_wq_wait() - block until @item has been executed */
+void snpy_wq_wait(struct snpy_wq *wq, struct snpy_wq_item *item) {
+    pthread_mutex_lock(&wq->mutex);
+    while (!item->done)
+        pthread_cond_wait(&wq->done_cond, &wq->mutex);
+    pthread_mutex_unlock(&wq->mutex);
+}
+
+/* snpy_wq_destroy() - run all queued items, then stop the workers */
+void snpy_wq_destroy(struct snpy_wq *wq) {
+    if (!wq)
+        return;
+    pthread_mutex_lock(&wq->mutex);
+    wq->shutdown = 1;
+    pthread_cond_broadcast(&wq->work_cond);
+    pthread_mutex_unlock(&wq->mutex);
+
+    int i;
+    for (i = 0; i < wq->nthread; i ++)
+        pthread_join(wq->tid[i], NULL);
+
+    pthread_mutex_destroy(&wq->mutex);
+    pthread_cond_destroy(&wq->work_cond);
+    pthread_cond_destroy(&wq->done_cond);
+    free(wq);
+}
@@ -0,0 +1,39 @@
+#ifndef SNPY_WQ_H
+#define SNPY_WQ_H
+
+#include <pthread.h>
+
+/*
+ * snpy_wq - fixed size pool of worker threads
+ *
+ * Work items are owned by the caller, typically embedded in a per-buffer
+ * slot, and are executed in submission order by whichever worker is free.
+ * Callers needing ordered output wait on items in the order they were
+ * submitted.
+ */
+
+struct snpy_wq_item {
+    void (*fn)(void *arg);
+    void *arg;
+    int done;
+    struct snpy_wq_item *next;
+};
+
+struct snpy_wq {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;       /* signaled on submit and shutdown */
+    pthread_cond_t done_cond;       /* signaled on item completion */
+    struct snpy_wq_item *head;
+    struct snpy_wq_item *tail;
+    int shutdown;
+    int nthread;
+    pthread_t tid[0];
+};
+
+struct snpy_wq *snpy_wq_create(int nthread);
+int snpy_wq_submit(struct snpy_wq *wq, struct snpy_wq_item *item,
+                   void (*fn)(void *arg), void *arg);
+void snpy_wq_wait(struct snpy_wq *wq, struct snpy_wq_item *item);
+void snpy_wq_destroy(struct snpy_wq *wq);
+
+#endif
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "json.h"
+#include "snpy_util.h"
+#include "snpy_log.h"
+#include "snpy_stage.h"
+#include "snpy_tb.h"
+#include "snpy_target.h"
+#include "snpy_chunk.h"
+
+/*
+ * posix target plugin
+ *
+ * Keeps backups as files named by job id under a directory tree, on a
+ * local filesystem or NFS: .tp_param.root (default SNPY_TARGET_POSIX_ROOT),
+ * in the subdirectory .tp_param.container if given.
+ *
+ * put moves each file of data/ there with as few copies as the
+ * filesystems allow: a hard link if staging is on the same filesystem,
+ * else a reflink, else copy_file_range(), which NFS 4.2 copies on the
+ * server, else read and write. A stream from a running export is spliced
+ * from its fifo. Files land under temporary names and are published by
+ * rename(2) only once all of them are durable and, for a stream, the
+ * export has succeeded, so a reader sees a backup whole or not at all.
+ *
+ * Durability is batched: written data is pushed out behind the writer
+ * (snpy_stage.h), then .tp_param.sync says how the job waits for it once
+ * all files are in place: "fsync" (default) each file, "syncfs" the
+ * filesystem in one call, or "none", for throughput benchmarks. The
+ * directory is synced once after the renames.
+ *
+ * get copies the backups of the restore back into data/ the same way,
+ * but never by hard link, so nothing done to the copy reaches the backup.
+ *
+ * .tp_param.bw_limit (MB/s) and meta/throttle limit byte copies; links
+ * and reflinks move no data and are not throttled.
+ *
+ * Deduplicated backups keep their chunks in the chunk store under
+ * SNPY_TARGET_CHUNK_DIR of the directory; reclaim drops those no backup
+ * refers to any more, once backup files have been removed.
+ */
+
+#define POSIX_IO_SIZE (8 << 20)
+#define POSIX_NOBJ_MAX 64
+
+enum posix_sync {
+    POSIX_SYNC_FSYNC,
+    POSIX_SYNC_SYNCFS,
+    POSIX_SYNC_NONE
+};
+
+struct posix_conf {
+    char dir[PATH_MAX];             /* backups go here */
+    int sync;
+    u64 bw_limit;
+};
+
+/* a file being put, under its temporary name until published */
+struct posix_obj {
+    char key[NAME_MAX + 1];
+    char tmp[NAME_MAX + 1];
+    int fd;
+};
+
+static int posix_conf_init(struct posix_conf *conf, const char *arg) {
+    int error, rc = 0;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    memset(conf, 0, sizeof *conf);
+    if ((rc = snpy_target_dir(arg, conf->dir, sizeof conf->dir)))
+        goto close_js;
+    const char *sync = json_string(js, ".tp_param.sync");
+    if (!sync[0] || !strcmp(sync, "fsync"))
+        conf->sync = POSIX_SYNC_FSYNC;
+    else if (!strcmp(sync, "syncfs"))
+        conf->sync = POSIX_SYNC_SYNCFS;
+    else if (!strcmp(sync, "none"))
+        conf->sync = POSIX_SYNC_NONE;
+    else
+        rc = -EINVAL;
+    /* MB/s, on top of the share of the shared limits xcore hands out */
+    conf->bw_limit = json_number(js, ".tp_param.bw_limit") * (1 << 20);
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/*
+ * copy_data() - copy @src to @dst from their current offsets
+ *
+ * The whole of a regular file @src is reflinked if the filesystem can,
+ * else copied in the kernel with copy_file_range() or, from a fifo,
+ * splice(); read and write if neither works here. Returns bytes copied.
+ */
+static ssize_t copy_data(int src, int dst, struct snpy_tb *tb) {
+    struct stat sb;
+    struct snpy_stage stage;
+    u64 pos = 0;
+    char *buf = NULL;
+    ssize_t rc = 0;
+    if (fstat(src, &sb))
+        return -errno;
+    int reg = S_ISREG(sb.st_mode);
+    if (reg && !ioctl(dst, FICLONE, src))
+        return sb.st_size;
+
+    snpy_stage_init(&stage, dst, 0, 0);
+    if (reg)
+        snpy_stage_prealloc(&stage, sb.st_size);
+    int mode = 0;                   /* 0 kernel copy, 1 read and write */
+    for (;;) {
+        ssize_t n;
+        if (!mode) {
+            n = reg ? copy_file_range(src, NULL, dst, NULL, POSIX_IO_SIZE, 0) :
+                splice(src, NULL, dst, NULL, POSIX_IO_SIZE, SPLICE_F_MOVE);
+            if (n < 0 && !pos && (errno == EXDEV || errno == EINVAL ||
+                                  errno == ENOSYS || errno == EOPNOTSUPP)) {
+                if (!(buf = malloc(POSIX_IO_SIZE))) {
+                    rc = -ENOMEM;
+                    break;
+                }
+                mode = 1;
+                continue;
+            }
+        } else if ((n = read(src, buf, POSIX_IO_SIZE)) > 0 &&
+                   snpy_write_full(dst, buf, n) != n) {
+            n = -1;
+        }
+        if (n < 0) {
+            rc = -errno;
+            break;
+        }
+        if (!n)
+            break;
+        pos += n;
+        snpy_tb_take(tb, n, 1);
+        snpy_stage_write(&stage, pos);
+    }
+    free(buf);
+    if (!rc)
+        rc = snpy_stage_trim(&stage, pos);
+    return rc ? rc : pos;
+}
+
+/* obj_create() - @o under a temporary name in @dirfd, from data/@key */
+static int obj_create(int dirfd, struct posix_obj *o, const char *key,
+                      int stream, struct snpy_tb *tb) {
+    char src[PATH_MAX];
+    int rc = 0, fd;
+    o->fd = -1;
+    o->tmp[0] = '\0';
+    if (strlcpy(o->key, key, sizeof o->key) >= sizeof o->key ||
+        snprintf(o->tmp, sizeof o->tmp, ".%s.%d.part", key, getpid()) >=
+        sizeof o->tmp)
+        return -ENAMETOOLONG;
+    snprintf(src, sizeof src, "data/%s", key);
+    unlinkat(dirfd, o->tmp, 0);
+
+    /* staging is thrown away after put, its inode can be the backup's */
+    if (!stream && !linkat(AT_FDCWD, src, dirfd, o->tmp, 0)) {
+        if ((o->fd = openat(dirfd, o->tmp, O_RDONLY)) == -1)
+            return -errno;
+        snpy_logger(SNPY_LOG_INFO, "%s linked.", key);
+        return 0;
+    }
+    if ((fd = open(src, O_RDONLY)) == -1)
+        return -errno;
+    if ((o->fd = openat(dirfd, o->tmp, O_WRONLY|O_CREAT|O_EXCL, 0644)) == -1) {
+        rc = -errno;
+        goto close_fd;
+    }
+    ssize_t n = copy_data(fd, o->fd, tb);
+    if (n < 0)
+        rc = n;
+    else
+        snpy_logger(SNPY_LOG_INFO, "%s copied, %zd bytes.", key, n);
+close_fd:
+    close(fd);
+    return rc;
+}
+
+/*
+ * publish() - make the @n objects of @ov durable, then visible
+ *
+ * All files are synced in one batch before any is renamed to its key, and
+ * the directory once after all of them are.
+ */
+static int publish(const struct posix_conf *conf, int dirfd,
+                   struct posix_obj *ov, int n) {
+    int i;
+    if (conf->sync == POSIX_SYNC_SYNCFS && n && syncfs(dirfd))
+        return -errno;
+    for (i = 0; conf->sync == POSIX_SYNC_FSYNC && i < n; i ++)
+        if (fsync(ov[i].fd))
+            return -errno;
+    for (i = 0; i < n; i ++) {
+        if (renameat(dirfd, ov[i].tmp, dirfd, ov[i].key))
+            return -errno;
+        ov[i].tmp[0] = '\0';
+    }
+    if (conf->sync != POSIX_SYNC_NONE && fsync(dirfd))
+        return -errno;
+    return 0;
+}
+
+static int do_put(const struct posix_conf *conf, struct snpy_tb *tb) {
+    int rc = 0, i, n = 0;
+    struct stat sb;
+    struct posix_obj ov[POSIX_NOBJ_MAX];
+    if (lstat("data", &sb))
+        return -errno;
+    if ((rc = mkdir_p(conf->dir, 0755)))
+        return rc;
+    int dirfd = open(conf->dir, O_RDONLY|O_DIRECTORY);
+    if (dirfd == -1)
+        return -errno;
+    DIR *d = opendir("data");
+    if (!d) {
+        rc = -errno;
+        goto close_dirfd;
+    }
+
+    /* a stream from a running export comes through the fifo data/<id> */
+    int stream = S_ISLNK(sb.st_mode);
+    struct dirent *de;
+    while (!rc && (de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (n == POSIX_NOBJ_MAX) {
+            rc = -E2BIG;
+            break;
+        }
+        rc = obj_create(dirfd, &ov[n ++], de->d_name, stream, tb);
+        if (stream)
+            break;
+    }
+    closedir(d);
+    if (!rc && stream) {
+        int status = snpy_target_export_status();
+        if (status) {
+            snpy_logger(SNPY_LOG_ERR, "export failed: %d, not keeping %s.",
+                        status, ov[0].key);
+            rc = -EIO;
+        }
+    }
+    if (!rc)
+        rc = publish(conf, dirfd, ov, n);
+
+    for (i = 0; i < n; i ++) {
+        if (ov[i].fd >= 0)
+            close(ov[i].fd);
+        if (ov[i].tmp[0])
+            unlinkat(dirfd, ov[i].tmp, 0);
+    }
+close_dirfd:
+    close(dirfd);
+    return rc;
+}
+
+/* fetch() - copy backup @key into @fn, which may be a fifo */
+static int fetch(const struct posix_conf *conf, struct snpy_tb *tb,
+                 const char *key, const char *fn) {
+    char src[PATH_MAX];
+    int rc = 0, fd, out;
+    struct stat sb;
+    if (snprintf(src, sizeof src, "%s/%s", conf->dir, key) >= sizeof src)
+        return -ENAMETOOLONG;
+    if ((fd = open(src, O_RDONLY)) == -1)
+        return -errno;
+    int fifo = !stat(fn, &sb) && S_ISFIFO(sb.st_mode);
+    if ((out = open(fn, fifo ? O_WRONLY : O_WRONLY|O_CREAT|O_TRUNC, 0644))
+        == -1) {
+        rc = -errno;
+        goto close_fd;
+    }
+    /* to a fifo the kernel copy is a splice */
+    ssize_t n = fifo ? -EINVAL : copy_data(fd, out, tb);
+    if (fifo) {
+        struct snpy_stage stage;
+        snpy_stage_init(&stage, fd, 0, 1);
+        u64 pos = 0;
+        while ((n = splice(fd, NULL, out, NULL, POSIX_IO_SIZE,
+                           SPLICE_F_MOVE)) > 0) {
+            pos += n;
+            snpy_tb_take(tb, n, 1);
+            snpy_stage_read(&stage, pos);
+        }
+        n = n < 0 ? -errno : pos;
+    }
+    if (n < 0)
+        rc = n;
+    else
+        snpy_logger(SNPY_LOG_INFO, "%s fetched, %zd bytes.", key, n);
+    close(out);
+close_fd:
+    close(fd);
+    return rc;
+}
+
+/*
+ * do_get() - copy the backups meta/rstr_arg names
+ *
+ * The members of an incremental chain go to data/<job id> for patch, a
+ * single backup to data/data. A ranged restore gets the whole file, the
+ * import reads only what it needs of it.
+ */
+static int do_get(const struct posix_conf *conf, struct snpy_tb *tb) {
+    char rstr_arg[4096], key[32], fn[64];
+    int rc, error, i;
+    if ((rc = kv_get_sval("meta/rstr_arg", rstr_arg, sizeof rstr_arg, NULL)))
+        return rc;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, rstr_arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    int nchain = json_count(js, ".rstr_chain");
+    for (i = 0; !rc && i < MAX(nchain, 1); i ++) {
+        if (nchain > 1) {
+            snprintf(key, sizeof key, "%.0f",
+                     json_number(js, ".rstr_chain[#]", i));
+            snprintf(fn, sizeof fn, "data/%s", key);
+        } else {
+            snprintf(key, sizeof key, "%.0f",
+                     json_number(js, ".rstr_to_job_id"));
+            strlcpy(fn, "data/data", sizeof fn);
+        }
+        if ((rc = fetch(conf, tb, key, fn)))
+            snpy_logger(SNPY_LOG_ERR, "fetch of %s failed: %d.", key, rc);
+    }
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/*
+ * mark_dir() - mark the chunks the data files in @dir refer to
+ *
+ * Refs to chunks not in the store are added to @nmiss.
+ */
+static int mark_dir(struct snpy_chunk_store *s, const char *dir, u64 *nmiss) {
+    int rc = 0;
+    DIR *d = opendir(dir);
+    if (!d)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -errno;
+    struct dirent *de;
+    while (!rc && (de = readdir(d))) {
+        struct stat st;
+        if (de->d_name[0] == '.' || 
+            fstatat(dirfd(d), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+        /* put drops its temporary files meanwhile */
+        int fd = openat(dirfd(d), de->d_name, O_RDONLY);
+        if (fd == -1) {
+            rc = errno == ENOENT ? 0 : -errno;
+            continue;
+        }
+        ssize_t n = snpy_chunk_store_mark_file(s, fd);
+        close(fd);
+        if (n < 0) {
+            rc = n;
+            snpy_logger(SNPY_LOG_ERR, "error marking chunks of %s/%s: %d.",
+                        dir, de->d_name, rc);
+        } else if (n) {
+            *nmiss += n;
+            snpy_logger(SNPY_LOG_WARN, "%s/%s refers to %zd chunks not in "
+                        "the store.", dir, de->d_name, n);
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+/*
+ * do_reclaim() - drop the chunks no backup refers to
+ *
+ * Run as a job of its own, with no export or restore using the store. The
+ * chunks of the data files in the directory are kept, and of those in
+ * data/ of the jobs next to this one, which the exports left there for put.
+ * Job directories are scanned first: put publishes a file before its job
+ * directory goes, so a file moving meanwhile is seen in one or the other.
+ * Jobs of other hosts sharing the directory are not seen, none of them may
+ * be between export and put.
+ */
+static int do_reclaim(const struct posix_conf *conf) {
+    char fn[PATH_MAX];
+    int rc = 0;
+    u64 nmiss = 0, nbyte;
+    if (snprintf(fn, sizeof fn, "%s/%s", conf->dir, SNPY_TARGET_CHUNK_DIR) >=
+        sizeof fn)
+        return -ENAMETOOLONG;
+    struct snpy_chunk_store *s = snpy_chunk_store_open(fn, SNPY_CHUNK_RECLAIM);
+    if (!s) {
+        rc = -errno;
+        snpy_logger(SNPY_LOG_ERR, "can not open chunk store %s: %d.", fn, rc);
+        return rc;
+    }
+    DIR *d = opendir("..");
+    if (!d) {
+        rc = -errno;
+        goto close_store;
+    }
+    struct dirent *de;
+    while (!rc && (de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(fn, sizeof fn, "../%s/data", de->d_name);
+        rc = mark_dir(s, fn, &nmiss);
+    }
+    closedir(d);
+    if (rc || (rc = mark_dir(s, conf->dir, &nmiss)))
+        goto close_store;
+
+    ssize_t n = snpy_chunk_store_sweep(s, &nbyte);
+    if (n < 0) {
+        rc = n;
+        goto close_store;
+    }
+    snpy_logger(SNPY_LOG_INFO, "%zd chunks, %llu bytes reclaimed; %llu refs "
+                "to chunks missing.", n, (unsigned long long)nbyte,
+                (unsigned long long)nmiss);
+close_store:
+    snpy_chunk_store_close(s);
+    return rc;
+}
+
+int main(void) {
+    int rc;
+    char cmd[32] = "", arg[4096], buf[128];
+    struct posix_conf conf;
+    struct snpy_tb *tb = NULL;
+    time_t start = time(NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+    snpy_logger_open("meta/log", 0);
+    if ((rc = kv_get_sval("meta/cmd", cmd, sizeof cmd, NULL)) ||
+        (rc = kv_get_sval("meta/arg", arg, sizeof arg, NULL)) ||
+        (rc = posix_conf_init(&conf, arg)))
+        goto err_out;
+    snpy_logger(SNPY_LOG_INFO, "execute command: %s, in %s.", cmd, conf.dir);
+    if (!(tb = snpy_tb_create(conf.bw_limit, 0))) {
+        rc = -ENOMEM;
+        goto err_out;
+    }
+    if (!strcmp(cmd, "put"))
+        rc = do_put(&conf, tb);
+    else if (!strcmp(cmd, "get"))
+        rc = do_get(&conf, tb);
+    else if (!strcmp(cmd, "reclaim"))
+        rc = do_reclaim(&conf);
+    else
+        rc = -EINVAL;
+    snpy_tb_destroy(tb);
+    if (!rc)
+        rc = snpy_target_arg_out(arg, start, time(NULL));
+err_out:
+    kv_put_ival("meta/status", -rc, NULL);
+    const char *msg = strerror_r(-rc, buf, sizeof buf);
+    kv_put_sval("meta/status_msg", msg, strlen(msg) + 1, NULL);
+    if (rc)
+        snpy_logger(SNPY_LOG_ERR, "%s failed: %d.", cmd, rc);
+    snpy_logger_close(0);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include "snpy_codec.h"
+#include "snpy_crc32c.h"
+#include "snpy_cdc.h"
+
+int snpy_codec_parse(const char *name) {
+    if (!name || !name[0] || !strcmp(name, "none"))
+        return SNPY_CODEC_NONE;
+    if (!strcmp(name, "lz4"))
+        return SNPY_CODEC_LZ4;
+    if (!strcmp(name, "zstd"))
+        return SNPY_CODEC_ZSTD;
+    return -EINVAL;
+}
+
+size_t snpy_codec_bound(int type, size_t len) {
+    switch (type) {
+    case SNPY_CODEC_LZ4:
+        return LZ4_compressBound(len);
+    case SNPY_CODEC_ZSTD:
+        return ZSTD_compressBound(len);
+    default:
+        return len;
+    }
+}
+
+ssize_t snpy_codec_compress(int type, int level, const void *src, size_t len,
+                            void *dst, size_t dst_size) {
+    size_t n;
+    int rc;
+    switch (type) {
+    case SNPY_CODEC_LZ4:
+        rc = LZ4_compress_default(src, dst, len, dst_size);
+        return rc > 0 ? rc : -EIO;
+    case SNPY_CODEC_ZSTD:
+        n = ZSTD_compress(dst, dst_size, src, len, level ? level : 3);
+        return ZSTD_isError(n) ? -EIO : n;
+    default:
+        return -EINVAL;
+    }
+}
+
+ssize_t snpy_codec_decompress(int type, const void *src, size_t zlen,
+                              void *dst, size_t raw_len) {
+    size_t n;
+    int rc;
+    switch (type) {
+    case SNPY_CODEC_LZ4:
+        rc = LZ4_decompress_safe(src, dst, zlen, raw_len);
+        return rc >= 0 ? rc : -EIO;
+    case SNPY_CODEC_ZSTD:
+        n = ZSTD_decompress(dst, raw_len, src, zlen);
+        return ZSTD_isError(n) ? -EIO : n;
+    default:
+        return -EINVAL;
+    }
+}
+
+/* snpy_codec_chunk_bound() - most stored bytes of a chunk in any codec */
+size_t snpy_codec_chunk_bound(void) {
+    return MAX(snpy_codec_bound(SNPY_CODEC_LZ4, SNPY_CDC_MAX),
+               snpy_codec_bound(SNPY_CODEC_ZSTD, SNPY_CDC_MAX));
+}
+
+/*
+ * snpy_codec_unref() - raw bytes of a SNPY_CODEC_REF record
+ *
+ * The chunks named by the @zlen bytes of refs at @refv are read from @store
+ * through @buf and decoded into @dst, which they must fill exactly.
+ */
+ssize_t snpy_codec_unref(struct snpy_chunk_store *store, const void *refv,
+                         size_t zlen, void *buf, size_t buf_size,
+                         void *dst, size_t raw_len) {
+    const struct snpy_chunk_ref *ref = refv;
+    size_t i, pos = 0;
+    if (!store || zlen % sizeof *ref)
+        return -EINVAL;
+    for (i = 0; i < zlen / sizeof *ref; i ++, ref ++) {
+        u32 len, codec;
+        ssize_t n = snpy_chunk_store_get(store, ref->fp, buf, buf_size,
+                                         &len, &codec);
+        if (n < 0)
+            return n;
+        if (len != ref->len || len > raw_len - pos)
+            return -EIO;
+        if (SNPY_CODEC_IS_RAW(codec)) {
+            if (n != len)
+                return -EIO;
+            memcpy((char *)dst + pos, buf, len);
+        } else if (snpy_codec_decompress(codec, buf, n, (char *)dst + pos,
+                                         len) != len) {
+            return -EIO;
+        }
+        pos += len;
+    }
+    return pos == raw_len ? pos : -EIO;
+}
+
+/*
+ * rec_aad() - what a seal of @rec covers: its fields but zlen, which
+ * changes with it, the backup @id and the record number @seq in its data
+ * file, so a record can not be dropped, moved or taken from another backup
+ * sealed with the same key unnoticed
+ */
+static void rec_aad(u64 id, u64 seq, const struct snpy_seg_rec *rec, 
+                    u8 *aad) {
+    memcpy(aad, &rec->off, sizeof rec->off);
+    memcpy(aad + 8, &rec->len, sizeof rec->len);
+    memcpy(aad + 12, &rec->codec, sizeof rec->codec);
+    memcpy(aad + 16, &seq, sizeof seq);
+    memcpy(aad + 24, &id, sizeof id);
+}
+
+/* snpy_codec_seal() - seal the @len stored bytes of @rec into @dst */
+ssize_t snpy_codec_seal(const struct snpy_crypt *crypt, u64 id, u64 seq,
+                        const struct snpy_seg_rec *rec, const void *src,
+                        size_t len, void *dst) {
+    u8 aad[32];
+    rec_aad(id, seq, rec, aad);
+    return snpy_crypt_seal(crypt, aad, sizeof aad, src, len, dst);
+}
+
+/* snpy_codec_open() - open the @len sealed bytes of @rec into @dst */
+ssize_t snpy_codec_open(const struct snpy_crypt *crypt, u64 id, u64 seq,
+                        const struct snpy_seg_rec *rec, const void *src,
+                        size_t len, void *dst) {
+    u8 aad[32];
+    rec_aad(id, seq, rec, aad);
+    return snpy_crypt_open(crypt, aad, sizeof aad, src, len, dst);
+}
+
+/*
+ * ref_work() - cut a record into chunks and replace it by their refs
+ *
+ * Each chunk is compressed on its own, so it can be shared by records of
+ * other backups; chunks already in the store are compressed all the same,
+ * the workers do not look into it.
+ */
+static void ref_work(struct snpy_frame_slot *slot) {
+    struct snpy_codec_pipe *pipe = slot->pipe;
+    struct snpy_seg_rec *rec = &slot->rec;
+    struct snpy_chunk_ref *refv = (struct snpy_chunk_ref *)slot->z;
+    size_t cpos = 0;
+    u32 pos = 0;
+    int n = 0;
+
+    if (pipe->crc)
+        rec->crc = snpy_crc32c(0, slot->raw, rec->len);
+    while (pos < rec->len) {
+        const char *raw = slot->raw + pos;
+        u32 len = snpy_cdc_cut(raw, rec->len - pos);
+        struct snpy_chunk_ref *ref = &refv[n];
+        struct snpy_frame_chunk *c = &slot->chunkv[n ++];
+        memset(ref, 0, sizeof *ref);
+        snpy_sha256(raw, len, ref->fp);
+        ref->len = len;
+        ssize_t zlen = SNPY_CODEC_IS_RAW(pipe->type) ? 0 : 
+            snpy_codec_compress(pipe->type, pipe->level, raw, len,
+                                slot->c + cpos, pipe->frame_size - cpos);
+        if (zlen > 0 && zlen < len) {
+            c->data = slot->c + cpos;
+            c->zlen = zlen;
+            c->codec = pipe->type;
+            cpos += zlen;
+        } else {
+            c->data = raw;
+            c->zlen = len;
+            c->codec = SNPY_CODEC_NONE;
+        }
+        pos += len;
+    }
+    slot->nchunk = n;
+    rec->codec = SNPY_CODEC_REF;
+    rec->zlen = n * sizeof *refv;
+    slot->out = slot->z;
+}
+
+/* rec_work() - worker side of the pipe, sets slot->out and the record */
+static void rec_work(void *arg) {
+    struct snpy_frame_slot *slot = arg;
+    struct snpy_codec_pipe *pipe = slot->pipe;
+    struct snpy_seg_rec *rec = &slot->rec;
+    ssize_t n;
+
+    slot->status = 0;
+    if (pipe->dir == SNPY_CODEC_ENC) {
+        if (pipe->store) {
+            ref_work(slot);
+        } else {
+            if (pipe->crc)
+                rec->crc = snpy_crc32c(0, slot->raw, rec->len);
+            n = SNPY_CODEC_IS_RAW(pipe->type) ? 0 :
+                snpy_codec_compress(pipe->type, pipe->level, 
+                                    slot->raw, rec->len, slot->z, 
+                                    snpy_codec_bound(pipe->type, 
+                                                     pipe->frame_size));
+            if (n > 0 && n < rec->len) {
+                rec->codec = pipe->type;
+                rec->zlen = n;
+                slot->out = slot->z;
+            } else {                /* incompressible, store raw */
+                rec->codec = SNPY_CODEC_NONE;
+                rec->zlen = rec->len;
+                slot->out = slot->raw;
+            }
+        }
+        if (pipe->crypt) {
+            n = snpy_codec_seal(pipe->crypt, pipe->id, slot->seq, rec, 
+                                slot->out, rec->zlen, slot->e);
+            if (n < 0) {
+                slot->status = -n;
+                return;
+            }
+            rec->zlen = n;
+            slot->out = slot->e;
+        }
+        return;
+    }
+
+    if (pipe->crypt) {              /* opened into e, which becomes z */
+        n = snpy_codec_open(pipe->crypt, pipe->id, slot->seq, rec, slot->z, 
+                            rec->zlen, slot->e);
+        if (n < 0) {
+            slot->status = -n;
+            return;
+        }
+        char *z = slot->z;
+        slot->z = slot->e;
+        slot->e = z;
+        rec->zlen = n;
+    }
+
+    if (rec->codec == SNPY_CODEC_REF) {
+        n = snpy_codec_unref(pipe->store, slot->z, rec->zlen, slot->c,
+                             snpy_codec_chunk_bound(), slot->raw, rec->len);
+        slot->out = slot->raw;
+        if (n != rec->len) {
+            slot->status = n < 0 ? -n : EIO;
+            return;
+        }
+    } else if (SNPY_CODEC_IS_RAW(rec->codec)) {
+        slot->out = slot->z;
+    } else {
+        n = snpy_codec_decompress(rec->codec, slot->z, rec->zlen,
+                                  slot->raw, rec->len);
+        slot->out = slot->raw;
+        if (n != rec->len) {
+            slot->status = n < 0 ? -n : EIO;
+            return;
+        }
+    }
+    if (pipe->crc && snpy_crc32c(0, slot->out, rec->len) != rec->crc)
+        slot->status = EBADMSG;
+}
+
+struct snpy_codec_pipe *snpy_codec_pipe_create(int type, int level, int dir,
+                                               int nthread, size_t frame_size,
+                                               struct snpy_chunk_store *store,
+                                               const struct snpy_crypt *crypt,
+                                               snpy_frame_sink_t sink,
+                                               void *ctx) {
+    /* raw records only pass through to be deduplicated or encrypted */
+    if (type < SNPY_CODEC_NONE || type >= SNPY_CODEC_LAST || 
+        (SNPY_CODEC_IS_RAW(type) && !store && !crypt) || !sink || 
+        !frame_size ||
+        (store && frame_size < snpy_codec_chunk_bound())) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (nthread <= 0)
+        nthread = 1;
+    int nslot = 2 * nthread;
+    struct snpy_codec_pipe *pipe = 
+        calloc(1, sizeof *pipe + nslot * sizeof pipe->slotv[0]);
+    if (!pipe)
+        return NULL;
+    *pipe = (struct snpy_codec_pipe) {
+        .type = type,
+        .level = level,
+        .dir = dir,
+        .frame_size = frame_size,
+        .store = store,
+        .crypt = crypt,
+        .sink = sink,
+        .ctx = ctx,
+        .nslot = nslot
+    };
+
+    size_t zsize = snpy_codec_bound(type, frame_size) + 
+        (crypt ? SNPY_CRYPT_OVERHEAD : 0);
+    size_t csize = dir == SNPY_CODEC_ENC ? frame_size : 
+        snpy_codec_chunk_bound();
+    size_t nchunk = frame_size / SNPY_CDC_MIN + 1;
+    int i;
+    for (i = 0; i < nslot; i ++) {
+        struct snpy_frame_slot *slot = &pipe->slotv[i];
+        slot->pipe = pipe;
+        if (!(slot->raw = malloc(frame_size)) || 
+            !(slot->z = malloc(zsize)) ||
+            (crypt && !(slot->e = malloc(zsize))))
+            goto free_pipe;
+        if (store && 
+            (!(slot->c = malloc(csize)) ||
+             !(slot->chunkv = malloc(nchunk * sizeof slot->chunkv[0]))))
+            goto free_pipe;
+    }
+    if (!(pipe->wq = snpy_wq_create(nthread)))
+        goto free_pipe;
+    return pipe;
+
+free_pipe:
+    snpy_codec_pipe_destroy(pipe);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* sink_tail() - wait for the oldest slot in flight and pass it to the sink */
+static int sink_tail(struct snpy_codec_pipe *pipe) {
+    struct snpy_frame_slot *slot = &pipe->slotv[pipe->tail % pipe->nslot];
+    int rc;
+
+    snpy_wq_wait(pipe->wq, &slot->item);
+    pipe->tail ++;
+    if (pipe->status)
+        return -pipe->status;
+    if (slot->status || (rc = pipe->sink(slot, pipe->ctx))) 
+        pipe->status = slot->status ? slot->status : -rc;
+    return -pipe->status;
+}
+
+struct snpy_frame_slot *snpy_codec_pipe_get(struct snpy_codec_pipe *pipe) {
+    if (pipe->head - pipe->tail == pipe->nslot && sink_tail(pipe))
+        return NULL;
+    if (pipe->status)
+        return NULL;
+    struct snpy_frame_slot *slot = &pipe->slotv[pipe->head % pipe->nslot];
+    memset(&slot->rec, 0, sizeof slot->rec);
+    slot->out = NULL;
+    return slot;
+}
+
+int snpy_codec_pipe_put(struct snpy_codec_pipe *pipe,
+                        struct snpy_frame_slot *slot) {
+    if (slot != &pipe->slotv[pipe->head % pipe->nslot] ||
+        slot->rec.len > pipe->frame_size)
+        return -EINVAL;
+    slot->seq = pipe->seq ++;
+    pipe->head ++;
+    return snpy_wq_submit(pipe->wq, &slot->item, rec_work, slot);
+}
+
+/* snpy_codec_pipe_flush() - sink every slot put so far */
+int snpy_codec_pipe_flush(struct snpy_codec_pipe *pipe) {
+    while (pipe->tail != pipe->head)
+        sink_tail(pipe);
+    return -pipe->status;
+}
+
+void snpy_codec_pipe_destroy(struct snpy_codec_pipe *pipe) {
+    if (!pipe)
+        return;
+    snpy_wq_destroy(pipe->wq);      /* runs whatever is still queued */
+    int i;
+    for (i = 0; i < pipe->nslot; i ++) {
+        free(pipe->slotv[i].raw);
+        free(pipe->slotv[i].z);
+        free(pipe->slotv[i].e);
+        free(pipe->slotv[i].c);
+        free(pipe->slotv[i].chunkv);
+    }
+    free(pipe);
+}
@@ -0,0 +1,132 @@
+#ifndef SNPY_CODEC_H
+#define SNPY_CODEC_H
+
+#include <sys/types.h>
+
+#include "snpy_util.h"
+#include "snpy_wq.h"
+#include "snpy_data.h"
+#include "snpy_chunk.h"
+#include "snpy_crypt.h"
+
+/*
+ * codecs of the extent records of a v2 data file (see snpy_data.h); a
+ * record is stored with SNPY_CODEC_NONE when compression did not pay off.
+ */
+
+enum snpy_codec_type {
+    SNPY_CODEC_NONE = 1,        /* v1 data files carry 1 for raw extents */
+    SNPY_CODEC_LZ4,
+    SNPY_CODEC_ZSTD,
+    SNPY_CODEC_LAST
+};
+
+#define SNPY_CODEC_IS_RAW(type) ((type) <= SNPY_CODEC_NONE || \
+                                 (type) >= SNPY_CODEC_LAST)
+
+/*
+ * a record of a data file with SNPY_DATA_F_DEDUP stores its raw bytes by
+ * reference: an array of struct snpy_chunk_ref naming their chunks in a
+ * chunk store, each chunk stored there with a codec of its own.
+ */
+#define SNPY_CODEC_REF SNPY_CHUNK_CODEC_REF
+
+int snpy_codec_parse(const char *name);
+size_t snpy_codec_bound(int type, size_t len);
+ssize_t snpy_codec_compress(int type, int level, const void *src, size_t len,
+                            void *dst, size_t dst_size);
+ssize_t snpy_codec_decompress(int type, const void *src, size_t zlen,
+                              void *dst, size_t raw_len);
+size_t snpy_codec_chunk_bound(void);
+ssize_t snpy_codec_seal(const struct snpy_crypt *crypt, u64 id, u64 seq,
+                        const struct snpy_seg_rec *rec, const void *src,
+                        size_t len, void *dst);
+ssize_t snpy_codec_open(const struct snpy_crypt *crypt, u64 id, u64 seq,
+                        const struct snpy_seg_rec *rec, const void *src,
+                        size_t len, void *dst);
+ssize_t snpy_codec_unref(struct snpy_chunk_store *store, const void *refv,
+                         size_t zlen, void *buf, size_t buf_size,
+                         void *dst, size_t raw_len);
+
+/*
+ * snpy_codec_pipe - compress or decompress records on a worker pool
+ *
+ * Slots are handed out in a ring; once filled and put, a slot is processed
+ * by a worker and passed to @sink in the order it was put. The sink runs in
+ * the caller's thread, from snpy_codec_pipe_get() and _flush().
+ *
+ * With a chunk store, ENC cuts records into chunks and turns them into
+ * SNPY_CODEC_REF records; the chunks are left in the slot for the sink to
+ * put in the store, which is not touched by the workers. DEC resolves
+ * SNPY_CODEC_REF records from the store.
+ *
+ * With a crypt, ENC seals the stored bytes of each record, their zlen
+ * growing by SNPY_CRYPT_OVERHEAD, and DEC opens them first. A record is
+ * sealed as record seq of backup id, seq counting the slots put from the
+ * pipe's seq on.
+ */
+
+enum snpy_codec_dir {
+    SNPY_CODEC_ENC,
+    SNPY_CODEC_DEC
+};
+
+struct snpy_codec_pipe;
+
+/* stored bytes of a chunk of a SNPY_CODEC_REF record, in raw or c */
+struct snpy_frame_chunk {
+    const char *data;
+    u32 zlen;
+    u32 codec;
+};
+
+struct snpy_frame_slot {
+    struct snpy_wq_item item;
+    struct snpy_codec_pipe *pipe;
+    char *raw;
+    char *z;
+    struct snpy_seg_rec rec;
+    const char *out;            /* processed data, raw, z or e */
+    int status;
+    char *e;                    /* with a crypt: the sealed bytes */
+    u64 seq;                    /* record number in the data file */
+    char *c;                    /* ENC with a store: chunks compressed */
+    int nchunk;                 /* chunks of the record, refs in z */
+    struct snpy_frame_chunk *chunkv;
+};
+
+typedef int (*snpy_frame_sink_t)(struct snpy_frame_slot *slot, void *ctx);
+
+struct snpy_codec_pipe {
+    struct snpy_wq *wq;
+    int type;
+    int level;
+    int dir;
+    size_t frame_size;
+    snpy_frame_sink_t sink;
+    int crc;                    /* set (ENC) or check (DEC) record crc */
+    struct snpy_chunk_store *store; /* NULL if not deduplicating */
+    const struct snpy_crypt *crypt; /* NULL if not encrypting */
+    u64 id;                     /* backup records are sealed for */
+    u64 seq;                    /* record number of the next slot put */
+    void *ctx;
+    int status;                 /* first sink or codec error */
+    u64 head;                   /* next slot to hand out */
+    u64 tail;                   /* oldest slot not yet sunk */
+    int nslot;
+    struct snpy_frame_slot slotv[0];
+};
+
+struct snpy_codec_pipe *snpy_codec_pipe_create(int type, int level, int dir,
+                                               int nthread, size_t frame_size,
+                                               struct snpy_chunk_store *store,
+                                               const struct snpy_crypt *crypt,
+                                               snpy_frame_sink_t sink,
+                                               void *ctx);
+struct snpy_frame_slot *snpy_codec_pipe_get(struct snpy_codec_pipe *pipe);
+int snpy_codec_pipe_put(struct snpy_codec_pipe *pipe,
+                        struct snpy_frame_slot *slot);
+int snpy_codec_pipe_flush(struct snpy_codec_pipe *pipe);
+void snpy_codec_pipe_destroy(struct snpy_codec_pipe *pipe);
+
+#endif
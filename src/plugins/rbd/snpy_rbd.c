@@ -25,6 +25,7 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 
 #include <unistd.h>
@@ -39,7 +40,21 @@
 
 #include "json.h"
 #include "snpy_util.h"
+#include "snpy_log.h"
 #include "snpy_blk_map.h"
+#include "snpy_data_tag.h"
+#include "snpy_data.h"
+#include "snpy_crc32c.h"
+#include "snpy_ckpt.h"
+#include "snpy_progress.h"
+#include "snpy_tb.h"
+#include "snpy_stage.h"
+#include "snpy_ioeng.h"
+#include "snpy_codec.h"
+#include "snpy_manifest.h"
+#include "snpy_sha256.h"
+#include "snpy_target.h"
+#include "snpy_rbd_aio.h"
 
 struct rbd_data {
     rados_t cluster;
@@ -57,14 +72,54 @@ struct rbd_conf {
     char pool[RBD_CONF_SIZE];
     char image[RBD_CONF_SIZE];
     char snap[RBD_CONF_SIZE];
+    char from_snap[RBD_CONF_SIZE];  /* base snapshot of incremental export */
+    int codec;                      /* export compression, enum snpy_codec_type */
+    int codec_level;
+    int nthread;                    /* codec worker threads */
+    u64 zero_blk;                   /* zero detection granularity, 0: off */
+    int rstr_mode;                  /* import: enum snpy_rbd_rstr_mode */
+    int obj_order;                  /* layout of an image created on import */
+    u64 features;
+    u64 stripe_unit;
+    u64 stripe_count;
+    int aio_depth;                  /* import: rbd_aio_write()s in flight */
+    u64 bw_limit;                   /* image bytes a second, 0: no limit */
+    u64 iops_limit;                 /* image ios a second, 0: no limit */
+    u64 alloc_size;                 /* allocated bytes found by snap, 0: unknown */
+    int io_flags;                   /* data file engine, SNPY_IOENG_SYNC */
+    int dedup;                      /* export: records by chunk reference */
+    char dedup_store[RBD_CONF_SIZE];    /* chunk store, "" if none */
+    int manifest;                   /* export: emit a manifest */
+    int hash_diff;                  /* export: blocks changed since it only */
+    char manifest_dir[RBD_CONF_SIZE];   /* last manifest of each image */
+    int verify;                     /* import: check the image against it */
+    int crypt;                      /* export: enum snpy_crypt_alg */
+    char crypt_key[RBD_CONF_SIZE];  /* key file, records sealed if given */
 };
 
-struct rbd_hdr {
-    u64 blk_dev_size;   /* total size */
-    u64 blk_map_offset; /* location of block map */
-    u64 compress_type;  /* type of compression */
+#define SNPY_RBD_AIO_DEPTH 16
+#define SNPY_RBD_AIO_DEPTH_MAX 256
+
+#define SNPY_RBD_ZERO_BLK 4096
+
+/*
+ * how import treats the ranges of the target image not in the backup:
+ * OVERWRITE leaves them alone, DISCARD discards them and CREATE restores
+ * into a newly created, hence empty, image.
+ */
+enum snpy_rbd_rstr_mode {
+    SNPY_RBD_RSTR_OVERWRITE,
+    SNPY_RBD_RSTR_DISCARD,
+    SNPY_RBD_RSTR_CREATE
 };
 
+#define SNPY_RBD_NTHREAD_MAX 64
+
+#define SNPY_RBD_PIPE_SIZE (1 << 20)
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031           /* linux, <fcntl.h> under _GNU_SOURCE */
+#endif
+
 #define SNPY_RBD_EBASE 0x10000
 
 
@@ -74,6 +129,7 @@ enum snpy_rbd_error {
     SNPY_RBD_EENV,
     SNPY_RBD_ESNAPCR,
     SNPY_RBD_ESTAT,
+    SNPY_RBD_ECREATE,
     SNPY_RBD_ELAST
 };
 
@@ -82,7 +138,8 @@ static const char *snpy_rbd_errmsg_tab[] = {
     [SNPY_RBD_ECONN - SNPY_RBD_EBASE] = "fail connecting rbd.",
     [SNPY_RBD_EENV - SNPY_RBD_EBASE] = "job env error/incomplete.",
     [SNPY_RBD_ESNAPCR - SNPY_RBD_EBASE] = "can not create rbd snapshot.",
-    [SNPY_RBD_ESTAT - SNPY_RBD_EBASE] = "can not get rbd image stat."
+    [SNPY_RBD_ESTAT - SNPY_RBD_EBASE] = "can not get rbd image stat.",
+    [SNPY_RBD_ECREATE - SNPY_RBD_EBASE] = "can not create rbd image."
 };
 
 const char* snpy_rbd_strerror(int errnum) {
@@ -92,10 +149,8 @@ const char* snpy_rbd_strerror(int errnum) {
     
     if (errnum >= SNPY_RBD_EBASE && errnum < SNPY_RBD_ELAST) 
         return snpy_rbd_errmsg_tab[errnum - SNPY_RBD_EBASE];
-    else if (errnum < sys_nerr)
-        return sys_errlist[errnum];
     else 
-        return "unknown error";
+        return strerror(errnum);
 
 }
 
@@ -103,8 +158,6 @@ int rbd_data_init(struct rbd_conf *conf, struct rbd_data *rbd) ;
 static int diff_cb_snap(uint64_t off, size_t len, int exists, void *arg);
 void rbd_data_destroy(struct rbd_data *rbd) ;
 
-static int snpy_rbd_write_image(rbd_image_t image, u64 off, u64 len, int fd, 
-                                char *buf, size_t buf_size) ;
 static int do_snap(const char *arg, int arg_size);
 static int do_export(const char *arg, int arg_size);
 static int do_import(const char *arg, int arg_size);
@@ -123,10 +176,327 @@ struct diff_cb_export_arg {
     int fd;
     rbd_image_t image;
     char *buf;
+    size_t buf_size;
     struct blk_map *bm;
+    struct blk_map *holes;          /* incremental: extents gone since base */
+    struct snpy_codec_pipe *pipe;   /* NULL if not compressing */
+    struct snpy_chunk_store *store; /* NULL if not deduplicating */
+    u64 dup_bytes;                  /* record bytes found in the store */
+    struct snpy_manifest_builder *mb;   /* NULL if no manifest */
+    struct snpy_manifest *manifest; /* built by mb */
+    struct snpy_manifest *base;     /* of the last export, for hash_diff */
+    int hash_diff;                  /* export blocks changed since base */
+    u64 same_bytes;                 /* bytes of blocks left out as such */
+    u64 zero_blk;                   /* 0 if not detecting zero blocks */
+    u64 zero_bytes;                 /* allocated bytes dropped as zeros */
+    u64 nbyte;                      /* extent data written so far */
+    u64 chunk_size;                 /* records never cross a chunk */
+    struct snpy_data_idx *idx;      /* footer index of the records */
+    u32 crc;                        /* crc32c of all records so far */
+    struct snpy_ckpt *ckpt;         /* NULL if not checkpointing */
+    struct snpy_progress *progress;
+    struct snpy_tb *tb;             /* throttles image reads */
+    u64 nraw;                       /* extent bytes read */
+    struct snpy_stage stage;        /* writes back behind the data file */
+    struct snpy_ioeng *io;          /* appends to the data file */
     int status;
 };
 
+/* crypt_flag() - data file flag of records sealed with @alg */
+static u64 crypt_flag(int alg) {
+    return alg == SNPY_CRYPT_AES_GCM ? SNPY_DATA_F_CRYPT_AES_GCM :
+        alg == SNPY_CRYPT_CHACHA20 ? SNPY_DATA_F_CRYPT_CHACHA20 : 0;
+}
+
+/* data_crypt() - key of @conf for a data file of @flags, alg 0 if plain */
+static int data_crypt(const struct rbd_conf *conf, u64 flags, 
+                      struct snpy_crypt *c) {
+    int alg = flags & SNPY_DATA_F_CRYPT_AES_GCM ? SNPY_CRYPT_AES_GCM :
+        flags & SNPY_DATA_F_CRYPT_CHACHA20 ? SNPY_CRYPT_CHACHA20 : 
+        SNPY_CRYPT_NONE;
+    c->alg = SNPY_CRYPT_NONE;
+    if (!alg)
+        return 0;
+    if (!conf->crypt_key[0]) {
+        snpy_logger(SNPY_LOG_ERR, "data file sealed, no crypt_key given.");
+        return -ENOKEY;
+    }
+    return snpy_crypt_init(c, alg, conf->crypt_key);
+}
+
+/* stored bytes of the end record of a sealed data file */
+#define SNPY_RBD_SEAL_SIZE (SNPY_SHA256_SIZE + SNPY_CRYPT_OVERHEAD)
+
+/* map_digest() - hash @bm by segment, adjacent ones as one */
+static void map_digest(struct snpy_sha256 *c, const struct blk_map *bm) {
+    struct seg end = { .off = ~0ULL, .len = 0 };
+    u64 i = 0;
+    while (i < bm->nuse) {
+        struct seg s = bm->segv[i ++];
+        while (i < bm->nuse && bm->segv[i].off == s.off + s.len)
+            s.len += bm->segv[i ++].len;
+        snpy_sha256_update(c, &s, sizeof s);
+    }
+    snpy_sha256_update(c, &end, sizeof end);
+}
+
+/*
+ * footer_digest() - sha256 of what the end record of a sealed data file
+ *                   vouches for
+ *
+ * The header fields a restore goes by, the index, the blk_map and the hole
+ * map, @holes NULL if none. Maps are hashed as blk_map_read() returns them.
+ */
+static void footer_digest(const struct snpy_data_hdr *hdr, 
+                          const struct snpy_data_idx *idx,
+                          const struct blk_map *bm, 
+                          const struct blk_map *holes, u8 *md) {
+    struct snpy_sha256 c;
+    u64 fields[] = { 
+        hdr->blk_dev_size, hdr->compress_type, hdr->chunk_size, hdr->flags 
+    };
+    snpy_sha256_init(&c);
+    snpy_sha256_update(&c, fields, sizeof fields);
+    snpy_sha256_update(&c, &idx->nuse, sizeof idx->nuse);
+    snpy_sha256_update(&c, idx->entv, idx->nuse * sizeof idx->entv[0]);
+    map_digest(&c, bm);
+    if (holes)
+        map_digest(&c, holes);
+    snpy_sha256_final(&c, md);
+}
+
+/* export_rec() - append a record and its stored bytes to the data file */
+static int export_rec(struct diff_cb_export_arg *p, 
+                      const struct snpy_seg_rec *rec, const char *data) {
+    int rc;
+    u64 file_off = sizeof(struct snpy_data_hdr) + p->nbyte + sizeof *rec;
+    if ((rc = snpy_ioeng_write(p->io, rec, sizeof *rec)) ||
+        (rc = snpy_ioeng_write(p->io, data, rec->zlen)))
+        return rc;
+    p->nbyte += sizeof *rec + rec->zlen;
+    snpy_stage_write(&p->stage, sizeof(struct snpy_data_hdr) + p->nbyte);
+    if (!rec->len)
+        return 0;
+    p->crc = snpy_crc32c_combine(p->crc, rec->crc, rec->len);
+    return snpy_data_idx_add(&p->idx, rec, file_off);
+}
+
+/* export_chunk() - raw bytes of the record at @off, at most @len */
+static u32 export_chunk(struct diff_cb_export_arg *p, u64 off, u64 len) {
+    return MIN(len, p->chunk_size - off % p->chunk_size);
+}
+
+/* export_sink() - append a compressed record to the data file
+ *
+ * The new chunks of a record by reference go to the store first.
+ */
+static int export_sink(struct snpy_frame_slot *slot, void *ctx) {
+    struct diff_cb_export_arg *p = ctx;
+    const struct snpy_chunk_ref *refv = (const void *)slot->z;
+    int i, rc;
+    for (i = 0; p->store && i < slot->nchunk; i ++) {
+        const struct snpy_frame_chunk *c = &slot->chunkv[i];
+        if (snpy_chunk_store_has(p->store, refv[i].fp))
+            p->dup_bytes += refv[i].len;
+        else if ((rc = snpy_chunk_store_put(p->store, refv[i].fp, 
+                                            refv[i].len, c->codec,
+                                            c->data, c->zlen)))
+            return rc;
+    }
+    return export_rec(p, &slot->rec, slot->out);
+}
+
+/* export_records() - read an extent into records for the codec workers */
+static int export_records(struct diff_cb_export_arg *p, u64 off, u64 len) {
+    int rc;
+    struct snpy_codec_pipe *pipe = p->pipe;
+    while (len) {
+        struct snpy_frame_slot *slot = snpy_codec_pipe_get(pipe);
+        if (!slot) 
+            return -pipe->status;
+        u32 n = export_chunk(p, off, len);
+        snpy_tb_take(p->tb, n, 1);
+        ssize_t nbyte = rbd_read(p->image, off, n, slot->raw);
+        if (nbyte != n) 
+            return nbyte < 0 ? nbyte : -EIO;
+        if (p->mb && 
+            (rc = snpy_manifest_builder_feed(p->mb, off, slot->raw, n)))
+            return rc;
+        slot->rec.off = off;
+        slot->rec.len = n;
+        if ((rc = snpy_codec_pipe_put(pipe, slot)))
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* export_run() - record and append a run of extent data already read */
+static int export_run(struct diff_cb_export_arg *p, 
+                      u64 off, const char *data, u64 len) {
+    int rc;
+    if ((rc = blk_map_add(&p->bm, off, len)))
+        return rc;
+    struct snpy_codec_pipe *pipe = p->pipe;
+    while (len) {
+        u32 n = export_chunk(p, off, len);
+        if (!pipe) {
+            struct snpy_seg_rec rec = {
+                .off = off, .len = n, .zlen = n, .codec = SNPY_CODEC_NONE,
+                .crc = snpy_crc32c(0, data, n)
+            };
+            if ((rc = export_rec(p, &rec, data)))
+                return rc;
+        } else {
+            struct snpy_frame_slot *slot = snpy_codec_pipe_get(pipe);
+            if (!slot) 
+                return -pipe->status;
+            memcpy(slot->raw, data, n);
+            slot->rec.off = off;
+            slot->rec.len = n;
+            if ((rc = snpy_codec_pipe_put(pipe, slot)))
+                return rc;
+        }
+        off += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* export_sparse() - export an extent, leaving out its all-zero blocks
+ *
+ * Blocks are aligned to zero_blk in image offsets, so a dropped block is
+ * never partially covered by the blk_map. An incremental export adds the
+ * dropped blocks to its holes, an older backup of the chain may have data
+ * there. Without zero_blk the extent is exported as a whole, a buffer at a
+ * time.
+ */
+static int export_sparse(struct diff_cb_export_arg *p, u64 off, u64 len) {
+    int rc;
+    while (len) {
+        u64 n = MIN(len, p->buf_size);
+        snpy_tb_take(p->tb, n, 1);
+        ssize_t nbyte = rbd_read(p->image, off, n, p->buf);
+        if (nbyte != n) 
+            return nbyte < 0 ? nbyte : -EIO;
+        if (p->mb && (rc = snpy_manifest_builder_feed(p->mb, off, p->buf, n)))
+            return rc;
+
+        u64 pos = 0;
+        u64 run = 0;                /* start of pending non-zero run */
+        while (p->zero_blk && pos < n) {
+            u64 bl = MIN(p->zero_blk - (off + pos) % p->zero_blk, n - pos);
+            if (snpy_is_zero(p->buf + pos, bl)) {
+                if (pos > run && 
+                    (rc = export_run(p, off + run, p->buf + run, pos - run)))
+                    return rc;
+                if (p->holes && (rc = blk_map_add(&p->holes, off + pos, bl)))
+                    return rc;
+                p->zero_bytes += bl;
+                run = pos + bl;
+            }
+            pos += bl;
+        }
+        if (n > run && (rc = export_run(p, off + run, p->buf + run, n - run)))
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* export_feed() - read an extent into the manifest only
+ *
+ * With hash_diff blocks are exported by export_blk() once complete.
+ */
+static int export_feed(struct diff_cb_export_arg *p, u64 off, u64 len) {
+    while (len) {
+        u64 n = MIN(len, p->buf_size);
+        snpy_tb_take(p->tb, n, 1);
+        ssize_t nbyte = rbd_read(p->image, off, n, p->buf);
+        if (nbyte != n) 
+            return nbyte < 0 ? nbyte : -EIO;
+        int rc = snpy_manifest_builder_feed(p->mb, off, p->buf, n);
+        if (rc)
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* export_blk() - export a block of the manifest unless the base has it
+ *
+ * Only with hash_diff. A changed block goes out whole, zeros included, so
+ * it covers whatever an older backup of the chain has there.
+ */
+static int export_blk(u64 blk, const char *data, u32 len, void *arg) {
+    struct diff_cb_export_arg *p = arg;
+    const struct snpy_manifest *m = p->mb->m;
+    const struct snpy_manifest *base = p->base;
+    if (!p->hash_diff)
+        return 0;
+    if (base->hdr.blk_size == m->hdr.blk_size && blk < base->hdr.nleaf &&
+        !memcmp(base->nodev[blk], m->nodev[blk], sizeof m->nodev[0])) {
+        p->same_bytes += len;
+        return 0;
+    }
+    return export_run(p, blk * m->hdr.blk_size, data, len);
+}
+
+/* export_ckpt() - save progress once SNPY_CKPT_INTERVAL more bytes are out
+ *
+ * The image below @pos has been read; its records, and the chunks they
+ * refer to, are sinked and synced before the checkpoint is written.
+ */
+static int export_ckpt(struct diff_cb_export_arg *p, u64 pos) {
+    int rc;
+    struct snpy_ckpt *ckpt = p->ckpt;
+    if (!ckpt || p->nbyte - ckpt->nbyte < SNPY_CKPT_INTERVAL)
+        return 0;
+    if ((p->pipe && (rc = snpy_codec_pipe_flush(p->pipe))) ||
+        (p->store && (rc = snpy_chunk_store_sync(p->store))) ||
+        (rc = snpy_ioeng_flush(p->io)))
+        return rc;
+    if (fdatasync(p->fd))
+        return -errno;
+    ckpt->pos = pos;
+    ckpt->nbyte = p->nbyte;
+    ckpt->aux = p->zero_bytes;
+    ckpt->crc = p->crc;
+    if ((rc = snpy_ckpt_write(ckpt, p->idx, p->bm)))
+        return rc;
+    snpy_logger(SNPY_LOG_DEBUG, "checkpoint at %llu, %llu bytes out.",
+                (unsigned long long)pos, (unsigned long long)p->nbyte);
+    return 0;
+}
+
+/* diff_cb_hole() - find the holes below the checkpoint of a resumed export
+ *
+ * The parts of a changed extent missing from the blk_map were dropped as
+ * zero blocks.
+ */
+static int diff_cb_hole(uint64_t off, size_t len, int exists, void *arg) {
+    struct diff_cb_export_arg *p = arg;
+    struct blk_map *bm = p->bm;
+    u64 end = off + len;
+    u64 i;
+    int rc;
+    if (!exists)
+        return blk_map_add(&p->holes, off, len);
+    for (i = blk_map_find(bm, off); off < end; i ++) {
+        u64 next = i < bm->nuse ? MIN(bm->segv[i].off, end) : end;
+        if (next > off && (rc = blk_map_add(&p->holes, off, next - off)))
+            return rc;
+        if (i >= bm->nuse)
+            break;
+        off = MAX(off, bm->segv[i].off + bm->segv[i].len);
+    }
+    return 0;
+}
+
 static int diff_cb_export(uint64_t off, size_t len, int exists, void *arg) {
     struct diff_cb_export_arg *p = arg;
     int rc;
@@ -134,28 +504,26 @@ static int diff_cb_export(uint64_t off, size_t len, int exists, void *arg) {
         p->status = EINVAL;
         return -p->status;
     }
-    if (exists) {
-        /* update the segment list */
-        rc = blk_map_add(&(p->bm), off, len);
-        if (rc) {
+    if (!exists) {
+        /* no record covers it, a restore zeroes it from the hole map */
+        if (p->holes && (rc = blk_map_add(&p->holes, off, len))) {
             p->status = -rc;
             return rc;
         }
-
-        /* write to data file */
-        ssize_t nbyte = rbd_read(p->image, off, len, p->buf);
-        if(nbyte != len) {
-            p->status = -nbyte;
-            return nbyte;
-        }
-        
-        nbyte = write(p->fd, p->buf, len);
-        if(nbyte != len) {
-            p->status = errno;
-            return -errno;
-        }
-        
+        return 0;
+    }
+    if (p->hash_diff)
+        rc = export_feed(p, off, len);
+    else if (p->zero_blk || !p->pipe) 
+        rc = export_sparse(p, off, len);
+    else if (!(rc = blk_map_add(&(p->bm), off, len)))   /* segment list */
+        rc = export_records(p, off, len);
+    if (rc || (rc = export_ckpt(p, off + len))) {
+        p->status = -rc;
+        return rc;
     }
+    p->nraw += len;
+    snpy_progress_update(p->progress, off + len, p->nraw, p->bm->nuse);
     return 0;
 }
 
@@ -176,6 +544,73 @@ int rbd_conf_init(struct rbd_conf *conf, const char *arg) {
     strlcpy(conf->pool, json_string(js, ".sp_param.pool"), sizeof conf->pool);
     strlcpy(conf->image, json_string(js, ".sp_param.image"), sizeof conf->image);
     strlcpy(conf->snap, json_string(js, ".sp_param.snap_name"), sizeof conf->snap);
+    strlcpy(conf->from_snap, json_string(js, ".sp_param.from_snap"), 
+            sizeof conf->from_snap);
+
+    conf->codec = snpy_codec_parse(json_string(js, ".sp_param.compress"));
+    if (conf->codec < 0) 
+        goto close_js;
+    conf->codec_level = json_number(js, ".sp_param.compress_level");
+    conf->nthread = json_number(js, ".sp_param.nthread");
+    if (conf->nthread <= 0) 
+        conf->nthread = sysconf(_SC_NPROCESSORS_ONLN);
+    conf->nthread = MAX(1, MIN(conf->nthread, SNPY_RBD_NTHREAD_MAX));
+
+    conf->zero_blk = SNPY_RBD_ZERO_BLK;
+    if (json_exists(js, ".sp_param.zero_blk"))
+        conf->zero_blk = json_number(js, ".sp_param.zero_blk");
+    const char *rstr_mode = json_string(js, ".sp_param.rstr_mode");
+    if (!rstr_mode[0] || !strcmp(rstr_mode, "overwrite"))
+        conf->rstr_mode = SNPY_RBD_RSTR_OVERWRITE;
+    else if (!strcmp(rstr_mode, "discard"))
+        conf->rstr_mode = SNPY_RBD_RSTR_DISCARD;
+    else if (!strcmp(rstr_mode, "create"))
+        conf->rstr_mode = SNPY_RBD_RSTR_CREATE;
+    else 
+        goto close_js;
+    if (json_boolean(js, ".sp_param.discard") && 
+        conf->rstr_mode == SNPY_RBD_RSTR_OVERWRITE)
+        conf->rstr_mode = SNPY_RBD_RSTR_DISCARD;
+    conf->obj_order = json_number(js, ".sp_param.obj_order");
+    conf->features = json_number(js, ".sp_param.features");
+    conf->stripe_unit = json_number(js, ".sp_param.stripe_unit");
+    conf->stripe_count = json_number(js, ".sp_param.stripe_count");
+
+    conf->aio_depth = json_number(js, ".sp_param.aio_depth");
+    if (conf->aio_depth <= 0)
+        conf->aio_depth = SNPY_RBD_AIO_DEPTH;
+    conf->aio_depth = MIN(conf->aio_depth, SNPY_RBD_AIO_DEPTH_MAX);
+
+    /* MB/s, on top of the share of the shared limits xcore hands out */
+    conf->bw_limit = json_number(js, ".sp_param.bw_limit") * (1 << 20);
+    conf->iops_limit = json_number(js, ".sp_param.iops_limit");
+    double alloc_size = json_number(js, ".sp_param.alloc_size");
+    conf->alloc_size = alloc_size > 0 ? alloc_size : 0;
+    /* io_uring unless "sync" asks for plain pread()/pwrite() */
+    conf->io_flags = strcmp(json_string(js, ".sp_param.io_engine"), "sync") ?
+        0 : SNPY_IOENG_SYNC;
+    conf->dedup = json_boolean(js, ".sp_param.dedup");
+    /* chunks live beside the backups, for any host restoring them */
+    char dir[PATH_MAX];
+    conf->dedup_store[0] = 0;
+    if (!snpy_target_dir(arg, dir, sizeof dir) &&
+        snprintf(conf->dedup_store, sizeof conf->dedup_store, "%s/%s", dir,
+                 SNPY_TARGET_CHUNK_DIR) >= sizeof conf->dedup_store)
+        goto close_js;
+    conf->hash_diff = json_boolean(js, ".sp_param.hash_diff");
+    conf->manifest = conf->hash_diff || json_boolean(js, ".sp_param.manifest");
+    const char *manifest_dir = json_string(js, ".sp_param.manifest_dir");
+    strlcpy(conf->manifest_dir, manifest_dir[0] ? manifest_dir : 
+            SNPY_MANIFEST_DEFAULT_DIR, sizeof conf->manifest_dir);
+    conf->verify = json_boolean(js, ".sp_param.verify");
+    /* a key turns sealing on, with the fastest algorithm unless named */
+    const char *crypt_key = json_string(js, ".sp_param.crypt_key");
+    strlcpy(conf->crypt_key, crypt_key, sizeof conf->crypt_key);
+    const char *crypt = json_string(js, ".sp_param.crypt");
+    conf->crypt = !conf->crypt_key[0] ? SNPY_CRYPT_NONE :
+        snpy_crypt_parse(crypt[0] ? crypt : "auto");
+    if (conf->crypt < 0) 
+        goto close_js;
     return 0;
 close_js:
     return -SNPY_RBD_ECONF;
@@ -200,6 +635,35 @@ static ssize_t get_rbd_alloc_size(rbd_image_t image) {
 
 }
 
+/* get_snap_id() - id of snapshot @snap, which tells it from a later one
+ * of the same name
+ */
+static int get_snap_id(rbd_image_t image, const char *snap, u64 *id) {
+    int rc;
+    int max_snaps = 16;
+    rbd_snap_info_t *snaps = NULL;
+    do {
+        free(snaps);
+        if (!(snaps = calloc(max_snaps, sizeof *snaps)))
+            return -ENOMEM;
+        rc = rbd_snap_list(image, snaps, &max_snaps);
+    } while (rc == -ERANGE);
+    if (rc < 0) 
+        goto free_snaps;
+
+    int i, nsnap = rc;
+    for (i = 0, rc = -ENOENT; i < nsnap; i ++) {
+        if (!strcmp(snaps[i].name, snap)) {
+            *id = snaps[i].id;
+            rc = 0;
+        }
+    }
+    rbd_snap_list_end(snaps);
+free_snaps:
+    free(snaps);
+    return rc;
+}
+
 static int do_snap(const char *arg, int arg_size) {
     int rc;
     struct rbd_data rbd;
@@ -306,7 +770,8 @@ err_out:
 
 static int update_export_arg(const char *arg, 
                              time_t export_start, 
-                             time_t export_fin) {
+                             time_t export_fin,
+                             struct rbd_data *rbd) {
     /* TODO: update arg:
      * 1. set vol_size, alloc_size and snap_name in sp_param object
      * 2. set est_size in top level object.
@@ -330,6 +795,19 @@ static int update_export_arg(const char *arg,
         status = rc;
         goto close_js;
     } 
+
+    /* image layout, lets import re-create the image */
+    u64 features = 0, stripe_unit = 0, stripe_count = 0;
+    rbd_get_features(rbd->image, &features);
+    rbd_get_stripe_unit(rbd->image, &stripe_unit);
+    rbd_get_stripe_count(rbd->image, &stripe_count);
+    if ((rc = json_setnumber(js, rbd->info.order, ".sp_param.obj_order")) ||
+        (rc = json_setnumber(js, features, ".sp_param.features")) ||
+        (rc = json_setnumber(js, stripe_unit, ".sp_param.stripe_unit")) ||
+        (rc = json_setnumber(js, stripe_count, ".sp_param.stripe_count"))) {
+        status = rc;
+        goto close_js;
+    }
     
     FILE *arg_fp = fopen("meta/arg.out", "w");
     if (!arg_fp) {
@@ -399,11 +877,38 @@ err_out:
     return status;
 }
 
+/* manifest_path() - file of the manifest of the last export of the image */
+static int manifest_path(const struct rbd_conf *conf, char *fn, size_t size) {
+    if (snprintf(fn, size, "%s/%s.%s", conf->manifest_dir, conf->pool, 
+                 conf->image) >= size)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/* save_manifest() - keep @m for the next hash_diff export of the image
+ *
+ * Failing that the manifest kept before is dropped: diffing against it
+ * would leave out blocks this export has.
+ */
+static int save_manifest(const struct rbd_conf *conf, 
+                         const struct snpy_manifest *m) {
+    char fn[PATH_MAX];
+    int rc;
+    if ((rc = manifest_path(conf, fn, sizeof fn)))
+        return rc;
+    if (mkdir(conf->manifest_dir, 0700) && errno != EEXIST)
+        rc = -errno;
+    if (rc || (rc = snpy_manifest_save(fn, m)))
+        unlink(fn);
+    return rc;
+}
+
 static int do_export(const char *arg, int arg_size) {
 
     int rc;
     struct rbd_data rbd;
     struct rbd_conf conf;
+    struct snpy_crypt crypt = { .alg = SNPY_CRYPT_NONE };
     time_t start, fin;
     int status = 0;
     int status_msg[1024];
@@ -416,6 +921,26 @@ static int do_export(const char *arg, int arg_size) {
         status = EINVAL;
         goto err_out;
     }
+    if (conf.dedup && !conf.dedup_store[0]) {
+        snpy_logger(SNPY_LOG_ERR, "dedup keeps chunks in the directory of a "
+                    "posix target, the target has none.");
+        status = EINVAL;
+        goto err_out;
+    }
+    /* chunks are stored and shared by their plain bytes */
+    if (conf.crypt && conf.dedup) {
+        snpy_logger(SNPY_LOG_ERR, "dedup keeps chunks in plain, "
+                    "it can not be used with crypt.");
+        status = EINVAL;
+        goto err_out;
+    }
+    if (conf.crypt && 
+        (rc = snpy_crypt_init(&crypt, conf.crypt, conf.crypt_key))) {
+        snpy_logger(SNPY_LOG_ERR, "can not load key %s: %d", 
+                    conf.crypt_key, rc);
+        status = -rc;
+        goto err_out;
+    }
     if((rc = rbd_data_init(&conf, &rbd))) {
         status = EINVAL;
         goto err_out;
@@ -439,13 +964,47 @@ static int do_export(const char *arg, int arg_size) {
         status = -rc;
         goto cleanup_rbd_data;
     }   /* done prepare rbd image */
+    u64 snap_id = 0;
+    if ((rc = get_snap_id(rbd.image, conf.snap, &snap_id))) {
+        snpy_logger(SNPY_LOG_ERR, "error get snapshot id: %d", rc);
+        status = -rc;
+        goto cleanup_rbd_data;
+    }
+
+    /* 
+     * a manifest needs the whole image, not a snapshot diff; its leaves
+     * are not checkpointed, an export with one starts over
+     */
+    if (conf.manifest && conf.from_snap[0] && !conf.hash_diff) {
+        snpy_logger(SNPY_LOG_INFO, "no manifest for a snapshot diff export.");
+        conf.manifest = 0;
+    }
+    int incremental = conf.from_snap[0] && !conf.hash_diff;
+
+    /* a checkpoint of the same snapshot resumes an earlier run */
+    struct snpy_ckpt ckpt;
+    struct snpy_data_idx *ckpt_idx = NULL;
+    struct blk_map *ckpt_bm = NULL;
+    int resume = !conf.manifest && !snpy_ckpt_read(&ckpt, &ckpt_idx, &ckpt_bm);
+    if (resume && (ckpt.id != snap_id || ckpt.size != rbd.info.size)) {
+        snpy_logger(SNPY_LOG_INFO, "checkpoint of another snapshot dropped.");
+        snpy_data_idx_free(ckpt_idx);
+        blk_map_free(ckpt_bm);
+        ckpt_idx = NULL;
+        ckpt_bm = NULL;
+        resume = 0;
+    }
+    if (!resume) 
+        ckpt = (struct snpy_ckpt) { 
+            .magic = SNPY_CKPT_MAGIC, .id = snap_id, .size = rbd.info.size 
+        };
 
     /* prepare export call back function write buffer */
     char *buf = malloc(rbd.info.obj_size);
     if (!buf) {
         snpy_logger(SNPY_LOG_ERR, "can not calloc write call-back function buffer");
         status = errno;
-        goto cleanup_rbd_data;
+        goto free_ckpt;
     }
 
     /* prepare data file for write */
@@ -455,19 +1014,52 @@ static int do_export(const char *arg, int arg_size) {
         status = ENAMETOOLONG;
         goto free_buf;
     }
-    int data_fd = open(data_fn, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    int data_fd = open(data_fn, O_WRONLY|O_CREAT|(resume ? 0 : O_TRUNC), 0600);
     if (data_fd == -1) {
         status = errno;
         goto free_buf;
     }
 
-    struct rbd_hdr hdr = {
-        .blk_dev_size = rbd.info.size,
-        .blk_map_offset = -1,
-        .compress_type = 1
-    };
-    /* seek pass the rbd header */
-    lseek(data_fd, sizeof(struct rbd_hdr), SEEK_SET);
+    struct snpy_data_hdr hdr;
+    snpy_data_hdr_init(&hdr, rbd.info.size, conf.codec);
+    if (conf.dedup)
+        hdr.flags |= SNPY_DATA_F_DEDUP;
+    if (incremental)
+        hdr.flags |= SNPY_DATA_F_HOLES;
+    if (crypt.alg)                  /* the tags check sealed records */
+        hdr.flags = (hdr.flags & ~SNPY_DATA_F_CRC32C) | crypt_flag(crypt.alg);
+    struct stat data_st;
+    int is_fifo = !fstat(data_fd, &data_st) && S_ISFIFO(data_st.st_mode);
+    off_t ckpt_end = sizeof hdr + ckpt.nbyte;
+    if (resume && (is_fifo || data_st.st_size < ckpt_end)) {
+        snpy_logger(SNPY_LOG_INFO, "checkpoint ahead of data file dropped.");
+        resume = 0;
+    }
+    if (resume) {
+        /* drop whatever was written after the checkpoint */
+        if (ftruncate(data_fd, ckpt_end) || 
+            lseek(data_fd, ckpt_end, SEEK_SET) != ckpt_end) {
+            status = errno;
+            goto close_data_fd;
+        }
+        snpy_logger(SNPY_LOG_INFO, "resume export at %llu, %llu bytes out.",
+                    (unsigned long long)ckpt.pos, 
+                    (unsigned long long)ckpt.nbyte);
+    } else if (is_fifo) {
+        /* streaming to put, write the header now and again at the end */
+        fcntl(data_fd, F_SETPIPE_SZ, SNPY_RBD_PIPE_SIZE);
+        if (write(data_fd, &hdr, sizeof hdr) != sizeof hdr) {
+            status = errno;
+            goto close_data_fd;
+        }
+    } else {
+        /* seek pass the rbd header */
+        if (ftruncate(data_fd, 0)) {
+            status = errno;
+            goto close_data_fd;
+        }
+        lseek(data_fd, sizeof(struct snpy_data_hdr), SEEK_SET);
+    }
     
     /* prepare export data block map */
     /* initialize callback argument */
@@ -475,19 +1067,106 @@ static int do_export(const char *arg, int arg_size) {
     {   .image = rbd.image,
         .fd = data_fd,
         .buf = buf,
-        .bm = blk_map_alloc(4096),
+        .buf_size = rbd.info.obj_size,
+        .bm = resume ? ckpt_bm : blk_map_alloc(4096),
+        .holes = incremental ? blk_map_alloc(0) : NULL,
+        .zero_blk = conf.zero_blk,
+        .zero_bytes = resume ? ckpt.aux : 0,
+        .nbyte = resume ? ckpt.nbyte : 0,
+        .chunk_size = hdr.chunk_size,
+        .idx = resume ? ckpt_idx : snpy_data_idx_alloc(4096),
+        .crc = resume ? ckpt.crc : 0,
+        /* a stream can not be resumed */
+        .ckpt = is_fifo || conf.manifest ? NULL : &ckpt,
+        .progress = snpy_progress_open(rbd.info.size),
+        .tb = snpy_tb_create(conf.bw_limit, conf.iops_limit),
         .status = 0
     };
+    if (resume) 
+        ckpt_bm = NULL, ckpt_idx = NULL;    /* owned by export_arg now */
+    else 
+        ckpt.pos = ckpt.nbyte = 0;
+
+    /* 
+     * a full export stores at most the allocated bytes plus record headers,
+     * reserve them up front so the data file is laid out in one piece
+     */
+    snpy_stage_init(&export_arg.stage, data_fd, sizeof hdr + ckpt.nbyte, 0);
+    export_arg.io = snpy_ioeng_open(data_fd, is_fifo ? 0 : 
+                                    sizeof hdr + ckpt.nbyte, 
+                                    conf.io_flags, 0, 0);
+    if (!resume && !conf.from_snap[0] && conf.alloc_size &&
+        (rc = snpy_stage_prealloc(&export_arg.stage, conf.alloc_size + 
+                                  (conf.alloc_size / hdr.chunk_size + 1) * 
+                                  sizeof(struct snpy_seg_rec))))
+        snpy_logger(SNPY_LOG_DEBUG, "data file not preallocated: %d.", rc);
 
     /* check blk_mapp_alloc return */
-    if (!export_arg.bm) {
+    if (!export_arg.bm || !export_arg.idx || !export_arg.tb || 
+        !export_arg.io || (incremental && !export_arg.holes)) {
         status = ENOMEM;
         snpy_logger(SNPY_LOG_ERR, "can not alloc export data block map");
-        goto close_data_fd;
+        goto free_blk_map;
+    }
+
+    /* hash_diff without the manifest of the last export is a full export */
+    char manifest_fn[PATH_MAX];
+    if (conf.hash_diff && 
+        ((rc = manifest_path(&conf, manifest_fn, sizeof manifest_fn)) ||
+         (rc = snpy_manifest_load(manifest_fn, &export_arg.base))))
+        snpy_logger(SNPY_LOG_INFO, "no manifest of the last export (%d), "
+                    "exporting all blocks.", rc);
+    export_arg.hash_diff = !!export_arg.base;
+    if (conf.manifest && 
+        !(export_arg.mb = snpy_manifest_builder_create(rbd.info.size, 
+                                                       SNPY_MANIFEST_BLK,
+                                                       export_blk, 
+                                                       &export_arg))) {
+        status = ENOMEM;
+        snpy_logger(SNPY_LOG_ERR, "can not alloc manifest");
+        goto free_blk_map;
+    }
+
+    if (conf.dedup && 
+        !(export_arg.store = snpy_chunk_store_open(conf.dedup_store, 1))) {
+        status = errno;
+        snpy_logger(SNPY_LOG_ERR, "can not open chunk store %s: %d", 
+                    conf.dedup_store, status);
+        goto free_blk_map;
+    }
+
+    /* compress, deduplicate and seal records on worker threads */
+    if (!SNPY_CODEC_IS_RAW(conf.codec) || export_arg.store || crypt.alg) {
+        export_arg.pipe = snpy_codec_pipe_create(conf.codec, conf.codec_level,
+                                                 SNPY_CODEC_ENC, conf.nthread,
+                                                 SNPY_DATA_CHUNK_SIZE,
+                                                 export_arg.store,
+                                                 crypt.alg ? &crypt : NULL,
+                                                 export_sink, &export_arg);
+        if (!export_arg.pipe) {
+            status = errno;
+            snpy_logger(SNPY_LOG_ERR, "can not create codec pipe: %d", status);
+            goto free_blk_map;
+        }
+        export_arg.pipe->crc = !!(hdr.flags & SNPY_DATA_F_CRC32C);
+        /* records are sealed for this backup, numbered on from a resume */
+        export_arg.pipe->id = strtoull(job_id, NULL, 10);
+        export_arg.pipe->seq = export_arg.idx->nuse;
     }
 
 
-    rc = rbd_diff_iterate(rbd.image, NULL, 0, rbd.info.size,
+    /* incremental export if a base snapshot is given */
+    const char *from_snap = incremental ? conf.from_snap : NULL;
+    /* a checkpoint keeps no holes, those below it are found again */
+    if (resume && incremental &&
+        (rc = rbd_diff_iterate(rbd.image, from_snap, 0, ckpt.pos,
+                               diff_cb_hole, &export_arg))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "rbd_diff_iterate: %d.", rc);
+        goto free_blk_map;
+    }
+    rc = rbd_diff_iterate(rbd.image, from_snap, ckpt.pos, 
+                          rbd.info.size - ckpt.pos,
                           diff_cb_export, &export_arg);
 
     if (rc)  {
@@ -502,13 +1181,93 @@ static int do_export(const char *arg, int arg_size) {
         goto free_blk_map;
     }
 
+    /* blocks past the last extent complete, and export with hash_diff */
+    if (export_arg.mb && 
+        (rc = snpy_manifest_builder_finish(export_arg.mb, 
+                                           &export_arg.manifest))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error building manifest: %d.", rc);
+        goto free_blk_map;
+    }
+    if (export_arg.base)
+        memcpy(export_arg.manifest->hdr.base, export_arg.base->hdr.root,
+               sizeof export_arg.manifest->hdr.base);
+
+    if (export_arg.pipe && (rc = snpy_codec_pipe_flush(export_arg.pipe))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error writing compressed records: %d.", rc);
+        goto free_blk_map;
+    }
+    if (export_arg.store && (rc = snpy_chunk_store_sync(export_arg.store))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error syncing chunk store: %d.", rc);
+        goto free_blk_map;
+    }
+    /* 
+     * the end record of a sealed data file carries the digest of its
+     * footer, sealed as the record after the last
+     */
+    struct snpy_seg_rec end_rec = { .len = 0 };
+    u8 md[SNPY_SHA256_SIZE];
+    u8 seal[SNPY_RBD_SEAL_SIZE];
+    if (crypt.alg) {
+        ssize_t n;
+        footer_digest(&hdr, export_arg.idx, export_arg.bm, export_arg.holes,
+                      md);
+        if ((n = snpy_codec_seal(&crypt, export_arg.pipe->id, 
+                                 export_arg.idx->nuse, &end_rec, md, 
+                                 sizeof md, seal)) < 0) {
+            status = -n;
+            snpy_logger(SNPY_LOG_ERR, "error sealing footer: %d.", (int)n);
+            goto free_blk_map;
+        }
+        end_rec.zlen = n;
+    }
+    if ((rc = export_rec(&export_arg, &end_rec, (const char *)seal))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error writing end record: %d.", rc);
+        goto free_blk_map;
+    }
+    /* the footer is written past the records through data_fd */
+    if ((rc = snpy_ioeng_flush(export_arg.io))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error writing records: %d.", rc);
+        goto free_blk_map;
+    }
+    snpy_logger(SNPY_LOG_INFO, "dropped %llu bytes of zero blocks.",
+                (unsigned long long)export_arg.zero_bytes);
+    if (export_arg.store)
+        snpy_logger(SNPY_LOG_INFO, "%llu bytes already in chunk store.",
+                    (unsigned long long)export_arg.dup_bytes);
+    if (export_arg.hash_diff)
+        snpy_logger(SNPY_LOG_INFO, "%llu bytes of unchanged blocks left out.",
+                    (unsigned long long)export_arg.same_bytes);
+
     /* finishing export task  */
     
-    hdr.blk_map_offset = lseek(data_fd, 0, SEEK_CUR); /* save current offset */
+    hdr.idx_offset = sizeof hdr + export_arg.nbyte;
+    hdr.nrec = export_arg.idx->nuse;
+    hdr.blk_map_offset = hdr.idx_offset + sizeof export_arg.idx->nuse +
+        hdr.nrec * sizeof export_arg.idx->entv[0];
+    struct snpy_manifest *manifest = export_arg.manifest;
+    if (manifest) {
+        hdr.manifest_offset = hdr.blk_map_offset;
+        hdr.blk_map_offset += sizeof manifest->hdr + 
+            manifest->hdr.nnode * sizeof manifest->nodev[0];
+    }
 
-    rc = blk_map_write(data_fd, export_arg.bm);    /* write block_map */
-    if (rc == -1) {
+    if ((rc = snpy_data_idx_write(data_fd, export_arg.idx)) ||
+        (manifest && (rc = snpy_manifest_write(data_fd, manifest))) ||
+        (rc = blk_map_write(data_fd, export_arg.bm)) ||
+        (export_arg.holes && 
+         (rc = blk_map_write(data_fd, export_arg.holes)))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error write index/block map: %d", rc);
+        goto free_blk_map;
+    }
+    if (is_fifo && write(data_fd, &hdr, sizeof hdr) != sizeof hdr) {
         status = errno;
+        snpy_logger(SNPY_LOG_ERR, "error write trailing header: %d", errno);
         goto free_blk_map;
     }
 
@@ -528,34 +1287,64 @@ static int do_export(const char *arg, int arg_size) {
         goto free_blk_map;
     }
     close(tag_fd);
+    if (hdr.flags & SNPY_DATA_F_CRC32C) {
+        memcpy(tag_buf + offsetof(struct snpy_data_tag, chksum), 
+               &export_arg.crc, sizeof export_arg.crc);
+        snpy_logger(SNPY_LOG_INFO, "image data crc32c: %08x.", 
+                    export_arg.crc);
+    }
     ssize_t nwrite = write(data_fd, tag_buf, sizeof tag_buf);
     if (nwrite != sizeof tag_buf) {
+        status = errno;
         snpy_logger(SNPY_LOG_ERR, "error append tag file: %d.", errno);
         goto free_blk_map;
     }
+    if (!is_fifo && (rc = snpy_stage_trim(&export_arg.stage, 
+                                          lseek(data_fd, 0, SEEK_CUR))))
+        snpy_logger(SNPY_LOG_WARN, "error free preallocated space: %d.", 
+                    rc);
    
     /* fill in rbd_hdr */
-    lseek(data_fd, 0, SEEK_SET);
-    if ((nwrite = write(data_fd, &hdr, sizeof hdr)) != sizeof hdr) {
+    if (!is_fifo && (lseek(data_fd, 0, SEEK_SET) ||
+                     write(data_fd, &hdr, sizeof hdr) != sizeof hdr)) {
+        status = errno;
         snpy_logger(SNPY_LOG_ERR, "error update rbd data header: %d", errno);
         goto free_blk_map;
     }
+    snpy_ckpt_clear();
+    if (manifest && (rc = save_manifest(&conf, manifest)))
+        snpy_logger(SNPY_LOG_WARN, "error saving manifest, the next hash_diff "
+                    "export exports all blocks: %d.", rc);
 
 
     fin = time(NULL);
-    if ((rc = update_export_arg(arg, start, fin))) {
+    if ((rc = update_export_arg(arg, start, fin, &rbd))) {
         snpy_logger(SNPY_LOG_ERR, "update_export_arg: %d.", rc);
     }
 
 free_blk_map:
+    snpy_ioeng_close(export_arg.io);
+    snpy_tb_destroy(export_arg.tb);
+    snpy_progress_close(export_arg.progress);
+    snpy_codec_pipe_destroy(export_arg.pipe);
+    snpy_chunk_store_close(export_arg.store);
+    snpy_manifest_builder_free(export_arg.mb);
+    free(export_arg.manifest);
+    free(export_arg.base);
+    snpy_data_idx_free(export_arg.idx);
     blk_map_free(export_arg.bm);
+    blk_map_free(export_arg.holes);
 close_data_fd:
     close(data_fd);
 free_buf:
     free(buf);
+free_ckpt:
+    snpy_data_idx_free(ckpt_idx);
+    blk_map_free(ckpt_bm);
 cleanup_rbd_data:
     rbd_data_destroy(&rbd);
 err_out:
+    snpy_crypt_clear(&crypt);
     kv_put_ival("meta/status", status, NULL);
     strerror_r(status, str_buf, sizeof str_buf);
     kv_put_sval("meta/status_msg", str_buf, sizeof str_buf, NULL);
@@ -566,142 +1355,922 @@ err_out:
 
 
 
-static int snpy_rbd_write_image(rbd_image_t image, u64 off, u64 len, int fd, 
-                         char *buf, size_t buf_size) {
-
-    ssize_t nread, nwrite;
-    while (1) {
-        if (len <= buf_size) {
-            nread = read(fd, buf, len);
-            if (nread != len) 
-                return -errno;
+/* discard_holes() - discard the parts of [@start, @end) not in @bm */
+static int discard_holes(struct rbd_aio_writer *aw, 
+                         struct blk_map *bm, u64 start, u64 end) {
+    u64 pos = start;
+    u64 i;
+    int rc;
+    for (i = blk_map_find(bm, start); i <= bm->nuse && pos < end; i ++) {
+        u64 hole_end = i < bm->nuse ? MIN(bm->segv[i].off, end) : end;
+        if (hole_end > pos && 
+            (rc = rbd_aio_writer_discard(aw, pos, hole_end - pos)))
+            return rc;
+        if (i < bm->nuse)
+            pos = MAX(pos, bm->segv[i].off + bm->segv[i].len);
+    }
+    return 0;
+}
 
-            nwrite = rbd_write(image, off, len, buf);
-            if (nwrite != len) 
-                return -errno;
+/* discard_ranges() - discard_holes() inside @range, or in all @size bytes */
+static int discard_ranges(struct rbd_aio_writer *aw, struct blk_map *bm, 
+                          struct blk_map *range, u64 size) {
+    if (!range)
+        return discard_holes(aw, bm, 0, size);
+    u64 i;
+    int rc;
+    for (i = 0; i < range->nuse; i ++) {
+        u64 start = MIN(range->segv[i].off, size);
+        u64 end = MIN(range->segv[i].off + range->segv[i].len, size);
+        if ((rc = discard_holes(aw, bm, start, end)))
+            return rc;
+    }
+    return 0;
+}
 
-            break;
-        } else {
-            nread = read(fd, buf, buf_size); 
-            if (nread != buf_size)
-                return -errno;
-            nwrite = rbd_write(image, off, buf_size, buf);
-            if (nwrite != buf_size)
-                return -errno;
-
-            off += buf_size;
-            len -= buf_size;
+/* zero_ranges() - zero the segments of @holes, only inside @range if given */
+static int zero_ranges(struct rbd_aio_writer *aw, struct blk_map *holes,
+                       struct blk_map *range) {
+    u64 i, j = 0, k;
+    int rc;
+    for (i = 0; i < holes->nuse; i ++) {
+        u64 off = holes->segv[i].off;
+        u64 end = off + holes->segv[i].len;
+        if (!range) {
+            if ((rc = rbd_aio_writer_zero(aw, off, end - off)))
+                return rc;
+            continue;
+        }
+        while (j < range->nuse && 
+               range->segv[j].off + range->segv[j].len <= off)
+            j ++;
+        for (k = j; k < range->nuse && range->segv[k].off < end; k ++) {
+            u64 s = MAX(off, range->segv[k].off);
+            u64 e = MIN(end, range->segv[k].off + range->segv[k].len);
+            if ((rc = rbd_aio_writer_zero(aw, s, e - s)))
+                return rc;
         }
     }
     return 0;
 }
 
-static int do_import(const char *arg, int arg_size) {
-    int rc;
-    struct rbd_data rbd;
-    struct rbd_conf conf;
-    time_t start, fin;
-    int status = 0;
-    char status_msg[1024] = "";
-    char str_buf[64];
-    
-    start = time(NULL);
-    /* prepare rbd connection */
-    if ((rc = rbd_conf_init(&conf, arg))) {
-        status = -rc;
-        snprintf(status_msg, sizeof status_msg,
-                 "configuration invalid: %d\n", status);
-        goto err_out;
+/* check_seal() - whether the end record of sealed data file @fd vouches
+ *                for the footer read, of backup @id
+ */
+static int check_seal(int fd, const struct snpy_data_hdr *hdr,
+                      const struct snpy_crypt *crypt, u64 id,
+                      const struct snpy_data_idx *idx,
+                      const struct blk_map *bm, const struct blk_map *holes) {
+    struct snpy_seg_rec rec;
+    u8 seal[SNPY_RBD_SEAL_SIZE];
+    u8 md[SNPY_SHA256_SIZE], want[SNPY_SHA256_SIZE];
+    u64 off = hdr->idx_offset - sizeof rec - sizeof seal;
+    if (hdr->idx_offset < snpy_data_hdr_size(hdr) + sizeof rec + sizeof seal ||
+        pread(fd, &rec, sizeof rec, off) != sizeof rec ||
+        pread(fd, seal, sizeof seal, off + sizeof rec) != sizeof seal ||
+        rec.len || rec.zlen != sizeof seal)
+        return -EIO;
+    footer_digest(hdr, idx, bm, holes, md);
+    if (snpy_codec_open(crypt, id, idx->nuse, &rec, seal, sizeof seal, 
+                        want) != sizeof want ||
+        memcmp(md, want, sizeof md)) {
+        snpy_logger(SNPY_LOG_ERR, "footer of data file not the one sealed "
+                    "by backup %llu.", (unsigned long long)id);
+        return -EBADMSG;
     }
-    if((rc = rbd_data_init(&conf, &rbd))) {
-        status = -rc;
-        snprintf(status_msg, sizeof status_msg,
-                 "error initiating rbd connection: %d\n", status);
-        goto err_out;
-    }                                       /* RAII point */
-    char job_id[32];
-    if (kv_get_sval("meta/id", job_id, sizeof job_id, NULL)) {
-        status = -rc;
-        snprintf(status_msg, sizeof status_msg,
-                 "error getting job id: %d\n", status);
-        goto cleanup_rbd_data;
+    return 0;
+}
+
+/*
+ * read_footer() - index, blk_map and hole map of data file @fd
+ *
+ * Each is read into @idx, @bm and @holes if not NULL; @holes is left NULL
+ * if the file has none, @idx if it is v1. The footer of a sealed file must
+ * be the one the end record vouches for, sealed by backup @id.
+ */
+static int read_footer(int fd, const struct snpy_data_hdr *hdr,
+                       const struct snpy_crypt *crypt, u64 id,
+                       struct snpy_data_idx **idx, struct blk_map **bm,
+                       struct blk_map **holes) {
+    int rc = 0;
+    struct snpy_data_idx *i = NULL;
+    struct blk_map *b = NULL, *h = NULL;
+    if (hdr->version >= 2 &&
+        (lseek(fd, hdr->idx_offset, SEEK_SET) == -1 ||
+         (rc = snpy_data_idx_read(fd, &i)) || i->nuse != hdr->nrec)) {
+        rc = rc ? rc : -EIO;
+        goto free_footer;
     }
-    /*
-    char rstr_job_id[32];
-    if (kv_get_sval("meta/rstr_job_id", rstr_job_id, sizeof rstr_job_id, NULL)) {
-        status = -rc;
-        goto cleanup_rbd_data;
+    if (lseek(fd, hdr->blk_map_offset, SEEK_SET) == -1) {
+        rc = -errno;
+        goto free_footer;
     }
-    */
-    if((rc = rbd_stat(rbd.image, &rbd.info, sizeof rbd.info))) {
-        status = -rc;
-        snprintf(status_msg, sizeof status_msg,
-                 "error getting rbd stat: %d\n", status);
-        goto cleanup_rbd_data;
+    if ((rc = blk_map_read(fd, &b)) ||
+        ((hdr->flags & SNPY_DATA_F_HOLES) && (rc = blk_map_read(fd, &h))))
+        goto free_footer;
+    if (crypt && (!i || (rc = check_seal(fd, hdr, crypt, id, i, b, h)))) {
+        rc = rc ? rc : -EINVAL;
+        goto free_footer;
     }
-    
-    /* allocation buffer */
-    size_t buf_size = 4*(1<<20);
-    char *buf = malloc(buf_size);
-    if (!buf) {
-        status = ENOMEM;
-        snprintf(status_msg, sizeof status_msg,
-                 "error allocating import buffer: %d\n", status);
-        goto cleanup_rbd_data;
-    }                                       /* RAII point */
+    if (idx)
+        *idx = i, i = NULL;
+    if (bm)
+        *bm = b, b = NULL;
+    if (holes)
+        *holes = h, h = NULL;
+free_footer:
+    snpy_data_idx_free(i);
+    blk_map_free(b);
+    blk_map_free(h);
+    return rc;
+}
+
+/*
+ * get_rstr_range() - image ranges to restore
+ *
+ * .rstr_range of the restore arg is an array of objects with off and len in
+ * bytes; only extents overlapping them are restored. The ranges come back
+ * sorted and merged in @range, which is left NULL for a full restore.
+ */
+static int get_rstr_range(struct blk_map **range) {
+    char rstr_arg[4096];
+    int rc = 0;
+    *range = NULL;
+    if ((rc = kv_get_sval("meta/rstr_arg", rstr_arg, sizeof rstr_arg, NULL)))
+        return rc == -ENOENT ? 0 : rc;  /* no restore arg, full restore */
+
+    int error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, rstr_arg)) {
+        rc = -SNPY_RBD_EENV;
+        goto close_js;
+    }
+    int n = json_count(js, ".rstr_range");
+    if (n <= 0)
+        goto close_js;
+
+    /* ranges may come in any order and overlap */
+    struct blk_map_sort *s = blk_map_sort_create("meta", n);
+    int i;
+    for (i = 0, rc = s ? 0 : -ENOMEM; !rc && i < n; i ++) {
+        double off = json_number(js, ".rstr_range[#].off", i);
+        double len = json_number(js, ".rstr_range[#].len", i);
+        if (off < 0 || len <= 0) {
+            rc = -SNPY_RBD_ECONF;
+            break;
+        }
+        rc = blk_map_sort_add(s, off, len);
+    }
+    if (!rc)
+        rc = blk_map_sort_map(s, range);
+    blk_map_sort_free(s);
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/*
+ * get_rstr_id() - id of the backup restored
+ *
+ * Records of a sealed data file are bound to the export that wrote them,
+ * .rstr_to_job_id of the restore arg.
+ */
+static int get_rstr_id(u64 *id) {
+    char rstr_arg[4096];
+    int rc;
+    if ((rc = kv_get_sval("meta/rstr_arg", rstr_arg, sizeof rstr_arg, NULL)))
+        return rc;
+
+    int error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    double n;
+    if (json_loadstring(js, rstr_arg) || 
+        (n = json_number(js, ".rstr_to_job_id")) <= 0)
+        rc = -SNPY_RBD_EENV;
+    else
+        *id = n;
+    json_close(js);
+    return rc;
+}
+
+/* create_image() - create the image to restore into
+ *
+ * Size comes from the data file header, layout from the export arg; a new
+ * image is thin, so restore only needs to write the extents.
+ */
+static int create_image(struct rbd_conf *conf, u64 size) {
+    int rc;
+    rados_t cluster;
+    rados_ioctx_t io_ctx;
+    if ((rc = rados_create(&cluster, conf->user))) 
+        return rc;
+    if ((rc = rados_conf_set(cluster, "mon_host", conf->mon_host)) ||
+        (rc = rados_conf_set(cluster, "key", conf->key)) ||
+        (rc = rados_connect(cluster))) 
+        goto shutdown_cluster;
+    if ((rc = rados_ioctx_create(cluster, conf->pool, &io_ctx))) 
+        goto shutdown_cluster;
+
+    rbd_image_options_t opts;
+    rbd_image_options_create(&opts);
+    if ((conf->obj_order && 
+         (rc = rbd_image_options_set_uint64(opts, RBD_IMAGE_OPTION_ORDER,
+                                            conf->obj_order))) ||
+        (conf->features &&
+         (rc = rbd_image_options_set_uint64(opts, RBD_IMAGE_OPTION_FEATURES,
+                                            conf->features))) ||
+        (conf->stripe_unit && conf->stripe_count &&
+         ((rc = rbd_image_options_set_uint64(opts, 
+                                             RBD_IMAGE_OPTION_STRIPE_UNIT,
+                                             conf->stripe_unit)) ||
+          (rc = rbd_image_options_set_uint64(opts, 
+                                             RBD_IMAGE_OPTION_STRIPE_COUNT,
+                                             conf->stripe_count)))))
+        goto destroy_opts;
+    rc = rbd_create4(io_ctx, conf->image, size, opts);
+    if (rc) 
+        snpy_logger(SNPY_LOG_ERR, "can not create image %s: %d.", 
+                    conf->image, rc);
+
+destroy_opts:
+    rbd_image_options_destroy(opts);
+    rados_ioctx_destroy(io_ctx);
+shutdown_cluster:
+    rados_shutdown(cluster);
+    return rc;
+}
+
+static int import_sink(struct snpy_frame_slot *slot, void *ctx) {
+    return rbd_aio_writer_mem(ctx, slot->rec.off, slot->rec.len, slot->out);
+}
+
+/* import_ckpt() - save progress once SNPY_CKPT_INTERVAL more bytes are in
+ *
+ * The records before data file offset @pos are decoded and on the image
+ * before the checkpoint is saved.
+ */
+static int import_ckpt(struct rbd_aio_writer *aw, struct snpy_codec_pipe *pipe,
+                       u64 pos, struct blk_map *bm, 
+                       struct snpy_ckpt *ckpt, u64 nbyte, u64 nrec) {
+    int rc;
+    if (!ckpt || nbyte - ckpt->nbyte < SNPY_CKPT_INTERVAL)
+        return 0;
+    if ((pipe && (rc = snpy_codec_pipe_flush(pipe))) ||
+        (rc = rbd_aio_writer_flush(aw)))
+        return rc;
+    ckpt->pos = pos;
+    ckpt->nbyte = nbyte;
+    ckpt->aux = nrec;
+    if ((rc = snpy_ckpt_write(ckpt, NULL, bm)))
+        return rc;
+    snpy_logger(SNPY_LOG_DEBUG, "checkpoint at %llu, %llu bytes in.",
+                (unsigned long long)pos, (unsigned long long)nbyte);
+    return 0;
+}
+
+/* 
+ * import_seal() - whether end record @rec read from @in is the one sealed
+ *                 after the @nrec records of backup @id
+ *
+ * What it vouches for of the footer is checked by read_footer(), a stream
+ * has read past the end record only: no record was dropped, moved or added.
+ */
+static int import_seal(struct snpy_ioeng *in, const struct snpy_crypt *crypt,
+                       u64 id, u64 nrec, const struct snpy_seg_rec *rec) {
+    u8 seal[SNPY_RBD_SEAL_SIZE];
+    u8 md[SNPY_SHA256_SIZE];
+    if (rec->zlen != sizeof seal || 
+        snpy_ioeng_read(in, seal, sizeof seal) != sizeof seal)
+        return -EIO;
+    if (snpy_codec_open(crypt, id, nrec, rec, seal, sizeof seal, md) != 
+        sizeof md) {
+        snpy_logger(SNPY_LOG_ERR, "records of data file not the %llu sealed "
+                    "by backup %llu.", (unsigned long long)nrec,
+                    (unsigned long long)id);
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+/* import_records() - restore the extents of a data file in record layout
+ *
+ * Records are consumed sequentially from @fd, which may be a fifo still fed
+ * by get, so the trailing blk_map is never needed; the extents restored are
+ * collected in @bm instead. Compressed records are decoded on @nthread
+ * workers and queued to the aio writer in file order. Record crcs are
+ * checked as records arrive, the first mismatch fails the import.
+ *
+ * With @ckpt progress is saved now and then; @fd and @bm then start where
+ * the checkpoint left off. @fd is read through an I/O engine of @io_flags.
+ * Records by reference are resolved from @store, sealed ones opened with
+ * @crypt as records of backup @id in file order; the sealed end record
+ * must come right after the last of them.
+ */
+
+static int import_records(struct rbd_aio_writer *aw, int fd, 
+                          const struct snpy_data_hdr *hdr, int nthread,
+                          int io_flags, struct snpy_chunk_store *store,
+                          const struct snpy_crypt *crypt, u64 id,
+                          struct snpy_ckpt *ckpt, 
+                          struct snpy_progress *progress,
+                          struct blk_map **bm) {
+    int rc = 0;
+    u64 nbyte = ckpt ? ckpt->nbyte : 0;
+    u64 nrec = ckpt ? ckpt->aux : 0;
+    u64 pos = ckpt ? ckpt->pos : snpy_data_hdr_size(hdr);
+    int codec = SNPY_DATA_CODEC(hdr->compress_type);
+    struct snpy_codec_pipe *pipe = NULL;
+    if ((!SNPY_CODEC_IS_RAW(codec) || store || crypt) &&
+        !(pipe = snpy_codec_pipe_create(codec, 0, SNPY_CODEC_DEC, nthread,
+                                        SNPY_DATA_CHUNK_SIZE, store, crypt,
+                                        import_sink, aw)))
+        return -errno;
+    int check_crc = !!(hdr->flags & SNPY_DATA_F_CRC32C);
+    if (pipe) {
+        pipe->crc = check_crc;
+        pipe->id = id;
+        pipe->seq = nrec;
+    }
+    struct snpy_ioeng *in = 
+        snpy_ioeng_open(fd, pos, io_flags|SNPY_IOENG_READ, 0, 0);
+    if (!in) {
+        rc = -ENOMEM;
+        goto destroy_pipe;
+    }
+
+    u64 zmax = pipe ? snpy_codec_bound(codec, SNPY_DATA_CHUNK_SIZE) : 0;
+    u32 xo = crypt ? SNPY_CRYPT_OVERHEAD : 0;       /* beyond the plain zlen */
+    struct snpy_stage stage;
+    snpy_stage_init(&stage, fd, pos, 1);
+    struct snpy_seg_rec rec;
+    while (snpy_ioeng_read(in, &rec, sizeof rec) == sizeof rec) {
+        if (!rec.len) {
+            if (pipe)
+                rc = snpy_codec_pipe_flush(pipe);
+            if (!rc && crypt)
+                rc = import_seal(in, crypt, id, nrec, &rec);
+            goto close_in;
+        }
+        if (rec.len > SNPY_DATA_CHUNK_SIZE || 
+            rec.off + rec.len > hdr->blk_dev_size ||
+            rec.zlen < xo ||
+            (rec.codec == SNPY_CODEC_NONE ? rec.zlen - xo != rec.len :
+             rec.codec == SNPY_CODEC_REF ? 
+             (!store || (rec.zlen - xo) % sizeof(struct snpy_chunk_ref) || 
+              rec.zlen - xo > zmax) :
+             (!pipe || rec.codec != codec || rec.zlen - xo > zmax))) {
+            rc = -EIO;
+            goto close_in;
+        }
+        if ((rc = blk_map_add(bm, rec.off, rec.len)))
+            goto close_in;
+        if (!pipe) {
+            u32 crc = 0;
+            if ((rc = rbd_aio_writer_read(aw, rec.off, rec.len, in, &crc)))
+                goto close_in;
+            if (check_crc && crc != rec.crc) {
+                rc = -EBADMSG;
+                goto close_in;
+            }
+        } else {
+            struct snpy_frame_slot *slot = snpy_codec_pipe_get(pipe);
+            if (!slot) {
+                rc = -pipe->status;
+                goto close_in;
+            }
+            slot->rec = rec;
+            if (snpy_ioeng_read(in, slot->z, rec.zlen) != rec.zlen) {
+                rc = -EIO;
+                goto close_in;
+            }
+            if ((rc = snpy_codec_pipe_put(pipe, slot)))
+                goto close_in;
+        }
+        nbyte += rec.len;
+        nrec ++;
+        pos += sizeof rec + rec.zlen;
+        snpy_stage_read(&stage, pos);
+        snpy_progress_update(progress, pos, nbyte, (*bm)->nuse);
+        if ((rc = import_ckpt(aw, pipe, pos, *bm, ckpt, nbyte, nrec)))
+            goto close_in;
+    }
+    rc = in->status ? -in->status : -EIO;   /* ended before the end record */
+
+close_in:
+    snpy_ioeng_close(in);
+destroy_pipe:
+    snpy_codec_pipe_destroy(pipe);
+    return rc;
+}
+
+/* import_extents() - restore the raw extents of a v1 data file
+ *
+ * Extents are located through the blk_map, which is returned in @bm; with
+ * @range only their parts inside it are written.
+ */
+static int import_extents(struct rbd_aio_writer *aw, int fd, 
+                          const struct snpy_data_hdr *hdr, 
+                          struct blk_map *range, 
+                          struct snpy_progress *progress,
+                          struct blk_map **bm) {
+    int rc;
+    if (lseek(fd, hdr->blk_map_offset, SEEK_SET) == -1)
+        return -errno;
+    if ((rc = blk_map_read(fd, bm)))
+        return rc;
+
+    u64 file_off = snpy_data_hdr_size(hdr);  /* extents follow the header */
+    struct snpy_stage stage = { .fd = -1 };  /* a range is read sparsely */
+    if (!range)
+        snpy_stage_init(&stage, fd, file_off, 1);
+    u64 i, j = 0;
+    for (i = 0; i < (*bm)->nuse; i ++) {
+        u64 off = (*bm)->segv[i].off;
+        u64 len = (*bm)->segv[i].len;
+        if (!range) {
+            rc = rbd_aio_writer_file(aw, off, len, fd, file_off);
+        } else {
+            while (j < range->nuse && 
+                   range->segv[j].off + range->segv[j].len <= off)
+                j ++;
+            u64 k;
+            for (k = j, rc = 0; 
+                 !rc && k < range->nuse && range->segv[k].off < off + len;
+                 k ++) {
+                u64 s = MAX(off, range->segv[k].off);
+                u64 e = MIN(off + len, 
+                            range->segv[k].off + range->segv[k].len);
+                rc = rbd_aio_writer_file(aw, s, e - s, fd, 
+                                         file_off + s - off);
+            }
+        }
+        if (rc)
+            return rc;
+        file_off += len;
+        snpy_stage_read(&stage, file_off);
+        snpy_progress_update(progress, file_off, 
+                             file_off - snpy_data_hdr_size(hdr), i + 1);
+        snpy_logger(SNPY_LOG_DEBUG, "done queuing segment: %llu.", 
+                    (unsigned long long)i);
+    }
+    return 0;
+}
+
+/* last record read, extents of a record are usually written in a row */
+struct rec_cache {
+    int src;
+    u64 rec;
+    char *raw;
+    char *z;
+    const char *store_dir;          /* of records by reference */
+    struct snpy_chunk_store *store; /* opened on the first of them */
+    char *c;                        /* a chunk of the store */
+    char *e;                        /* a sealed record */
+};
+
+static int rec_cache_init(struct rec_cache *cache, const char *store_dir) {
+    cache->src = -1;
+    cache->store_dir = store_dir;
+    cache->store = NULL;
+    cache->c = NULL;
+    cache->e = NULL;
+    cache->raw = malloc(SNPY_DATA_CHUNK_SIZE);
+    cache->z = malloc(MAX(snpy_codec_bound(SNPY_CODEC_LZ4, 
+                                           SNPY_DATA_CHUNK_SIZE),
+                          snpy_codec_bound(SNPY_CODEC_ZSTD, 
+                                           SNPY_DATA_CHUNK_SIZE)));
+    return cache->raw && cache->z ? 0 : -ENOMEM;
+}
+
+static void rec_cache_free(struct rec_cache *cache) {
+    free(cache->raw);
+    free(cache->z);
+    free(cache->c);
+    free(cache->e);
+    snpy_chunk_store_close(cache->store);
+}
 
+/* rec_cache_unref() - resolve the refs in cache->z into cache->raw */
+static int rec_cache_unref(struct rec_cache *cache, 
+                           const struct snpy_data_ent *ent, u32 zlen) {
+    if (!cache->store &&
+        !(cache->store = snpy_chunk_store_open(cache->store_dir, 0)))
+        return -errno;
+    if (!cache->c && !(cache->c = malloc(snpy_codec_chunk_bound())))
+        return -ENOMEM;
+    ssize_t n = snpy_codec_unref(cache->store, cache->z, zlen, cache->c,
+                                 snpy_codec_chunk_bound(), cache->raw, 
+                                 ent->len);
+    return n == ent->len ? 0 : n < 0 ? n : -EIO;
+}
+
+/* rec_cache_open() - read record @i of backup @id, sealed, into @dst */
+static int rec_cache_open(struct rec_cache *cache, int fd, u64 id, u64 i,
+                          const struct snpy_data_ent *ent, 
+                          const struct snpy_crypt *crypt, char *dst) {
+    size_t size = MAX(snpy_codec_bound(SNPY_CODEC_LZ4, SNPY_DATA_CHUNK_SIZE),
+                      snpy_codec_bound(SNPY_CODEC_ZSTD, SNPY_DATA_CHUNK_SIZE))
+        + SNPY_CRYPT_OVERHEAD;
+    if (!cache->e && !(cache->e = malloc(size)))
+        return -ENOMEM;
+    if (ent->zlen > size || 
+        pread(fd, cache->e, ent->zlen, ent->file_off) != ent->zlen)
+        return -EIO;
+    struct snpy_seg_rec rec = { 
+        .off = ent->off, .len = ent->len, .codec = ent->codec 
+    };
+    ssize_t n = snpy_codec_open(crypt, id, i, &rec, cache->e, ent->zlen, 
+                                dst);
+    return n == ent->zlen - SNPY_CRYPT_OVERHEAD ? 0 : n < 0 ? n : -EIO;
+}
+
+/* write_records() - write [@off, @off + @len) from the records of a v2 file
+ *
+ * The range must be covered by records; @src tells data files apart in
+ * @cache. Sealed records are opened with @crypt as records of backup @id.
+ */
+static int write_records(struct rbd_aio_writer *aw, int fd, int src,
+                         const struct snpy_data_hdr *hdr, 
+                         const struct snpy_data_idx *idx,
+                         const struct snpy_crypt *crypt, u64 id,
+                         u64 off, u64 len, struct rec_cache *cache) {
+    u64 zmax = snpy_codec_bound(SNPY_DATA_CODEC(hdr->compress_type),
+                                SNPY_DATA_CHUNK_SIZE);
+    u32 xo = crypt ? SNPY_CRYPT_OVERHEAD : 0;
+    u64 i;
+    for (i = snpy_data_idx_find(idx, off); len && i < idx->nuse; i ++) {
+        const struct snpy_data_ent *ent = &idx->entv[i];
+        if (off < ent->off || ent->len > SNPY_DATA_CHUNK_SIZE)
+            return -EIO;
+        if (cache->src != src || cache->rec != i) {
+            cache->src = -1;
+            int raw = ent->codec == SNPY_CODEC_NONE;
+            u32 zlen = ent->zlen - xo;
+            if (ent->zlen < xo || (raw ? zlen != ent->len : zlen > zmax))
+                return -EIO;
+            char *dst = raw ? cache->raw : cache->z;
+            int rc = 0;
+            if (crypt)
+                rc = rec_cache_open(cache, fd, id, i, ent, crypt, dst);
+            else if (pread(fd, dst, zlen, ent->file_off) != zlen)
+                rc = -EIO;
+            if (rc)
+                return rc;
+            if (ent->codec == SNPY_CODEC_REF)
+                rc = rec_cache_unref(cache, ent, zlen);
+            else if (!raw && 
+                     snpy_codec_decompress(ent->codec, cache->z, zlen, 
+                                           cache->raw, ent->len) != ent->len)
+                rc = -EIO;
+            if (rc)
+                return rc;
+            if ((hdr->flags & SNPY_DATA_F_CRC32C) && 
+                snpy_crc32c(0, cache->raw, ent->len) != ent->crc)
+                return -EBADMSG;
+            cache->src = src;
+            cache->rec = i;
+        }
+        u64 skip = off - ent->off;
+        u64 n = MIN(len, ent->len - skip);
+        int rc = rbd_aio_writer_mem(aw, off, n, cache->raw + skip);
+        if (rc)
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return len ? -EIO : 0;
+}
+
+/* import_ranges() - restore the parts of a v2 data file inside @range
+ *
+ * Only the records overlapping @range are read, located through the footer
+ * index; the data file may be sparse elsewhere. The blk_map is returned in
+ * @bm. Sealed records are opened with @crypt as records of backup @id.
+ */
+static int import_ranges(struct rbd_aio_writer *aw, int fd, 
+                         const struct snpy_data_hdr *hdr, 
+                         struct blk_map *range, const char *store_dir,
+                         const struct snpy_crypt *crypt, u64 id,
+                         struct blk_map **bm) {
+    int rc;
+    struct snpy_data_idx *idx = NULL;
+    struct rec_cache cache;
+    if ((rc = rec_cache_init(&cache, store_dir)) ||
+        (rc = read_footer(fd, hdr, crypt, id, &idx, bm, NULL)))
+        goto free_cache;
+
+    u64 i, j;
+    for (i = 0; i < range->nuse; i ++) {
+        u64 start = range->segv[i].off;
+        u64 end = start + range->segv[i].len;
+        for (j = snpy_data_idx_find(idx, start); 
+             j < idx->nuse && idx->entv[j].off < end; j ++) {
+            u64 s = MAX(start, idx->entv[j].off);
+            u64 e = MIN(end, idx->entv[j].off + idx->entv[j].len);
+            if ((rc = write_records(aw, fd, 0, hdr, idx, crypt, id, s, 
+                                    e - s, &cache)))
+                goto free_cache;
+        }
+    }
+
+free_cache:
+    snpy_data_idx_free(idx);
+    rec_cache_free(&cache);
+    return rc;
+}
+
+struct verify_arg {
+    rbd_image_t image;
+    char *buf;
+    size_t buf_size;
+    struct snpy_manifest_builder *mb;
+};
+
+static int diff_cb_verify(uint64_t off, size_t len, int exists, void *arg) {
+    struct verify_arg *p = arg;
+    if (!exists)
+        return 0;
+    while (len) {
+        size_t n = MIN(len, p->buf_size);
+        ssize_t nbyte = rbd_read(p->image, off, n, p->buf);
+        if (nbyte != n)
+            return nbyte < 0 ? nbyte : -EIO;
+        int rc = snpy_manifest_builder_feed(p->mb, off, p->buf, n);
+        if (rc)
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * verify_image() - check the restored image against a data file manifest
+ *
+ * The allocated extents of the image are read back into a manifest of
+ * their own; returns -EBADMSG if any block differs from the one @fd has.
+ * A data file without a manifest passes.
+ */
+static int verify_image(struct rbd_data *rbd, int fd, 
+                        const struct snpy_data_hdr *hdr) {
+    int rc;
+    if (!hdr->manifest_offset) {
+        snpy_logger(SNPY_LOG_WARN, "no manifest in data file to verify with.");
+        return 0;
+    }
+    struct snpy_manifest *m = NULL;
+    struct snpy_manifest *img = NULL;
+    if (lseek(fd, hdr->manifest_offset, SEEK_SET) == -1)
+        return -errno;
+    if ((rc = snpy_manifest_read(fd, &m)))
+        return rc;
+    struct verify_arg arg = {
+        .image = rbd->image,
+        .buf = malloc(rbd->info.obj_size),
+        .buf_size = rbd->info.obj_size,
+        .mb = snpy_manifest_builder_create(m->hdr.size, m->hdr.blk_size,
+                                           NULL, NULL)
+    };
+    if (!arg.buf || !arg.mb) {
+        rc = -ENOMEM;
+        goto free_arg;
+    }
+    if ((rc = rbd_diff_iterate(rbd->image, NULL, 0, m->hdr.size, 
+                               diff_cb_verify, &arg)) ||
+        (rc = snpy_manifest_builder_finish(arg.mb, &img)))
+        goto free_arg;
+    u64 ndiff = snpy_manifest_diff(m, img, NULL, NULL);
+    if (ndiff) {
+        snpy_logger(SNPY_LOG_ERR, "%llu blocks of the image differ from "
+                    "the backup.", (unsigned long long)ndiff);
+        rc = -EBADMSG;
+    } else {
+        snpy_logger(SNPY_LOG_INFO, "image verified against the manifest.");
+    }
+free_arg:
+    free(img);
+    snpy_manifest_builder_free(arg.mb);
+    free(arg.buf);
+    free(m);
+    return rc;
+}
+
+static int do_import(const char *arg, int arg_size) {
+    int rc;
+    struct rbd_data rbd;
+    struct rbd_conf conf;
+    time_t start, fin;
+    int status = 0;
+    char status_msg[1024] = "";
+    struct blk_map *bm = NULL;
+    struct blk_map *holes = NULL;
+    struct blk_map *range = NULL;
+    struct snpy_progress *progress = NULL;
+    struct snpy_chunk_store *store = NULL;
+    struct snpy_crypt crypt = { .alg = SNPY_CRYPT_NONE };
+    
+    start = time(NULL);
+    /* prepare rbd connection */
+    if ((rc = rbd_conf_init(&conf, arg)) || (rc = get_rstr_range(&range))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "configuration invalid: %d\n", status);
+        goto err_out;
+    }
+
+    /* data/data is a fifo when get streams to import */
     char data_fn[PATH_MAX]="data/data";
     int data_fd = open(data_fn, O_RDONLY, 0600);
     if (data_fd == -1) {
         status = errno;
         snprintf(status_msg, sizeof status_msg,
                  "error open data file: %d\n", status);
-        goto free_buf;
+        goto err_out;
     }                                       /* RAII point */
 
-    struct rbd_hdr hdr;
-    ssize_t nread = pread(data_fd, &hdr, sizeof hdr, 0);
-    if ( nread != sizeof hdr) {
-        status = errno;
+    struct snpy_data_hdr hdr;
+    struct stat data_st;
+    int is_fifo = !fstat(data_fd, &data_st) && S_ISFIFO(data_st.st_mode);
+    if ((rc = snpy_data_hdr_read(data_fd, &hdr)) ||
+        (!is_fifo && 
+         lseek(data_fd, snpy_data_hdr_size(&hdr), SEEK_SET) == -1 && 
+         (rc = -errno))) {
+        status = -rc;
         snprintf(status_msg, sizeof status_msg,
-                 "error read rbd header: %d\n", status);
+                 "error read data header: %d\n", status);
+        goto close_data_fd;
+    }
+    if ((rc = data_crypt(&conf, hdr.flags, &crypt))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error load key of sealed data file: %d\n", status);
+        goto close_data_fd;
+    }
+    const struct snpy_crypt *crypt_p = crypt.alg ? &crypt : NULL;
+    u64 id = 0;
+    if (crypt_p && (rc = get_rstr_id(&id))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error getting backup id of sealed data file: %d\n", status);
+        goto close_data_fd;
+    }
+    /* the hole map comes behind the records, a stream has read past it */
+    if (is_fifo && (hdr.version < 2 || range || 
+                    (hdr.flags & SNPY_DATA_F_HOLES))) {
+        status = EINVAL;
+        snprintf(status_msg, sizeof status_msg,
+                 "data file version/range/holes restore can not be "
+                 "streamed\n");
         goto close_data_fd;
     }
 
-    /* read out block map */
-    off_t offset = lseek(data_fd, hdr.blk_map_offset, SEEK_SET);
-    struct blk_map *bm;
-    if ((rc = blk_map_read(data_fd, &bm))) {
+    /* 
+     * a full restore of a v2 data file is checkpointed, a checkpoint of the
+     * same data file resumes an earlier run into the image it created
+     */
+    struct snpy_ckpt ckpt;
+    struct snpy_ckpt *ckpt_p = NULL;
+    int resume = 0;
+    if (hdr.version >= 2 && !range && !is_fifo) {
+        resume = !snpy_ckpt_read(&ckpt, NULL, &bm);
+        if (resume && (ckpt.id != hdr.idx_offset || 
+                       ckpt.size != hdr.blk_dev_size ||
+                       ckpt.pos < snpy_data_hdr_size(&hdr) ||
+                       lseek(data_fd, ckpt.pos, SEEK_SET) == -1)) {
+            snpy_logger(SNPY_LOG_INFO, "checkpoint of another data file dropped.");
+            blk_map_free(bm);
+            bm = NULL;
+            resume = 0;
+        }
+        if (!resume)
+            ckpt = (struct snpy_ckpt) {
+                .magic = SNPY_CKPT_MAGIC, 
+                .id = hdr.idx_offset, .size = hdr.blk_dev_size
+            };
+        else 
+            snpy_logger(SNPY_LOG_INFO, "resume import at %llu, %llu bytes in.",
+                        (unsigned long long)ckpt.pos, 
+                        (unsigned long long)ckpt.nbyte);
+        ckpt_p = &ckpt;
+    }
+
+    if (conf.rstr_mode == SNPY_RBD_RSTR_CREATE && !resume &&
+        (rc = create_image(&conf, hdr.blk_dev_size))) {
+        status = SNPY_RBD_ECREATE;
+        snprintf(status_msg, sizeof status_msg,
+                 "error creating image %s: %d\n", conf.image, rc);
+        goto close_data_fd;
+    }
+    if((rc = rbd_data_init(&conf, &rbd))) {
         status = -rc;
         snprintf(status_msg, sizeof status_msg,
-                 "error read block map: %d.", status);
+                 "error initiating rbd connection: %d\n", status);
         goto close_data_fd;
     }                                       /* RAII point */
-    /* TODO: sanity check for blk_map */
-    
-    /* EXPRIMENTAL: do discard */
-    /*
-    snpy_logger(SNPY_LOG_DEBUG, "starting discarding rbd volume: %d.");
-    rc = rbd_discard(rbd.image, 0, rbd.info.size);
-    snpy_logger(SNPY_LOG_DEBUG, "done discarding rbd volume: %d.", rc);
-    */
-    /* writing rbd image */
-    lseek(data_fd, sizeof hdr, SEEK_SET); /* seek to the beginning of data */
-    int i;
-    for (i = 0; i < bm->nuse; i ++) {
-        u64 off = bm->segv[i].off;
-        u64 len = bm->segv[i].len;
-        if ((rc = snpy_rbd_write_image(rbd.image, off, len, data_fd,
-                                       buf, buf_size)))
-        {
-            status = -rc;
-            snprintf(status_msg, sizeof status_msg,
-                     "error write image: %d.", status);
-            goto free_bm;
-        }
-        snpy_logger(SNPY_LOG_DEBUG, "done writing segment: %d.", i);
+    char job_id[32];
+    if (kv_get_sval("meta/id", job_id, sizeof job_id, NULL)) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error getting job id: %d\n", status);
+        goto cleanup_rbd_data;
+    }
+    if((rc = rbd_stat(rbd.image, &rbd.info, sizeof rbd.info))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error getting rbd stat: %d\n", status);
+        goto cleanup_rbd_data;
+    }
+    if (rbd.info.size < hdr.blk_dev_size) {
+        status = EINVAL;
+        snprintf(status_msg, sizeof status_msg,
+                 "image smaller than backup: %llu < %llu\n",
+                 (unsigned long long)rbd.info.size, 
+                 (unsigned long long)hdr.blk_dev_size);
+        goto cleanup_rbd_data;
     }
     
+    /* writes are queued with up to aio_depth in flight */
+    struct rbd_aio_writer *aw = 
+        rbd_aio_writer_create(rbd.image, conf.aio_depth, rbd.info.obj_size);
+    if (!aw || rbd_aio_writer_throttle(aw, conf.bw_limit, conf.iops_limit)) {
+        status = ENOMEM;
+        snprintf(status_msg, sizeof status_msg,
+                 "error allocating import buffer: %d\n", status);
+        goto destroy_aw;
+    }                                       /* RAII point */
+
+    /* writing rbd image, progress is the data file consumed */
+    progress = snpy_progress_open(is_fifo ? 0 : data_st.st_size);
+    if (hdr.version >= 2 && range) {
+        rc = import_ranges(aw, data_fd, &hdr, range, conf.dedup_store, 
+                           crypt_p, id, &bm);
+    } else if (hdr.version >= 2) {
+        if (!bm && !(bm = blk_map_alloc(0)))
+            rc = -ENOMEM;
+        else if ((hdr.flags & SNPY_DATA_F_DEDUP) &&
+                 !(store = snpy_chunk_store_open(conf.dedup_store, 0)))
+            rc = -errno;
+        else 
+            rc = import_records(aw, data_fd, &hdr, conf.nthread, 
+                                conf.io_flags, store, crypt_p, id, 
+                                ckpt_p, progress, &bm);
+    } else if (SNPY_CODEC_IS_RAW(hdr.compress_type)) {
+        rc = import_extents(aw, data_fd, &hdr, range, progress, &bm);
+    } else {
+        rc = -EINVAL;               /* compressed but not in record layout */
+    }
+    if (rc) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error restore data: %d.", status);
+        goto destroy_aw;
+    }
+
+    /* extents gone since the base snapshot of an incremental export */
+    if ((hdr.flags & SNPY_DATA_F_HOLES) && 
+        ((rc = read_footer(data_fd, &hdr, crypt_p, id, NULL, NULL, 
+                           &holes)) ||
+         (rc = zero_ranges(aw, holes, range)) ||
+         (rc = blk_map_union(&bm, holes)))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error zero holes: %d.", status);
+        goto destroy_aw;
+    }
+
+    /* unallocated and zero blocks are holes in the map */
+    if (conf.rstr_mode == SNPY_RBD_RSTR_DISCARD &&
+        (rc = discard_ranges(aw, bm, range, rbd.info.size))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error discard image: %d.", status);
+        goto destroy_aw;
+    }
+
+    if ((rc = rbd_aio_writer_flush(aw))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error write image: %d.", status);
+        goto destroy_aw;
+    }
+    snpy_ckpt_clear();
+    if (conf.verify && !range && !is_fifo && 
+        (rc = verify_image(&rbd, data_fd, &hdr))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error verify image: %d.", status);
+        goto destroy_aw;
+    }
+
+    /* let get finish writing the blk_map and tag behind the records */
+    char drain[4096];
+    while (is_fifo && snpy_read_full(data_fd, drain, sizeof drain) > 0)
+        ;
+
     fin = time(NULL);
     /* update arg: add import starting and finishing time */
     if ((rc = update_import_arg(arg, start, fin))) {
@@ -709,15 +2278,19 @@ static int do_import(const char *arg, int arg_size) {
         snprintf(status_msg, sizeof status_msg,
                  "update_import_arg: %d.", status);
     }
-free_bm:
-    blk_map_free(bm);
-close_data_fd:
-    close(data_fd);
-free_buf:
-    free(buf);
+destroy_aw:
+    snpy_chunk_store_close(store);
+    snpy_progress_close(progress);
+    rbd_aio_writer_destroy(aw);
 cleanup_rbd_data:
     rbd_data_destroy(&rbd);
+close_data_fd:
+    close(data_fd);
 err_out:
+    snpy_crypt_clear(&crypt);
+    blk_map_free(bm);
+    blk_map_free(holes);
+    blk_map_free(range);
     kv_put_ival("meta/status", status, NULL);
     kv_put_sval("meta/status_msg", status_msg, sizeof status_msg, NULL);
 
@@ -729,10 +2302,399 @@ static int do_diff(const char *arg, int arg_size) {
     return 0;
 }
 
-static int do_patch(const char *arg, int arg_size) {
+/*
+ * incremental chain restore
+ *
+ * meta/rstr_arg carries the backup chain in .rstr_chain, newest first and
+ * ending with the full backup; each member's data file is data/<id>.
+ * The extents of all members are overlaid in memory so that every block is
+ * written exactly once, from the newest member holding it.
+ */
+
+#define SNPY_RBD_CHAIN_MAX 64
+
+struct patch_src {
+    int id;
+    int fd;
+    struct snpy_data_hdr hdr;
+    struct blk_map *bm;
+    struct blk_map *holes;      /* extents it zeroes, NULL if none */
+    struct snpy_data_idx *idx;  /* record index, v2 only */
+    struct snpy_crypt crypt;    /* of sealed records, alg 0 if plain */
+};
+
+struct patch_ext {
+    u64 off;            /* image offset */
+    u64 len;
+    u64 soff;           /* offset in source raw extent stream, raw layout */
+    int src;            /* index of chain member, PATCH_SRC_ZERO */
+};
+
+#define PATCH_SRC_ZERO (-1) /* a hole of a member, zeroed */
+
+struct patch_extv {
+    u64 nalloc;
+    u64 nuse;
+    struct patch_ext *v;
+};
+
+static int get_rstr_chain(int *chain, int chain_size) {
+    char rstr_arg[4096];
+    int rc;
+    if ((rc = kv_get_sval("meta/rstr_arg", rstr_arg, sizeof rstr_arg, NULL)))
+        return rc;
+
+    int error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    int n = 0;
+    if ((rc = json_loadstring(js, rstr_arg))) {
+        n = -SNPY_RBD_EENV;
+        goto close_js;
+    }
+    n = json_count(js, ".rstr_chain");
+    if (n <= 0 || n > chain_size) {
+        n = -SNPY_RBD_EENV;
+        goto close_js;
+    }
+    int i;
+    for (i = 0; i < n; i ++) 
+        chain[i] = json_number(js, ".rstr_chain[#]", i);
+close_js:
+    json_close(js);
+    return n;
+}
+
+static int patch_extv_add(struct patch_extv *ev, 
+                          u64 off, u64 len, u64 soff, int src) {
+    if (ev->nuse == ev->nalloc) {
+        u64 n = ev->nalloc ? ev->nalloc << 1 : 4096;
+        void *p = realloc(ev->v, n * sizeof ev->v[0]);
+        if (!p) 
+            return -ENOMEM;
+        ev->v = p;
+        ev->nalloc = n;
+    }
+    ev->v[ev->nuse++] = (struct patch_ext) {
+        .off = off, .len = len, .soff = soff, .src = src
+    };
+    return 0;
+}
+
+static int patch_ext_cmp(const void *a, const void *b) {
+    const struct patch_ext *x = a, *y = b;
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+/* patch_uncovered() - add the parts of @bm not in @cov to @ev, from @src */
+static int patch_uncovered(struct patch_extv *ev, const struct blk_map *cov,
+                           const struct blk_map *bm, int src) {
+    int rc;
+    u64 soff = 0;
+    u64 j, k = 0;
+    for (j = 0; j < bm->nuse; j ++) {
+        u64 off = bm->segv[j].off;
+        u64 end = off + bm->segv[j].len;
+        u64 pos = off;
+        while (k < cov->nuse && cov->segv[k].off + cov->segv[k].len <= off)
+            k ++;
+        u64 m = k;
+        while (pos < end) {
+            if (m < cov->nuse && cov->segv[m].off < end) {
+                if (cov->segv[m].off > pos &&
+                    (rc = patch_extv_add(ev, pos, cov->segv[m].off - pos,
+                                         soff + pos - off, src)))
+                    return rc;
+                pos = MAX(pos, cov->segv[m].off + cov->segv[m].len);
+                m ++;
+            } else {
+                if ((rc = patch_extv_add(ev, pos, end - pos, 
+                                         soff + pos - off, src)))
+                    return rc;
+                pos = end;
+            }
+        }
+        soff += bm->segv[j].len;
+    }
+    return 0;
+}
+
+/* patch_overlay() - resolve which member provides each extent
+ *
+ * Members are visited newest first; only the parts of a member's segments
+ * not already covered by a newer member are emitted. The holes of a member
+ * cover older members as well, their uncovered parts are emitted as
+ * PATCH_SRC_ZERO extents.
+ */
+
+static int patch_overlay(struct patch_src *srcv, int nsrc, 
+                         struct patch_extv *ev) {
+    int rc;
+    struct blk_map *cov = blk_map_alloc(0);
+    if (!cov)
+        return -ENOMEM;
+
+    int i;
+    for (i = 0; i < nsrc; i ++) {
+        struct blk_map *holes = srcv[i].holes;
+        if ((rc = patch_uncovered(ev, cov, srcv[i].bm, i)) ||
+            (holes && (rc = patch_uncovered(ev, cov, holes, PATCH_SRC_ZERO))) ||
+            (rc = blk_map_union(&cov, srcv[i].bm)) ||
+            (holes && (rc = blk_map_union(&cov, holes))))
+            goto free_cov;
+    }
+    /* write in image order */
+    qsort(ev->v, ev->nuse, sizeof ev->v[0], patch_ext_cmp);
+    rc = 0;
+
+free_cov:
+    blk_map_free(cov);
+    return rc;
+}
+
+/* patch_clip() - keep the parts of the overlay inside @range */
+static int patch_clip(struct patch_extv *ev, struct blk_map *range) {
+    struct patch_extv out = {0, 0, NULL};
+    u64 i, j = 0, k;
+    int rc = 0;
+    for (i = 0; !rc && i < ev->nuse; i ++) {
+        struct patch_ext *e = &ev->v[i];
+        while (j < range->nuse && 
+               range->segv[j].off + range->segv[j].len <= e->off)
+            j ++;
+        for (k = j; 
+             !rc && k < range->nuse && range->segv[k].off < e->off + e->len;
+             k ++) {
+            u64 s = MAX(e->off, range->segv[k].off);
+            u64 end = MIN(e->off + e->len, 
+                          range->segv[k].off + range->segv[k].len);
+            rc = patch_extv_add(&out, s, end - s, e->soff + s - e->off, e->src);
+        }
+    }
+    if (rc) {
+        free(out.v);
+        return rc;
+    }
+    free(ev->v);
+    *ev = out;
     return 0;
 }
 
+static int do_patch(const char *arg, int arg_size) {
+    int rc;
+    struct rbd_data rbd;
+    struct rbd_conf conf;
+    time_t start, fin;
+    int status = 0;
+    char status_msg[1024] = "";
+    struct patch_src srcv[SNPY_RBD_CHAIN_MAX];
+    struct patch_extv ev = {0, 0, NULL};
+    int chain[SNPY_RBD_CHAIN_MAX];
+    int i, nsrc = 0;
+    struct blk_map *range = NULL;
+    
+    start = time(NULL);
+    /* prepare rbd connection */
+    if ((rc = rbd_conf_init(&conf, arg)) || (rc = get_rstr_range(&range))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "configuration invalid: %d\n", status);
+        goto err_out;
+    }
+    int nchain = get_rstr_chain(chain, ARRAY_SIZE(chain));
+    if (nchain < 0) {
+        status = -nchain;
+        snprintf(status_msg, sizeof status_msg,
+                 "error getting restore chain: %d\n", status);
+        goto err_out;
+    }
+    if (conf.rstr_mode == SNPY_RBD_RSTR_CREATE) {
+        char data_fn[64];
+        struct snpy_data_hdr hdr;
+        int fd;
+        snprintf(data_fn, sizeof data_fn, "data/%d", chain[0]);
+        if ((fd = open(data_fn, O_RDONLY)) == -1)
+            rc = -errno;
+        else {
+            rc = snpy_data_hdr_read(fd, &hdr);
+            close(fd);
+        }
+        if (rc || (rc = create_image(&conf, hdr.blk_dev_size))) {
+            status = SNPY_RBD_ECREATE;
+            snprintf(status_msg, sizeof status_msg,
+                     "error creating image %s: %d\n", conf.image, rc);
+            goto err_out;
+        }
+    }
+    if((rc = rbd_data_init(&conf, &rbd))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error initiating rbd connection: %d\n", status);
+        goto err_out;
+    }                                       /* RAII point */
+    if((rc = rbd_stat(rbd.image, &rbd.info, sizeof rbd.info))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error getting rbd stat: %d\n", status);
+        goto cleanup_rbd_data;
+    }
+
+    /* open chain members and load their block maps */
+    for (nsrc = 0; nsrc < nchain; nsrc ++) {
+        struct patch_src *src = &srcv[nsrc];
+        char data_fn[64];
+        src->id = chain[nsrc];
+        src->bm = NULL;
+        src->holes = NULL;
+        src->idx = NULL;
+        src->crypt.alg = SNPY_CRYPT_NONE;
+        snprintf(data_fn, sizeof data_fn, "data/%d", src->id);
+        if ((src->fd = open(data_fn, O_RDONLY)) == -1) {
+            status = errno;
+            snprintf(status_msg, sizeof status_msg,
+                     "error open data file %s: %d\n", data_fn, status);
+            goto close_srcv;
+        }
+        if (snpy_data_hdr_read(src->fd, &src->hdr)) {
+            status = EIO;
+            snprintf(status_msg, sizeof status_msg,
+                     "error read header of %s\n", data_fn);
+            close(src->fd);
+            goto close_srcv;
+        }
+        if (src->hdr.version < 2 && 
+            !SNPY_CODEC_IS_RAW(src->hdr.compress_type))
+            rc = -EINVAL;           /* compressed but not v2 */
+        else if (!(rc = data_crypt(&conf, src->hdr.flags, &src->crypt)))
+            rc = read_footer(src->fd, &src->hdr, 
+                             src->crypt.alg ? &src->crypt : NULL, src->id,
+                             &src->idx, &src->bm, &src->holes);
+        if (rc) {
+            status = -rc;
+            snprintf(status_msg, sizeof status_msg,
+                     "error read footer of %s: %d\n", data_fn, status);
+            nsrc ++;
+            goto close_srcv;
+        }
+    }
+
+    if (rbd.info.size < srcv[0].hdr.blk_dev_size) {
+        status = EINVAL;
+        snprintf(status_msg, sizeof status_msg,
+                 "image smaller than backup: %llu < %llu\n",
+                 (unsigned long long)rbd.info.size, 
+                 (unsigned long long)srcv[0].hdr.blk_dev_size);
+        goto close_srcv;
+    }
+
+    if ((rc = patch_overlay(srcv, nsrc, &ev))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error building extent overlay: %d\n", status);
+        goto free_ev;
+    }
+    if (range && (rc = patch_clip(&ev, range))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error clipping extent overlay: %d\n", status);
+        goto free_ev;
+    }
+    snpy_logger(SNPY_LOG_INFO, "chain of %d backups resolved to %llu extents.",
+                nsrc, (unsigned long long)ev.nuse);
+
+    struct rec_cache cache;
+    int cache_rc = rec_cache_init(&cache, conf.dedup_store);
+    struct rbd_aio_writer *aw = 
+        rbd_aio_writer_create(rbd.image, conf.aio_depth, rbd.info.obj_size);
+    if (cache_rc || !aw || 
+        rbd_aio_writer_throttle(aw, conf.bw_limit, conf.iops_limit)) {
+        status = ENOMEM;
+        snprintf(status_msg, sizeof status_msg,
+                 "error allocating import buffer: %d\n", status);
+        goto free_buf;
+    }                                       /* RAII point */
+
+    u64 j;
+    if (conf.rstr_mode == SNPY_RBD_RSTR_DISCARD) {
+        struct blk_map *bm = blk_map_alloc(ev.nuse);
+        for (j = 0, rc = bm ? 0 : -ENOMEM; !rc && j < ev.nuse; j ++) 
+            rc = blk_map_add(&bm, ev.v[j].off, ev.v[j].len);
+        if (!rc)
+            rc = discard_ranges(aw, bm, range, rbd.info.size);
+        blk_map_free(bm);
+        if (rc) {
+            status = -rc;
+            snprintf(status_msg, sizeof status_msg,
+                     "error discard image: %d.", status);
+            goto free_buf;
+        }
+    }
+
+    for (j = 0; j < ev.nuse; j ++) {
+        struct patch_ext *e = &ev.v[j];
+        struct patch_src *src = e->src == PATCH_SRC_ZERO ? NULL : &srcv[e->src];
+        if (!src)
+            rc = rbd_aio_writer_zero(aw, e->off, e->len);
+        else if (src->idx)
+            rc = write_records(aw, src->fd, e->src, &src->hdr, src->idx,
+                               src->crypt.alg ? &src->crypt : NULL, 
+                               src->id, e->off, e->len, &cache);
+        else 
+            rc = rbd_aio_writer_file(aw, e->off, e->len, src->fd, 
+                                     snpy_data_hdr_size(&src->hdr) + e->soff);
+        if (rc) {
+            status = -rc;
+            snprintf(status_msg, sizeof status_msg,
+                     "error write image: %d.", status);
+            goto free_buf;
+        }
+    }
+    if ((rc = rbd_aio_writer_flush(aw))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error write image: %d.", status);
+        goto free_buf;
+    }
+    /* the newest backup of the chain has the manifest of the whole image */
+    if (conf.verify && !range && 
+        (rc = verify_image(&rbd, srcv[0].fd, &srcv[0].hdr))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error verify image: %d.", status);
+        goto free_buf;
+    }
+
+    fin = time(NULL);
+    if ((rc = update_import_arg(arg, start, fin))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "update_import_arg: %d.", status);
+    }
+
+free_buf:
+    rbd_aio_writer_destroy(aw);
+    rec_cache_free(&cache);
+free_ev:
+    free(ev.v);
+close_srcv:
+    for (i = 0; i < nsrc; i ++) {
+        snpy_data_idx_free(srcv[i].idx);
+        blk_map_free(srcv[i].bm);
+        blk_map_free(srcv[i].holes);
+        snpy_crypt_clear(&srcv[i].crypt);
+        close(srcv[i].fd);
+    }
+cleanup_rbd_data:
+    rbd_data_destroy(&rbd);
+err_out:
+    blk_map_free(range);
+    kv_put_ival("meta/status", status, NULL);
+    kv_put_sval("meta/status_msg", status_msg, sizeof status_msg, NULL);
+
+    return -status;
+}
+
 int rbd_data_init(struct rbd_conf *conf, struct rbd_data *rbd) {
     int rc;
     if (!conf ||  !rbd)
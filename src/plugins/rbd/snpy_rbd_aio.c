@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "snpy_rbd_aio.h"
+#include "snpy_crc32c.h"
+
+#define RBD_AIO_DISCARD_NOBJ 64
+
+struct rbd_aio_writer *rbd_aio_writer_create(rbd_image_t image, int depth,
+                                             u64 obj_size) {
+    if (depth <= 0)
+        depth = 1;
+    struct rbd_aio_writer *w = 
+        calloc(1, sizeof *w + depth * sizeof w->slotv[0]);
+    if (!w)
+        return NULL;
+    w->image = image;
+    w->obj_size = obj_size ? obj_size : (4 << 20);
+    w->buf_size = w->obj_size;
+    w->depth = depth;
+
+    int i;
+    for (i = 0; i < depth; i ++) {
+        if (!(w->slotv[i].buf = malloc(w->buf_size))) {
+            rbd_aio_writer_destroy(w);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return w;
+}
+
+/* wait_tail() - complete the oldest request in flight */
+static int wait_tail(struct rbd_aio_writer *w) {
+    struct rbd_aio_slot *slot = &w->slotv[w->tail % w->depth];
+    rbd_aio_wait_for_complete(slot->c);
+    ssize_t rc = rbd_aio_get_return_value(slot->c);
+    rbd_aio_release(slot->c);
+    w->tail ++;
+    if (rc < 0 && !w->status)
+        w->status = -rc;
+    return -w->status;
+}
+
+/* get_slot() - next free slot, waiting for the oldest if the window is full */
+static struct rbd_aio_slot *get_slot(struct rbd_aio_writer *w) {
+    if (w->head - w->tail == w->depth)
+        wait_tail(w);
+    if (w->status)
+        return NULL;
+    return &w->slotv[w->head % w->depth];
+}
+
+static int submit_slot(struct rbd_aio_writer *w, struct rbd_aio_slot *slot,
+                       u64 off, u64 len) {
+    int rc;
+    slot->off = off;
+    slot->len = len;
+    snpy_tb_take(w->tb, len, 1);
+    if ((rc = rbd_aio_create_completion(NULL, NULL, &slot->c)))
+        return rc;
+    if ((rc = rbd_aio_write(w->image, off, len, slot->buf, slot->c))) {
+        rbd_aio_release(slot->c);
+        return rc;
+    }
+    w->head ++;
+    return 0;
+}
+
+/* chunk() - bytes from @off up to the next object boundary, at most @len */
+static u64 chunk(struct rbd_aio_writer *w, u64 off, u64 len) {
+    return MIN(len, w->obj_size - off % w->obj_size);
+}
+
+/* rbd_aio_writer_file() - write @len bytes at @file_off of @fd to @off */
+int rbd_aio_writer_file(struct rbd_aio_writer *w, u64 off, u64 len,
+                        int fd, u64 file_off) {
+    int rc;
+    while (len) {
+        struct rbd_aio_slot *slot = get_slot(w);
+        if (!slot)
+            return -w->status;
+        u64 n = chunk(w, off, len);
+        ssize_t nread = pread(fd, slot->buf, n, file_off);
+        if (nread != n) 
+            return nread < 0 ? -errno : -EIO;
+        if ((rc = submit_slot(w, slot, off, n)))
+            return rc;
+        off += n;
+        file_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* rbd_aio_writer_read() - write the next @len bytes read from @in to @off
+ *
+ * Unlike rbd_aio_writer_file() this consumes the data file sequentially, so
+ * it works on a fifo. The crc32c of the bytes read is continued in @crc if
+ * given.
+ */
+int rbd_aio_writer_read(struct rbd_aio_writer *w, u64 off, u64 len, 
+                        struct snpy_ioeng *in, u32 *crc) {
+    int rc;
+    while (len) {
+        struct rbd_aio_slot *slot = get_slot(w);
+        if (!slot)
+            return -w->status;
+        u64 n = chunk(w, off, len);
+        ssize_t nread = snpy_ioeng_read(in, slot->buf, n);
+        if (nread != n) 
+            return nread < 0 ? nread : -EIO;
+        if (crc)
+            *crc = snpy_crc32c(*crc, slot->buf, n);
+        if ((rc = submit_slot(w, slot, off, n)))
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* rbd_aio_writer_mem() - write @len bytes of @data to @off */
+int rbd_aio_writer_mem(struct rbd_aio_writer *w, u64 off, u64 len,
+                       const char *data) {
+    int rc;
+    while (len) {
+        struct rbd_aio_slot *slot = get_slot(w);
+        if (!slot)
+            return -w->status;
+        u64 n = chunk(w, off, len);
+        memcpy(slot->buf, data, n);
+        if ((rc = submit_slot(w, slot, off, n)))
+            return rc;
+        off += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* rbd_aio_writer_discard() - discard @len bytes at @off
+ *
+ * The partial objects at either end are discarded on their own; the whole
+ * objects between them go in object aligned requests of up to
+ * RBD_AIO_DISCARD_NOBJ objects, which librbd removes instead of zeroing.
+ */
+int rbd_aio_writer_discard(struct rbd_aio_writer *w, u64 off, u64 len) {
+    int rc;
+    while (len) {
+        struct rbd_aio_slot *slot = get_slot(w);
+        if (!slot)
+            return -w->status;
+        u64 n;
+        if (off % w->obj_size || len < w->obj_size)
+            n = chunk(w, off, len);
+        else 
+            n = MIN(len - len % w->obj_size, 
+                    w->obj_size * RBD_AIO_DISCARD_NOBJ);
+        slot->off = off;
+        slot->len = n;
+        snpy_tb_take(w->tb, 0, 1);
+        if ((rc = rbd_aio_create_completion(NULL, NULL, &slot->c)))
+            return rc;
+        if ((rc = rbd_aio_discard(w->image, off, n, slot->c))) {
+            rbd_aio_release(slot->c);
+            return rc;
+        }
+        w->head ++;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* rbd_aio_writer_zero() - make @len bytes at @off read back as zeros
+ *
+ * The whole objects are discarded. The partial objects at either end are
+ * written with zeros, a partial discard may leave their bytes in place.
+ */
+int rbd_aio_writer_zero(struct rbd_aio_writer *w, u64 off, u64 len) {
+    int rc;
+    while (len) {
+        u64 n;
+        if (off % w->obj_size || len < w->obj_size) {
+            struct rbd_aio_slot *slot = get_slot(w);
+            if (!slot)
+                return -w->status;
+            n = chunk(w, off, len);
+            memset(slot->buf, 0, n);
+            rc = submit_slot(w, slot, off, n);
+        } else {
+            n = len - len % w->obj_size;
+            rc = rbd_aio_writer_discard(w, off, n);
+        }
+        if (rc)
+            return rc;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* rbd_aio_writer_throttle() - limit to @bw bytes and @iops requests a second
+ *
+ * 0 is no limit of its own, xcore may still hand the job a share of the
+ * shared limits.
+ */
+int rbd_aio_writer_throttle(struct rbd_aio_writer *w, u64 bw, u64 iops) {
+    snpy_tb_destroy(w->tb);
+    if (!(w->tb = snpy_tb_create(bw, iops)))
+        return -ENOMEM;
+    return 0;
+}
+
+/* rbd_aio_writer_flush() - wait for all requests, then flush the image */
+int rbd_aio_writer_flush(struct rbd_aio_writer *w) {
+    int rc;
+    while (w->tail != w->head)
+        wait_tail(w);
+    if (w->status)
+        return -w->status;
+    if ((rc = rbd_flush(w->image)) < 0)
+        w->status = -rc;
+    return -w->status;
+}
+
+void rbd_aio_writer_destroy(struct rbd_aio_writer *w) {
+    if (!w)
+        return;
+    while (w->tail != w->head)
+        wait_tail(w);
+    int i;
+    for (i = 0; i < w->depth; i ++)
+        free(w->slotv[i].buf);
+    snpy_tb_destroy(w->tb);
+    free(w);
+}
@@ -0,0 +1,54 @@
+#ifndef SNPY_RBD_AIO_H
+#define SNPY_RBD_AIO_H
+
+#include <rbd/librbd.h>
+
+#include "snpy_util.h"
+#include "snpy_tb.h"
+#include "snpy_ioeng.h"
+
+/*
+ * rbd_aio_writer - bounded window of rbd_aio_write()s
+ *
+ * Each slot owns a buffer of buf_size bytes. Writes are split at rados
+ * object boundaries so that the requests in flight hit different objects.
+ * Discards share the window but not the buffers.
+ * When all slots are busy the oldest request is waited for; the first
+ * failed request is remembered and fails every later call. A throttled
+ * writer pays for each request before submitting it.
+ */
+
+struct rbd_aio_slot {
+    rbd_completion_t c;
+    char *buf;
+    u64 off;
+    u64 len;
+};
+
+struct rbd_aio_writer {
+    rbd_image_t image;
+    u64 obj_size;
+    size_t buf_size;
+    int status;
+    u64 head;
+    u64 tail;
+    int depth;
+    struct snpy_tb *tb;             /* NULL if not throttled */
+    struct rbd_aio_slot slotv[0];
+};
+
+struct rbd_aio_writer *rbd_aio_writer_create(rbd_image_t image, int depth,
+                                             u64 obj_size);
+int rbd_aio_writer_file(struct rbd_aio_writer *w, u64 off, u64 len,
+                        int fd, u64 file_off);
+int rbd_aio_writer_read(struct rbd_aio_writer *w, u64 off, u64 len, 
+                        struct snpy_ioeng *in, u32 *crc);
+int rbd_aio_writer_mem(struct rbd_aio_writer *w, u64 off, u64 len,
+                       const char *data);
+int rbd_aio_writer_discard(struct rbd_aio_writer *w, u64 off, u64 len);
+int rbd_aio_writer_zero(struct rbd_aio_writer *w, u64 off, u64 len);
+int rbd_aio_writer_throttle(struct rbd_aio_writer *w, u64 bw, u64 iops);
+int rbd_aio_writer_flush(struct rbd_aio_writer *w);
+void rbd_aio_writer_destroy(struct rbd_aio_writer *w);
+
+#endif
@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
@@ -36,12 +38,49 @@
 
 
 #include "snpy_util.h"
+#include "snpy_log.h"
+#include "snpy_data.h"
+#include "snpy_data_tag.h"
+#include "snpy_blk_map.h"
+#include "snpy_crc32c.h"
+#include "snpy_ioeng.h"
+#include "snpy_stage.h"
+#include "snpy_progress.h"
+#include "snpy_tb.h"
 #include "json.h"
 
+/*
+ * snull source plugin: a synthetic load generator
+ *
+ * snap and export act on an image that is not there. export produces
+ * .sp_param.size bytes of extents spread over an image of vol_size, so
+ * that a share sparsity of it is holes, and writes them as a real v2 data
+ * file: crc32c records cut at chunks, the footer index, the blk_map and
+ * the tag, streamed through the fifo if the put streams. import reads a
+ * data file through, checking every record against its crc32c, and
+ * writes nothing. Scheduler, staging I/O and target plugins can so be
+ * driven at scale without a cluster.
+ *
+ * The data of an image offset depends on the seed only, so exports of
+ * one seed deduplicate against each other. Of each SNPY_SNULL_BLK block a
+ * share compress is a repeated pattern, the rest random: the records are
+ * stored raw, the share is what a compressing target or transport saves.
+ *
+ * .sp_param: vol_size, size (bytes; either follows from the other and
+ * sparsity), sparsity (0 to 1), ext_size (mean extent bytes), compress
+ * (0 to 1), seed (default the job id), bw_limit (MB/s), iops_limit,
+ * latency (ms, slept per extent, record and snapshot), fail_prob (of a
+ * job failing with EIO at a random point) and io_engine.
+ */
 
 /* define error  type */
 #define SNPY_NULL_EBASE 0x10000
 
+#define SNPY_SNULL_VOL_SIZE (1ULL << 30)
+#define SNPY_SNULL_EXT_SIZE (4 << 20)
+#define SNPY_SNULL_BLK 4096
+#define SNPY_SNULL_CODEC_NONE 1     /* record codec of raw bytes */
+
 /* error number to string  */
 const char* snpy_snull_strerror(int errnum) {
 
@@ -49,7 +88,18 @@ const char* snpy_snull_strerror(int errnum) {
 
 }
 
-FILE *log_file;
+struct snull_conf {
+    u64 vol_size;
+    u64 size;               /* extent bytes */
+    u64 ext_size;
+    double compress;
+    u64 seed;
+    u64 bw_limit;
+    u64 iops_limit;
+    int latency;            /* ms */
+    u64 fail_at;            /* fail once this many bytes are moved, or -1 */
+    int io_flags;
+};
 
 
 static int do_snap(const char *arg, int arg_size);
@@ -59,20 +109,186 @@ static int do_diff(const char *arg, int arg_size);
 static int do_patch(const char *arg, int arg_size);
 
 
+/* mix() - splitmix64, the generator of extents and data */
+static u64 mix(u64 *x) {
+    u64 z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* rnd() - uniform in [0, 1) */
+static double rnd(u64 *x) {
+    return (mix(x) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int snull_conf_init(struct snull_conf *conf, const char *arg) {
+    int rc = 0, error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    memset(conf, 0, sizeof *conf);
+    double sparsity = json_number(js, ".sp_param.sparsity");
+    double vol_size = json_number(js, ".sp_param.vol_size");
+    double size = json_number(js, ".sp_param.size");
+    if (sparsity < 0 || sparsity >= 1 || vol_size < 0 || size < 0) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    if (vol_size <= 0)
+        vol_size = size > 0 ? size / (1 - sparsity) : SNPY_SNULL_VOL_SIZE;
+    if (size <= 0 || size > vol_size)
+        size = vol_size * (1 - sparsity);
+    /* extents are of whole blocks */
+    conf->vol_size = ((u64)vol_size + SNPY_SNULL_BLK - 1) / 
+        SNPY_SNULL_BLK * SNPY_SNULL_BLK;
+    conf->size = MIN((u64)size / SNPY_SNULL_BLK * SNPY_SNULL_BLK, 
+                     conf->vol_size);
+    double ext_size = json_number(js, ".sp_param.ext_size");
+    conf->ext_size = ext_size > 0 ? ext_size : SNPY_SNULL_EXT_SIZE;
+    conf->ext_size = MAX(conf->ext_size / SNPY_SNULL_BLK * SNPY_SNULL_BLK, 
+                         SNPY_SNULL_BLK);
+    conf->compress = json_number(js, ".sp_param.compress");
+    conf->compress = MAX(0, MIN(conf->compress, 1));
+    int id = 0;
+    if (json_exists(js, ".sp_param.seed"))
+        conf->seed = json_number(js, ".sp_param.seed");
+    else if (!kv_get_ival("meta/id", &id, NULL))
+        conf->seed = id;
+    /* MB/s, on top of the share of the shared limits xcore hands out */
+    conf->bw_limit = json_number(js, ".sp_param.bw_limit") * (1 << 20);
+    conf->iops_limit = json_number(js, ".sp_param.iops_limit");
+    conf->latency = MAX(0, json_number(js, ".sp_param.latency"));
+    conf->io_flags = strcmp(json_string(js, ".sp_param.io_engine"), "sync") ?
+        0 : SNPY_IOENG_SYNC;
+
+    /* whether and where this run fails differs from run to run */
+    u64 x = time(NULL) ^ ((u64)getpid() << 32);
+    conf->fail_at = (u64)-1;
+    if (rnd(&x) < json_number(js, ".sp_param.fail_prob"))
+        conf->fail_at = rnd(&x) * conf->size;
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/* snull_wait() - the injected latency of an operation */
+static void snull_wait(const struct snull_conf *conf) {
+    if (conf->latency)
+        usleep(conf->latency * 1000);
+}
+
+/* snull_fail() - whether the injected failure is due after @nbyte bytes */
+static int snull_fail(const struct snull_conf *conf, u64 nbyte) {
+    if (nbyte < conf->fail_at)
+        return 0;
+    snpy_logger(SNPY_LOG_ERR, "injected failure at %llu bytes.", 
+                (unsigned long long)nbyte);
+    return -EIO;
+}
+
+/*
+ * gen_data() - the data of the image at @off, @len bytes, whole blocks
+ *
+ * A block is random for its first (1 - compress) share, the rest repeats
+ * a pattern; both follow from the seed and the block offset only.
+ */
+static void gen_data(const struct snull_conf *conf, u64 off, char *buf, 
+                     u64 len) {
+    static const char pat[] = "snappy synthetic data ";
+    u64 nrnd = (u64)((1 - conf->compress) * SNPY_SNULL_BLK) & ~7ULL;
+    u64 pos, i;
+    for (pos = 0; pos < len; pos += SNPY_SNULL_BLK) {
+        u64 x = conf->seed ^ ((off + pos) * 0xd6e8feb86659fd93ULL);
+        char *b = buf + pos;
+        for (i = 0; i < nrnd; i += 8) {
+            u64 r = mix(&x);
+            memcpy(b + i, &r, 8);
+        }
+        for (; i < SNPY_SNULL_BLK; i ++)
+            b[i] = pat[i % (sizeof pat - 1)];
+    }
+}
+
+/*
+ * next_ext() - the extent after @off, @left extent bytes still to place
+ *
+ * Extent lengths vary around ext_size and the holes before them around
+ * the average that spreads the extents over the whole image.
+ */
+static void next_ext(const struct snull_conf *conf, u64 *x, u64 off, 
+                     u64 left, u64 *ext_off, u64 *ext_len) {
+    u64 nblk = conf->ext_size / SNPY_SNULL_BLK;
+    u64 len = (nblk / 2 + mix(x) % (nblk + 1)) * SNPY_SNULL_BLK;
+    len = MIN(MAX(len, SNPY_SNULL_BLK), left);
+    u64 hole = conf->vol_size - off - left;     /* holes still to place */
+    u64 next = (left + conf->ext_size - 1) / conf->ext_size;
+    u64 gap = 2 * (hole / SNPY_SNULL_BLK) / MAX(next, 1);
+    gap = mix(x) % (gap + 1);
+    gap = MIN(gap, hole / SNPY_SNULL_BLK) * SNPY_SNULL_BLK;
+    *ext_off = off + gap;
+    *ext_len = len;
+}
+
 static int do_snap(const char *arg, int arg_size) {
     int rc;
     char str_buf[64];
     int status = 0;
     const char* status_msg = NULL;
+    struct snull_conf conf;
 
-    time_t snap_start = time(NULL);
-
-    /*
-     * do actually snapshot
-     */
+    if ((rc = snull_conf_init(&conf, arg))) {
+        status = -rc;
+        goto err_out;
+    }
+    char job_id[32];
+    if ((rc = kv_get_sval("meta/id", job_id, sizeof job_id, NULL))) {
+        status = -rc;
+        goto err_out;
+    }
 
+    time_t snap_start = time(NULL);
+    snull_wait(&conf);
+    if ((rc = snull_fail(&conf, 0))) {
+        status = -rc;
+        goto err_out;
+    }
     time_t snap_fin = time(NULL);
+    char snap_name[64];
+    snprintf(snap_name, sizeof snap_name, "snpy-%s", job_id);
 
+    /* what rbd reports of a snapshot */
+    int error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js) {
+        status = error;
+        goto err_out;
+    }                                                   /* allocation point: js */
+    if ((rc = json_loadstring(js, arg)) ||
+        (rc = json_setnumber(js, conf.vol_size, ".sp_param.vol_size")) ||
+        (rc = json_setnumber(js, conf.size, ".sp_param.alloc_size")) ||
+        (rc = json_setnumber(js, snap_start, ".sp_param.snap_start")) ||
+        (rc = json_setnumber(js, snap_fin, ".sp_param.snap_fin")) ||
+        (rc = json_setstring(js, snap_name, ".sp_param.snap_name"))) {
+        status = EINVAL;
+        goto close_js;
+    } 
+    FILE *arg_fp = fopen("meta/arg.out", "w");
+    if (!arg_fp) {
+        status = errno;
+        goto close_js;
+    }                                                   /* ALLOCATION POINT: arg_fp */
+    if (json_printfile(js, arg_fp, 0))
+        status = EIO;
+    fclose(arg_fp);
+
+close_js:
+    json_close(js);
+err_out:
     sprintf(str_buf, "%d", status);
     rc = kv_put_sval("meta/status", str_buf, sizeof str_buf, NULL); 
     status_msg = snpy_snull_strerror(status);
@@ -176,6 +392,62 @@ err_out:
     return status;
 }
 
+struct export_arg {
+    const struct snull_conf *conf;
+    struct snpy_ioeng *io;
+    struct snpy_stage stage;
+    struct snpy_data_idx *idx;
+    struct blk_map *bm;
+    struct snpy_tb *tb;
+    struct snpy_progress *progress;
+    char *buf;
+    u64 nbyte;              /* record bytes written */
+    u64 nraw;               /* extent bytes */
+    u32 crc;                /* crc32c of all records */
+};
+
+/* export_rec() - append a record and its bytes to the data file */
+static int export_rec(struct export_arg *p, const struct snpy_seg_rec *rec,
+                      const char *data) {
+    int rc;
+    u64 file_off = sizeof(struct snpy_data_hdr) + p->nbyte + sizeof *rec;
+    if ((rc = snpy_ioeng_write(p->io, rec, sizeof *rec)) ||
+        (rc = snpy_ioeng_write(p->io, data, rec->zlen)))
+        return rc;
+    p->nbyte += sizeof *rec + rec->zlen;
+    snpy_stage_write(&p->stage, sizeof(struct snpy_data_hdr) + p->nbyte);
+    if (!rec->len)
+        return 0;
+    p->crc = snpy_crc32c_combine(p->crc, rec->crc, rec->len);
+    return snpy_data_idx_add(&p->idx, rec, file_off);
+}
+
+/* export_ext() - generate an extent into records cut at chunks */
+static int export_ext(struct export_arg *p, u64 off, u64 len, u32 chunk) {
+    int rc;
+    const struct snull_conf *conf = p->conf;
+    if ((rc = blk_map_add(&p->bm, off, len)))
+        return rc;
+    snull_wait(conf);
+    while (len) {
+        u32 n = MIN(len, chunk - off % chunk);
+        snpy_tb_take(p->tb, n, 1);
+        gen_data(conf, off, p->buf, n);
+        struct snpy_seg_rec rec = {
+            .off = off, .len = n, .zlen = n, .codec = SNPY_SNULL_CODEC_NONE,
+            .crc = snpy_crc32c(0, p->buf, n)
+        };
+        if ((rc = export_rec(p, &rec, p->buf)) ||
+            (rc = snull_fail(conf, p->nraw + n)))
+            return rc;
+        p->nraw += n;
+        off += n;
+        len -= n;
+        snpy_progress_update(p->progress, off, p->nraw, p->bm->nuse);
+    }
+    return 0;
+}
+
 static int do_export(const char *arg, int arg_size) {
 
     int rc;
@@ -183,16 +455,147 @@ static int do_export(const char *arg, int arg_size) {
     int status = 0;
     int status_msg[1024];
     char str_buf[64];
+    struct snull_conf conf;
     
 
     /* prepare rbd image handle */
     start = time(NULL);
+    if ((rc = snull_conf_init(&conf, arg))) {
+        status = EINVAL;
+        goto err_out;
+    }
+    char job_id[32];
+    if ((rc = kv_get_sval("meta/id", job_id, sizeof job_id, NULL))) {
+        snpy_logger(SNPY_LOG_ERR, "missing meta/id file: %d", rc);
+        status = -rc;
+        goto err_out;
+    }
+    snpy_logger(SNPY_LOG_INFO, "generating %llu bytes over %llu, seed %llu.",
+                (unsigned long long)conf.size, 
+                (unsigned long long)conf.vol_size,
+                (unsigned long long)conf.seed);
+
+    char data_fn[PATH_MAX];
+    snprintf(data_fn, sizeof data_fn, "data/%s", job_id);
+    int data_fd = open(data_fn, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (data_fd == -1) {
+        status = errno;
+        goto err_out;
+    }
+    struct snpy_data_hdr hdr;
+    snpy_data_hdr_init(&hdr, conf.vol_size, SNPY_SNULL_CODEC_NONE);
+    struct stat data_st;
+    int is_fifo = !fstat(data_fd, &data_st) && S_ISFIFO(data_st.st_mode);
+    /* streaming to put, the header goes again at the end */
+    if (is_fifo ? write(data_fd, &hdr, sizeof hdr) != sizeof hdr :
+        lseek(data_fd, sizeof hdr, SEEK_SET) != sizeof hdr) {
+        status = errno;
+        goto close_data_fd;
+    }
+
+    struct export_arg export_arg = {
+        .conf = &conf,
+        .io = snpy_ioeng_open(data_fd, is_fifo ? 0 : sizeof hdr, 
+                              conf.io_flags, 0, 0),
+        .idx = snpy_data_idx_alloc(4096),
+        .bm = blk_map_alloc(4096),
+        .tb = snpy_tb_create(conf.bw_limit, conf.iops_limit),
+        .progress = snpy_progress_open(conf.vol_size),
+        .buf = malloc(hdr.chunk_size)
+    };
+    if (!export_arg.io || !export_arg.idx || !export_arg.bm || 
+        !export_arg.tb || !export_arg.buf) {
+        status = ENOMEM;
+        goto free_export_arg;
+    }
+    snpy_stage_init(&export_arg.stage, data_fd, sizeof hdr, 0);
+    if ((rc = snpy_stage_prealloc(&export_arg.stage, conf.size + 
+                                  (conf.size / hdr.chunk_size + 1) *
+                                  sizeof(struct snpy_seg_rec))))
+        snpy_logger(SNPY_LOG_DEBUG, "data file not preallocated: %d.", rc);
+
+    /* the extent layout follows from the seed as well */
+    u64 x = conf.seed, off = 0, left = conf.size;
+    while (left) {
+        u64 ext_off, ext_len;
+        next_ext(&conf, &x, off, left, &ext_off, &ext_len);
+        if ((rc = export_ext(&export_arg, ext_off, ext_len, hdr.chunk_size))) {
+            status = -rc;
+            goto free_export_arg;
+        }
+        off = ext_off + ext_len;
+        left -= ext_len;
+    }
+
+    struct snpy_seg_rec end_rec = { .len = 0 };
+    if ((rc = export_rec(&export_arg, &end_rec, NULL)) ||
+        (rc = snpy_ioeng_flush(export_arg.io))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error writing records: %d.", rc);
+        goto free_export_arg;
+    }
+    hdr.idx_offset = sizeof hdr + export_arg.nbyte;
+    hdr.nrec = export_arg.idx->nuse;
+    hdr.blk_map_offset = hdr.idx_offset + sizeof export_arg.idx->nuse +
+        hdr.nrec * sizeof export_arg.idx->entv[0];
+    if ((rc = snpy_data_idx_write(data_fd, export_arg.idx)) ||
+        (rc = blk_map_write(data_fd, export_arg.bm))) {
+        status = -rc;
+        snpy_logger(SNPY_LOG_ERR, "error write index/block map: %d", rc);
+        goto free_export_arg;
+    }
+    if (is_fifo && write(data_fd, &hdr, sizeof hdr) != sizeof hdr) {
+        status = errno;
+        goto free_export_arg;
+    }
+
+    /* append the data tag, with the crc of the image data */
+    char tag_buf[SNPY_DATA_TAG_SIZE];
+    int tag_fd = open("meta/tag", O_RDONLY);
+    if (tag_fd == -1 || 
+        snpy_read_full(tag_fd, tag_buf, sizeof tag_buf) != sizeof tag_buf) {
+        status = tag_fd == -1 ? errno : EIO;
+        snpy_logger(SNPY_LOG_ERR, "error read tag file: %d.", status);
+        if (tag_fd != -1)
+            close(tag_fd);
+        goto free_export_arg;
+    }
+    close(tag_fd);
+    memcpy(tag_buf + offsetof(struct snpy_data_tag, chksum), 
+           &export_arg.crc, sizeof export_arg.crc);
+    if (write(data_fd, tag_buf, sizeof tag_buf) != sizeof tag_buf) {
+        status = errno;
+        goto free_export_arg;
+    }
+    if (!is_fifo && (rc = snpy_stage_trim(&export_arg.stage, 
+                                          lseek(data_fd, 0, SEEK_CUR))))
+        snpy_logger(SNPY_LOG_WARN, "error free preallocated space: %d.", 
+                    rc);
+    if (!is_fifo && (lseek(data_fd, 0, SEEK_SET) ||
+                     write(data_fd, &hdr, sizeof hdr) != sizeof hdr)) {
+        status = errno;
+        snpy_logger(SNPY_LOG_ERR, "error update data header: %d", errno);
+        goto free_export_arg;
+    }
+    snpy_logger(SNPY_LOG_INFO, "%llu bytes in %llu records, crc32c %08x.",
+                (unsigned long long)export_arg.nraw, 
+                (unsigned long long)hdr.nrec, export_arg.crc);
     
     fin = time(NULL);
     if ((rc = update_export_arg(arg, start, fin))) {
-        fprintf(log_file, "update_export_arg: %d.", rc);
+        snpy_logger(SNPY_LOG_ERR, "update_export_arg: %d.", rc);
     }
 
+free_export_arg:
+    snpy_ioeng_close(export_arg.io);
+    snpy_progress_close(export_arg.progress);
+    snpy_tb_destroy(export_arg.tb);
+    blk_map_free(export_arg.bm);
+    snpy_data_idx_free(export_arg.idx);
+    free(export_arg.buf);
+close_data_fd:
+    close(data_fd);
+err_out:
     kv_put_ival("meta/status", status, NULL);
     strerror_r(status, str_buf, sizeof str_buf);
     kv_put_sval("meta/status_msg", str_buf, sizeof str_buf, NULL);
@@ -201,27 +604,146 @@ static int do_export(const char *arg, int arg_size) {
 
 }
 
+/* import_records() - read the records of a v2 data file, checking them */
+static int import_records(const struct snull_conf *conf, int fd, 
+                          const struct snpy_data_hdr *hdr, u64 *nbyte) {
+    int rc = 0;
+    u64 pos = snpy_data_hdr_size(hdr);
+    int check_crc = !!(hdr->flags & SNPY_DATA_F_CRC32C);
+    struct snpy_ioeng *in = 
+        snpy_ioeng_open(fd, pos, conf->io_flags|SNPY_IOENG_READ, 0, 0);
+    struct snpy_tb *tb = snpy_tb_create(conf->bw_limit, conf->iops_limit);
+    struct snpy_progress *progress = snpy_progress_open(hdr->blk_dev_size);
+    char *buf = malloc(SNPY_DATA_CHUNK_SIZE);
+    if (!in || !tb || !buf) {
+        rc = -ENOMEM;
+        goto free_buf;
+    }
+    struct snpy_stage stage;
+    snpy_stage_init(&stage, fd, pos, 1);
+    struct snpy_seg_rec rec;
+    u64 nrec = 0;
+    for (;;) {
+        if (snpy_ioeng_read(in, &rec, sizeof rec) != sizeof rec) {
+            rc = in->status ? -in->status : -EIO;
+            break;
+        }
+        if (!rec.len)
+            break;
+        /* records of a chunk store or sealed ones are checked unread */
+        if (rec.len > SNPY_DATA_CHUNK_SIZE || rec.zlen > SNPY_DATA_CHUNK_SIZE ||
+            rec.off + rec.len > hdr->blk_dev_size) {
+            rc = -EIO;
+            break;
+        }
+        snull_wait(conf);
+        snpy_tb_take(tb, rec.zlen, 1);
+        if (snpy_ioeng_read(in, buf, rec.zlen) != rec.zlen) {
+            rc = -EIO;
+            break;
+        }
+        if (check_crc && rec.codec == SNPY_SNULL_CODEC_NONE && 
+            snpy_crc32c(0, buf, rec.len) != rec.crc) {
+            snpy_logger(SNPY_LOG_ERR, "record at %llu damaged.",
+                        (unsigned long long)rec.off);
+            rc = -EBADMSG;
+            break;
+        }
+        if ((rc = snull_fail(conf, *nbyte + rec.len)))
+            break;
+        *nbyte += rec.len;
+        pos += sizeof rec + rec.zlen;
+        snpy_stage_read(&stage, pos);
+        snpy_progress_update(progress, rec.off + rec.len, *nbyte, ++ nrec);
+    }
+free_buf:
+    free(buf);
+    snpy_progress_close(progress);
+    snpy_tb_destroy(tb);
+    snpy_ioeng_close(in);
+    return rc;
+}
 
 static int do_import(const char *arg, int arg_size) {
     int rc;
     time_t start, fin;
     int status = 0;
     char status_msg[1024] = "";
+    struct snull_conf conf;
+    u64 nbyte = 0;
     
+    start = time(NULL);
+    if ((rc = snull_conf_init(&conf, arg))) {
+        status = EINVAL;
+        snprintf(status_msg, sizeof status_msg,
+                 "configuration invalid: %d\n", status);
+        goto err_out;
+    }
+    /* data/data is a fifo when get streams to import */
+    int data_fd = open("data/data", O_RDONLY);
+    if (data_fd == -1) {
+        status = errno;
+        snprintf(status_msg, sizeof status_msg,
+                 "error open data file: %d\n", status);
+        goto err_out;
+    }
+    struct snpy_data_hdr hdr;
+    if ((rc = snpy_data_hdr_read(data_fd, &hdr)) || hdr.version < 2) {
+        status = rc ? -rc : EINVAL;
+        snprintf(status_msg, sizeof status_msg,
+                 "error read v2 data header: %d\n", status);
+        goto close_data_fd;
+    }
+    if ((rc = import_records(&conf, data_fd, &hdr, &nbyte))) {
+        status = -rc;
+        snprintf(status_msg, sizeof status_msg,
+                 "error read records: %d\n", status);
+        goto close_data_fd;
+    }
+    snpy_logger(SNPY_LOG_INFO, "%llu bytes of records read.", 
+                (unsigned long long)nbyte);
+    fin = time(NULL);
+    if ((rc = update_import_arg(arg, start, fin)))
+        snpy_logger(SNPY_LOG_ERR, "update_import_arg: %d.", rc);
+
+close_data_fd:
+    close(data_fd);
+err_out:
+    if (status)
+        snpy_logger(SNPY_LOG_ERR, "%s", status_msg);
+    else 
+        strerror_r(status, status_msg, sizeof status_msg);
     kv_put_ival("meta/status", status, NULL);
     kv_put_sval("meta/status_msg", status_msg, sizeof status_msg, NULL);
 
-    fprintf(log_file, status_msg);
     return -status;
 
 }
 
+/* do_nop() - an operation snull has nothing to do for, but wait and fail */
+static int do_nop(const char *arg, int arg_size) {
+    int rc;
+    int status = 0;
+    char str_buf[64];
+    struct snull_conf conf;
+    if ((rc = snull_conf_init(&conf, arg)))
+        status = -rc;
+    else {
+        snull_wait(&conf);
+        status = -snull_fail(&conf, 0);
+    }
+    kv_put_ival("meta/status", status, NULL);
+    strerror_r(status, str_buf, sizeof str_buf);
+    kv_put_sval("meta/status_msg", str_buf, sizeof str_buf, NULL);
+    return -status;
+}
+
 static int do_diff(const char *arg, int arg_size) {
-    return 0;
+    return do_nop(arg, arg_size);
 }
 
 static int do_patch(const char *arg, int arg_size) {
-    return 0;
+    return do_nop(arg, arg_size);
 }
 
 
@@ -232,13 +754,11 @@ int main(void) {
     char id_buf[64];
     int job_id = -1;
     /* open log */
-    log_file = fopen("meta/log", "w");
-    if (!log_file) {
-        rc = -errno;
+    if ((rc = snpy_logger_open("meta/log", 0))) {
         fprintf(stderr, "can not open log to write.\n"); 
         goto err_out;
     }
-    defer { fclose(log_file); }
+    defer { snpy_logger_close(0); }
 
     if ((rc = kv_get_sval("meta/cmd", cmd, sizeof cmd, NULL))) 
         goto err_out;
@@ -248,6 +768,7 @@ int main(void) {
 
     if (kv_get_sval("meta/arg", arg, sizeof arg, NULL))
         goto err_out;
+    snpy_logger(SNPY_LOG_INFO, "execute command: %s.", cmd);
 
     if (!strcmp(cmd, "snap")) {
         rc = do_snap(arg, sizeof arg);
@@ -0,0 +1,725 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "json.h"
+#include "snpy_log.h"
+#include "snpy_sha256.h"
+#include "snpy_objstore.h"
+
+#define OBJSTORE_AUTH_RESP_SIZE (256 << 10)
+#define OBJSTORE_RESP_SIZE 4096
+#define OBJSTORE_PATH_SIZE 2048
+
+/* growable string of request bodies */
+struct sbuf {
+    char *p;
+    size_t len;
+    size_t size;
+    int err;
+};
+
+static void sbuf_printf(struct sbuf *b, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        if (b->err)
+            return;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (b->len + n < b->size) {
+            b->len += n;
+            return;
+        }
+        size_t size = MAX(2 * b->size, b->len + n + 4096);
+        char *p = realloc(b->p, size);
+        if (!p) {
+            b->err = ENOMEM;
+            return;
+        }
+        b->p = p;
+        b->size = size;
+    }
+}
+
+/* sbuf_quote() - @s as a JSON string */
+static void sbuf_quote(struct sbuf *b, const char *s) {
+    sbuf_printf(b, "\"");
+    for (; *s; s ++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            sbuf_printf(b, "\\%c", ch);
+        else if (ch < 0x20)
+            sbuf_printf(b, "\\u%04x", ch);
+        else
+            sbuf_printf(b, "%c", ch);
+    }
+    sbuf_printf(b, "\"");
+}
+
+/* http_err() - errno of an HTTP status */
+static int http_err(int status) {
+    if (status >= 200 && status < 300)
+        return 0;
+    switch (status) {
+    case 401:
+    case 403:
+        return -EACCES;
+    case 404:
+        return -ENOENT;
+    case 416:
+        return -ERANGE;
+    case 408:
+    case 429:
+        return -EAGAIN;
+    }
+    return status >= 500 ? -EAGAIN : -EPROTO;
+}
+
+/* unquote() - copy an ETag without its quotes */
+static void unquote(const char *s, char *dst, size_t size) {
+    size_t n = strlen(s);
+    if (n >= 2 && s[0] == '"' && s[n - 1] == '"') {
+        s ++;
+        n -= 2;
+    }
+    n = MIN(n, size - 1);
+    memcpy(dst, s, n);
+    dst[n] = '\0';
+}
+
+static int auth_tempauth(struct snpy_objstore *os) {
+    int rc;
+    struct snpy_http_url u;
+    struct snpy_http_conn c;
+    struct snpy_http_resp resp = { .buf = NULL };
+    char hdrs[1024], storage[1024];
+    if ((rc = snpy_http_url_parse(os->conf.url, &u)))
+        return rc;
+    if (snprintf(hdrs, sizeof hdrs, "X-Auth-User: %s\r\nX-Auth-Key: %s\r\n",
+                 os->conf.user, os->conf.password) >= sizeof hdrs)
+        return -ENAMETOOLONG;
+    struct snpy_http_req req = {
+        .method = "GET", .path = u.path, .hdrs = hdrs
+    };
+    snpy_http_conn_init(&c, &u);
+    rc = snpy_http_do(&c, &req, &resp);
+    snpy_http_conn_close(&c);
+    if (rc || (rc = http_err(resp.status)))
+        return rc;
+    if (snpy_http_header(&resp, "X-Storage-Url", storage, sizeof storage) ||
+        snpy_http_header(&resp, "X-Auth-Token", os->token, sizeof os->token))
+        return -EPROTO;
+    return snpy_http_url_parse(storage, &os->storage);
+}
+
+/*
+ * keystone_url() - public object-store endpoint in the catalog of @js
+ *
+ * v2 lists endpoints with a publicURL, v3 with an interface and a url.
+ */
+static int keystone_url(struct snpy_objstore *os, struct json *js, int v3) {
+    const char *cat = v3 ? ".token.catalog" : ".access.serviceCatalog";
+    int i, j, n = json_count(js, cat);
+    char path[128];
+    for (i = 0; i < n; i ++) {
+        snprintf(path, sizeof path, "%s[#].type", cat);
+        if (strcmp(json_string(js, path, i), "object-store"))
+            continue;
+        snprintf(path, sizeof path, "%s[#].endpoints", cat);
+        int m = json_count(js, path, i);
+        for (j = 0; j < m; j ++) {
+            const char *region, *url;
+            snprintf(path, sizeof path, "%s[#].endpoints[#].region", cat);
+            region = json_string(js, path, i, j);
+            if (os->conf.region[0] && strcmp(region, os->conf.region))
+                continue;
+            if (v3) {
+                snprintf(path, sizeof path, "%s[#].endpoints[#].interface",
+                         cat);
+                if (strcmp(json_string(js, path, i, j), "public"))
+                    continue;
+                snprintf(path, sizeof path, "%s[#].endpoints[#].url", cat);
+            } else {
+                snprintf(path, sizeof path, "%s[#].endpoints[#].publicURL",
+                         cat);
+            }
+            url = json_string(js, path, i, j);
+            if (url[0])
+                return snpy_http_url_parse(url, &os->storage);
+        }
+    }
+    return -ENOENT;
+}
+
+static int auth_keystone(struct snpy_objstore *os) {
+    int rc, error;
+    struct snpy_http_url u;
+    struct snpy_http_conn c;
+    struct sbuf body = { NULL, 0, 0, 0 };
+    const struct snpy_objstore_conf *conf = &os->conf;
+    if ((rc = snpy_http_url_parse(conf->url, &u)))
+        return rc;
+    size_t n = strlen(u.path);
+    int v3 = n >= 3 && !strcmp(u.path + n - 3, "/v3");
+    if (n + sizeof "/auth/tokens" > sizeof u.path)
+        return -ENAMETOOLONG;
+    strcat(u.path, v3 ? "/auth/tokens" : "/tokens");
+
+    if (v3) {
+        sbuf_printf(&body, "{\"auth\":{\"identity\":{\"methods\":"
+                    "[\"password\"],\"password\":{\"user\":{\"name\":");
+        sbuf_quote(&body, conf->user);
+        sbuf_printf(&body, ",\"domain\":{\"id\":\"default\"},\"password\":");
+        sbuf_quote(&body, conf->password);
+        sbuf_printf(&body, "}}},\"scope\":{\"project\":{\"name\":");
+        sbuf_quote(&body, conf->project);
+        sbuf_printf(&body, ",\"domain\":{\"id\":\"default\"}}}}}");
+    } else {
+        sbuf_printf(&body, "{\"auth\":{\"tenantName\":");
+        sbuf_quote(&body, conf->project);
+        sbuf_printf(&body, ",\"passwordCredentials\":{\"username\":");
+        sbuf_quote(&body, conf->user);
+        sbuf_printf(&body, ",\"password\":");
+        sbuf_quote(&body, conf->password);
+        sbuf_printf(&body, "}}}");
+    }
+    struct snpy_http_resp resp = {
+        .buf = malloc(OBJSTORE_AUTH_RESP_SIZE),
+        .size = OBJSTORE_AUTH_RESP_SIZE
+    };
+    if (body.err || !resp.buf) {
+        rc = -ENOMEM;
+        goto free_body;
+    }
+    struct snpy_http_req req = {
+        .method = "POST", .path = u.path,
+        .hdrs = "Content-Type: application/json\r\n",
+        .body = body.p, .body_len = body.len
+    };
+    snpy_http_conn_init(&c, &u);
+    rc = snpy_http_do(&c, &req, &resp);
+    snpy_http_conn_close(&c);
+    if (rc || (rc = http_err(resp.status)))
+        goto free_body;
+
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js) {
+        rc = -ENOMEM;
+        goto free_body;
+    }
+    if (json_loadstring(js, resp.buf)) {
+        rc = -EPROTO;
+        goto close_js;
+    }
+    if (v3)
+        rc = snpy_http_header(&resp, "X-Subject-Token", os->token,
+                              sizeof os->token);
+    else if (strlcpy(os->token, json_string(js, ".access.token.id"),
+                     sizeof os->token) >= sizeof os->token)
+        rc = -ENAMETOOLONG;
+    if (!rc && !os->token[0])
+        rc = -EPROTO;
+    if (!rc)
+        rc = keystone_url(os, js, v3);
+close_js:
+    json_close(js);
+free_body:
+    free(resp.buf);
+    free(body.p);
+    return rc;
+}
+
+/* auth() - (re)authenticate, called with lock held */
+static int auth(struct snpy_objstore *os) {
+    int rc = !strcmp(os->conf.auth_method, "keystone") ? auth_keystone(os) :
+        auth_tempauth(os);
+    os->auth_gen ++;
+    if (rc)
+        snpy_logger(SNPY_LOG_ERR, "%s authentication at %s failed: %d.",
+                    os->conf.auth_method, os->conf.url, rc);
+    return rc;
+}
+
+/* reauth() - authenticate again unless done since generation @gen */
+static int reauth(struct snpy_objstore *os, u64 gen) {
+    int rc = 0;
+    pthread_mutex_lock(&os->lock);
+    if (os->auth_gen == gen)
+        rc = auth(os);
+    pthread_mutex_unlock(&os->lock);
+    return rc;
+}
+
+static void hmac(const void *key, int klen, const char *msg, u8 *md) {
+    unsigned int n;
+    HMAC(EVP_sha256(), key, klen, (const u8 *)msg, strlen(msg), md, &n);
+}
+
+static void to_hex(const u8 *p, int n, char *dst) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < n; i ++) {
+        dst[2 * i] = hex[p[i] >> 4];
+        dst[2 * i + 1] = hex[p[i] & 15];
+    }
+    dst[2 * n] = '\0';
+}
+
+/*
+ * s3_sign() - SigV4 headers of a request to @path, ahead of @extra
+ *
+ * The payload is left unsigned, its parts are checked against their ETag
+ * instead. Queries come sorted and escaped already.
+ */
+static int s3_sign(struct snpy_objstore *os, const char *method,
+                   const char *path, const char *extra,
+                   char *hdrs, size_t size) {
+    const struct snpy_objstore_conf *conf = &os->conf;
+    const struct snpy_http_url *u = &os->storage;
+    const char *region = conf->region[0] ? conf->region : "us-east-1";
+    char amz_date[32], date[16], host[300], canon[OBJSTORE_PATH_SIZE + 512];
+    char sts[512], hash[2 * SNPY_SHA256_SIZE + 1], sig[65], key[300];
+    u8 md[SNPY_SHA256_SIZE], k[SNPY_SHA256_SIZE];
+    struct tm tm;
+    time_t t = time(NULL);
+
+    gmtime_r(&t, &tm);
+    strftime(amz_date, sizeof amz_date, "%Y%m%dT%H%M%SZ", &tm);
+    strftime(date, sizeof date, "%Y%m%d", &tm);
+    int def_port = !strcmp(u->port, u->tls ? "443" : "80");
+    snprintf(host, sizeof host, "%s%s%s", u->host, def_port ? "" : ":",
+             def_port ? "" : u->port);
+    const char *q = strchr(path, '?');
+    int ulen = q ? q - path : strlen(path);
+    if (snprintf(canon, sizeof canon, "%s\n%.*s\n%s\nhost:%s\n"
+                 "x-amz-content-sha256:UNSIGNED-PAYLOAD\nx-amz-date:%s\n\n"
+                 "host;x-amz-content-sha256;x-amz-date\nUNSIGNED-PAYLOAD",
+                 method, ulen, ulen ? path : "/", q ? q + 1 : "", host,
+                 amz_date) >= sizeof canon)
+        return -ENAMETOOLONG;
+    snpy_sha256(canon, strlen(canon), md);
+    to_hex(md, sizeof md, hash);
+    snprintf(sts, sizeof sts, "AWS4-HMAC-SHA256\n%s\n%s/%s/s3/aws4_request\n%s",
+             amz_date, date, region, hash);
+
+    snprintf(key, sizeof key, "AWS4%s", conf->password);
+    hmac(key, strlen(key), date, k);
+    hmac(k, sizeof k, region, k);
+    hmac(k, sizeof k, "s3", k);
+    hmac(k, sizeof k, "aws4_request", k);
+    hmac(k, sizeof k, sts, md);
+    to_hex(md, sizeof md, sig);
+    if (snprintf(hdrs, size, "x-amz-date: %s\r\n"
+                 "x-amz-content-sha256: UNSIGNED-PAYLOAD\r\n"
+                 "Authorization: AWS4-HMAC-SHA256 "
+                 "Credential=%s/%s/%s/s3/aws4_request, "
+                 "SignedHeaders=host;x-amz-content-sha256;x-amz-date, "
+                 "Signature=%s\r\n%s", amz_date, conf->user, date, region,
+                 sig, extra ? extra : "") >= size)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/*
+ * os_do() - send @req with the credentials of @os
+ *
+ * Returns the errno of the transport or of the response status.
+ */
+static int os_do(struct snpy_objstore *os, struct snpy_http_conn *c,
+                 struct snpy_http_req *req, const char *extra,
+                 struct snpy_http_resp *resp) {
+    int rc, again = !req->read;
+    char *hdrs = malloc(sizeof os->token + 2048);
+    if (!hdrs)
+        return -ENOMEM;
+    for (;;) {
+        u64 gen = 0;
+        if (os->api == SNPY_OBJSTORE_S3) {
+            rc = s3_sign(os, req->method, req->path, extra, hdrs,
+                         sizeof os->token + 2048);
+        } else {
+            pthread_mutex_lock(&os->lock);
+            gen = os->auth_gen;
+            rc = snprintf(hdrs, sizeof os->token + 2048,
+                          "X-Auth-Token: %s\r\n%s", os->token,
+                          extra ? extra : "") >= sizeof os->token + 2048 ?
+                -ENAMETOOLONG : 0;
+            pthread_mutex_unlock(&os->lock);
+        }
+        if (rc)
+            break;
+        req->hdrs = hdrs;
+        if ((rc = snpy_http_do(c, req, resp)))
+            break;
+        if (resp->status != 401 || os->api == SNPY_OBJSTORE_S3) {
+            rc = http_err(resp->status);
+            break;
+        }
+        if ((rc = reauth(os, gen)) || (rc = -EAGAIN, !again))
+            break;
+        again = 0;
+    }
+    free(hdrs);
+    return rc;
+}
+
+/* obj_path() - escaped path of @name in @container, @query appended */
+static int obj_path(const struct snpy_objstore *os, const char *container,
+                    const char *name, const char *query,
+                    char *dst, size_t size) {
+    char ec[768], en[1024];
+    if (snpy_http_escape(container, 0, ec, sizeof ec) >= sizeof ec ||
+        snpy_http_escape(name, 1, en, sizeof en) >= sizeof en ||
+        snprintf(dst, size, "%s/%s%s%s%s", os->storage.path, ec,
+                 name[0] ? "/" : "", en, query ? query : "") >= size)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/* snpy_objstore_open() - log in to the store of @conf */
+int snpy_objstore_open(struct snpy_objstore *os,
+                       const struct snpy_objstore_conf *conf) {
+    int rc = 0;
+    memset(os, 0, sizeof *os);
+    os->conf = *conf;
+    pthread_mutex_init(&os->lock, NULL);
+    if (!strcmp(conf->auth_method, "s3")) {
+        os->api = SNPY_OBJSTORE_S3;
+        return snpy_http_url_parse(conf->url, &os->storage);
+    }
+    if (strcmp(conf->auth_method, "keystone") &&
+        strcmp(conf->auth_method, "tempauth"))
+        return -EINVAL;
+    os->api = SNPY_OBJSTORE_SWIFT;
+    pthread_mutex_lock(&os->lock);
+    rc = auth(os);
+    pthread_mutex_unlock(&os->lock);
+    return rc;
+}
+
+void snpy_objstore_close(struct snpy_objstore *os) {
+    pthread_mutex_destroy(&os->lock);
+    memset(os->token, 0, sizeof os->token);
+}
+
+/* snpy_objstore_conn() - an unconnected connection to the storage */
+void snpy_objstore_conn(struct snpy_objstore *os, struct snpy_http_conn *c) {
+    pthread_mutex_lock(&os->lock);
+    snpy_http_conn_init(c, &os->storage);
+    pthread_mutex_unlock(&os->lock);
+}
+
+int snpy_objstore_head(struct snpy_objstore *os, struct snpy_http_conn *c,
+                       const char *key, u64 *size) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE], val[32];
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = { .method = "HEAD", .path = path };
+    if ((rc = obj_path(os, os->conf.container, key, NULL, path, sizeof path)) ||
+        (rc = os_do(os, c, &req, NULL, &resp)))
+        return rc;
+    if (snpy_http_header(&resp, "Content-Length", val, sizeof val))
+        return -EPROTO;
+    *size = strtoull(val, NULL, 10);
+    return 0;
+}
+
+/*
+ * snpy_objstore_get() - pass bytes [@off, @off + @len) of @key to @write
+ *
+ * A @len of 0 gets the whole object. Only the body of a 200, or of a 206
+ * for a range, reaches @write; a short range response fails.
+ */
+int snpy_objstore_get(struct snpy_objstore *os, struct snpy_http_conn *c,
+                      const char *key, u64 off, u64 len,
+                      snpy_http_write_t write, void *arg) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE], range[64] = "", err[256] = "";
+    struct snpy_http_resp resp = { 
+        .write = write, .arg = arg, .want = len ? 206 : 200,
+        .buf = err, .size = sizeof err
+    };
+    struct snpy_http_req req = { .method = "GET", .path = path };
+    if (len)
+        snprintf(range, sizeof range, "Range: bytes=%llu-%llu\r\n",
+                 (unsigned long long)off, (unsigned long long)(off + len - 1));
+    if ((rc = obj_path(os, os->conf.container, key, NULL, path, sizeof path)) ||
+        (rc = os_do(os, c, &req, range, &resp))) {
+        if (err[0])
+            snpy_logger(SNPY_LOG_WARN, "get of %s: %d %s", key, resp.status,
+                        err);
+        return rc;
+    }
+    if (resp.status != resp.want || (len && resp.len != len))
+        return -EIO;
+    return 0;
+}
+
+/* snpy_objstore_put() - store @len bytes from @read as @key */
+int snpy_objstore_put(struct snpy_objstore *os, struct snpy_http_conn *c,
+                      const char *key, u64 len,
+                      snpy_http_read_t read, void *arg, char *etag) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE], val[80];
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = {
+        .method = "PUT", .path = path, .body_len = len,
+        .read = read, .arg = arg
+    };
+    if ((rc = obj_path(os, os->conf.container, key, NULL, path, sizeof path)) ||
+        (rc = os_do(os, c, &req, NULL, &resp)))
+        return rc;
+    if (snpy_http_header(&resp, "ETag", val, sizeof val))
+        return -EPROTO;
+    unquote(val, etag, 64);
+    return 0;
+}
+
+/* snpy_objstore_delete() - remove @key, with its segments on swift */
+int snpy_objstore_delete(struct snpy_objstore *os, struct snpy_http_conn *c,
+                         const char *key) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE];
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = { .method = "DELETE", .path = path };
+    if ((rc = obj_path(os, os->conf.container, key,
+                       os->api == SNPY_OBJSTORE_SWIFT ?
+                       "?multipart-manifest=delete" : NULL,
+                       path, sizeof path)))
+        return rc;
+    rc = os_do(os, c, &req, NULL, &resp);
+    return rc == -ENOENT ? 0 : rc;
+}
+
+static void seg_container(const struct snpy_objstore *os, char *dst,
+                          size_t size) {
+    snprintf(dst, size, "%s_segments", os->conf.container);
+}
+
+/* s3_upload_id() - the UploadId of a CreateMultipartUpload response */
+static int s3_upload_id(const char *xml, char *dst, size_t size) {
+    const char *p = strstr(xml, "<UploadId>");
+    const char *e = p ? strstr(p, "</UploadId>") : NULL;
+    if (!e)
+        return -EPROTO;
+    p += strlen("<UploadId>");
+    char id[1024];
+    if (e - p >= sizeof id)
+        return -ENAMETOOLONG;
+    memcpy(id, p, e - p);
+    id[e - p] = '\0';
+    return snpy_http_escape(id, 0, dst, size) >= size ? -ENAMETOOLONG : 0;
+}
+
+/* snpy_objstore_mp_begin() - start the upload of a large object @key */
+int snpy_objstore_mp_begin(struct snpy_objstore *os,
+                           struct snpy_http_conn *c, const char *key,
+                           struct snpy_objstore_mp *mp) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE], buf[OBJSTORE_RESP_SIZE];
+    struct snpy_http_resp resp = { .buf = buf, .size = sizeof buf };
+    if (strlcpy(mp->key, key, sizeof mp->key) >= sizeof mp->key)
+        return -ENAMETOOLONG;
+
+    if (os->api == SNPY_OBJSTORE_S3) {
+        struct snpy_http_req req = { .method = "POST", .path = path };
+        if ((rc = obj_path(os, os->conf.container, key, "?uploads=",
+                           path, sizeof path)) ||
+            (rc = os_do(os, c, &req, NULL, &resp)))
+            return rc;
+        return s3_upload_id(buf, mp->id, sizeof mp->id);
+    }
+
+    /* segments of one upload are kept apart from those of the others */
+    struct timeval tv;
+    char seg[300];
+    gettimeofday(&tv, NULL);
+    snprintf(mp->id, sizeof mp->id, "%s/slo/%ld.%06ld", key,
+             (long)tv.tv_sec, (long)tv.tv_usec);
+    seg_container(os, seg, sizeof seg);
+    struct snpy_http_req req = { .method = "PUT", .path = path };
+    if ((rc = obj_path(os, seg, "", NULL, path, sizeof path)))
+        return rc;
+    return os_do(os, c, &req, NULL, &resp);
+}
+
+/* snpy_objstore_mp_put() - store part @i of @len bytes from @read */
+int snpy_objstore_mp_put(struct snpy_objstore *os, struct snpy_http_conn *c,
+                         const struct snpy_objstore_mp *mp, int i, u64 len,
+                         snpy_http_read_t read, void *arg, char *etag) {
+    int rc;
+    char path[OBJSTORE_PATH_SIZE], name[1100], query[1100], val[80];
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = {
+        .method = "PUT", .path = path, .body_len = len,
+        .read = read, .arg = arg
+    };
+    if (os->api == SNPY_OBJSTORE_S3) {
+        snprintf(query, sizeof query, "?partNumber=%d&uploadId=%s", i + 1,
+                 mp->id);
+        rc = obj_path(os, os->conf.container, mp->key, query,
+                      path, sizeof path);
+    } else {
+        seg_container(os, query, sizeof query);
+        snprintf(name, sizeof name, "%s/%08d", mp->id, i);
+        rc = obj_path(os, query, name, NULL, path, sizeof path);
+    }
+    if (rc || (rc = os_do(os, c, &req, NULL, &resp)))
+        return rc;
+    if (snpy_http_header(&resp, "ETag", val, sizeof val))
+        return -EPROTO;
+    unquote(val, etag, 64);
+    return 0;
+}
+
+/* slo_put() - PUT the manifest of @partv at @path, segments named by @id */
+static int slo_put(struct snpy_objstore *os, struct snpy_http_conn *c,
+                   const char *path, const char *id,
+                   const struct snpy_objstore_part *partv, int first, int n,
+                   int nested) {
+    int rc, i;
+    char seg[300];
+    struct sbuf body = { NULL, 0, 0, 0 };
+    seg_container(os, seg, sizeof seg);
+    sbuf_printf(&body, "[");
+    for (i = first; i < first + n; i ++) {
+        char name[1300];
+        if (nested)
+            snprintf(name, sizeof name, "/%s/%s/manifest.%04d", seg, id, i);
+        else
+            snprintf(name, sizeof name, "/%s/%s/%08d", seg, id, i);
+        sbuf_printf(&body, "%s{\"path\":", i > first ? "," : "");
+        sbuf_quote(&body, name);
+        if (nested)
+            sbuf_printf(&body, ",\"etag\":null,\"size_bytes\":%llu}",
+                        (unsigned long long)partv[i].size);
+        else
+            sbuf_printf(&body, ",\"etag\":\"%s\",\"size_bytes\":%llu}",
+                        partv[i].etag, (unsigned long long)partv[i].size);
+    }
+    sbuf_printf(&body, "]");
+    if (body.err) {
+        free(body.p);
+        return -ENOMEM;
+    }
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = {
+        .method = "PUT", .path = path, .body = body.p, .body_len = body.len
+    };
+    rc = os_do(os, c, &req, "Content-Type: application/json\r\n", &resp);
+    free(body.p);
+    return rc;
+}
+
+static int slo_commit(struct snpy_objstore *os, struct snpy_http_conn *c,
+                      const struct snpy_objstore_mp *mp,
+                      const struct snpy_objstore_part *partv, int n) {
+    int rc, i;
+    char path[OBJSTORE_PATH_SIZE], seg[300], name[1100];
+    const char *q = "?multipart-manifest=put";
+    if (n <= SNPY_OBJSTORE_SLO_MAX) {
+        if ((rc = obj_path(os, os->conf.container, mp->key, q,
+                           path, sizeof path)))
+            return rc;
+        return slo_put(os, c, path, mp->id, partv, 0, n, 0);
+    }
+
+    /* a manifest of manifests, each of up to SLO_MAX segments */
+    int ngroup = (n + SNPY_OBJSTORE_SLO_MAX - 1) / SNPY_OBJSTORE_SLO_MAX;
+    if (ngroup > SNPY_OBJSTORE_SLO_MAX)
+        return -EFBIG;
+    struct snpy_objstore_part *groupv = calloc(ngroup, sizeof *groupv);
+    if (!groupv)
+        return -ENOMEM;
+    seg_container(os, seg, sizeof seg);
+    for (i = 0, rc = 0; !rc && i < ngroup; i ++) {
+        int first = i * SNPY_OBJSTORE_SLO_MAX;
+        int m = MIN(n - first, SNPY_OBJSTORE_SLO_MAX);
+        int j;
+        for (j = first; j < first + m; j ++)
+            groupv[i].size += partv[j].size;
+        snprintf(name, sizeof name, "%s/manifest.%04d", mp->id, i);
+        if (!(rc = obj_path(os, seg, name, q, path, sizeof path)))
+            rc = slo_put(os, c, path, mp->id, partv, first, m, 0);
+    }
+    if (!rc &&
+        !(rc = obj_path(os, os->conf.container, mp->key, q,
+                        path, sizeof path)))
+        rc = slo_put(os, c, path, mp->id, groupv, 0, ngroup, 1);
+    free(groupv);
+    return rc;
+}
+
+static int s3_commit(struct snpy_objstore *os, struct snpy_http_conn *c,
+                     const struct snpy_objstore_mp *mp,
+                     const struct snpy_objstore_part *partv, int n) {
+    int rc, i;
+    char path[OBJSTORE_PATH_SIZE], query[1100], buf[OBJSTORE_RESP_SIZE];
+    struct sbuf body = { NULL, 0, 0, 0 };
+    snprintf(query, sizeof query, "?uploadId=%s", mp->id);
+    if ((rc = obj_path(os, os->conf.container, mp->key, query,
+                       path, sizeof path)))
+        return rc;
+    sbuf_printf(&body, "<CompleteMultipartUpload>");
+    for (i = 0; i < n; i ++)
+        sbuf_printf(&body, "<Part><PartNumber>%d</PartNumber>"
+                    "<ETag>\"%s\"</ETag></Part>", i + 1, partv[i].etag);
+    sbuf_printf(&body, "</CompleteMultipartUpload>");
+    if (body.err) {
+        free(body.p);
+        return -ENOMEM;
+    }
+    struct snpy_http_resp resp = { .buf = buf, .size = sizeof buf };
+    struct snpy_http_req req = {
+        .method = "POST", .path = path, .body = body.p, .body_len = body.len
+    };
+    rc = os_do(os, c, &req, "Content-Type: application/xml\r\n", &resp);
+    free(body.p);
+    /* a failed completion may still come with 200 */
+    if (!rc && strstr(buf, "<Error>"))
+        rc = -EAGAIN;
+    return rc;
+}
+
+/* snpy_objstore_mp_commit() - make the @n parts the object */
+int snpy_objstore_mp_commit(struct snpy_objstore *os,
+                            struct snpy_http_conn *c,
+                            const struct snpy_objstore_mp *mp,
+                            const struct snpy_objstore_part *partv, int n) {
+    return os->api == SNPY_OBJSTORE_S3 ? s3_commit(os, c, mp, partv, n) :
+        slo_commit(os, c, mp, partv, n);
+}
+
+/* snpy_objstore_mp_abort() - drop the first @n parts of an upload */
+int snpy_objstore_mp_abort(struct snpy_objstore *os, struct snpy_http_conn *c,
+                           const struct snpy_objstore_mp *mp, int n) {
+    int rc = 0, i;
+    char path[OBJSTORE_PATH_SIZE], query[1100], name[1100];
+    struct snpy_http_resp resp = { .buf = NULL };
+    struct snpy_http_req req = { .method = "DELETE", .path = path };
+    if (os->api == SNPY_OBJSTORE_S3) {
+        snprintf(query, sizeof query, "?uploadId=%s", mp->id);
+        if (!(rc = obj_path(os, os->conf.container, mp->key, query,
+                            path, sizeof path)))
+            rc = os_do(os, c, &req, NULL, &resp);
+        return rc == -ENOENT ? 0 : rc;
+    }
+    seg_container(os, query, sizeof query);
+    for (i = 0; i < n; i ++) {
+        snprintf(name, sizeof name, "%s/%08d", mp->id, i);
+        int err = obj_path(os, query, name, NULL, path, sizeof path);
+        if (!err)
+            err = os_do(os, c, &req, NULL, &resp);
+        if (err && err != -ENOENT)
+            rc = err;
+    }
+    return rc;
+}
@@ -0,0 +1,93 @@
+#ifndef SNPY_OBJSTORE_H
+#define SNPY_OBJSTORE_H
+
+#include <pthread.h>
+
+#include "snpy_util.h"
+#include "snpy_http.h"
+
+/*
+ * object store API of the swift target plugin: Swift or S3
+ *
+ * Swift authenticates with tempauth or keystone (v2, v3 if the auth url
+ * ends in /v3) and keeps a large object as a static large object: its
+ * segments go to <container>_segments under <key>/slo/<time>/ and the
+ * manifest PUT commits them, nested once there are more segments than
+ * one manifest takes. S3 signs requests with SigV4, user and password
+ * being the access key and secret, and keeps a large object as a
+ * multipart upload. Either way an object appears whole at commit, or not
+ * at all.
+ *
+ * Calls are made on the caller's connection to the storage, so threads
+ * move parts in parallel on connections of their own. A Swift request
+ * answered 401 authenticates again; it is sent again right away unless
+ * its body streams from a callback, then -EAGAIN tells the caller to
+ * start the part over.
+ */
+
+#define SNPY_OBJSTORE_SLO_MAX 1000  /* segments of one swift manifest */
+#define SNPY_OBJSTORE_MP_MAX 10000  /* parts of one s3 upload */
+
+enum snpy_objstore_api {
+    SNPY_OBJSTORE_SWIFT,
+    SNPY_OBJSTORE_S3
+};
+
+struct snpy_objstore_conf {
+    char auth_method[32];           /* keystone, tempauth or s3 */
+    char url[1024];                 /* auth url, the endpoint for s3 */
+    char user[256];
+    char password[256];
+    char project[256];
+    char container[256];            /* the bucket for s3 */
+    char region[64];
+};
+
+struct snpy_objstore {
+    struct snpy_objstore_conf conf;
+    int api;
+    struct snpy_http_url storage;   /* account storage url, s3 endpoint */
+    pthread_mutex_t lock;           /* of auth_gen and token */
+    u64 auth_gen;                   /* bumped by each authentication */
+    char token[4096];
+};
+
+/* a large object being uploaded */
+struct snpy_objstore_mp {
+    char key[256];
+    char id[1024];                  /* s3 upload id, swift segment prefix */
+};
+
+struct snpy_objstore_part {
+    u64 size;
+    char etag[64];
+};
+
+int snpy_objstore_open(struct snpy_objstore *os,
+                       const struct snpy_objstore_conf *conf);
+void snpy_objstore_close(struct snpy_objstore *os);
+void snpy_objstore_conn(struct snpy_objstore *os, struct snpy_http_conn *c);
+int snpy_objstore_head(struct snpy_objstore *os, struct snpy_http_conn *c,
+                       const char *key, u64 *size);
+int snpy_objstore_get(struct snpy_objstore *os, struct snpy_http_conn *c,
+                      const char *key, u64 off, u64 len,
+                      snpy_http_write_t write, void *arg);
+int snpy_objstore_put(struct snpy_objstore *os, struct snpy_http_conn *c,
+                      const char *key, u64 len,
+                      snpy_http_read_t read, void *arg, char *etag);
+int snpy_objstore_delete(struct snpy_objstore *os, struct snpy_http_conn *c,
+                         const char *key);
+int snpy_objstore_mp_begin(struct snpy_objstore *os,
+                           struct snpy_http_conn *c, const char *key,
+                           struct snpy_objstore_mp *mp);
+int snpy_objstore_mp_put(struct snpy_objstore *os, struct snpy_http_conn *c,
+                         const struct snpy_objstore_mp *mp, int i, u64 len,
+                         snpy_http_read_t read, void *arg, char *etag);
+int snpy_objstore_mp_commit(struct snpy_objstore *os,
+                            struct snpy_http_conn *c,
+                            const struct snpy_objstore_mp *mp,
+                            const struct snpy_objstore_part *partv, int n);
+int snpy_objstore_mp_abort(struct snpy_objstore *os, struct snpy_http_conn *c,
+                           const struct snpy_objstore_mp *mp, int n);
+
+#endif
@@ -0,0 +1,1398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include "json.h"
+#include "snpy_util.h"
+#include "snpy_log.h"
+#include "snpy_data.h"
+#include "snpy_data_tag.h"
+#include "snpy_crc32c.h"
+#include "snpy_tb.h"
+#include "snpy_wq.h"
+#include "snpy_ckpt.h"
+#include "snpy_target.h"
+#include "snpy_objstore.h"
+
+/*
+ * swift target plugin
+ *
+ * put uploads each file of data/, or the fifo a running export streams
+ * into, as an object named after it. An object larger than part_size
+ * goes up in parts, concurrency of them at a time on connections kept
+ * alive, each part retried on its own and checked against the md5 the
+ * store answers with. The parts become the object at commit only, so a
+ * failed upload, or one of a failed export, leaves no object behind.
+ * Streaming holds concurrency + 1 parts in memory. The parts of a file
+ * are recorded in an upload manifest as they are stored, so that a put
+ * that fails part way sends only what is missing when xcore runs it
+ * again, see upload_find().
+ *
+ * get fetches the backups of the restore into data/ by concurrent ranged
+ * GETs of part_size, each retried on its own and written at its offset;
+ * down a fifo they are written in order from concurrency + 1 buffers. Of
+ * a v2 data file only the header, footer and the records overlapping
+ * .rstr_range are fetched if the restore asks for ranges. A fetched v2
+ * data file is verified against the backup's checksums as far as get can
+ * without decoding: its index against the crc32c of the image in the tag,
+ * the header of each record against the index, and the bytes of records
+ * stored raw against their crc32c, see check_recs(). The crc32c of a
+ * compressed, deduplicated or sealed record is of its decoded bytes, which
+ * only import, linking the codecs, the chunk store and the key, checks;
+ * such a record fails the import, not a ranged GET retry here. What goes
+ * down a fifo is checked by import as it reads it.
+ *
+ * .tp_param: auth_method (keystone, tempauth or s3), url, user, password,
+ * project, container, region, part_size (MB), concurrency, retries and
+ * bw_limit (MB/s).
+ */
+
+#define SWIFT_PART_SIZE 64          /* MB */
+#define SWIFT_NTHREAD 8
+#define SWIFT_NTHREAD_MAX 64
+#define SWIFT_RETRIES 5
+#define SWIFT_BACKOFF_MAX 30        /* seconds */
+#define SWIFT_RANGE_GAP (64 << 10)  /* record gaps fetched rather than split */
+#define SWIFT_NRANGE_MAX 1024
+
+struct swift_conf {
+    struct snpy_objstore_conf os;
+    u64 part_size;
+    int nthread;
+    int retries;
+    u64 bw_limit;
+};
+
+struct swift {
+    struct swift_conf conf;
+    struct snpy_objstore os;
+    struct snpy_wq *wq;
+    struct snpy_tb *tb;
+    int failed;                     /* a part gave up, cancel the rest */
+    int last;                       /* no rerun follows a failure */
+    int up_fd;                      /* upload manifest, -1 if none */
+    pthread_mutex_t lock;           /* of connv and up_fd */
+    int nconn;
+    struct snpy_http_conn *connv[SWIFT_NTHREAD_MAX + 1];
+};
+
+/* a part of an upload, or the whole object if mp is NULL */
+struct part {
+    struct swift *sw;
+    const struct snpy_objstore_mp *mp;
+    const char *key;
+    int i;
+    int fd;                         /* source unless buf is set */
+    char *buf;
+    u64 off;                        /* of the part in fd */
+    u64 len;
+    u64 pos;                        /* bytes sent */
+    EVP_MD_CTX *md;
+    int keep;                       /* record it in the upload manifest */
+    int stored;                     /* by an earlier run, if md5 still is */
+    char md5[2 * 16 + 1];
+    char etag[64];
+    int rc;
+    int busy;
+    struct snpy_wq_item item;
+};
+
+static int swift_conf_init(struct swift_conf *conf, const char *arg) {
+    int error, rc = 0;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    memset(conf, 0, sizeof *conf);
+    struct snpy_objstore_conf *os = &conf->os;
+    strlcpy(os->auth_method, json_string(js, ".tp_param.auth_method"),
+            sizeof os->auth_method);
+    strlcpy(os->url, json_string(js, ".tp_param.url"), sizeof os->url);
+    strlcpy(os->user, json_string(js, ".tp_param.user"), sizeof os->user);
+    strlcpy(os->password, json_string(js, ".tp_param.password"),
+            sizeof os->password);
+    strlcpy(os->project, json_string(js, ".tp_param.project"),
+            sizeof os->project);
+    strlcpy(os->container, json_string(js, ".tp_param.container"),
+            sizeof os->container);
+    strlcpy(os->region, json_string(js, ".tp_param.region"),
+            sizeof os->region);
+
+    double part_size = json_number(js, ".tp_param.part_size");
+    conf->part_size = (part_size > 0 ? part_size : SWIFT_PART_SIZE) * (1 << 20);
+    /* s3 takes no part under 5 MB but the last */
+    conf->part_size = MAX(conf->part_size, 5 << 20);
+    conf->nthread = json_number(js, ".tp_param.concurrency");
+    if (conf->nthread <= 0)
+        conf->nthread = SWIFT_NTHREAD;
+    conf->nthread = MIN(conf->nthread, SWIFT_NTHREAD_MAX);
+    conf->retries = SWIFT_RETRIES;
+    if (json_exists(js, ".tp_param.retries"))
+        conf->retries = MAX(0, json_number(js, ".tp_param.retries"));
+    /* MB/s, on top of the share of the shared limits xcore hands out */
+    conf->bw_limit = json_number(js, ".tp_param.bw_limit") * (1 << 20);
+close_js:
+    json_close(js);
+    return rc;
+}
+
+/* conn_get() - a connection of the pool, kept alive since its last use */
+static struct snpy_http_conn *conn_get(struct swift *sw) {
+    struct snpy_http_conn *c = NULL;
+    pthread_mutex_lock(&sw->lock);
+    if (sw->nconn)
+        c = sw->connv[-- sw->nconn];
+    pthread_mutex_unlock(&sw->lock);
+    if (!c && (c = malloc(sizeof *c)))
+        snpy_objstore_conn(&sw->os, c);
+    return c;
+}
+
+static void conn_put(struct swift *sw, struct snpy_http_conn *c) {
+    pthread_mutex_lock(&sw->lock);
+    if (sw->nconn < ARRAY_SIZE(sw->connv)) {
+        sw->connv[sw->nconn ++] = c;
+        c = NULL;
+    }
+    pthread_mutex_unlock(&sw->lock);
+    if (c) {
+        snpy_http_conn_close(c);
+        free(c);
+    }
+}
+
+static int swift_open(struct swift *sw, const struct swift_conf *conf) {
+    int rc;
+    memset(sw, 0, sizeof *sw);
+    sw->conf = *conf;
+    sw->up_fd = -1;
+    pthread_mutex_init(&sw->lock, NULL);
+    if ((rc = snpy_objstore_open(&sw->os, &conf->os)))
+        goto err_out;
+    if (!(sw->wq = snpy_wq_create(conf->nthread))) {
+        rc = -ENOMEM;
+        goto close_os;
+    }
+    if (!(sw->tb = snpy_tb_create(conf->bw_limit, 0))) {
+        rc = -ENOMEM;
+        goto destroy_wq;
+    }
+    return 0;
+
+destroy_wq:
+    snpy_wq_destroy(sw->wq);
+close_os:
+    snpy_objstore_close(&sw->os);
+err_out:
+    pthread_mutex_destroy(&sw->lock);
+    return rc;
+}
+
+static void swift_close(struct swift *sw) {
+    snpy_tb_destroy(sw->tb);
+    snpy_wq_destroy(sw->wq);
+    while (sw->nconn) {
+        struct snpy_http_conn *c = sw->connv[-- sw->nconn];
+        snpy_http_conn_close(c);
+        free(c);
+    }
+    snpy_objstore_close(&sw->os);
+    pthread_mutex_destroy(&sw->lock);
+}
+
+/* final() - whether @rc is an error no retry can fix */
+static int final(int rc) {
+    return rc == -EACCES || rc == -ENOENT || rc == -EINVAL ||
+        rc == -ENAMETOOLONG || rc == -ENOMEM || rc == -EFBIG;
+}
+
+/*
+ * retry() - whether to try again after try @i failed with @rc
+ *
+ * Backs off exponentially first; errors a retry can not fix are final.
+ */
+static int retry(const struct swift *sw, int i, int rc, const char *what) {
+    if (i >= sw->conf.retries || sw->failed || final(rc))
+        return 0;
+    int delay = MIN(1 << MIN(i, 5), SWIFT_BACKOFF_MAX);
+    snpy_logger(SNPY_LOG_WARN, "%s failed: %d, retry %d in %ds.",
+                what, rc, i + 1, delay);
+    sleep(delay);
+    return 1;
+}
+
+/*
+ * upload manifest
+ *
+ * The objects of a put that go up in parts are recorded in
+ * SNPY_CKPT_UPLOAD_KEY as their parts are stored, a line at a time, synced:
+ *
+ *   obj <key> <size> <mtime> <part size> <upload id>
+ *   part <key> <i> <len> <md5> <etag>
+ *   done <key> <size> <mtime>
+ *   drop <key>
+ *
+ * If the put fails with an error a retry may fix, the stored parts are
+ * kept and so is the manifest, and xcore runs the put again. The rerun
+ * skips the objects done, uploads only the parts not recorded, or whose
+ * data no longer has the md5 recorded, and commits each object as before.
+ * A put that succeeds, or fails for good, drops the manifest.
+ */
+
+struct upload_part {
+    u64 len;                        /* 0 if not stored */
+    char md5[2 * 16 + 1];
+    char etag[64];
+};
+
+/* what an earlier run stored of an object */
+struct upload {
+    int done;
+    u64 part_size;                  /* 0 if there is no upload to resume */
+    struct snpy_objstore_mp mp;
+    int npart;
+    struct upload_part *partv;
+};
+
+static void upload_reset(struct upload *up) {
+    free(up->partv);
+    memset(up, 0, sizeof *up);
+}
+
+/*
+ * upload_find() - what the upload manifest records of @key
+ *
+ * An upload of the file @sb no longer is, size or mtime changed, is not
+ * resumed. A line not ended, cut short by a crash, is ignored.
+ */
+static int upload_find(const char *key, const struct stat *sb,
+                       struct upload *up) {
+    char line[2048], k[NAME_MAX + 1], id[1024], md5[64], etag[64];
+    unsigned long long size, len;
+    long mtime;
+    int i, rc = 0;
+    memset(up, 0, sizeof *up);
+    FILE *fp = fopen(SNPY_CKPT_UPLOAD_KEY, "r");
+    if (!fp)
+        return errno == ENOENT ? 0 : -errno;
+    while (fgets(line, sizeof line, fp)) {
+        if (!strchr(line, '\n'))
+            break;
+        if (sscanf(line, "obj %255s %llu %ld %llu %1023s",
+                   k, &size, &mtime, &len, id) == 5) {
+            if (strcmp(k, key))
+                continue;
+            upload_reset(up);
+            if (size != sb->st_size || mtime != sb->st_mtime || !len)
+                continue;
+            up->part_size = len;
+            strlcpy(up->mp.key, key, sizeof up->mp.key);
+            strlcpy(up->mp.id, id, sizeof up->mp.id);
+        } else if (sscanf(line, "part %255s %d %llu %63s %63s",
+                          k, &i, &len, md5, etag) == 5) {
+            if (strcmp(k, key) || !up->part_size || i < 0 ||
+                i >= SNPY_OBJSTORE_MP_MAX * SNPY_OBJSTORE_SLO_MAX ||
+                strlen(md5) != 2 * 16)
+                continue;
+            if (i >= up->npart) {
+                int n = MAX(2 * up->npart, i + 1);
+                struct upload_part *q = realloc(up->partv, n * sizeof *q);
+                if (!q) {
+                    rc = -ENOMEM;
+                    break;
+                }
+                memset(q + up->npart, 0, (n - up->npart) * sizeof *q);
+                up->partv = q;
+                up->npart = n;
+            }
+            up->partv[i].len = len;
+            strlcpy(up->partv[i].md5, md5, sizeof up->partv[i].md5);
+            strlcpy(up->partv[i].etag, etag, sizeof up->partv[i].etag);
+        } else if (sscanf(line, "done %255s %llu %ld", k, &size, &mtime) == 3) {
+            if (strcmp(k, key))
+                continue;
+            upload_reset(up);
+            up->done = size == sb->st_size && mtime == sb->st_mtime;
+        } else if (sscanf(line, "drop %255s", k) == 1 && !strcmp(k, key)) {
+            upload_reset(up);
+        }
+    }
+    fclose(fp);
+    if (rc)
+        upload_reset(up);
+    return rc;
+}
+
+/*
+ * upload_log() - add a line to the upload manifest
+ *
+ * A manifest that can not be updated is dropped, a rerun then starts over.
+ */
+static void upload_log(struct swift *sw, const char *fmt, ...) {
+    char line[2048];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof line, fmt, ap);
+    va_end(ap);
+    pthread_mutex_lock(&sw->lock);
+    if (sw->up_fd != -1 &&
+        (n >= sizeof line || write(sw->up_fd, line, n) != n ||
+         fdatasync(sw->up_fd))) {
+        snpy_logger(SNPY_LOG_WARN, "can not update the upload manifest, "
+                    "dropping it.");
+        close(sw->up_fd);
+        sw->up_fd = -1;
+        unlink(SNPY_CKPT_UPLOAD_KEY);
+    }
+    pthread_mutex_unlock(&sw->lock);
+}
+
+/*
+ * upload_open() - start, or go on with, the upload manifest of a put
+ *
+ * A rerun waits a while first, for what failed the run before to pass.
+ */
+static void upload_open(struct swift *sw) {
+    int nresume = 0;
+    kv_get_ival("meta/nresume", &nresume, NULL);
+    sw->last = nresume >= SNPY_CKPT_RESUME_MAX;
+    if (nresume) {
+        int delay = MIN(SWIFT_BACKOFF_MAX << MIN(nresume - 1, 4), 300);
+        snpy_logger(SNPY_LOG_INFO, "rerun %d of the put, resuming in %ds.",
+                    nresume, delay);
+        sleep(delay);
+    }
+    sw->up_fd = open(SNPY_CKPT_UPLOAD_KEY, O_WRONLY|O_APPEND|O_CREAT, 0600);
+    if (sw->up_fd == -1)
+        snpy_logger(SNPY_LOG_WARN, "can not open the upload manifest: %d, "
+                    "a rerun starts over.", -errno);
+}
+
+/* upload_close() - keep the manifest only if a rerun can finish the put */
+static void upload_close(struct swift *sw, int rc) {
+    if (sw->up_fd == -1)
+        return;
+    close(sw->up_fd);
+    sw->up_fd = -1;
+    if (!rc || final(rc) || sw->last)
+        unlink(SNPY_CKPT_UPLOAD_KEY);
+}
+
+static ssize_t part_read(void *arg, char *dst, size_t n) {
+    struct part *p = arg;
+    ssize_t got = MIN(n, p->len - p->pos);
+    if (p->buf)
+        memcpy(dst, p->buf + p->pos, got);
+    else if ((got = pread(p->fd, dst, got, p->off + p->pos)) <= 0)
+        return got ? -errno : -EIO;
+    if (EVP_DigestUpdate(p->md, dst, got) != 1)
+        return -EIO;
+    snpy_tb_take(p->sw->tb, got, 0);
+    p->pos += got;
+    return got;
+}
+
+/* part_send() - one try of uploading @p, checked against its ETag */
+static int part_send(struct part *p, struct snpy_http_conn *c) {
+    struct swift *sw = p->sw;
+    u8 md[EVP_MAX_MD_SIZE];
+    unsigned int i, mdlen;
+    int rc;
+    p->pos = 0;
+    if (EVP_DigestInit_ex(p->md, EVP_md5(), NULL) != 1)
+        return -EIO;
+    snpy_tb_take(sw->tb, 0, 1);
+    rc = p->mp ? snpy_objstore_mp_put(&sw->os, c, p->mp, p->i, p->len,
+                                      part_read, p, p->etag) :
+        snpy_objstore_put(&sw->os, c, p->key, p->len, part_read, p, p->etag);
+    if (rc)
+        return rc;
+    if (EVP_DigestFinal_ex(p->md, md, &mdlen) != 1)
+        return -EIO;
+    for (i = 0; i < mdlen; i ++)
+        sprintf(p->md5 + 2 * i, "%02x", md[i]);
+    /* an ETag that is no md5, as of objects s3 encrypts with kms, is not */
+    if (strlen(p->etag) == 2 * mdlen && strcasecmp(p->etag, p->md5))
+        return -EBADMSG;
+    return 0;
+}
+
+/* part_stored() - whether the data of @p still is what an earlier run sent */
+static int part_stored(struct part *p) {
+    u8 md[EVP_MAX_MD_SIZE];
+    unsigned int i, mdlen;
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    u64 pos;
+    size_t size = 1 << 20;
+    char *buf = malloc(size);
+    int ok = 0;
+    if (!buf || EVP_DigestInit_ex(p->md, EVP_md5(), NULL) != 1)
+        goto free_buf;
+    for (pos = 0; pos < p->len; ) {
+        ssize_t got = pread(p->fd, buf, MIN(size, p->len - pos), p->off + pos);
+        if (got <= 0 || EVP_DigestUpdate(p->md, buf, got) != 1)
+            goto free_buf;
+        pos += got;
+    }
+    if (EVP_DigestFinal_ex(p->md, md, &mdlen) != 1)
+        goto free_buf;
+    for (i = 0; i < mdlen; i ++)
+        sprintf(hex + 2 * i, "%02x", md[i]);
+    ok = !strcmp(hex, p->md5);
+free_buf:
+    free(buf);
+    return ok;
+}
+
+/* part_run() - upload @arg with retries, on a connection of the pool */
+static void part_run(void *arg) {
+    struct part *p = arg;
+    struct swift *sw = p->sw;
+    struct snpy_http_conn *c = NULL;
+    char what[300];
+    int i;
+    if (sw->failed) {
+        p->rc = -ECANCELED;
+        return;
+    }
+    snprintf(what, sizeof what, "upload of part %d of %s", p->i, p->key);
+    if (!(p->md = EVP_MD_CTX_new())) {
+        p->rc = -ENOMEM;
+        goto out;
+    }
+    if (p->stored) {
+        if ((p->rc = part_stored(p) ? 0 : -ESTALE) == 0)
+            goto out;
+        snpy_logger(SNPY_LOG_WARN, "part %d of %s changed, sending it again.",
+                    p->i, p->key);
+    }
+    if (!(c = conn_get(sw))) {
+        p->rc = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; (p->rc = part_send(p, c)) && retry(sw, i, p->rc, what); i ++)
+        ;
+    conn_put(sw, c);
+    if (!p->rc && p->keep && !strpbrk(p->etag, " \t\n"))
+        upload_log(sw, "part %s %d %llu %s %s\n", p->key, p->i,
+                   (unsigned long long)p->len, p->md5, p->etag);
+out:
+    EVP_MD_CTX_free(p->md);
+    p->md = NULL;
+    if (p->rc) {
+        snpy_logger(SNPY_LOG_ERR, "%s failed: %d.", what, p->rc);
+        sw->failed = 1;
+    }
+}
+
+static int mp_begin(struct swift *sw, struct snpy_http_conn *c,
+                    const char *key, struct snpy_objstore_mp *mp) {
+    int rc, i;
+    for (i = 0; (rc = snpy_objstore_mp_begin(&sw->os, c, key, mp)) &&
+             retry(sw, i, rc, "upload start"); i ++)
+        ;
+    return rc;
+}
+
+static int mp_commit(struct swift *sw, struct snpy_http_conn *c,
+                     const struct snpy_objstore_mp *mp,
+                     const struct snpy_objstore_part *partv, int n) {
+    int rc, i;
+    for (i = 0; (rc = snpy_objstore_mp_commit(&sw->os, c, mp, partv, n)) &&
+             retry(sw, i, rc, "upload commit"); i ++)
+        ;
+    return rc;
+}
+
+/*
+ * mp_end() - commit the @n parts of @mp or, on @rc, drop them
+ *
+ * Returns @rc or the error of the commit.
+ */
+static int mp_end(struct swift *sw, struct snpy_http_conn *c,
+                  const struct snpy_objstore_mp *mp,
+                  const struct snpy_objstore_part *partv, int n, int rc) {
+    if (!rc)
+        rc = mp_commit(sw, c, mp, partv, n);
+    if (rc) {
+        snpy_logger(SNPY_LOG_ERR, "upload of %s failed: %d, dropping %d parts.",
+                    mp->key, rc, n);
+        snpy_objstore_mp_abort(&sw->os, c, mp, n);
+    }
+    return rc;
+}
+
+/*
+ * upload_parts() - upload the @size bytes of @fd as @key, in parallel parts
+ *
+ * Goes on with the upload @up names, if any. On an error the parts stored
+ * are dropped, unless they are in the manifest and a rerun can finish.
+ */
+static int upload_parts(struct swift *sw, const char *key, int fd, u64 size,
+                        const struct stat *sb, struct upload *up, int keep) {
+    int rc = 0, i, nstored = 0;
+    u64 part_size = up->part_size;
+    if (!part_size) {
+        part_size = sw->conf.part_size;
+        if (sw->os.api == SNPY_OBJSTORE_S3)
+            part_size = MAX(part_size, (size + SNPY_OBJSTORE_MP_MAX - 1) /
+                            SNPY_OBJSTORE_MP_MAX);
+    }
+    int n = (size + part_size - 1) / part_size;
+    struct part *partv = calloc(n, sizeof *partv);
+    struct snpy_objstore_part *ov = calloc(n, sizeof *ov);
+    struct snpy_http_conn *c = conn_get(sw);
+    if (!partv || !ov || !c) {
+        rc = -ENOMEM;
+        goto free_partv;
+    }
+    if (!up->part_size) {
+        if ((rc = mp_begin(sw, c, key, &up->mp)))
+            goto free_partv;
+        if (keep)
+            upload_log(sw, "obj %s %llu %ld %llu %s\n", key,
+                       (unsigned long long)size, (long)sb->st_mtime,
+                       (unsigned long long)part_size, up->mp.id);
+    }
+    for (i = 0; i < n; i ++) {
+        struct part *p = &partv[i];
+        p->sw = sw;
+        p->mp = &up->mp;
+        p->key = key;
+        p->i = i;
+        p->fd = fd;
+        p->off = i * part_size;
+        p->len = MIN(part_size, size - p->off);
+        p->keep = keep;
+        if (i < up->npart && up->partv[i].len == p->len) {
+            p->stored = 1;
+            strlcpy(p->md5, up->partv[i].md5, sizeof p->md5);
+            strlcpy(p->etag, up->partv[i].etag, sizeof p->etag);
+            nstored ++;
+        }
+        snpy_wq_submit(sw->wq, &p->item, part_run, p);
+    }
+    if (up->part_size)
+        snpy_logger(SNPY_LOG_INFO, "resuming upload of %s, %d of %d parts "
+                    "stored.", key, nstored, n);
+    for (i = 0; i < n; i ++) {
+        snpy_wq_wait(sw->wq, &partv[i].item);
+        /* the error of the part that failed, not of those it cancelled */
+        if (partv[i].rc && (!rc || rc == -ECANCELED))
+            rc = partv[i].rc;
+        ov[i].size = partv[i].len;
+        strlcpy(ov[i].etag, partv[i].etag, sizeof ov[i].etag);
+    }
+    if (!rc && !(rc = mp_commit(sw, c, &up->mp, ov, n))) {
+        if (keep)
+            upload_log(sw, "done %s %llu %ld\n", key,
+                       (unsigned long long)size, (long)sb->st_mtime);
+    } else if (keep && !final(rc) && !sw->last) {
+        snpy_logger(SNPY_LOG_ERR, "upload of %s failed: %d, keeping its "
+                    "parts for a rerun.", key, rc);
+    } else {
+        snpy_logger(SNPY_LOG_ERR, "upload of %s failed: %d, dropping %d "
+                    "parts.", key, rc, n);
+        snpy_objstore_mp_abort(&sw->os, c, &up->mp, n);
+        if (keep)
+            upload_log(sw, "drop %s\n", key);
+    }
+free_partv:
+    if (c)
+        conn_put(sw, c);
+    free(ov);
+    free(partv);
+    return rc;
+}
+
+/*
+ * upload_file() - upload the file @fd as @key
+ *
+ * What an earlier run of the put stored of it is not sent again.
+ */
+static int upload_file(struct swift *sw, const char *key, int fd,
+                       const struct stat *sb) {
+    int rc;
+    u64 size = sb->st_size;
+    struct upload up;
+    /* the manifest is of words */
+    int keep = sw->up_fd != -1 && !strpbrk(key, " \t\n");
+    if (!keep || upload_find(key, sb, &up))
+        memset(&up, 0, sizeof up);
+    if (up.done) {
+        snpy_logger(SNPY_LOG_INFO, "%s stored by an earlier run.", key);
+        return 0;
+    }
+
+    if (size <= sw->conf.part_size) {
+        struct part one = {
+            .sw = sw, .key = key, .fd = fd, .len = size
+        };
+        part_run(&one);
+        if (!(rc = one.rc) && keep)
+            upload_log(sw, "done %s %llu %ld\n", key,
+                       (unsigned long long)size, (long)sb->st_mtime);
+        goto free_up;
+    }
+    rc = upload_parts(sw, key, fd, size, sb, &up, keep);
+    if (rc == -ENOENT && up.part_size) {
+        /* expired or aborted in the store */
+        snpy_logger(SNPY_LOG_WARN, "upload of %s is gone, starting over.",
+                    key);
+        upload_log(sw, "drop %s\n", key);
+        upload_reset(&up);
+        sw->failed = 0;
+        rc = upload_parts(sw, key, fd, size, sb, &up, keep);
+    }
+free_up:
+    upload_reset(&up);
+    return rc;
+}
+
+/*
+ * upload_stream() - upload @fd, of unknown size, as @key
+ *
+ * The stream is read into concurrency + 1 part buffers, refilled as their
+ * uploads finish. The upload is committed only once the export is known
+ * to have succeeded.
+ */
+static int upload_stream(struct swift *sw, const char *key, int fd) {
+    int rc = 0, i, n = 0, nslot = sw->conf.nthread + 1;
+    int single = 0;
+    size_t nalloc = 0;
+    struct snpy_objstore_mp mp;
+    struct snpy_objstore_part *ov = NULL;
+    struct part *slotv = calloc(nslot, sizeof *slotv);
+    struct snpy_http_conn *c = conn_get(sw);
+    if (!slotv || !c) {
+        rc = -ENOMEM;
+        goto free_slotv;
+    }
+    for (i = 0; i < nslot; i ++)
+        if (!(slotv[i].buf = malloc(sw->conf.part_size))) {
+            rc = -ENOMEM;
+            goto free_slotv;
+        }
+
+    for (i = 0; ; i ++) {
+        struct part *p = &slotv[i % nslot];
+        if (p->busy) {
+            snpy_wq_wait(sw->wq, &p->item);
+            p->busy = 0;
+            ov[p->i].size = p->len;
+            strlcpy(ov[p->i].etag, p->etag, sizeof ov[p->i].etag);
+            if ((rc = p->rc))
+                break;
+        }
+        ssize_t len = snpy_read_full(fd, p->buf, sw->conf.part_size);
+        if (len < 0) {
+            rc = len;
+            break;
+        }
+        if (!i && len < sw->conf.part_size) {
+            single = 1;                 /* all of it, PUT after the check */
+            p->len = len;
+            break;
+        }
+        if (!len)
+            break;
+        if (!i && (rc = mp_begin(sw, c, key, &mp)))
+            break;
+        if (sw->os.api == SNPY_OBJSTORE_S3 && i >= SNPY_OBJSTORE_MP_MAX) {
+            rc = -EFBIG;
+            break;
+        }
+        if (i >= nalloc) {
+            size_t m = MAX(2 * nalloc, 64);
+            struct snpy_objstore_part *q = realloc(ov, m * sizeof *q);
+            if (!q) {
+                rc = -ENOMEM;
+                break;
+            }
+            ov = q;
+            nalloc = m;
+        }
+        p->sw = sw;
+        p->mp = &mp;
+        p->key = key;
+        p->i = i;
+        p->len = len;
+        p->busy = 1;
+        snpy_wq_submit(sw->wq, &p->item, part_run, p);
+        n = i + 1;
+    }
+    for (i = 0; i < nslot; i ++) {
+        struct part *p = &slotv[i];
+        if (!p->busy)
+            continue;
+        snpy_wq_wait(sw->wq, &p->item);
+        p->busy = 0;
+        ov[p->i].size = p->len;
+        strlcpy(ov[p->i].etag, p->etag, sizeof ov[p->i].etag);
+        if (!rc)
+            rc = p->rc;
+    }
+
+    int status = snpy_target_export_status();
+    if (!rc && status) {
+        snpy_logger(SNPY_LOG_ERR, "export failed: %d, not keeping %s.",
+                    status, key);
+        rc = -EIO;
+    }
+    if (single) {
+        if (!rc) {
+            slotv[0].sw = sw;
+            slotv[0].key = key;
+            part_run(&slotv[0]);
+            rc = slotv[0].rc;
+        }
+    } else if (n) {
+        rc = mp_end(sw, c, &mp, ov, n, rc);
+    }
+free_slotv:
+    if (c)
+        conn_put(sw, c);
+    for (i = 0; slotv && i < nslot; i ++)
+        free(slotv[i].buf);
+    free(slotv);
+    free(ov);
+    return rc;
+}
+
+/* first_entry() - name of the first entry of @dir */
+static int first_entry(const char *dir, char *name, size_t size) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    int rc = -ENOENT;
+    if (!d)
+        return -errno;
+    while ((de = readdir(d)))
+        if (de->d_name[0] != '.') {
+            rc = strlcpy(name, de->d_name, size) < size ? 0 : -ENAMETOOLONG;
+            break;
+        }
+    closedir(d);
+    return rc;
+}
+
+static int do_put(struct swift *sw) {
+    int rc = 0, fd;
+    char fn[PATH_MAX], key[NAME_MAX + 1];
+    struct stat sb;
+    if (lstat("data", &sb))
+        return -errno;
+
+    if (S_ISLNK(sb.st_mode)) {
+        /* streamed from a running export through the fifo data/<export id> */
+        if ((rc = first_entry("data", key, sizeof key)))
+            return rc;
+        snprintf(fn, sizeof fn, "data/%s", key);
+        if ((fd = open(fn, O_RDONLY)) == -1)
+            return -errno;
+        snpy_logger(SNPY_LOG_INFO, "streaming %s.", key);
+        rc = upload_stream(sw, key, fd);
+        close(fd);
+        return rc;
+    }
+
+    DIR *d = opendir("data");
+    struct dirent *de;
+    if (!d)
+        return -errno;
+    upload_open(sw);
+    while (!rc && (de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(fn, sizeof fn, "data/%s", de->d_name);
+        if ((fd = open(fn, O_RDONLY)) == -1) {
+            rc = -errno;
+            break;
+        }
+        if (fstat(fd, &sb))
+            rc = -errno;
+        else if (S_ISREG(sb.st_mode)) {
+            snpy_logger(SNPY_LOG_INFO, "uploading %s, %llu bytes.",
+                        de->d_name, (unsigned long long)sb.st_size);
+            rc = upload_file(sw, de->d_name, fd, &sb);
+        }
+        close(fd);
+    }
+    closedir(d);
+    upload_close(sw, rc);
+    return rc;
+}
+
+struct range {
+    u64 off;
+    u64 len;
+};
+
+struct range_list {
+    struct range *v;
+    size_t n;
+    size_t nalloc;
+};
+
+/*
+ * range_add() - add [@off, @off + @len) to @l, in pieces of at most @max
+ *
+ * A range starting at most @gap after the last one is merged into it as
+ * long as that stays within @max.
+ */
+static int range_add(struct range_list *l, u64 off, u64 len, u64 gap,
+                     u64 max) {
+    struct range *last = l->n ? &l->v[l->n - 1] : NULL;
+    if (last && off >= last->off + last->len &&
+        off - (last->off + last->len) <= gap &&
+        off + len - last->off <= max) {
+        last->len = off + len - last->off;
+        return 0;
+    }
+    while (len) {
+        if (l->n == l->nalloc) {
+            size_t m = MAX(2 * l->nalloc, 64);
+            struct range *v = realloc(l->v, m * sizeof *v);
+            if (!v)
+                return -ENOMEM;
+            l->v = v;
+            l->nalloc = m;
+        }
+        u64 n = MIN(len, max);
+        l->v[l->n ++] = (struct range){ off, n };
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+struct sink {
+    struct swift *sw;
+    int fd;                         /* destination unless buf is set */
+    char *buf;                      /* holding bytes from base on */
+    u64 base;
+    u64 len;                        /* bytes it takes from base on */
+    u64 off;                        /* where the next bytes go */
+};
+
+/* sink_write() - take @n more bytes, failing any past the range asked for */
+static int sink_write(void *arg, const char *data, size_t n) {
+    struct sink *s = arg;
+    size_t done = 0;
+    if (n > s->base + s->len - s->off)
+        return -EIO;
+    snpy_tb_take(s->sw->tb, n, 0);
+    if (s->buf)
+        memcpy(s->buf + s->off - s->base, data, n);
+    while (!s->buf && done < n) {
+        ssize_t m = pwrite(s->fd, data + done, n - done, s->off + done);
+        if (m <= 0)
+            return m ? -errno : -EIO;
+        done += m;
+    }
+    s->off += n;
+    return 0;
+}
+
+/*
+ * get_range() - GET bytes [@off, @off + @len) of @key
+ *
+ * They go to the same offsets of @fd, or to @buf if set; a failed GET is
+ * tried again from the start of the range.
+ */
+static int get_range(struct swift *sw, struct snpy_http_conn *c,
+                     const char *key, int fd, char *buf, u64 off, u64 len) {
+    struct sink s = { 
+        .sw = sw, .fd = fd, .buf = buf, .base = off, .len = len 
+    };
+    char what[64];
+    int rc, i;
+    snprintf(what, sizeof what, "get of %s at %llu", key,
+             (unsigned long long)off);
+    for (i = 0; ; i ++) {
+        s.off = off;
+        snpy_tb_take(sw->tb, 0, 1);
+        rc = snpy_objstore_get(&sw->os, c, key, off, len, sink_write, &s);
+        if (!rc || !retry(sw, i, rc, what))
+            return rc;
+    }
+}
+
+/* a ranged GET run by the work queue */
+struct get_job {
+    struct swift *sw;
+    const char *key;
+    int fd;
+    char *buf;
+    struct range r;
+    int rc;
+    int busy;
+    struct snpy_wq_item item;
+};
+
+static void get_run(void *arg) {
+    struct get_job *j = arg;
+    struct snpy_http_conn *c;
+    if (j->sw->failed) {
+        j->rc = -ECANCELED;
+        return;
+    }
+    if (!(c = conn_get(j->sw))) {
+        j->rc = -ENOMEM;
+        return;
+    }
+    j->rc = get_range(j->sw, c, j->key, j->fd, j->buf, j->r.off, j->r.len);
+    conn_put(j->sw, c);
+    if (j->rc) {
+        snpy_logger(SNPY_LOG_ERR, "get of %s at %llu failed: %d.", j->key,
+                    (unsigned long long)j->r.off, j->rc);
+        j->sw->failed = 1;
+    }
+}
+
+/* get_ranges() - GET the ranges of @l of @key into @fd, concurrently */
+static int get_ranges(struct swift *sw, const char *key, int fd,
+                      const struct range_list *l) {
+    int rc = 0;
+    size_t i;
+    struct get_job *jv = calloc(l->n, sizeof *jv);
+    if (!jv && l->n)
+        return -ENOMEM;
+    for (i = 0; i < l->n; i ++) {
+        jv[i] = (struct get_job){ .sw = sw, .key = key, .fd = fd,
+                                  .r = l->v[i] };
+        snpy_wq_submit(sw->wq, &jv[i].item, get_run, &jv[i]);
+    }
+    for (i = 0; i < l->n; i ++) {
+        snpy_wq_wait(sw->wq, &jv[i].item);
+        if (!rc)
+            rc = jv[i].rc;
+    }
+    free(jv);
+    sw->failed = 0;
+    return rc;
+}
+
+/*
+ * get_stream() - GET all @size bytes of @key down the fifo @fd
+ *
+ * Ranges are fetched concurrently into concurrency + 1 buffers and
+ * written out in order as they arrive.
+ */
+static int get_stream(struct swift *sw, const char *key, int fd, u64 size) {
+    int rc = 0, i, nslot = sw->conf.nthread + 1;
+    u64 k, part_size = sw->conf.part_size;
+    u64 n = (size + part_size - 1) / part_size;
+    struct get_job *slotv = calloc(nslot, sizeof *slotv);
+    if (!slotv)
+        return -ENOMEM;
+    for (i = 0; i < nslot; i ++)
+        if (!(slotv[i].buf = malloc(part_size))) {
+            rc = -ENOMEM;
+            goto free_slotv;
+        }
+    for (k = 0; !rc && k < n + nslot; k ++) {
+        struct get_job *j = &slotv[k % nslot];
+        if (j->busy) {                  /* range k - nslot, the oldest */
+            snpy_wq_wait(sw->wq, &j->item);
+            j->busy = 0;
+            if (!(rc = j->rc) &&
+                snpy_write_full(fd, j->buf, j->r.len) != j->r.len)
+                rc = errno ? -errno : -EIO;
+        }
+        if (rc || k >= n)
+            continue;
+        j->sw = sw;
+        j->key = key;
+        j->r.off = k * part_size;
+        j->r.len = MIN(part_size, size - j->r.off);
+        j->busy = 1;
+        snpy_wq_submit(sw->wq, &j->item, get_run, j);
+    }
+    sw->failed = 1;                     /* cancel what is left */
+    for (i = 0; i < nslot; i ++)
+        if (slotv[i].busy)
+            snpy_wq_wait(sw->wq, &slotv[i].item);
+    sw->failed = 0;
+free_slotv:
+    for (i = 0; i < nslot; i ++)
+        free(slotv[i].buf);
+    free(slotv);
+    return rc;
+}
+
+/*
+ * data_hdr() - header of data file @fd of @size bytes
+ *
+ * With @c set, the header is fetched from @key first, and so is the one in
+ * front of the tag of a streamed export.
+ */
+static int data_hdr(struct swift *sw, struct snpy_http_conn *c,
+                    const char *key, int fd, u64 size,
+                    struct snpy_data_hdr *hdr) {
+    int rc;
+    u64 off = 0;
+    for (;;) {
+        if (c && (rc = get_range(sw, c, key, fd, NULL, off, sizeof *hdr)))
+            return rc;
+        if (pread(fd, hdr, sizeof *hdr, off) != sizeof *hdr)
+            return -EIO;
+        if (!(hdr->compress_type & SNPY_DATA_F_V2))
+            return 0;                   /* v1, no index to go by */
+        if (off || hdr->blk_map_offset != SNPY_DATA_HDR_TRAILER)
+            break;
+        if (size < SNPY_DATA_TAG_SIZE + 2 * sizeof *hdr)
+            return -EINVAL;
+        off = size - SNPY_DATA_TAG_SIZE - sizeof *hdr;
+    }
+    if (hdr->magic != SNPY_DATA_MAGIC || hdr->idx_offset < sizeof *hdr ||
+        hdr->idx_offset >= size)
+        return -EINVAL;
+    return 0;
+}
+
+static int overlaps(const struct snpy_data_ent *ent,
+                    const struct range *rv, int nr) {
+    int i;
+    for (i = 0; i < nr; i ++)
+        if (ent->off < rv[i].off + rv[i].len && ent->off + ent->len > rv[i].off)
+            return 1;
+    return 0;
+}
+
+/*
+ * check_recs() - check the records of @idx in data file @fd
+ *
+ * A record must follow a header repeating its index entry and one stored
+ * raw must match its crc32c; compressed, deduplicated and sealed records
+ * are checked by import as it decodes them; their number, and that of all
+ * records of a file without crc32c, is added to @nskip. Only records overlapping the @nr ranges @rv are checked if @nr;
+ * the file ranges of bad ones are added to @bad.
+ */
+static int check_recs(const struct swift *sw, int fd,
+                      const struct snpy_data_hdr *hdr,
+                      const struct snpy_data_idx *idx,
+                      const struct range *rv, int nr, struct range_list *bad,
+                      u64 *nskip) {
+    int rc = 0;
+    u64 i;
+    size_t size = MAX(hdr->chunk_size, SNPY_DATA_CHUNK_SIZE);
+    int crc = (hdr->flags & SNPY_DATA_F_CRC32C) &&
+        !(hdr->flags & (SNPY_DATA_F_DEDUP|SNPY_DATA_F_CRYPT));
+    char *buf = crc ? malloc(size) : NULL;
+    if (crc && !buf)
+        return -ENOMEM;
+    for (i = 0; !rc && i < idx->nuse; i ++) {
+        const struct snpy_data_ent *ent = &idx->entv[i];
+        struct snpy_seg_rec rec;
+        u64 off = ent->file_off - sizeof rec;
+        if (nr && !overlaps(ent, rv, nr))
+            continue;
+        if (ent->file_off < sizeof *hdr + sizeof rec ||
+            ent->file_off + ent->zlen > hdr->idx_offset) {
+            rc = -EINVAL;               /* the index itself is bad */
+            break;
+        }
+        if (pread(fd, &rec, sizeof rec, off) != sizeof rec) {
+            rc = -EIO;
+            break;
+        }
+        int ok = rec.off == ent->off && rec.len == ent->len &&
+            rec.zlen == ent->zlen && rec.codec == ent->codec &&
+            rec.crc == ent->crc;
+        /* codec 1 is stored raw */
+        if (ok && crc && ent->codec == 1 && ent->zlen == ent->len &&
+            ent->len <= size) {
+            if (pread(fd, buf, ent->len, ent->file_off) != ent->len)
+                rc = -EIO;
+            else
+                ok = snpy_crc32c(0, buf, ent->len) == ent->crc;
+        } else if (ok) {
+            (*nskip) ++;
+        }
+        if (!rc && !ok)
+            rc = range_add(bad, off, sizeof rec + ent->zlen, 0,
+                           sw->conf.part_size);
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * check_tag() - whether the index of a data file adds up to the crc32c
+ * of the image the export put in its tag
+ */
+static int check_tag(int fd, u64 size, const struct snpy_data_hdr *hdr,
+                     const struct snpy_data_idx *idx) {
+    u32 crc = 0, want;
+    u64 i;
+    if (!(hdr->flags & SNPY_DATA_F_CRC32C) || size < SNPY_DATA_TAG_SIZE)
+        return 0;
+    for (i = 0; i < idx->nuse; i ++)
+        crc = snpy_crc32c_combine(crc, idx->entv[i].crc, idx->entv[i].len);
+    if (pread(fd, &want, sizeof want, size - SNPY_DATA_TAG_SIZE +
+              offsetof(struct snpy_data_tag, chksum)) != sizeof want)
+        return -EIO;
+    return crc == want ? 0 : -EBADMSG;
+}
+
+/*
+ * read_idx() - index of data file @key fetched into @fd
+ *
+ * An index that can not be read or does not add up to the tag is fetched
+ * again with the rest of the footer, up to retries times.
+ */
+static int read_idx(struct swift *sw, const char *key, int fd, u64 size,
+                    const struct snpy_data_hdr *hdr,
+                    struct snpy_data_idx **idx) {
+    int rc, i;
+    struct range_list l = { NULL, 0, 0 };
+    if ((rc = range_add(&l, hdr->idx_offset, size - hdr->idx_offset, 0,
+                        sw->conf.part_size)))
+        return rc;
+    for (i = 0; ; i ++) {
+        *idx = NULL;
+        if (lseek(fd, hdr->idx_offset, SEEK_SET) == -1)
+            rc = -errno;
+        else if (!(rc = snpy_data_idx_read(fd, idx)) &&
+                 (rc = check_tag(fd, size, hdr, *idx))) {
+            snpy_data_idx_free(*idx);
+            *idx = NULL;
+        }
+        if (!rc || rc == -ENOMEM)
+            break;
+        snpy_logger(SNPY_LOG_WARN, "%s: index failed its check: %d.", key, rc);
+        if (i >= sw->conf.retries) {
+            rc = -EBADMSG;
+            break;
+        }
+        if ((rc = get_ranges(sw, key, fd, &l)))
+            break;
+    }
+    free(l.v);
+    return rc;
+}
+
+/*
+ * verify() - check the records of fetched data file @key
+ *
+ * Records failing their check are fetched again, up to retries times.
+ */
+static int verify(struct swift *sw, const char *key, int fd,
+                  const struct snpy_data_hdr *hdr,
+                  const struct snpy_data_idx *idx,
+                  const struct range *rv, int nr) {
+    int rc, i;
+    u64 nskip = 0;
+    struct range_list bad = { NULL, 0, 0 };
+    for (i = 0; ; i ++) {
+        bad.n = 0;
+        if ((rc = check_recs(sw, fd, hdr, idx, rv, nr, &bad, &nskip)) || 
+            !bad.n)
+            break;
+        snpy_logger(SNPY_LOG_WARN, "%s: %zu ranges failed their check.",
+                    key, bad.n);
+        if (i >= sw->conf.retries) {
+            rc = -EBADMSG;
+            break;
+        }
+        if ((rc = get_ranges(sw, key, fd, &bad)))
+            break;
+        nskip = 0;
+    }
+    if (!rc && nskip)
+        snpy_logger(SNPY_LOG_INFO, "%s: %llu records not stored raw or "
+                    "without crc32c, left to import to check.", key, 
+                    (unsigned long long)nskip);
+    free(bad.v);
+    return rc;
+}
+
+/*
+ * fetch() - GET data file @key into @fn, which may be a fifo
+ *
+ * A file is preallocated and filled by concurrent ranged GETs, each
+ * written at its offset. With @nr ranges @rv of a v2 data file only the
+ * header, the footer (index, manifest, blk_map, tag) and the records
+ * overlapping them are fetched into a sparse file; records close together
+ * come in one GET. v2 data files are then checked against their
+ * checksums.
+ */
+static int fetch(struct swift *sw, const char *key, const char *fn,
+                 const struct range *rv, int nr) {
+    int rc, fd;
+    u64 size, i;
+    struct stat sb;
+    struct snpy_data_hdr hdr;
+    struct snpy_data_idx *idx = NULL;
+    struct range_list l = { NULL, 0, 0 };
+    u64 part_size = sw->conf.part_size;
+    struct snpy_http_conn *c = conn_get(sw);
+    if (!c)
+        return -ENOMEM;
+    if ((rc = snpy_objstore_head(&sw->os, c, key, &size)))
+        goto put_conn;
+    int fifo = !stat(fn, &sb) && S_ISFIFO(sb.st_mode);
+    if ((fd = open(fn, fifo ? O_WRONLY : O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+        rc = -errno;
+        goto put_conn;
+    }
+    if (fifo) {
+        rc = get_stream(sw, key, fd, size);
+        goto close_fd;
+    }
+    if (nr) {
+        rc = ftruncate(fd, size) ? -errno : 0;
+    } else if ((rc = -posix_fallocate(fd, 0, size)) == -EOPNOTSUPP ||
+               rc == -EINVAL) {
+        rc = ftruncate(fd, size) ? -errno : 0;
+    }
+    if (rc)
+        goto close_fd;
+
+    int v2 = 0;
+    if (nr && size >= sizeof hdr) {
+        if ((rc = data_hdr(sw, c, key, fd, size, &hdr)))
+            goto close_fd;
+        v2 = !!(hdr.compress_type & SNPY_DATA_F_V2);
+    }
+    if (v2) {
+        if ((rc = range_add(&l, hdr.idx_offset, size - hdr.idx_offset, 0,
+                            part_size)) ||
+            (rc = get_ranges(sw, key, fd, &l)) ||
+            (rc = read_idx(sw, key, fd, size, &hdr, &idx)))
+            goto free_l;
+        l.n = 0;
+        for (i = 0; !rc && i < idx->nuse; i ++) {
+            const struct snpy_data_ent *ent = &idx->entv[i];
+            if (overlaps(ent, rv, nr) && ent->file_off >= sizeof hdr +
+                sizeof(struct snpy_seg_rec))
+                rc = range_add(&l, ent->file_off - sizeof(struct snpy_seg_rec),
+                               sizeof(struct snpy_seg_rec) + ent->zlen,
+                               SWIFT_RANGE_GAP, part_size);
+        }
+    } else {
+        /* all of it, v1 data files have no index to go by */
+        nr = 0;
+        rc = range_add(&l, 0, size, 0, part_size);
+    }
+    if (rc || (rc = get_ranges(sw, key, fd, &l)))
+        goto free_l;
+
+    if (!nr && (size < sizeof hdr ||
+                (rc = data_hdr(sw, NULL, key, fd, size, &hdr)) ||
+                !(hdr.compress_type & SNPY_DATA_F_V2) ||
+                (rc = read_idx(sw, key, fd, size, &hdr, &idx))))
+        goto free_l;
+    rc = verify(sw, key, fd, &hdr, idx, rv, nr);
+free_l:
+    snpy_data_idx_free(idx);
+    free(l.v);
+close_fd:
+    close(fd);
+put_conn:
+    conn_put(sw, c);
+    return rc;
+}
+
+/*
+ * do_get() - fetch the backups meta/rstr_arg names
+ *
+ * The members of an incremental chain are fetched into data/<job id> for
+ * patch, one after the other, a single backup into data/data.
+ */
+static int do_get(struct swift *sw) {
+    char rstr_arg[4096], key[32], fn[64];
+    int rc, error, i;
+    struct range rv[SWIFT_NRANGE_MAX];
+    if ((rc = kv_get_sval("meta/rstr_arg", rstr_arg, sizeof rstr_arg, NULL)))
+        return rc;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -error;
+    if (json_loadstring(js, rstr_arg)) {
+        rc = -EINVAL;
+        goto close_js;
+    }
+    int nr = json_count(js, ".rstr_range");
+    if (nr > SWIFT_NRANGE_MAX) {
+        rc = -E2BIG;
+        goto close_js;
+    }
+    for (i = 0; i < nr; i ++) {
+        rv[i].off = json_number(js, ".rstr_range[#].off", i);
+        rv[i].len = json_number(js, ".rstr_range[#].len", i);
+    }
+
+    int nchain = json_count(js, ".rstr_chain");
+    for (i = 0; !rc && i < MAX(nchain, 1); i ++) {
+        if (nchain > 1) {
+            snprintf(key, sizeof key, "%.0f",
+                     json_number(js, ".rstr_chain[#]", i));
+            snprintf(fn, sizeof fn, "data/%s", key);
+        } else {
+            snprintf(key, sizeof key, "%.0f",
+                     json_number(js, ".rstr_to_job_id"));
+            strlcpy(fn, "data/data", sizeof fn);
+        }
+        snpy_logger(SNPY_LOG_INFO, "fetching %s.", key);
+        if ((rc = fetch(sw, key, fn, rv, nr)))
+            snpy_logger(SNPY_LOG_ERR, "fetch of %s failed: %d.", key, rc);
+    }
+close_js:
+    json_close(js);
+    return rc;
+}
+
+int main(void) {
+    int rc;
+    char cmd[32], arg[4096], msg[128];
+    struct swift_conf conf;
+    struct swift sw;
+    time_t start = time(NULL);
+
+    /* a dropped connection is an error of the request, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    snpy_logger_open("meta/log", 0);
+    if ((rc = kv_get_sval("meta/cmd", cmd, sizeof cmd, NULL)) ||
+        (rc = kv_get_sval("meta/arg", arg, sizeof arg, NULL)) ||
+        (rc = swift_conf_init(&conf, arg)))
+        goto err_out;
+    snpy_logger(SNPY_LOG_INFO, "execute command: %s.", cmd);
+    if ((rc = swift_open(&sw, &conf)))
+        goto err_out;
+    if (!strcmp(cmd, "put"))
+        rc = do_put(&sw);
+    else if (!strcmp(cmd, "get"))
+        rc = do_get(&sw);
+    else
+        rc = -EINVAL;
+    swift_close(&sw);
+    if (!rc)
+        rc = snpy_target_arg_out(arg, start, time(NULL));
+err_out:
+    memset(&conf, 0, sizeof conf);
+    kv_put_ival("meta/status", -rc, NULL);
+    strerror_r(-rc, msg, sizeof msg);
+    kv_put_sval("meta/status_msg", msg, sizeof msg, NULL);
+    if (rc)
+        snpy_logger(SNPY_LOG_ERR, "%s failed: %d.", cmd, rc);
+    snpy_logger_close(0);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# swift_stub.py - in-memory Swift endpoint for testing snpy_swift
+#
+# Speaks plain http on 127.0.0.1: tempauth at /auth/v1.0, object PUT, GET
+# (whole or one byte range), HEAD and DELETE, and static large objects
+# (?multipart-manifest=put). Objects live in memory and are gone when the
+# stub exits.
+#
+# The port it listens on is printed on the first line of stdout. Control
+# paths, which take no token, steer a test:
+#
+#   GET /stub/stats         counters as JSON; "seg_put" is segment PUTs
+#   GET /stub/fail/<n>      fail every segment PUT after the next <n>
+#                           with 503, -1 to stop failing
+#   GET /stub/fail_get/<n>  fail the next <n> object GETs with 503 and an
+#                           error page
+#
+# usage: swift_stub.py [user] [key]
+
+import hashlib
+import json
+import re
+import sys
+import threading
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+from urllib.parse import unquote
+
+ACCOUNT = '/v1/AUTH_test'
+TOKEN = 'AUTH_tk_stub'
+
+
+class Store:
+    def __init__(self, user, key):
+        self.user = user
+        self.key = key
+        self.lock = threading.Lock()
+        self.objs = {}          # path: bytes, or list of segment paths
+        self.stats = {'put': 0, 'seg_put': 0, 'get': 0, 'fail': 0}
+        self.fail_after = -1
+        self.fail_get = 0
+
+    def data(self, path):
+        obj = self.objs[path]
+        if isinstance(obj, list):
+            return b''.join(self.data(p) for p in obj)
+        return obj
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def reply(self, status, body=b'', hdrs=None):
+        self.send_response(status)
+        for k, v in (hdrs or {}).items():
+            self.send_header(k, v)
+        if 'Content-Length' not in (hdrs or {}):
+            self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def body(self):
+        return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+    def target(self):
+        path, _, query = self.path.partition('?')
+        return unquote(path), query
+
+    def authed(self):
+        return self.headers.get('X-Auth-Token') == TOKEN
+
+    def do_GET(self):
+        st = self.server.store
+        path, _ = self.target()
+        if path == '/auth/v1.0':
+            if (self.headers.get('X-Auth-User') != st.user or
+                    self.headers.get('X-Auth-Key') != st.key):
+                return self.reply(401)
+            port = self.server.server_address[1]
+            return self.reply(200, hdrs={
+                'X-Storage-Url': 'http://127.0.0.1:%d%s' % (port, ACCOUNT),
+                'X-Auth-Token': TOKEN})
+        if path == '/stub/stats':
+            with st.lock:
+                return self.reply(200, json.dumps(st.stats).encode())
+        if path.startswith('/stub/fail/'):
+            with st.lock:
+                st.fail_after = int(path[len('/stub/fail/'):])
+            return self.reply(200)
+        if path.startswith('/stub/fail_get/'):
+            with st.lock:
+                st.fail_get = int(path[len('/stub/fail_get/'):])
+            return self.reply(200)
+        if not self.authed():
+            return self.reply(401, b'token missing or expired')
+        with st.lock:
+            if path not in st.objs:
+                return self.reply(404, b'<html><h1>Not Found</h1></html>')
+            if st.fail_get > 0:
+                st.fail_get -= 1
+                st.stats['fail'] += 1
+                return self.reply(503, b'<html><h1>Service Unavailable'
+                                  b'</h1></html>' * 64)
+            data = st.data(path)
+            st.stats['get'] += 1
+        rng = self.headers.get('Range')
+        if not rng:
+            return self.reply(200, data)
+        m = re.fullmatch(r'bytes=(\d+)-(\d+)', rng)
+        first, last = int(m.group(1)), int(m.group(2))
+        if first >= len(data):
+            return self.reply(416)
+        last = min(last, len(data) - 1)
+        return self.reply(206, data[first:last + 1], {
+            'Content-Range': 'bytes %d-%d/%d' % (first, last, len(data))})
+
+    def do_HEAD(self):
+        st = self.server.store
+        path, _ = self.target()
+        if not self.authed():
+            return self.reply(401)
+        with st.lock:
+            if path not in st.objs:
+                return self.reply(404)
+            size = len(st.data(path))
+        self.reply(200, hdrs={'Content-Length': str(size)})
+
+    def do_PUT(self):
+        st = self.server.store
+        path, query = self.target()
+        body = self.body()
+        if not self.authed():
+            return self.reply(401)
+        if 'multipart-manifest=put' in query:
+            segs = [ACCOUNT + s['path'] for s in json.loads(body)]
+            with st.lock:
+                missing = [s for s in segs if s not in st.objs]
+                if missing:
+                    return self.reply(400, ('missing ' + missing[0]).encode())
+                st.objs[path] = segs
+            return self.reply(201, hdrs={'ETag': '"manifest"'})
+        seg = '/slo/' in path
+        with st.lock:
+            if seg and st.fail_after == 0:
+                st.stats['fail'] += 1
+                return self.reply(503, b'stub: failing segment PUTs')
+            if seg and st.fail_after > 0:
+                st.fail_after -= 1
+            st.objs[path] = body
+            st.stats['put'] += 1
+            st.stats['seg_put'] += seg
+        self.reply(201, hdrs={'ETag': hashlib.md5(body).hexdigest()})
+
+    def do_DELETE(self):
+        st = self.server.store
+        path, _ = self.target()
+        if not self.authed():
+            return self.reply(401)
+        with st.lock:
+            found = st.objs.pop(path, None) is not None
+        self.reply(204 if found else 404)
+
+
+def main():
+    user = sys.argv[1] if len(sys.argv) > 1 else 'test:tester'
+    key = sys.argv[2] if len(sys.argv) > 2 else 'testing'
+    srv = ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+    srv.daemon_threads = True
+    srv.store = Store(user, key)
+    print(srv.server_address[1], flush=True)
+    srv.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
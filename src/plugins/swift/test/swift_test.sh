@@ -0,0 +1,131 @@
+#!/bin/sh
+#
+# swift_test.sh - put and get a data file through swift_stub.py
+#
+# An export of the snull plugin is put, then fetched back whole, by range
+# and streamed through a fifo; a missing object must fail to come back. A
+# second put has its segment PUTs failing part way, its rerun must upload
+# only the parts the first run did not store. Needs snpy_swift and
+# snpy_snull built, and python3.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+swift=$here/../snpy_swift
+snull=$here/../../snull/snpy_snull
+tmp=$(mktemp -d)
+stub=
+trap '[ -n "$stub" ] && kill $stub; rm -rf "$tmp"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# job <dir> <cmd> <arg> - a job directory as xcore lays it out
+job() {
+    mkdir -p "$tmp/$1/meta" "$tmp/$1/data"
+    printf %s "$2" > "$tmp/$1/meta/cmd"
+    printf %s "$3" > "$tmp/$1/meta/arg"
+}
+
+# run <dir> <plugin> - run a job, which failed unless meta/status is 0
+run() {
+    (cd "$tmp/$1" && "$2") || true
+    if [ "$(cat "$tmp/$1/meta/status")" != 0 ]; then
+        tail -5 "$tmp/$1/meta/log"
+        return 1
+    fi
+}
+
+# ctl <path> - GET a control path of the stub
+ctl() {
+    python3 -c 'import sys, urllib.request
+print(urllib.request.urlopen(sys.argv[1]).read().decode())' "$url/stub/$1"
+}
+
+seg_put() {
+    ctl stats | python3 -c 'import sys, json
+print(json.load(sys.stdin)["seg_put"])'
+}
+
+python3 "$here/swift_stub.py" > "$tmp/port" &
+stub=$!
+while [ ! -s "$tmp/port" ]; do
+    kill -0 $stub || fail "stub did not start"
+    sleep 0.1
+done
+url=http://127.0.0.1:$(head -1 "$tmp/port")
+tp='{"tp_param":{"auth_method":"tempauth","url":"'$url'/auth/v1.0",
+"user":"test:tester","password":"testing","container":"backup",
+"part_size":5,"concurrency":4,"retries":%d}}'
+
+# a v2 data file of 40 MB
+job exp export '{"sp_param":{"size":41943040,"sparsity":0.5,"compress":0.5}}'
+printf %s 101 > "$tmp/exp/meta/id"
+head -c 4096 /dev/zero > "$tmp/exp/meta/tag"
+run exp "$snull" || fail "snull export"
+file=$tmp/exp/data/101
+
+# put
+job put put "$(printf "$tp" 2)"
+cp -p "$file" "$tmp/put/data/101"
+run put "$swift" || fail "put"
+[ ! -e "$tmp/put/meta/upload" ] || fail "upload manifest left behind"
+
+# get, whole, its first GETs failing with an error page
+job get get "$(printf "$tp" 2)"
+printf %s '{"rstr_to_job_id":101}' > "$tmp/get/meta/rstr_arg"
+ctl fail_get/3 > /dev/null
+run get "$swift" || fail "get"
+cmp "$file" "$tmp/get/data/data" || fail "get: data differs"
+
+# get of a missing object fails, its error page stays out of the file
+job missing get "$(printf "$tp" 0)"
+printf %s '{"rstr_to_job_id":999}' > "$tmp/missing/meta/rstr_arg"
+! run missing "$swift" > /dev/null || fail "get of a missing object"
+[ ! -s "$tmp/missing/data/data" ] || fail "error page written to data"
+
+# get, one range: the header, the footer and the records in range
+job range get "$(printf "$tp" 2)"
+printf %s '{"rstr_to_job_id":101,"rstr_range":[{"off":8388608,"len":1048576}]}' \
+    > "$tmp/range/meta/rstr_arg"
+run range "$swift" || fail "ranged get"
+out=$tmp/range/data/data
+idx=$(od -An -t u8 -j 40 -N 8 "$file" | tr -d ' ')
+[ "$(wc -c < "$out")" -eq "$(wc -c < "$file")" ] || fail "ranged get: size"
+cmp -n 72 "$file" "$out" || fail "ranged get: header differs"
+cmp -i "$idx" "$file" "$out" || fail "ranged get: footer differs"
+
+# get, streamed through a fifo
+job stream get "$(printf "$tp" 2)"
+printf %s '{"rstr_to_job_id":101}' > "$tmp/stream/meta/rstr_arg"
+mkfifo "$tmp/stream/data/data"
+run stream "$swift" &
+getter=$!
+cat "$tmp/stream/data/data" > "$tmp/stream.out"
+wait $getter || fail "streamed get"
+cmp "$file" "$tmp/stream.out" || fail "streamed get: data differs"
+
+# put failing after 3 parts, then resumed by a rerun
+size=$(wc -c < "$file")
+part=$((5 << 20))
+nparts=$(((size + part - 1) / part))
+job resume put "$(printf "$tp" 0)"
+cp -p "$file" "$tmp/resume/data/102"
+ctl fail/3 > /dev/null
+! run resume "$swift" > /dev/null || fail "put did not fail"
+[ -s "$tmp/resume/meta/upload" ] || fail "no upload manifest kept"
+before=$(seg_put)
+ctl fail/-1 > /dev/null
+run resume "$swift" || fail "resumed put"
+after=$(seg_put)
+[ $((after - before)) -eq $((nparts - 3)) ] ||
+    fail "resumed put sent $((after - before)) of $nparts parts, not $((nparts - 3))"
+[ ! -e "$tmp/resume/meta/upload" ] || fail "upload manifest left behind"
+
+job get2 get "$(printf "$tp" 2)"
+printf %s '{"rstr_to_job_id":102}' > "$tmp/get2/meta/rstr_arg"
+run get2 "$swift" || fail "get of resumed put"
+cmp "$file" "$tmp/get2/data/data" || fail "resumed put: data differs"
+
+echo "swift_test: ok"
@@ -28,12 +28,14 @@
 #include <sys/wait.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include "stringbuilder.h"
 #include "ciniparser.h"
 #include "json.h"
 #include "snpy_util.h"
 #include "snpy_data_tag.h" 
+#include "snpy_ckpt.h"
 #include "snpy_log.h"
 
 #include "snappy.h"
@@ -41,6 +43,7 @@
 #include "arg.h"
 #include "log.h"
 #include "job.h"
+#include "throttle.h"
 #include "error.h"
 #include "conf.h"
 #include "plugin.h"
@@ -58,6 +61,7 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job);
 static int proc_ready(MYSQL *db_conn, snpy_job_t *job);
 static int proc_blocked(MYSQL *db_conn, snpy_job_t *job);
 static int proc_term(MYSQL *db_conn, snpy_job_t *job);
+static int add_job_put(MYSQL *db_conn, snpy_job_t *job);
 
 
 static int plugin_chooser(snpy_job_t *job, struct plugin **pi); 
@@ -151,6 +155,19 @@ static int get_snap_ts(const char *buf) {
     return 0;
 }
 
+/* get_dep_id() - job an incremental export depends on
+ *
+ * .sp_param.dep_id names the export job holding the base snapshot; a full
+ * export depends on itself.
+ */
+static int get_dep_id(const char *arg, int job_id) {
+    double dep_id;
+    if (snpy_get_json_val(arg, strlen(arg), ".sp_param.dep_id",
+                          &dep_id, sizeof dep_id) || dep_id <= 0)
+        return job_id;
+    return dep_id;
+}
+
 static int export_env_init(snpy_job_t *job) {
     int rc;
     int status = 0;
@@ -161,6 +178,11 @@ static int export_env_init(snpy_job_t *job) {
         return -SNPY_ECONF;
     struct stat wd_st;
     if (!lstat(wd, &wd_st) && S_ISDIR(wd_st.st_mode)) {
+        /* run again after the plugin died, it resumes from its checkpoint */
+        if (snpy_ckpt_exists(wd)) {
+            snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory has a checkpoint, resuming.\n");
+            return 0;
+        }
         snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory exists, trying cleanup.\n");
         if ((rc = rmdir_recurs(wd))) 
             return rc;
@@ -200,7 +222,7 @@ static int export_env_init(snpy_job_t *job) {
     struct snpy_data_tag tag = 
     {   
         .magic = SNPY_DATA_TAG_MAGIC,
-        .dep_id = job->id,
+        .dep_id = get_dep_id(job->argv[2], job->id),
         .job_id = job->id,
         .frag_id = job->id,
         .snap_ts = get_snap_ts(job->argv[2]),
@@ -213,6 +235,16 @@ static int export_env_init(snpy_job_t *job) {
         status = -rc;
         goto free_wd_fd;
     }
+
+    /* streaming: the data file is a fifo drained by the put job */
+    if (snpy_job_is_stream(job, 2)) {
+        char data_fn[64];
+        snprintf(data_fn, sizeof data_fn, "data/%d", job->id);
+        if (mkfifoat(wd_fd, data_fn, 0600)) {
+            status = errno;
+            goto free_wd_fd;
+        }
+    }
 free_wd_fd:
     close(wd_fd);
     return -status;;
@@ -241,6 +273,7 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
         rc = log_msg_add_errmsg(msg, sizeof msg, status);
         goto change_state;
     }
+    snpy_throttle_update(db_conn, job, wd);     /* best effort */
     /* spawn snapshot process */
     pid_t pid = fork();
     if (pid < 0) {
@@ -270,6 +303,16 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
         goto change_state;
     }
 
+    /* streaming: start put along with export */
+    if (snpy_job_is_stream(job, 2) && (rc = add_job_put(db_conn, job))) {
+        kill(pid, SIGKILL);         /* would block opening the fifo */
+        status = SNPY_EPROC;
+        new_state = SNPY_UPDATE_SCHED_STATE(job->state,
+                                            SNPY_SCHED_STATE_TERM);
+        log_msg_add_errmsg(msg, sizeof msg, status);
+        goto change_state;
+    }
+
     /* if we are here, change job status to running */
     status = 0;
     new_state = SNPY_UPDATE_SCHED_STATE(job->state,
@@ -363,10 +406,23 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     if (!kill(pid, 0)) {
         snpy_log(&xcore_log, 
                  SNPY_LOG_DEBUG, "plugin process pid: %d still running.\n", pid);
+        snpy_job_progress(db_conn, job, wd_path);   /* best effort */
+        snpy_throttle_update(db_conn, job, wd_path);
         return 0;
     }
     
     char arg_out[4096];
+
+    /* plugin died without a status, run it again from its checkpoint */
+    if (kv_get_ival("meta/status", &status, wd_path) && 
+        snpy_job_resume(wd_path)) {
+        snpy_log(&xcore_log, SNPY_LOG_INFO, 
+                 "plugin of job %d died, resuming from checkpoint.\n", job->id);
+        new_state = SNPY_UPDATE_SCHED_STATE(job->state,
+                                            SNPY_SCHED_STATE_CREATED);
+        status = 0;
+        goto change_state;
+    }
     
     if ((rc = kv_get_ival("meta/status", &status, wd_path)) ||
         (rc = kv_get_sval("meta/arg.out", arg_out, sizeof arg_out, wd_path))) {
@@ -387,7 +443,10 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     }
 
     /* export complete successfully */
-    rc = add_job_put(db_conn, job); /*add put job as the next job */
+    if (snpy_job_is_stream(job, 2)) 
+        rc = 0;                     /* put started with export */
+    else 
+        rc = add_job_put(db_conn, job); /*add put job as the next job */
     if (rc) {
         new_state = SNPY_UPDATE_SCHED_STATE(job->state,
                                             SNPY_SCHED_STATE_TERM);
@@ -28,6 +28,7 @@
 #include <sys/wait.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include "stringbuilder.h"
 #include "ciniparser.h"
@@ -42,6 +43,7 @@
 #include "arg.h"
 #include "log.h"
 #include "job.h"
+#include "throttle.h"
 #include "error.h"
 #include "conf.h"
 #include "plugin.h"
@@ -66,6 +68,9 @@ static int plugin_chooser(snpy_job_t *job, struct plugin **pi);
 
 static int job_get_wd(int job_id, char *wd, int wd_size);
 
+static int get_is_stream(snpy_job_t *job);
+static int add_job_import(MYSQL *db_conn, snpy_job_t *job);
+
 
 static int job_get_wd(int job_id, char *wd, int wd_size) {
     
@@ -203,6 +208,12 @@ static int get_env_init(MYSQL *db_conn, snpy_job_t *job) {
         status = -rc;
         goto free_wd_fd;
     }
+
+    /* streaming: the data file is a fifo drained by the import job */
+    if (get_is_stream(job) && mkfifoat(wd_fd, "data/data", 0600)) {
+        status = errno;
+        goto free_wd_fd;
+    }
     
 free_wd_fd:
     close(wd_fd);
@@ -250,6 +261,7 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
                  "plug env init error, code: %d.", rc);
         goto change_state;
     }
+    snpy_throttle_update(db_conn, job, wd);     /* best effort */
     /* spawn snapshot process */
     pid_t pid = fork();
     if (pid < 0) {
@@ -287,6 +299,17 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
         goto change_state;
     }
 
+    /* streaming: start import along with get */
+    if (get_is_stream(job) && (rc = add_job_import(db_conn, job))) {
+        kill(pid, SIGKILL);         /* would block opening the fifo */
+        status = SNPY_EDBCONN;
+        new_state = SNPY_UPDATE_SCHED_STATE(job->state,
+                                            SNPY_SCHED_STATE_TERM);
+        snprintf(ext_err_msg, sizeof ext_err_msg,
+                 "error add import job as the sub job: %d.", rc); 
+        goto change_state;
+    }
+
     /* if we are here, change job status to running */
     status = 0;
     new_state = SNPY_UPDATE_SCHED_STATE(job->state,
@@ -326,6 +349,35 @@ static int check_snap_run_state(MYSQL *db_conn, snpy_job_t *job) {
 
 
 
+/* 
+ * get_import_cmd() - plugin command for the import job
+ *
+ * A restore target with a chain of incremental backups is applied by "patch".
+ */
+static const char *get_import_cmd(snpy_job_t *job) {
+    int error;
+    const char *cmd = "import";
+    if (!job->argv[1])
+        return cmd;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return cmd;
+    if (!json_loadstring(js, job->argv[1]) && 
+        json_count(js, ".rstr_chain") > 1)
+        cmd = "patch";
+    json_close(js);
+    return cmd;
+}
+
+/*
+ * get_is_stream() - whether get streams to import through a fifo
+ *
+ * Only a single backup is streamed; patch needs every chain member on disk.
+ */
+static int get_is_stream(snpy_job_t *job) {
+    return snpy_job_is_stream(job, 1) && !strcmp(get_import_cmd(job), "import");
+}
+
 static int add_job_import(MYSQL *db_conn, snpy_job_t *job) {
     int rc;
     
@@ -342,12 +394,15 @@ static int add_job_import(MYSQL *db_conn, snpy_job_t *job) {
     import.root = job->root;
     import.state = SNPY_SCHED_STATE_CREATED;
     import.result = 0;
-    import.policy = BIT(0) | BIT(2); /* arg0, arg2 */
+    import.policy = BIT(0) | BIT(1) | BIT(2); /* arg0, arg1, arg2 */
  
     /* update import job */
     if((rc = db_update_job_partial(db_conn, &import)) ||
        (rc = db_update_str_val(db_conn, "feid", import.id, job->feid)) ||
-       (rc = db_update_str_val(db_conn, "arg0", import.id, "import")) ||
+       (rc = db_update_str_val(db_conn, "arg0", import.id, 
+                               get_import_cmd(job))) ||
+       (rc = db_update_str_val(db_conn, "arg1", import.id, 
+                               job->argv[1] ? job->argv[1] : "")) ||
        (rc = db_update_str_val(db_conn, "arg2", import.id, job->argv[2]))) 
 
         return rc;
@@ -394,6 +449,8 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     if (!kill(pid, 0)) {
         snpy_log(&xcore_log, 
                  SNPY_LOG_DEBUG, "plugin process pid: %d still running.\n", pid);
+        snpy_job_progress(db_conn, job, wd_path);   /* best effort */
+        snpy_throttle_update(db_conn, job, wd_path);
         return 0;
     }
     
@@ -418,7 +475,10 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     }
 
     /* export complete successfully */
-    rc = add_job_import(db_conn, job); /*add put job as the next job */
+    if (get_is_stream(job))
+        rc = 0;                     /* import started with get */
+    else 
+        rc = add_job_import(db_conn, job); /*add put job as the next job */
     if (rc) {
         new_state = SNPY_UPDATE_SCHED_STATE(job->state,
                                             SNPY_SCHED_STATE_TERM);
@@ -35,12 +35,14 @@
 #include "arg.h"
 #include "log.h"
 #include "job.h"
+#include "throttle.h"
 #include "error.h"
 #include "conf.h"
 #include "plugin.h"
 
 #include "snpy_util.h"
 #include "snpy_log.h"
+#include "snpy_ckpt.h"
 #include "stringbuilder.h"
 #include "json.h"
 
@@ -202,6 +204,11 @@ static int import_env_init(MYSQL *db_conn, snpy_job_t *job) {
 
     /* wd directory check if it already exists*/
     if (!lstat(wd, &wd_st) && S_ISDIR(wd_st.st_mode)) {
+        /* run again after the plugin died, data was moved here already */
+        if (snpy_ckpt_exists(wd)) {
+            snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory has a checkpoint, resuming.\n");
+            return 0;
+        }
         snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory exists, trying cleanup.\n");
         if ((rc = rmdir_recurs(wd))) 
             return rc;
@@ -230,7 +237,11 @@ static int import_env_init(MYSQL *db_conn, snpy_job_t *job) {
     snprintf(import_data_dir, PATH_MAX,
              "%s/%d/data", conf_get_run(), job->id);
 
-    rc = rename(get_data_dir, import_data_dir);
+    /* streaming: get is still writing, share its data dir */
+    if (snpy_job_is_stream(job, 1) && !strcmp(job->argv[0], "import"))
+        rc = symlink(get_data_dir, import_data_dir);
+    else 
+        rc = rename(get_data_dir, import_data_dir);
     if (rc == -1) {
         status = errno;
         snpy_log(&xcore_log, SNPY_LOG_ERR, "error moving export data directory: %d.", status);
@@ -256,6 +267,14 @@ static int import_env_init(MYSQL *db_conn, snpy_job_t *job) {
         goto free_wd_fd;
     }
 
+    /* setup restore arg, carries the backup chain for patch */
+    if (job->argv[1] &&
+        (rc = kv_put_sval("meta/rstr_arg", 
+                          job->argv[1], job->argv_size[1], wd))) {
+        status = -rc;
+        goto free_wd_fd;
+    }
+
 free_wd_fd:
     close(wd_fd);
     return -status;;
@@ -286,6 +305,7 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
 
         goto change_state;
     }
+    snpy_throttle_update(db_conn, job, wd);     /* best effort */
     /* spawn snapshot process */
     pid_t pid = fork();
     if (pid < 0) {
@@ -397,10 +417,23 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     }
     if (!kill(pid, 0)) {
         snpy_log(&xcore_log, SNPY_LOG_DEBUG, "plugin process pid: %d still running.\n", pid);
+        snpy_job_progress(db_conn, job, wd_path);   /* best effort */
+        snpy_throttle_update(db_conn, job, wd_path);
         return 0;
     }
    
     char arg_out[4096];
+
+    /* plugin died without a status, run it again from its checkpoint */
+    if (kv_get_ival("meta/status", &status, wd_path) && 
+        snpy_job_resume(wd_path)) {
+        snpy_log(&xcore_log, SNPY_LOG_INFO, 
+                 "plugin of job %d died, resuming from checkpoint.\n", job->id);
+        new_state = SNPY_UPDATE_SCHED_STATE(job->state,
+                                            SNPY_SCHED_STATE_CREATED);
+        status = 0;
+        goto change_state;
+    }
     
     if ((rc = kv_get_ival("meta/status", &status, wd_path)) ||
         (rc = kv_get_sval("meta/arg.out", arg_out, sizeof arg_out, wd_path))) {
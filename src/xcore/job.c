@@ -22,6 +22,7 @@
 #include <string.h>
 #include <time.h>
 #include <mysql.h>
+#include <mysqld_error.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -32,6 +33,9 @@
 #include "db.h"
 #include "snpy_util.h"
 #include "snpy_log.h"
+#include "snpy_ckpt.h"
+#include "snpy_progress.h"
+#include "json.h"
 #include "log.h"
 #include "conf.h"
 
@@ -378,3 +382,88 @@ int snpy_wd_cleanup(snpy_job_t *job) {
     return -status;
 
 }
+
+
+/*
+ * snpy_job_is_stream() - whether a job streams its data to the next job
+ *
+ * With .stream set in job arg @argi, the data file is a fifo read by the
+ * next job while this one is still running: the job arg of a backup tells
+ * export to stream to put, the restore arg (arg1) tells get to stream to
+ * import. A ranged restore (.rstr_range) reads the data file out of order
+ * and is never streamed.
+ */
+
+int snpy_job_is_stream(const snpy_job_t *job, int argi) {
+    int error;
+    int is_stream = 0;
+    if (!job || argi < 0 || argi >= SNPY_MAX_ARGS || !job->argv[argi])
+        return 0;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return 0;
+    if (!json_loadstring(js, job->argv[argi]))
+        is_stream = json_boolean(js, ".stream") && 
+            !json_count(js, ".rstr_range");
+    json_close(js);
+    return is_stream;
+}
+
+
+/*
+ * snpy_job_resume() - whether a job whose plugin died is to run again
+ *
+ * A plugin that leaves no meta/status was killed or went down with the host.
+ * If it saved a checkpoint in @wd the job is run again in the same working
+ * directory and the plugin resumes from there, up to SNPY_JOB_RESUME_MAX
+ * times as counted in meta/nresume. A put is also run again when its
+ * plugin failed but kept an upload manifest.
+ */
+
+int snpy_job_resume(const char *wd) {
+    int nresume = 0;
+    if (!snpy_ckpt_exists(wd))
+        return 0;
+    kv_get_ival("meta/nresume", &nresume, wd);
+    if (nresume >= SNPY_JOB_RESUME_MAX)
+        return 0;
+    return !kv_put_ival("meta/nresume", nresume + 1, wd);
+}
+
+
+/*
+ * snpy_job_progress() - copy the progress a running plugin publishes in
+ *                       @wd to the progress column of its job
+ *
+ * The eta extrapolates the average pace since the plugin started. Plugins
+ * publishing no progress are left alone, and so is a jobs table created
+ * before the progress column, until snappy_db_upgrade.sql adds it.
+ */
+
+int snpy_job_progress(MYSQL *db_conn, const snpy_job_t *job, const char *wd) {
+    static int no_column;
+    struct snpy_progress p;
+    if (no_column || snpy_progress_read(wd, &p))
+        return 0;
+    long long eta = -1;
+    long long elapsed = p.update - p.start;
+    if (p.total && p.done && p.done <= p.total)
+        eta = (p.total - p.done) * (double)elapsed / p.done;
+
+    char buf[256];
+    snprintf(buf, sizeof buf, 
+             "{\"total\": %llu, \"done\": %llu, \"nbyte\": %llu, "
+             "\"nseg\": %llu, \"rate\": %llu, \"eta\": %lld, \"ts\": %llu}",
+             (unsigned long long)p.total, (unsigned long long)p.done,
+             (unsigned long long)p.nbyte, (unsigned long long)p.nseg,
+             (unsigned long long)p.rate, eta, (unsigned long long)p.update);
+    int rc = db_update_str_val(db_conn, "progress", job->id, buf);
+    if (rc == -ER_BAD_FIELD_ERROR) {
+        snpy_log(&xcore_log, SNPY_LOG_WARN, 
+                 "jobs table has no progress column, "
+                 "apply snappy_db_upgrade.sql to publish progress.");
+        no_column = 1;
+        return 0;
+    }
+    return rc;
+}
@@ -21,6 +21,7 @@
 #ifndef SNPY_JOB_H
 #define SNPY_JOB_H
 #include <mysql.h>
+#include "snpy_ckpt.h"
 
 snpy_job_t *snpy_job_alloc(int size);
 
@@ -35,4 +36,9 @@ int snpy_job_update_state(MYSQL *db_conn, const snpy_job_t *job,
                           const char *msg_val_fmt, ...) ;
 
 int snpy_wd_cleanup(snpy_job_t *job);
+int snpy_job_is_stream(const snpy_job_t *job, int argi);
+
+#define SNPY_JOB_RESUME_MAX SNPY_CKPT_RESUME_MAX
+int snpy_job_resume(const char *wd);
+int snpy_job_progress(MYSQL *db_conn, const snpy_job_t *job, const char *wd);
 #endif
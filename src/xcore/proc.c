@@ -37,7 +37,7 @@ static proc_tab_entry_t proc_tab[128] = {
     { "export", export_proc},
     { "import", import_proc},
 //    { "diff", diff_proc},
-//   { "patch", patch_proc},
+    { "patch", import_proc},
     { "put", put_proc},
     { "get", get_proc},
     { "proc_tab_end", NULL}
@@ -35,12 +35,14 @@
 #include "arg.h"
 #include "log.h"
 #include "job.h"
+#include "throttle.h"
 #include "error.h"
 #include "conf.h"
 #include "plugin.h"
 
 #include "snpy_util.h"
 #include "snpy_log.h"
+#include "snpy_ckpt.h"
 #include "stringbuilder.h"
 #include "json.h"
 
@@ -197,6 +199,17 @@ static int put_env_init(MYSQL *db_conn, snpy_job_t *job) {
         return -ERANGE;
     struct stat wd_st;
     if (!lstat(wd_path, &wd_st) && S_ISDIR(wd_st.st_mode)) {
+        /* run again after the upload failed, data was moved here already */
+        if (snpy_ckpt_exists(wd_path)) {
+            snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory has an upload manifest, resuming.\n");
+            /* the status is of the failed run */
+            if ((wd_fd = open(wd_path, O_RDONLY)) == -1)
+                return -errno;
+            unlinkat(wd_fd, "meta/status", 0);
+            unlinkat(wd_fd, "meta/status_msg", 0);
+            close(wd_fd);
+            return 0;
+        }
         snpy_log(&xcore_log, SNPY_LOG_DEBUG, "working directory exists, trying cleanup.\n");
         if ((rc = rmdir_recurs(wd_path))) 
             return rc;
@@ -225,7 +238,11 @@ static int put_env_init(MYSQL *db_conn, snpy_job_t *job) {
     snprintf(put_data_dir, ARRAY_SIZE(put_data_dir),
              "%s/%d/data", conf_get_run(), job->id);
 
-    rc = rename(export_data_dir, put_data_dir);
+    /* streaming: export is still writing, share its data dir */
+    if (snpy_job_is_stream(job, 2))
+        rc = symlink(export_data_dir, put_data_dir);
+    else 
+        rc = rename(export_data_dir, put_data_dir);
     if (rc == -1) {
         status = errno;
         char err_buf[64]; 
@@ -282,6 +299,7 @@ static int proc_created(MYSQL *db_conn, snpy_job_t *job) {
 
         goto change_state;
     }
+    snpy_throttle_update(db_conn, job, wd);     /* best effort */
     /* spawn snapshot process */
     pid_t pid = fork();
     if (pid < 0) {
@@ -394,10 +412,26 @@ static int proc_run(MYSQL *db_conn, snpy_job_t *job) {
     }
     if (!kill(pid, 0)) {
         snpy_log(&xcore_log, SNPY_LOG_DEBUG, "plugin process pid: %d still running.\n", pid);
+        snpy_job_progress(db_conn, job, wd_path);   /* best effort */
+        snpy_throttle_update(db_conn, job, wd_path);
         return 0;
     }
    
     char arg_out[4096];
+
+    /* 
+     * the upload failed part way or the plugin died, run it again to send
+     * what its upload manifest lacks
+     */
+    if ((kv_get_ival("meta/status", &status, wd_path) || status) &&
+        snpy_job_resume(wd_path)) {
+        snpy_log(&xcore_log, SNPY_LOG_INFO, 
+                 "plugin of job %d failed, resuming upload.\n", job->id);
+        new_state = SNPY_UPDATE_SCHED_STATE(job->state,
+                                            SNPY_SCHED_STATE_CREATED);
+        status = 0;
+        goto change_state;
+    }
     
     if ((rc = kv_get_ival("meta/status", &status, wd_path)) ||
         (rc = kv_get_sval("meta/arg.out", arg_out, sizeof arg_out, wd_path))) {
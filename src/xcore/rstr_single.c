@@ -30,9 +30,20 @@
 #include "job.h"
 
 #include "snpy_util.h"
+#include "json.h"
 
 #include "rstr_single.h"
 
+/* the restore arg goes to the get job's arg1, a varchar(1024) column */
+#define SNPY_RSTR_ARG_SIZE 1024
+/* 
+ * a chain id takes at most 11 bytes with its comma, a full chain with the
+ * ,"rstr_chain":[] around it leaves over 600 bytes of arg1 to the
+ * frontend's own restore arg
+ */
+#define SNPY_RSTR_CHAIN_MAX 32
+#define SNPY_RSTR_CHAIN_LEN (SNPY_RSTR_CHAIN_MAX * 11 + 16)
+
 
 static int proc_created(MYSQL *db_conn, snpy_job_t *job);
 static int proc_done(MYSQL *db_conn, snpy_job_t *job);
@@ -58,6 +69,13 @@ static int job_validate(MYSQL *db_conn, snpy_job_t *job,
         return rc;
     }
 
+    if (strlen(job->argv[1]) + SNPY_RSTR_CHAIN_LEN >= SNPY_RSTR_ARG_SIZE) {
+        if (err_msg) 
+            snprintf(err_msg, err_msg_size,
+                     "restore arg leaves no room for the backup chain.");
+        return -SNPY_EARG;
+    }
+
     hist_job_id = js_val;
     rc = db_get_val(db_conn, "arg0", hist_job_id,
                     hist_job_arg0, sizeof hist_job_arg0);
@@ -108,10 +126,71 @@ static int proc_done(MYSQL *db_conn, snpy_job_t *job) {
     return 0;
 }
 
+/*
+ * make_rstr_arg() - resolve the backup chain of the restore target
+ *
+ * Follows .sp_param.dep_id of the export jobs from .rstr_to_job_id back to
+ * the full backup and stores the chain, newest first, as .rstr_chain in the
+ * restore argument handed to the get job.
+ */
+
+static int make_rstr_arg(MYSQL *db_conn, snpy_job_t *job,
+                         char *rstr_arg, int rstr_arg_size) {
+    int rc;
+    int status = 0;
+    int error;
+    struct json *js = json_open(JSON_F_NONE, &error);
+    if (!js)
+        return -SNPY_EARG;
+    if (json_loadstring(js, job->argv[1]) ||
+        json_setarray(js, ".rstr_chain")) {
+        status = SNPY_EARG;
+        goto close_js;
+    }
+
+    int id = json_number(js, ".rstr_to_job_id");
+    int n;
+    for (n = 0; n < SNPY_RSTR_CHAIN_MAX; n ++) {
+        char arg0[64] = "";
+        char arg2[4096] = "";
+        double dep_id;
+        if ((rc = db_get_val(db_conn, "arg0", id, arg0, sizeof arg0)) ||
+            (rc = db_get_val(db_conn, "arg2", id, arg2, sizeof arg2)) ||
+            strcmp(arg0, "export")) {
+            status = SNPY_EINVREC;
+            goto close_js;
+        }
+        if (json_setnumber(js, id, ".rstr_chain[#]", n)) {
+            status = SNPY_EARG;
+            goto close_js;
+        }
+        rc = snpy_get_json_val(arg2, sizeof arg2, ".sp_param.dep_id",
+                               &dep_id, sizeof dep_id);
+        if (rc || dep_id <= 0 || (int)dep_id == id)
+            break;                  /* reached the full backup */
+        id = dep_id;
+    }
+    if (n == SNPY_RSTR_CHAIN_MAX) {
+        status = SNPY_EINVREC;
+        goto close_js;
+    }
+
+    if (json_printstring(js, rstr_arg, rstr_arg_size, 0, &error) 
+        >= rstr_arg_size) 
+        status = SNPY_EARG;         /* chain does not fit the job arg */
+
+close_js:
+    json_close(js);
+    return -status;
+}
+
 static int add_job_get(MYSQL *db_conn, snpy_job_t *job) {
     int rc;
     if (job->sub != 0) 
         return -EINVAL;
+    char rstr_arg[SNPY_RSTR_ARG_SIZE] = "";
+    if ((rc = make_rstr_arg(db_conn, job, rstr_arg, sizeof rstr_arg)))
+        return rc;
     if ((rc = db_insert_new_job(db_conn)) < 0)  
         return rc;
     snpy_job_t sub_job;
@@ -149,7 +228,7 @@ static int add_job_get(MYSQL *db_conn, snpy_job_t *job) {
     if((rc = db_update_job_partial(db_conn, &sub_job)) ||
        (rc = db_update_str_val(db_conn, "feid", sub_job.id, job->feid)) ||
        (rc = db_update_str_val(db_conn, "arg0", sub_job.id, "get")) ||
-       (rc = db_update_str_val(db_conn, "arg1", sub_job.id, job->argv[1])) ||
+       (rc = db_update_str_val(db_conn, "arg1", sub_job.id, rstr_arg)) ||
        (rc = db_update_str_val(db_conn, "arg2", sub_job.id, sub_job_arg2)))
         
         return rc;
@@ -58,6 +58,14 @@ CREATE TABLE snappy.jobs (
     arg5        varchar(1024) DEFAULT '',   
     arg6        varchar(1024) DEFAULT '',   
     arg7        varchar(1024) DEFAULT '', 
+    /* 
+    plugin progress while running, json object:
+       {"total": <int>, "done": <int>, "nbyte": <int>, "nseg": <int>, 
+        "rate": <int>, "eta": <int>, "ts": <int>}
+       rate in bytes per second, eta in seconds, -1 if not known
+       older tables get it from snappy_db_upgrade.sql
+    */
+    progress    varchar(256) DEFAULT '',
     /* 
         required column:
         proc:                   int
@@ -0,0 +1,12 @@
+/* 
+    upgrade a jobs table created by an older snappy_db.sql, in place.
+    snappy_db.sql drops the table, this keeps the jobs in it.
+
+    each statement fails with a duplicate column error where the table
+    already has the column, the ones after it still apply with --force:
+
+        mysql --force < snappy_db_upgrade.sql
+*/
+
+/* plugin progress while running, see snappy_db.sql */
+ALTER TABLE snappy.jobs ADD COLUMN progress varchar(256) DEFAULT '';
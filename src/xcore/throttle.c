@@ -0,0 +1,219 @@
+/*
+ *  Copyright (c) 2016 AT&T Labs Research
+ *  All rights reservered.
+ *
+ *  Licensed under the GNU Lesser General Public License, version 2.1; you may
+ *  not use this file except in compliance with the License. You may obtain a
+ *  copy of the License at:
+ *
+ *  https://www.gnu.org/licenses/old-licenses/lgpl-2.1.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+ *  License for the specific language governing permissions and limitations
+ *  under the License.
+ *
+ *
+ *  Author: Pingkai Liu (pingkai@research.att.com)
+ */
+
+/*
+ * throttle.c - bandwidth and iops limits of the data movers
+ *
+ * Limits are set in snappy.conf, bandwidth in MB/s, 0 or missing for none:
+ *
+ *   [throttle]                 shared by all running data movers
+ *   bw = 400
+ *   iops = 4000
+ *   profiles = day,evening     time of day profiles, first match applies
+ *
+ *   [throttle_day]             replaces the [throttle] limits in its hours
+ *   hours = 8-18               local hours [from, to), may wrap midnight
+ *   bw = 100
+ *
+ *   [throttle_pool_<pool>]     shared by the running jobs on a pool
+ *   [throttle_plugin_<name>]   each job of a plugin
+ *
+ * A plugin job may also carry its own limits in its arg. Shared limits are
+ * split evenly among the running export, import, get and put jobs they
+ * cover; the share of a job is written to meta/throttle, which its plugin
+ * rereads while running (see snpy_tb.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <mysql.h>
+
+#include "snappy.h"
+#include "conf.h"
+#include "json.h"
+#include "snpy_util.h"
+#include "snpy_tb.h"
+#include "throttle.h"
+
+#define THROTTLE_NAME_SIZE 128
+
+struct throttle {
+    u64 bw;             /* bytes a second */
+    u64 iops;
+};
+
+/* min_limit() - the lower of two limits, 0 being no limit */
+static u64 min_limit(u64 a, u64 b) {
+    if (!a || !b)
+        return a | b;
+    return MIN(a, b);
+}
+
+/* conf_get_throttle() - limits of section @sec, @def for missing keys */
+static struct throttle conf_get_throttle(const char *sec, struct throttle def) {
+    char key[THROTTLE_NAME_SIZE + 64];
+    double bw, iops;
+    snprintf(key, sizeof key, "%s:bw", sec);
+    bw = ciniparser_getdouble(snpy_conf, key, def.bw / (double)(1 << 20));
+    snprintf(key, sizeof key, "%s:iops", sec);
+    iops = ciniparser_getdouble(snpy_conf, key, def.iops);
+    return (struct throttle) {
+        .bw = MAX(bw, 0) * (1 << 20), .iops = MAX(iops, 0)
+    };
+}
+
+/* in_hours() - whether hour @h is in "from-to", wrapping midnight */
+static int in_hours(const char *hours, int h) {
+    int from, to;
+    if (sscanf(hours, "%d-%d", &from, &to) != 2)
+        return 0;
+    if (from <= to)
+        return h >= from && h < to;
+    return h >= from || h < to;
+}
+
+/* global_throttle() - the [throttle] limits, or the profile of the hour */
+static struct throttle global_throttle(void) {
+    struct throttle none = { 0 };
+    struct throttle tr = conf_get_throttle("throttle", none);
+
+    char profiles[256];
+    strlcpy(profiles, ciniparser_getstring(snpy_conf, "throttle:profiles", ""),
+            sizeof profiles);
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    char *save = NULL;
+    char *name;
+    for (name = strtok_r(profiles, ", ", &save); name;
+         name = strtok_r(NULL, ", ", &save)) {
+        char sec[THROTTLE_NAME_SIZE];
+        char key[THROTTLE_NAME_SIZE + 16];
+        snprintf(sec, sizeof sec, "throttle_%s", name);
+        snprintf(key, sizeof key, "%s:hours", sec);
+        if (in_hours(ciniparser_getstring(snpy_conf, key, ""), tm.tm_hour))
+            return conf_get_throttle(sec, tr);
+    }
+    return tr;
+}
+
+/* job_pool() - pool a job moves data of, "" if it has none */
+static void job_pool(const char *arg, char *pool, int pool_size) {
+    pool[0] = 0;
+    if (arg && snpy_get_json_val(arg, strlen(arg), ".sp_param.pool",
+                                 pool, pool_size))
+        pool[0] = 0;
+}
+
+/* count_movers() - running data movers other than @job_id, all and on @pool */
+static int count_movers(MYSQL *db_conn, int job_id, const char *pool,
+                        int *nall, int *npool) {
+    char sql[256];
+    snprintf(sql, sizeof sql,
+             "select id, arg2 from snappy.jobs where done=0 and id!=%d and "
+             "(state & %d) and arg0 in ('export', 'import', 'patch', 'get', "
+             "'put')",
+             job_id, SNPY_SCHED_STATE_RUN);
+    if (mysql_query(db_conn, sql))
+        return -mysql_errno(db_conn);
+    MYSQL_RES *res = mysql_store_result(db_conn);
+    if (!res)
+        return -mysql_errno(db_conn);
+
+    MYSQL_ROW row;
+    *nall = *npool = 0;
+    while ((row = mysql_fetch_row(res))) {
+        char p[THROTTLE_NAME_SIZE];
+        job_pool(row[1], p, sizeof p);
+        (*nall) ++;
+        if (pool[0] && !strcmp(p, pool))
+            (*npool) ++;
+    }
+    mysql_free_result(res);
+    return 0;
+}
+
+/*
+ * snpy_throttle_update() - write the share of the limits of a data mover
+ *                          to meta/throttle in its working directory @wd
+ *
+ * Called before the plugin starts and then while it runs, so the share
+ * follows the time of day and the number of jobs running.
+ */
+
+int snpy_throttle_update(MYSQL *db_conn, const snpy_job_t *job,
+                         const char *wd) {
+    int rc;
+    int nall = 0, npool = 0;
+    char pool[THROTTLE_NAME_SIZE];
+    char sec[THROTTLE_NAME_SIZE + 32];
+    struct throttle none = { 0 };
+
+    job_pool(job->argv[2], pool, sizeof pool);
+    if ((rc = count_movers(db_conn, job->id, pool, &nall, &npool)))
+        return rc;
+
+    struct throttle tr = global_throttle();
+    tr.bw /= nall + 1;
+    tr.iops /= nall + 1;
+    if (pool[0]) {
+        snprintf(sec, sizeof sec, "throttle_pool_%s", pool);
+        struct throttle p = conf_get_throttle(sec, none);
+        tr.bw = min_limit(tr.bw, p.bw / (npool + 1));
+        tr.iops = min_limit(tr.iops, p.iops / (npool + 1));
+    }
+
+    /* 
+     * source plugin moves the data of export and import, and of patch, an
+     * import of a backup chain; target plugin that of put/get
+     */
+    char pi_name[THROTTLE_NAME_SIZE];
+    const char *pi_key = strcmp(job->argv[0], "export") &&
+        strcmp(job->argv[0], "import") && strcmp(job->argv[0], "patch") ? 
+        ".tp_name" : ".sp_name";
+    if (job->argv[2] &&
+        !snpy_get_json_val(job->argv[2], strlen(job->argv[2]), pi_key,
+                           pi_name, sizeof pi_name)) {
+        snprintf(sec, sizeof sec, "throttle_plugin_%s", pi_name);
+        struct throttle p = conf_get_throttle(sec, none);
+        tr.bw = min_limit(tr.bw, p.bw);
+        tr.iops = min_limit(tr.iops, p.iops);
+    }
+
+    /* replaced whole, the plugin may be reading it */
+    char val[64];
+    char tmp_key[PATH_MAX];
+    char key[PATH_MAX];
+    snprintf(val, sizeof val, "%llu %llu\n",
+             (unsigned long long)tr.bw, (unsigned long long)tr.iops);
+    if (snprintf(key, sizeof key, "%s/%s", wd, SNPY_TB_KEY) >= sizeof key ||
+        snprintf(tmp_key, sizeof tmp_key, "%s.tmp", key) >= sizeof tmp_key)
+        return -ENAMETOOLONG;
+    if ((rc = kv_put_sval(tmp_key, val, strlen(val), NULL)))
+        return rc;
+    if (rename(tmp_key, key))
+        return -errno;
+    return 0;
+}